@@ -0,0 +1,373 @@
+#include<stdio.h>
+#include<string.h>
+
+#include "dns_msg.h"
+
+#define LOWER(c)	((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+static int name_walk(unsigned char *msg, int len, int at, unsigned char *name, int *end);
+
+int dns_msg_parse(dns_msg *m, unsigned char *msg, int len) {
+	/*
+	 * Index a message: check that its question (if it has one) and every
+	 * record lie within it, and note where each one is.  Record owner
+	 * names are checked all the way through their compression pointers;
+	 * names inside rdata are checked when they are read.
+	 *
+	 * INPUT:  m: where the index goes
+	 * INPUT:  msg, len: the message, which must stay put while m is used
+	 * OUTPUT: 0 on success, -1 if the message is malformed, has more than
+	 *         one question or more than DNS_MSG_RRS_MAX records
+	 */
+	int at, i, s;
+	if (len < DNS_HEADER_LEN) {
+		return -1;
+	}
+	m->msg = msg;
+	m->len = len;
+	m->id = (msg[0] << 8) | msg[1];
+	m->flags = (msg[2] << 8) | msg[3];
+	m->num_questions = (msg[4] << 8) | msg[5];
+	m->qname_at = -1;
+	m->qtype = 0;
+	m->qclass = 0;
+	m->num_rrs = 0;
+	at = DNS_HEADER_LEN;
+	if (m->num_questions > 1) {
+		return -1;
+	}
+	if (m->num_questions == 1) {
+		m->qname_at = at;
+		at = dns_name_skip(msg, len, at);
+		if (at < 0 || at + 4 > len) {
+			return -1;
+		}
+		m->qtype = (msg[at] << 8) | msg[at + 1];
+		m->qclass = (msg[at + 2] << 8) | msg[at + 3];
+		at += 4;
+	}
+	m->question_end = at;
+	for (s = 0; s < 3; s++) {
+		m->count[s] = (msg[6 + 2 * s] << 8) | msg[7 + 2 * s];
+		if (m->num_rrs + m->count[s] > DNS_MSG_RRS_MAX) {
+			return -1;
+		}
+		for (i = 0; i < m->count[s]; i++) {
+			dns_msg_rr *rr = &m->rrs[m->num_rrs++];
+			rr->name_at = at;
+			at = dns_name_skip(msg, len, at);
+			if (at < 0 || at + 10 > len) {
+				return -1;
+			}
+			unsigned char *p = msg + at;
+			rr->type = (p[0] << 8) | p[1];
+			rr->class = (p[2] << 8) | p[3];
+			rr->ttl = ((unsigned int)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+			rr->rdata_len = (p[8] << 8) | p[9];
+			rr->rdata_at = at + 10;
+			at = rr->rdata_at + rr->rdata_len;
+			if (at > len) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+dns_msg_rr *dns_msg_section(dns_msg *m, int section, int *count) {
+	/*
+	 * The records of one section of a parsed message.
+	 *
+	 * INPUT:  m: the parsed message
+	 * INPUT:  section: DNS_ANSWER, DNS_AUTHORITY or DNS_ADDITIONAL
+	 * INPUT:  count: set to the number of records in the section
+	 * OUTPUT: the section's first record
+	 */
+	int first = 0;
+	int s;
+	for (s = 0; s < section; s++) {
+		first += m->count[s];
+	}
+	*count = m->count[section];
+	return &m->rrs[first];
+}
+
+int dns_msg_answer(dns_msg *m, unsigned short type, int *chain, int *chain_len) {
+	/*
+	 * Find the answer to a parsed message's question, following CNAME
+	 * records in the answer section in whatever order they come.
+	 *
+	 * INPUT:  m: the parsed message
+	 * INPUT:  type: the type of record wanted
+	 * INPUT:  chain: set to the indexes (in m->rrs) of the CNAMEs
+	 *         followed, DNS_CHAIN_MAX of them at most
+	 * INPUT:  chain_len: set to how many CNAMEs were followed
+	 * OUTPUT: the index in m->rrs of the first record of the type for the
+	 *         name the chain ends at, or -1 if there is none (the name
+	 *         is then the last CNAME's target, or the question's)
+	 */
+	unsigned char target[DNS_NAME_MAX];
+	int end, i;
+	*chain_len = 0;
+	if (m->num_questions != 1) {
+		return -1;
+	}
+	int name_at = m->qname_at;
+	while (1) {
+		if (dns_name_expand(m->msg, m->len, name_at, target, &end) < 0) {
+			return -1;
+		}
+		int cname = -1;
+		for (i = 0; i < m->count[DNS_ANSWER]; i++) {
+			dns_msg_rr *rr = &m->rrs[i];
+			if (!dns_name_equal(m->msg, m->len, rr->name_at, target)) {
+				continue;
+			}
+			if (rr->type == type) {
+				return i;
+			}
+			if (rr->type == DNS_TYPE_CNAME && cname < 0) {
+				cname = i;
+			}
+		}
+		if (cname < 0 || *chain_len == DNS_CHAIN_MAX) {
+			return -1;
+		}
+		chain[(*chain_len)++] = cname;
+		name_at = m->rrs[cname].rdata_at;
+	}
+}
+
+int dns_msg_opt(dns_msg *m) {
+	/*
+	 * Find the OPT record of a parsed message: a record of type OPT
+	 * owned by the root in the additional section.
+	 *
+	 * INPUT:  m: the parsed message
+	 * OUTPUT: the index of the OPT record in m->rrs, -1 if there is none
+	 *         or -2 if there is more than one or one with another owner
+	 *         (RFC 6891 says to answer FORMERR)
+	 */
+	int count, i;
+	int found = -1;
+	dns_msg_rr *rr = dns_msg_section(m, DNS_ADDITIONAL, &count);
+	for (i = 0; i < count; i++) {
+		if (rr[i].type != DNS_TYPE_OPT) {
+			continue;
+		}
+		if (found >= 0 || m->msg[rr[i].name_at] != 0) {
+			return -2;
+		}
+		found = rr - m->rrs + i;
+	}
+	return found;
+}
+
+int dns_opt_add(unsigned char *msg, int len, int max, unsigned short payload, unsigned int ttl) {
+	/*
+	 * Put an OPT record with no options on the end of a message and
+	 * count it in the additional section.
+	 *
+	 * INPUT:  msg, len: the message, at least a header
+	 * INPUT:  max: how long the message may get
+	 * INPUT:  payload: the largest UDP payload the sender takes
+	 * INPUT:  ttl: the extended RCODE, version and flags (DNS_EDNS_DO)
+	 * OUTPUT: the new length of the message, or -1 if there is no room
+	 */
+	if (len + DNS_OPT_LEN > max) {
+		return -1;
+	}
+	unsigned char *p = msg + len;
+	p[0] = 0;
+	p[1] = DNS_TYPE_OPT >> 8;
+	p[2] = DNS_TYPE_OPT & 0xff;
+	p[3] = payload >> 8;
+	p[4] = payload & 0xff;
+	p[5] = (ttl >> 24) & 0xff;
+	p[6] = (ttl >> 16) & 0xff;
+	p[7] = (ttl >> 8) & 0xff;
+	p[8] = ttl & 0xff;
+	p[9] = 0;
+	p[10] = 0;
+	int additional = ((msg[10] << 8) | msg[11]) + 1;
+	msg[10] = additional >> 8;
+	msg[11] = additional & 0xff;
+	return len + DNS_OPT_LEN;
+}
+
+int dns_question_length(unsigned char *msg, int len) {
+	/*
+	 * Check the question section of a message with one question against
+	 * the message's length: every label must fit, the name can't be
+	 * compressed (a query has nothing before it to point to) and the
+	 * type and class must follow it.
+	 *
+	 * INPUT:  msg, len: the message
+	 * OUTPUT: the length of the question (name, type and class), or -1
+	 */
+	int at = DNS_HEADER_LEN;
+	while (at < len && msg[at] != 0) {
+		if (msg[at] & 0xc0) {
+			return -1;
+		}
+		at += msg[at] + 1;
+		if (at - DNS_HEADER_LEN >= DNS_NAME_MAX) {
+			return -1;
+		}
+	}
+	// the zero label, type and class
+	at += 5;
+	if (at > len) {
+		return -1;
+	}
+	return at - DNS_HEADER_LEN;
+}
+
+int dns_name_skip(unsigned char *msg, int len, int at) {
+	/*
+	 * Check the (possibly compressed) name at msg + at.
+	 *
+	 * OUTPUT: the offset just past the name in the message, or -1 if it
+	 *         runs off the message, loops or is too long
+	 */
+	int end;
+	return name_walk(msg, len, at, NULL, &end) < 0 ? -1 : end;
+}
+
+int dns_name_expand(unsigned char *msg, int len, int at, unsigned char *name, int *end) {
+	/*
+	 * Copy the (possibly compressed) name at msg + at to name in plain
+	 * lower-case wire format.
+	 *
+	 * INPUT:  msg, len: the message
+	 * INPUT:  at: where the name starts
+	 * INPUT:  name: where to write it (DNS_NAME_MAX bytes)
+	 * INPUT:  end: set to the offset just past the name in the message
+	 * OUTPUT: the length of the expanded name, or -1 if it runs off the
+	 *         message, loops or is too long
+	 */
+	return name_walk(msg, len, at, name, end);
+}
+
+int dns_name_text(unsigned char *msg, int len, int at, char *text) {
+	/*
+	 * Write the (possibly compressed) name at msg + at as dotted text,
+	 * lower-cased and without the trailing dot ("." for the root).
+	 *
+	 * INPUT:  msg, len: the message
+	 * INPUT:  at: where the name starts
+	 * INPUT:  text: where to write it (DNS_NAME_TEXT_MAX bytes)
+	 * OUTPUT: the length of the text, or -1 if the name is malformed
+	 */
+	unsigned char name[DNS_NAME_MAX];
+	int end, i;
+	int text_len = 0;
+	if (name_walk(msg, len, at, name, &end) < 0) {
+		return -1;
+	}
+	for (i = 0; name[i] != 0; i += name[i] + 1) {
+		if (text_len > 0) {
+			text[text_len++] = '.';
+		}
+		memcpy(text + text_len, name + i + 1, name[i]);
+		text_len += name[i];
+	}
+	if (text_len == 0) {
+		text[text_len++] = '.';
+	}
+	text[text_len] = '\0';
+	return text_len;
+}
+
+int dns_name_equal(unsigned char *msg, int len, int at, unsigned char *name) {
+	/*
+	 * Compare the (possibly compressed) name at msg + at with a name in
+	 * plain wire format, without regard to case and without copying it.
+	 *
+	 * OUTPUT: 1 if they are the same name, 0 if not or if the name in
+	 *         the message is malformed
+	 */
+	int limit = at;
+	int i;
+	while (1) {
+		if (at >= len) {
+			return 0;
+		}
+		int c = msg[at];
+		if ((c & 0xc0) == 0xc0) {
+			int target = at + 1 < len ? ((c & 0x3f) << 8) | msg[at + 1] : len;
+			if (target >= limit || target < DNS_HEADER_LEN) {
+				return 0;
+			}
+			at = limit = target;
+			continue;
+		}
+		if ((c & 0xc0) || c != *name || at + 1 + c > len) {
+			return 0;
+		}
+		if (c == 0) {
+			return 1;
+		}
+		for (i = 1; i <= c; i++) {
+			if (LOWER(msg[at + i]) != LOWER(name[i])) {
+				return 0;
+			}
+		}
+		at += c + 1;
+		name += c + 1;
+	}
+}
+
+static int name_walk(unsigned char *msg, int len, int at, unsigned char *name, int *end) {
+	/*
+	 * Follow the name at msg + at to its end, copying it to name
+	 * (lower-cased) unless that is NULL.  A compression pointer must
+	 * point into the message past the header and before the name and
+	 * every pointer already followed, which is where the names it can
+	 * refer to were written; that way no name can loop.
+	 *
+	 * OUTPUT: the length of the name in wire format, or -1
+	 */
+	int name_len = 0;
+	int limit = at;
+	int i;
+	*end = -1;
+	while (1) {
+		if (at >= len) {
+			return -1;
+		}
+		int c = msg[at];
+		if ((c & 0xc0) == 0xc0) {
+			if (at + 1 >= len) {
+				return -1;
+			}
+			int target = ((c & 0x3f) << 8) | msg[at + 1];
+			if (target >= limit || target < DNS_HEADER_LEN) {
+				return -1;
+			}
+			if (*end < 0) {
+				*end = at + 2;
+			}
+			at = limit = target;
+			continue;
+		}
+		if ((c & 0xc0) || at + 1 + c > len || name_len + 1 + c > DNS_NAME_MAX) {
+			return -1;
+		}
+		if (name != NULL) {
+			name[name_len] = c;
+			for (i = 1; i <= c; i++) {
+				name[name_len + i] = LOWER(msg[at + i]);
+			}
+		}
+		name_len += c + 1;
+		if (c == 0) {
+			break;
+		}
+		at += c + 1;
+	}
+	if (*end < 0) {
+		*end = at + 1;
+	}
+	return name_len;
+}
@@ -0,0 +1,85 @@
+/*
+ * DNS message parser shared by the DNS server and resolver labs - CS 360
+ * A message is parsed where it lies: dns_msg_parse() checks the header,
+ * the question and every record against the message's length once and
+ * keeps an index of where each record's owner name and rdata are, with
+ * its type, class and TTL.  Nothing is copied or allocated; the index
+ * lives in a dns_msg the caller provides (on the stack is fine).
+ *
+ * Names stay compressed in the message until they are asked for, and
+ * are then written out, lower-cased, in wire format or as text into a
+ * buffer the caller provides, or compared with a name in place.  Every
+ * name is bounds checked as it is read, and a compression pointer must
+ * point before every pointer followed before it, so no name can loop.
+ *
+ * EDNS(0) (RFC 6891): dns_msg_opt() finds a message's OPT record and
+ * dns_opt_add() puts one on the end of a message being built.  An OPT
+ * record's class is the largest UDP payload its sender takes and its
+ * TTL holds the extended RCODE, the EDNS version and the DO flag.
+ *
+*/
+
+#ifndef DNS_MSG_H
+#define DNS_MSG_H
+
+#define DNS_HEADER_LEN		12
+#define DNS_NAME_MAX		255		// longest name in wire format
+#define DNS_NAME_TEXT_MAX	256		// a dotted name and its NUL always fit in this
+#define DNS_MSG_RRS_MAX		512		// records indexed (more than fit in 4 KB; a
+									// TCP answer with more does not parse)
+#define DNS_CHAIN_MAX		16		// CNAMEs dns_msg_answer() follows
+#define DNS_UDP_MIN			512		// UDP payload every client takes (RFC 1035)
+#define DNS_OPT_LEN			11		// an OPT record without options
+#define DNS_EDNS_DO			0x8000	// DO flag, in the low 16 bits of an OPT TTL
+#define DNS_EDNS_VERSION(ttl)	(((ttl) >> 16) & 0xff)
+#define DNS_EDNS_BADVERS	1		// extended RCODE 16, the top 8 bits of 12
+
+#define DNS_TYPE_A			1
+#define DNS_TYPE_NS			2
+#define DNS_TYPE_CNAME		5
+#define DNS_TYPE_SOA		6
+#define DNS_TYPE_MX			15
+#define DNS_TYPE_AAAA		28
+#define DNS_TYPE_OPT		41
+
+// sections, for dns_msg_section()
+#define DNS_ANSWER			0
+#define DNS_AUTHORITY		1
+#define DNS_ADDITIONAL		2
+
+typedef struct {
+	int name_at;			// where the owner name starts
+	unsigned short type;
+	unsigned short class;
+	unsigned int ttl;
+	int rdata_at;
+	unsigned short rdata_len;
+} dns_msg_rr;
+
+typedef struct {
+	unsigned char *msg;
+	int len;
+	unsigned short id;
+	unsigned short flags;	// QR, opcode, AA, TC, RD, RA, Z and RCODE
+	int num_questions;		// 0 or 1
+	int qname_at;			// the question, if there is one
+	unsigned short qtype;
+	unsigned short qclass;
+	int question_end;		// where the answer section starts
+	int count[3];			// records in each section
+	int num_rrs;
+	dns_msg_rr rrs[DNS_MSG_RRS_MAX];	// answer, authority, then additional
+} dns_msg;
+
+int dns_msg_parse(dns_msg *m, unsigned char *msg, int len);
+dns_msg_rr *dns_msg_section(dns_msg *m, int section, int *count);
+int dns_msg_answer(dns_msg *m, unsigned short type, int *chain, int *chain_len);
+int dns_msg_opt(dns_msg *m);
+int dns_opt_add(unsigned char *msg, int len, int max, unsigned short payload, unsigned int ttl);
+int dns_question_length(unsigned char *msg, int len);
+int dns_name_skip(unsigned char *msg, int len, int at);
+int dns_name_expand(unsigned char *msg, int len, int at, unsigned char *name, int *end);
+int dns_name_text(unsigned char *msg, int len, int at, char *text);
+int dns_name_equal(unsigned char *msg, int len, int at, unsigned char *name);
+
+#endif /* DNS_MSG_H */
@@ -0,0 +1,205 @@
+/*
+ * Benchmark for the DNS message parser - CS 360
+ * Parses three kinds of response over and over and prints how many
+ * messages a second are parsed: a compressed CNAME and A answer, a
+ * referral with four name servers and their glue, and an NXDOMAIN with
+ * the zone's SOA.  Each is timed parsing alone, parsing and finding the
+ * answer (following the CNAME), and parsing and writing out every owner
+ * name as text.
+ *
+ * Usage: msg_bench [-n messages]
+ *
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+
+#include "dns_msg.h"
+
+#define BENCH_MESSAGES	10000000
+#define BENCH_MSG_MAX	512
+
+typedef struct {
+	unsigned char msg[BENCH_MSG_MAX];
+	int len;
+} bench_msg;
+
+void put_header(bench_msg *b, int flags, int an, int ns, int ar);
+void put_name(bench_msg *b, char *text, int pointer);
+void put_short(bench_msg *b, int value);
+void put_rr(bench_msg *b, char *owner, int owner_pointer, int type, unsigned char *rdata, int rdata_len);
+void build_answer(bench_msg *b);
+void build_referral(bench_msg *b);
+void build_nxdomain(bench_msg *b);
+double seconds();
+
+int main(int argc, char *argv[]) {
+	long n = BENCH_MESSAGES;
+	int c;
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+			case 'n':
+				n = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n messages]\n", argv[0]);
+				exit(1);
+		}
+	}
+	bench_msg msgs[3];
+	char *names[3] = {"CNAME + A answer", "referral + glue", "NXDOMAIN + SOA"};
+	build_answer(&msgs[0]);
+	build_referral(&msgs[1]);
+	build_nxdomain(&msgs[2]);
+
+	dns_msg m;
+	char text[DNS_NAME_TEXT_MAX];
+	int chain[DNS_CHAIN_MAX];
+	int chain_len, k, mode;
+	long i;
+	char *modes[3] = {"parse", "parse + answer", "parse + names"};
+	for (k = 0; k < 3; k++) {
+		if (dns_msg_parse(&m, msgs[k].msg, msgs[k].len) < 0) {
+			fprintf(stderr, "%s: does not parse\n", names[k]);
+			exit(EXIT_FAILURE);
+		}
+		for (mode = 0; mode < 3; mode++) {
+			long found = 0;
+			double start = seconds();
+			for (i = 0; i < n; i++) {
+				dns_msg_parse(&m, msgs[k].msg, msgs[k].len);
+				if (mode == 1) {
+					found += dns_msg_answer(&m, DNS_TYPE_A, chain, &chain_len) >= 0;
+				} else if (mode == 2) {
+					int r;
+					for (r = 0; r < m.num_rrs; r++) {
+						found += dns_name_text(m.msg, m.len, m.rrs[r].name_at, text) > 0;
+					}
+				}
+			}
+			double elapsed = seconds() - start;
+			printf("%-18s %3d bytes, %2d records, %-15s %10.0f messages/s (%ld)\n", names[k],
+					msgs[k].len, m.num_rrs, modes[mode], n / elapsed, found);
+		}
+	}
+	return 0;
+}
+
+void build_answer(bench_msg *b) {
+	// www.example.com CNAME example.com, example.com A x2
+	unsigned char a1[4] = {192, 0, 2, 1};
+	unsigned char a2[4] = {192, 0, 2, 10};
+	unsigned char cname[2] = {0xc0, 16};
+	put_header(b, 0x8180, 3, 0, 0);
+	put_name(b, "www.example.com", -1);
+	put_short(b, DNS_TYPE_A);
+	put_short(b, 1);
+	put_rr(b, NULL, 12, DNS_TYPE_CNAME, cname, 2);
+	put_rr(b, NULL, 16, DNS_TYPE_A, a1, 4);
+	put_rr(b, NULL, 16, DNS_TYPE_A, a2, 4);
+}
+
+void build_referral(bench_msg *b) {
+	// host.example.com from a com server: 4 NS for example.com and
+	// their addresses
+	char ns[32];
+	int i, ns_at[4];
+	put_header(b, 0x8000, 0, 4, 4);
+	put_name(b, "host.example.com", -1);
+	put_short(b, DNS_TYPE_A);
+	put_short(b, 1);
+	for (i = 0; i < 4; i++) {
+		// owner example.com (offset 17), rdata nsN + pointer to example.com
+		put_rr(b, NULL, 17, DNS_TYPE_NS, NULL, 0);
+		int rdata_len_at = b->len - 2;
+		ns_at[i] = b->len;
+		snprintf(ns, sizeof(ns), "ns%d", i + 1);
+		put_name(b, ns, 17);
+		int rdata_len = b->len - ns_at[i];
+		b->msg[rdata_len_at] = rdata_len >> 8;
+		b->msg[rdata_len_at + 1] = rdata_len & 0xff;
+	}
+	for (i = 0; i < 4; i++) {
+		unsigned char addr[4] = {192, 0, 2, 53 + i};
+		put_rr(b, NULL, ns_at[i], DNS_TYPE_A, addr, 4);
+	}
+}
+
+void build_nxdomain(bench_msg *b) {
+	// nope.example.com: the example.com SOA in the authority section
+	unsigned char soa[64];
+	int soa_len = 0;
+	soa[soa_len++] = 3;
+	memcpy(soa + soa_len, "ns1", 3);
+	soa_len += 3;
+	soa[soa_len++] = 0xc0;
+	soa[soa_len++] = 17;
+	soa[soa_len++] = 10;
+	memcpy(soa + soa_len, "hostmaster", 10);
+	soa_len += 10;
+	soa[soa_len++] = 0xc0;
+	soa[soa_len++] = 17;
+	memset(soa + soa_len, 0, 20);
+	soa[soa_len + 19] = 60;
+	soa_len += 20;
+	put_header(b, 0x8183, 0, 1, 0);
+	put_name(b, "nope.example.com", -1);
+	put_short(b, DNS_TYPE_A);
+	put_short(b, 1);
+	put_rr(b, NULL, 17, DNS_TYPE_SOA, soa, soa_len);
+}
+
+void put_header(bench_msg *b, int flags, int an, int ns, int ar) {
+	memset(b->msg, 0, DNS_HEADER_LEN);
+	b->msg[0] = 0x12;
+	b->msg[1] = 0x34;
+	b->msg[2] = flags >> 8;
+	b->msg[3] = flags & 0xff;
+	b->msg[5] = 1;
+	b->msg[7] = an;
+	b->msg[9] = ns;
+	b->msg[11] = ar;
+	b->len = DNS_HEADER_LEN;
+}
+
+void put_name(bench_msg *b, char *text, int pointer) {
+	// the labels of text, then a pointer to an earlier name or the root
+	while (*text != '\0') {
+		int label = strcspn(text, ".");
+		b->msg[b->len++] = label;
+		memcpy(b->msg + b->len, text, label);
+		b->len += label;
+		text += label + (text[label] == '.');
+	}
+	if (pointer >= 0) {
+		b->msg[b->len++] = 0xc0 | (pointer >> 8);
+		b->msg[b->len++] = pointer & 0xff;
+	} else {
+		b->msg[b->len++] = 0;
+	}
+}
+
+void put_short(bench_msg *b, int value) {
+	b->msg[b->len++] = value >> 8;
+	b->msg[b->len++] = value & 0xff;
+}
+
+void put_rr(bench_msg *b, char *owner, int owner_pointer, int type, unsigned char *rdata, int rdata_len) {
+	put_name(b, owner != NULL ? owner : "", owner_pointer);
+	put_short(b, type);
+	put_short(b, 1);
+	put_short(b, 0);
+	put_short(b, 3600);
+	put_short(b, rdata_len);
+	memcpy(b->msg + b->len, rdata, rdata_len);
+	b->len += rdata_len;
+}
+
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
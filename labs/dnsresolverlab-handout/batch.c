@@ -0,0 +1,281 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<arpa/inet.h>
+
+#include "batch.h"
+#include "dns_msg.h"
+
+static void batch_free(batch_state *b);
+static int batch_fill(batch_state *b, FILE *names, FILE *out);
+static void batch_send(batch_state *b, char *name);
+static void batch_done(void *data, unsigned char *msg, int len);
+static void batch_report(batch_state *b, batch_query *q, unsigned char *msg, int len);
+static void batch_release(batch_state *b, batch_query *q);
+static batch_query *batch_find(batch_state *b, char *key, unsigned int hash);
+static unsigned int name_hash(char *key);
+
+int batch_resolve(FILE *names, char *servers, char *hints, unsigned short port, int in_flight,
+		int num_socks, int race, double drop_rate, rcache *cache, FILE *out) {
+	/*
+	 * Resolve every name in a file (one per line; blank lines and lines
+	 * starting with # are skipped) to an IPv4 address, keeping up to
+	 * in_flight queries outstanding.  A line "name => address" is
+	 * written for each name as its answer arrives, with NONE when there
+	 * is no address and TIMEOUT when no server answered.  A name already
+	 * in flight isn't sent again; it gets the same answer.  Totals, the
+	 * rate and each server's RTT are printed on stderr at the end.
+	 *
+	 * INPUT:  names: the list of names
+	 * INPUT:  servers, port: the DNS servers to ask (see upstream_init)
+	 * INPUT:  hints: a root hints file to resolve the names iteratively
+	 *         from (see iterate_init) instead, or NULL
+	 * INPUT:  in_flight: how many queries may be outstanding at once
+	 * INPUT:  num_socks: how many sockets to spread them over
+	 * INPUT:  race: how many servers each query is sent to at once
+	 * INPUT:  drop_rate: the fraction of queries to lose on purpose
+	 * INPUT:  cache: the response cache, or NULL
+	 * INPUT:  out: where the results go
+	 * OUTPUT: 0 on success, -1 if the engine could not be set up
+	 */
+	batch_state b;
+	int i;
+	memset(&b, 0, sizeof(b));
+	b.out = out;
+	b.cache = cache;
+	b.iterative = hints != NULL;
+	upstream_engine *engine = b.iterative ? &b.iter.engine : &b.engine;
+	int status = b.iterative ? iterate_init(&b.iter, hints, port, in_flight, num_socks, batch_done)
+			: upstream_init(&b.engine, servers, port, in_flight, num_socks, batch_done);
+	if (status < 0) {
+		batch_free(&b);
+		return -1;
+	}
+	if (race >= 1 && race < engine->race) {
+		engine->race = race;
+	}
+	engine->drop_rate = drop_rate;
+	// the engine may allow fewer queries than asked for
+	in_flight = b.iterative ? b.iter.max_queries : b.engine.max_queries;
+	b.queries = (batch_query *)malloc(sizeof(batch_query) * in_flight);
+	// a power of two at least twice the queries in flight
+	b.in_flight_mask = 1;
+	while (b.in_flight_mask < 2 * (unsigned int)in_flight) {
+		b.in_flight_mask <<= 1;
+	}
+	b.in_flight = (batch_query **)calloc(b.in_flight_mask, sizeof(batch_query *));
+	b.in_flight_mask--;
+	if (b.queries == NULL || b.in_flight == NULL) {
+		perror("malloc");
+		batch_free(&b);
+		return -1;
+	}
+	for (i = 0; i < in_flight; i++) {
+		b.queries[i].batch = &b;
+		b.queries[i].next = i + 1 < in_flight ? &b.queries[i + 1] : NULL;
+	}
+	b.free = &b.queries[0];
+
+	double start = now_seconds();
+	int more = batch_fill(&b, names, out);
+	while (more || (b.iterative ? b.iter.pending : b.engine.pending) > 0) {
+		if (b.iterative) {
+			iterate_wait(&b.iter);
+		} else {
+			upstream_wait(&b.engine);
+		}
+		if (more) {
+			more = batch_fill(&b, names, out);
+		}
+	}
+	double elapsed = now_seconds() - start;
+	unsigned long total = b.answered + b.no_address + b.timed_out;
+	fprintf(stderr, "%lu names in %.2f s (%.0f names/s): %lu answered, %lu without an address, "
+			"%lu timed out, %lu invalid\n",
+			total, elapsed, elapsed > 0 ? total / elapsed : 0.0, b.answered, b.no_address,
+			b.timed_out, b.invalid);
+	fprintf(stderr, "%lu names waited on a query in flight, %lu refreshes sent\n",
+			b.coalesced, b.prefetched);
+	if (b.iterative) {
+		iterate_print_stats(&b.iter, stderr);
+	} else {
+		upstream_print_stats(&b.engine, stderr);
+	}
+	if (cache != NULL) {
+		rcache_print_stats(cache, stderr);
+	}
+	batch_free(&b);
+	return 0;
+}
+
+static void batch_free(batch_state *b) {
+	if (b->iterative) {
+		iterate_free(&b->iter);
+	} else {
+		upstream_free(&b->engine);
+	}
+	free(b->queries);
+	free(b->in_flight);
+}
+
+int answer_ipv4(unsigned char *msg, int len, struct in_addr *addr) {
+	/*
+	 * Find the address of the question's name in a response, following
+	 * CNAME records in the answer section in whatever order they come.
+	 * The response is parsed in place, so every name and record is
+	 * bounds checked and nothing is copied.
+	 *
+	 * INPUT:  msg, len: the response
+	 * INPUT:  addr: where to put the address
+	 * OUTPUT: 1 if an address was found, 0 if not, -1 if the message is
+	 *         malformed
+	 */
+	dns_msg m;
+	int chain[DNS_CHAIN_MAX];
+	int chain_len;
+	if (dns_msg_parse(&m, msg, len) < 0 || m.num_questions != 1) {
+		return -1;
+	}
+	int i = dns_msg_answer(&m, DNS_TYPE_A, chain, &chain_len);
+	if (i < 0 || m.rrs[i].rdata_len != 4) {
+		return 0;
+	}
+	memcpy(&addr->s_addr, msg + m.rrs[i].rdata_at, 4);
+	return 1;
+}
+
+static int batch_fill(batch_state *b, FILE *names, FILE *out) {
+	/*
+	 * Send queries for the next names until every slot is in flight.
+	 *
+	 * OUTPUT: 1 if there may be more names, 0 at the end of the file
+	 */
+	char line[MAX_BUFFER_SIZE];
+	while (b->free != NULL) {
+		if (fgets(line, sizeof(line), names) == NULL) {
+			return 0;
+		}
+		char *name = line + strspn(line, " \t");
+		name[strcspn(name, " \t\r\n")] = '\0';
+		if (name[0] == '\0' || name[0] == '#') {
+			continue;
+		}
+		if (strlen(name) >= NAME_TEXT_MAX) {
+			fprintf(out, "%.*s... => INVALID\n", 64, name);
+			b->invalid++;
+			continue;
+		}
+		batch_send(b, name);
+	}
+	return 1;
+}
+
+static void batch_send(batch_state *b, char *name) {
+	// build the query for a name and answer it from the cache, wait on
+	// the query for it already in flight, or hand it to the engine or
+	// the iterator
+	unsigned char msg[MAX_BUFFER_SIZE];
+	unsigned char response[MAX_BUFFER_SIZE];
+	batch_query *q = b->free;
+	b->free = q->next;
+	strcpy(q->name, name);
+	strcpy(q->key, name);
+	canonicalize_name(q->key);
+	q->hash = name_hash(q->key);
+	q->prefetch = 0;
+	q->waiters = NULL;
+	int len = create_dns_query(q->key, TYPE_A, msg);
+	int prefetch = 0;
+	int response_len = b->cache != NULL ? rcache_get(b->cache, msg, len, response, &prefetch) : 0;
+	batch_query *leader = batch_find(b, q->key, q->hash);
+	if (response_len > 0) {
+		batch_report(b, q, response, response_len);
+		if (!prefetch || leader != NULL) {
+			batch_release(b, q);
+			return;
+		}
+		// the slot is kept to refresh the entry
+		q->prefetch = 1;
+		b->prefetched++;
+	} else if (leader != NULL) {
+		q->next = leader->waiters;
+		leader->waiters = q;
+		b->coalesced++;
+		return;
+	}
+	q->next = b->in_flight[q->hash & b->in_flight_mask];
+	b->in_flight[q->hash & b->in_flight_mask] = q;
+	if (b->iterative) {
+		iterate_submit(&b->iter, msg, len, q);
+	} else {
+		upstream_submit(&b->engine, msg, len, q);
+	}
+}
+
+static void batch_done(void *data, unsigned char *msg, int len) {
+	// the engine's (or iterator's) outcome for a query: cache it and
+	// report it for the query and every one waiting on it
+	batch_query *q = (batch_query *)data;
+	batch_state *b = (batch_state *)q->batch;
+	batch_query **p = &b->in_flight[q->hash & b->in_flight_mask];
+	while (*p != q) {
+		p = &(*p)->next;
+	}
+	*p = q->next;
+	if (msg != NULL && b->cache != NULL) {
+		rcache_put(b->cache, msg, len);
+	}
+	batch_query *w = q->waiters;
+	while (w != NULL) {
+		batch_query *next = w->next;
+		batch_report(b, w, msg, len);
+		batch_release(b, w);
+		w = next;
+	}
+	// a refresh's name was printed from the cache already
+	if (!q->prefetch) {
+		batch_report(b, q, msg, len);
+	}
+	batch_release(b, q);
+}
+
+static void batch_report(batch_state *b, batch_query *q, unsigned char *msg, int len) {
+	// print a name's answer
+	struct in_addr addr;
+	if (msg == NULL) {
+		fprintf(b->out, "%s => TIMEOUT\n", q->name);
+		b->timed_out++;
+	} else if (answer_ipv4(msg, len, &addr) == 1) {
+		fprintf(b->out, "%s => %s\n", q->name, inet_ntoa(addr));
+		b->answered++;
+	} else {
+		fprintf(b->out, "%s => NONE\n", q->name);
+		b->no_address++;
+	}
+}
+
+static void batch_release(batch_state *b, batch_query *q) {
+	// give a query's slot back
+	q->next = b->free;
+	b->free = q;
+}
+
+static batch_query *batch_find(batch_state *b, char *key, unsigned int hash) {
+	// the query in flight for a canonical name, or NULL
+	batch_query *q;
+	for (q = b->in_flight[hash & b->in_flight_mask]; q != NULL; q = q->next) {
+		if (q->hash == hash && strcmp(q->key, key) == 0) {
+			return q;
+		}
+	}
+	return NULL;
+}
+
+static unsigned int name_hash(char *key) {
+	// 32-bit FNV-1a
+	unsigned int hash = 2166136261u;
+	for (; *key != '\0'; key++) {
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
+	}
+	return hash;
+}
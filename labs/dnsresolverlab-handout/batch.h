@@ -0,0 +1,67 @@
+/*
+ * Batch mode for the DNS resolver - CS 360
+ * Resolves a list of names with many queries in flight at once.  The
+ * queries go through the query engine (see upstream.h), which spreads
+ * them over a few non-blocking UDP sockets watched with epoll, matches
+ * each response to its query by socket and query ID, and retransmits
+ * the ones that go unanswered.  Names whose answer is in the response
+ * cache (see rcache.h) aren't sent at all.  Given root hints, the names
+ * are resolved iteratively instead (see iterate.h), from the root
+ * servers down.
+ *
+ * Only one query for a name is ever in flight: a name that is asked for
+ * again while its query is outstanding waits for that query's answer
+ * (they are kept in a hash table by name).  A cache hit that the cache
+ * says is due for a refresh (see rcache.h) is answered from the cache
+ * and looked up again in the background, and the new answer is cached.
+ *
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "resolver.h"
+#include "upstream.h"
+#include "iterate.h"
+#include "rcache.h"
+
+#define BATCH_IN_FLIGHT		1000	// default queries outstanding at once
+#define BATCH_SOCKETS		4		// default sockets the queries are spread over
+#define NAME_TEXT_MAX		256		// longest name in a names file
+
+typedef struct batch_query {
+	char name[NAME_TEXT_MAX];	// the name as it will be printed
+	char key[NAME_TEXT_MAX];	// canonical, for finding it in flight
+	unsigned int hash;			// of key
+	int prefetch;				// a refresh nobody is waiting to print
+	void *batch;				// the batch_state it belongs to
+	struct batch_query *next;	// the free list, or the in-flight chain
+	struct batch_query *waiters;	// queries for the same name waiting on this one
+} batch_query;
+
+typedef struct {
+	int iterative;				// resolving from the root, with iter
+	upstream_engine engine;
+	iterator iter;
+	rcache *cache;
+	batch_query *queries;		// a slot per query in flight
+	batch_query *free;
+	batch_query **in_flight;	// the queries sent, by name
+	unsigned int in_flight_mask;
+	FILE *out;
+	unsigned long answered;		// with an address
+	unsigned long no_address;	// NXDOMAIN, no A record or an error rcode
+	unsigned long timed_out;	// no answer after every retransmission
+	unsigned long invalid;		// lines that aren't names
+	unsigned long coalesced;	// names that waited on a query already in flight
+	unsigned long prefetched;	// refreshes sent for popular names about to expire
+} batch_state;
+
+int batch_resolve(FILE *names, char *servers, char *hints, unsigned short port, int in_flight,
+		int num_socks, int race, double drop_rate, rcache *cache, FILE *out);
+int answer_ipv4(unsigned char *msg, int len, struct in_addr *addr);
+
+#endif /* BATCH_H */
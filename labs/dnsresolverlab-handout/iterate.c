@@ -0,0 +1,631 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<arpa/inet.h>
+
+#include "iterate.h"
+#include "batch.h"
+#include "dns_msg.h"
+
+#define TYPE_NS			2
+#define RCODE_SERVFAIL	2
+#define RCODE_NXDOMAIN	3
+
+static int load_hints(iterator *it, char *hints);
+static iterate_task *task_new(iterator *it, unsigned char *name, int name_len, unsigned short type,
+		iterate_task *parent);
+static void task_start(iterator *it, iterate_task *t);
+static void task_send(iterator *it, iterate_task *t);
+static void task_response(void *data, unsigned char *msg, int len);
+static int task_referral(iterator *it, iterate_task *t, dns_msg *m);
+static void task_next_ns(iterator *it, iterate_task *t);
+static void task_resume(iterator *it, iterate_task *t, unsigned char *msg, int len);
+static void task_finish(iterator *it, iterate_task *t, unsigned char *msg, int len, int rcode);
+static int build_response(iterate_task *t, unsigned char *msg, int len, int rcode,
+		unsigned char *response);
+static int copy_rr(dns_msg *m, dns_msg_rr *rr, unsigned char *out, int out_len);
+static int in_zone(unsigned char *name, int name_len, unsigned char *zone, int zone_len);
+static iterate_zone *zone_find(iterator *it, unsigned char *name, int name_len);
+static void zone_add(iterator *it, unsigned char *name, int name_len, int *servers,
+		int num_servers, dns_rr_ttl ttl);
+static unsigned int name_hash(unsigned char *name, int name_len);
+
+int iterate_init(iterator *it, char *hints, unsigned short port, int max_queries, int num_socks,
+		upstream_done done) {
+	/*
+	 * Set up an iterator for up to max_queries of the caller's queries
+	 * at once.
+	 *
+	 * INPUT:  it: the iterator
+	 * INPUT:  hints: a file of root servers, one per line, either "name
+	 *         address" or lines of a named.root file (only the A
+	 *         records are used); # and ; start comments
+	 * INPUT:  port: the port every server is asked on
+	 * INPUT:  max_queries: the most queries pending at once
+	 * INPUT:  num_socks: how many sockets to spread the queries over
+	 * INPUT:  done: called with each query's outcome: a response to the
+	 *         query, or NULL if no server answered
+	 * OUTPUT: 0 on success, -1 on error (the iterator must still be freed)
+	 */
+	int i;
+	memset(it, 0, sizeof(iterator));
+	it->port = port;
+	it->done = done;
+	if (max_queries < 1) {
+		max_queries = 1;
+	}
+	// a task per caller's query and as many again for the name server
+	// lookups some of them need on the way; each has one query in the
+	// engine at a time
+	it->num_tasks = 2 * max_queries;
+	if (upstream_init(&it->engine, NULL, port, it->num_tasks, num_socks, task_response) < 0) {
+		return -1;
+	}
+	it->num_tasks = it->engine.max_queries;
+	it->max_queries = it->num_tasks / 2 > 0 ? it->num_tasks / 2 : 1;
+	it->zones = (iterate_zone **)calloc(ITERATE_ZONE_BUCKETS, sizeof(iterate_zone *));
+	it->tasks = (iterate_task *)malloc(sizeof(iterate_task) * it->num_tasks);
+	if (it->zones == NULL || it->tasks == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (i = 0; i < it->num_tasks; i++) {
+		it->tasks[i].iterator = it;
+		it->tasks[i].next = i + 1 < it->num_tasks ? &it->tasks[i + 1] : NULL;
+	}
+	it->free = &it->tasks[0];
+	return load_hints(it, hints);
+}
+
+void iterate_free(iterator *it) {
+	int i;
+	upstream_free(&it->engine);
+	for (i = 0; it->zones != NULL && i < ITERATE_ZONE_BUCKETS; i++) {
+		while (it->zones[i] != NULL) {
+			iterate_zone *z = it->zones[i];
+			it->zones[i] = z->next;
+			free(z);
+		}
+	}
+	free(it->zones);
+	free(it->tasks);
+	it->zones = NULL;
+	it->tasks = NULL;
+}
+
+int iterate_submit(iterator *it, unsigned char *msg, int len, void *data) {
+	/*
+	 * Start resolving a query.
+	 *
+	 * INPUT:  it: the iterator
+	 * INPUT:  msg, len: the query, with one question
+	 * INPUT:  data: passed to the done function
+	 * OUTPUT: 0 if the query was started, -1 if max_queries are pending
+	 *         or the query is malformed
+	 */
+	unsigned char name[DNS_NAME_MAX];
+	int end;
+	if (it->pending >= it->max_queries || len < DNS_HEADER_LEN || len > MAX_BUFFER_SIZE) {
+		return -1;
+	}
+	int name_len = dns_name_expand(msg, len, DNS_HEADER_LEN, name, &end);
+	if (name_len < 0 || end + 4 > len) {
+		return -1;
+	}
+	iterate_task *t = task_new(it, name, name_len, (msg[end] << 8) | msg[end + 1], NULL);
+	if (t == NULL) {
+		return -1;
+	}
+	memcpy(t->query, msg, end + 4);
+	t->query_len = end + 4;
+	t->data = data;
+	it->pending++;
+	task_start(it, t);
+	return 0;
+}
+
+void iterate_wait(iterator *it) {
+	upstream_wait(&it->engine);
+}
+
+void iterate_print_stats(iterator *it, FILE *out) {
+	fprintf(out, "  iterative: %lu queries sent, %lu referrals, %lu lookups started below the root, "
+			"%lu name server lookups, %lu CNAMEs followed, %lu failed, %d delegations cached\n",
+			it->queries, it->referrals, it->cut_hits, it->ns_lookups, it->cname_restarts,
+			it->failed, it->num_zones);
+	upstream_print_stats(&it->engine, out);
+}
+
+static int load_hints(iterator *it, char *hints) {
+	// the root servers' addresses, where lookups start when no closer
+	// zone cut is known
+	char line[MAX_BUFFER_SIZE];
+	FILE *f = fopen(hints, "r");
+	if (f == NULL) {
+		perror(hints);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *last = NULL;
+		char *save = NULL;
+		char *word;
+		line[strcspn(line, "#;")] = '\0';
+		for (word = strtok_r(line, " \t\r\n", &save); word != NULL;
+				word = strtok_r(NULL, " \t\r\n", &save)) {
+			last = word;
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_port = htons(it->port);
+		if (last == NULL || inet_pton(AF_INET, last, &addr.sin_addr) != 1) {
+			continue;
+		}
+		int s = upstream_server(&it->engine, &addr);
+		if (s >= 0 && it->num_root < UPSTREAM_MAX) {
+			it->root[it->num_root++] = s;
+		}
+	}
+	fclose(f);
+	if (it->num_root == 0) {
+		fprintf(stderr, "No root server addresses in %s\n", hints);
+		return -1;
+	}
+	return 0;
+}
+
+static iterate_task *task_new(iterator *it, unsigned char *name, int name_len, unsigned short type,
+		iterate_task *parent) {
+	// a free task for a lookup, or NULL if there is none
+	iterate_task *t = it->free;
+	if (t == NULL) {
+		return NULL;
+	}
+	it->free = t->next;
+	memcpy(t->qname, name, name_len);
+	t->qname_len = name_len;
+	t->qtype = type;
+	t->query_len = 0;
+	t->referrals = 0;
+	t->cnames = 0;
+	t->chain_len = 0;
+	t->chain_rrs = 0;
+	t->followed = 0;
+	t->num_ns = 0;
+	t->parent = parent;
+	t->depth = parent != NULL ? parent->depth + 1 : 0;
+	t->data = NULL;
+	return t;
+}
+
+static void task_start(iterator *it, iterate_task *t) {
+	/*
+	 * Send a task's query to the servers of the closest zone cut known
+	 * above its name: the longest of its suffixes with an unexpired
+	 * delegation, or the root.
+	 */
+	unsigned char *name = t->qname;
+	int name_len = t->qname_len;
+	while (name_len > 1) {
+		iterate_zone *z = zone_find(it, name, name_len);
+		if (z != NULL) {
+			memcpy(t->zone, z->name, z->name_len);
+			t->zone_len = z->name_len;
+			memcpy(t->servers, z->servers, sizeof(int) * z->num_servers);
+			t->num_servers = z->num_servers;
+			it->cut_hits++;
+			task_send(it, t);
+			return;
+		}
+		name_len -= name[0] + 1;
+		name += name[0] + 1;
+	}
+	t->zone[0] = 0;
+	t->zone_len = 1;
+	memcpy(t->servers, it->root, sizeof(int) * it->num_root);
+	t->num_servers = it->num_root;
+	task_send(it, t);
+}
+
+static void task_send(iterator *it, iterate_task *t) {
+	// ask the current zone's servers for the name, without RD but with
+	// an OPT record (EDNS(0)) for a bigger UDP payload
+	unsigned char msg[MAX_BUFFER_SIZE];
+	memset(msg, 0, 12);
+	msg[5] = 1;
+	memcpy(msg + 12, t->qname, t->qname_len);
+	int len = 12 + t->qname_len;
+	msg[len++] = t->qtype >> 8;
+	msg[len++] = t->qtype & 0xff;
+	msg[len++] = 0;
+	msg[len++] = 1;
+	len = dns_opt_add(msg, len, MAX_BUFFER_SIZE, EDNS_PAYLOAD, 0);
+	it->queries++;
+	if (upstream_submit_to(&it->engine, msg, len, t->servers, t->num_servers, t) < 0) {
+		task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+	}
+}
+
+static void task_response(void *data, unsigned char *msg, int len) {
+	/*
+	 * The engine's outcome for one step of a lookup.  An answer for the
+	 * name (or that it doesn't exist, or has no data of the type) ends
+	 * the lookup; a CNAME without its target's data restarts it at the
+	 * target; a referral to a zone below the one asked moves it down.
+	 */
+	iterate_task *t = (iterate_task *)data;
+	iterator *it = (iterator *)t->iterator;
+	unsigned char target[DNS_NAME_MAX];
+	int chain[DNS_CHAIN_MAX];
+	int chain_len, i, end;
+	dns_msg m;
+	if (msg == NULL) {
+		task_finish(it, t, NULL, 0, -1);
+		return;
+	}
+	if (dns_msg_parse(&m, msg, len) < 0 || m.num_questions != 1) {
+		task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+		return;
+	}
+	int rcode = RCODE(msg[3]);
+	if (rcode != 0 && rcode != RCODE_NXDOMAIN) {
+		task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+		return;
+	}
+	// follow the CNAMEs in the answer, keeping each for the response
+	int answer = dns_msg_answer(&m, t->qtype, chain, &chain_len);
+	for (i = 0; i < chain_len; i++) {
+		int rr_len = copy_rr(&m, &m.rrs[chain[i]], t->chain + t->chain_len,
+				MAX_BUFFER_SIZE - t->chain_len);
+		if (rr_len < 0 || ++t->cnames > ITERATE_CNAMES_MAX) {
+			task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+			return;
+		}
+		t->chain_len += rr_len;
+		t->chain_rrs++;
+	}
+	if (chain_len > 0) {
+		int target_at = answer >= 0 ? m.rrs[answer].name_at : m.rrs[chain[chain_len - 1]].rdata_at;
+		int target_len = dns_name_expand(msg, len, target_at, target, &end);
+		if (target_len < 0) {
+			task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+			return;
+		}
+		memcpy(t->qname, target, target_len);
+		t->qname_len = target_len;
+	}
+	if (answer >= 0) {
+		// the answer, with any CNAMEs that led to it
+		task_finish(it, t, msg, len, rcode);
+		return;
+	}
+	if (chain_len > 0) {
+		// the target's data wasn't in the response; look it up from the
+		// closest zone cut known above it
+		t->followed = t->chain_rrs;
+		it->cname_restarts++;
+		task_start(it, t);
+		return;
+	}
+	if (rcode == 0 && m.count[DNS_ANSWER] == 0 && task_referral(it, t, &m)) {
+		return;
+	}
+	// the name doesn't exist or has no data of the type
+	task_finish(it, t, msg, len, rcode);
+}
+
+static int task_referral(iterator *it, iterate_task *t, dns_msg *m) {
+	/*
+	 * Follow a referral: NS records in the authority section for a zone
+	 * that holds the name and is below the zone that was asked.  The
+	 * delegation is cached and the query sent to its servers, or, with
+	 * no glue for them inside the zone asked, their addresses looked up
+	 * first.
+	 *
+	 * OUTPUT: 1 if the response was a referral (and the task has been
+	 *         moved along), 0 if not
+	 */
+	unsigned char owner[DNS_NAME_MAX];
+	unsigned char ns[DNS_NAME_MAX];
+	int i, n, count, end;
+	int cut_len = 0;
+	t->num_ns = 0;
+	t->cut_ttl = ITERATE_TTL_MAX;
+	dns_msg_rr *rr = dns_msg_section(m, DNS_AUTHORITY, &count);
+	for (i = 0; i < count; i++, rr++) {
+		int owner_len = dns_name_expand(m->msg, m->len, rr->name_at, owner, &end);
+		if (owner_len < 0) {
+			return 0;
+		}
+		if (rr->type != TYPE_NS || owner_len <= t->zone_len
+				|| !in_zone(owner, owner_len, t->zone, t->zone_len)
+				|| !in_zone(t->qname, t->qname_len, owner, owner_len)
+				|| (cut_len > 0 && (owner_len != cut_len || memcmp(owner, t->cut, cut_len) != 0))) {
+			continue;
+		}
+		int ns_len = dns_name_expand(m->msg, m->len, rr->rdata_at, ns, &end);
+		if (ns_len < 0 || t->num_ns == ITERATE_NS_MAX) {
+			continue;
+		}
+		memcpy(t->cut, owner, owner_len);
+		cut_len = t->cut_len = owner_len;
+		memcpy(t->ns[t->num_ns++], ns, ns_len);
+		if (rr->ttl < t->cut_ttl) {
+			t->cut_ttl = rr->ttl;
+		}
+	}
+	if (t->num_ns == 0) {
+		return 0;
+	}
+	if (++t->referrals > ITERATE_REFERRALS_MAX) {
+		task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+		return 1;
+	}
+	it->referrals++;
+	// the glue: addresses of the name servers, if they are in the zone
+	// that was asked
+	t->num_servers = 0;
+	rr = dns_msg_section(m, DNS_ADDITIONAL, &count);
+	for (i = 0; i < count; i++, rr++) {
+		int owner_len = dns_name_expand(m->msg, m->len, rr->name_at, owner, &end);
+		if (owner_len < 0) {
+			break;
+		}
+		if (rr->type != TYPE_A || rr->rdata_len != 4 || t->num_servers == UPSTREAM_MAX
+				|| !in_zone(owner, owner_len, t->zone, t->zone_len)) {
+			continue;
+		}
+		for (n = 0; n < t->num_ns; n++) {
+			if (memcmp(owner, t->ns[n], owner_len) == 0) {
+				break;
+			}
+		}
+		if (n == t->num_ns) {
+			continue;
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_port = htons(it->port);
+		memcpy(&addr.sin_addr.s_addr, m->msg + rr->rdata_at, 4);
+		int s = upstream_server(&it->engine, &addr);
+		if (s >= 0) {
+			t->servers[t->num_servers++] = s;
+		}
+	}
+	if (t->num_servers == 0) {
+		t->next_ns = 0;
+		task_next_ns(it, t);
+		return 1;
+	}
+	zone_add(it, t->cut, t->cut_len, t->servers, t->num_servers, t->cut_ttl);
+	memcpy(t->zone, t->cut, t->cut_len);
+	t->zone_len = t->cut_len;
+	task_send(it, t);
+	return 1;
+}
+
+static void task_next_ns(iterator *it, iterate_task *t) {
+	// look up the address of the next name server of a referral without
+	// glue; the task carries on when it is found
+	while (t->next_ns < t->num_ns) {
+		unsigned char *name = t->ns[t->next_ns++];
+		int name_len = 1;
+		while (name[name_len - 1] != 0) {
+			name_len += name[name_len - 1] + 1;
+		}
+		if (t->depth >= ITERATE_DEPTH_MAX) {
+			break;
+		}
+		iterate_task *child = task_new(it, name, name_len, TYPE_A, t);
+		if (child == NULL) {
+			break;
+		}
+		it->ns_lookups++;
+		task_start(it, child);
+		return;
+	}
+	task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+}
+
+static void task_resume(iterator *it, iterate_task *t, unsigned char *msg, int len) {
+	// a name server's address was looked up for a task: send its query
+	// to the delegation, or try the next name server
+	struct in_addr addr;
+	if (msg == NULL || answer_ipv4(msg, len, &addr) != 1) {
+		task_next_ns(it, t);
+		return;
+	}
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_port = htons(it->port);
+	server.sin_addr = addr;
+	int s = upstream_server(&it->engine, &server);
+	if (s < 0) {
+		task_finish(it, t, NULL, 0, RCODE_SERVFAIL);
+		return;
+	}
+	t->servers[0] = s;
+	t->num_servers = 1;
+	zone_add(it, t->cut, t->cut_len, t->servers, t->num_servers, t->cut_ttl);
+	memcpy(t->zone, t->cut, t->cut_len);
+	t->zone_len = t->cut_len;
+	task_send(it, t);
+}
+
+static void task_finish(iterator *it, iterate_task *t, unsigned char *msg, int len, int rcode) {
+	/*
+	 * End a lookup: hand a name server lookup's outcome to the task
+	 * waiting for it, or give the caller its response (NULL if no
+	 * server answered).
+	 *
+	 * INPUT:  msg, len: the last response, or NULL
+	 * INPUT:  rcode: the response code, -1 if no server answered
+	 */
+	unsigned char response[MAX_RESPONSE_SIZE];
+	int response_len = 0;
+	if (msg == NULL) {
+		it->failed++;
+	}
+	if (t->query_len > 0 && rcode >= 0) {
+		response_len = build_response(t, msg, len, rcode, response);
+	}
+	iterate_task *parent = t->parent;
+	void *data = t->data;
+	int is_query = t->query_len > 0;
+	t->next = it->free;
+	it->free = t;
+	if (parent != NULL) {
+		task_resume(it, parent, msg, len);
+		return;
+	}
+	if (is_query) {
+		it->pending--;
+		it->done(data, response_len > 0 ? response : NULL, response_len);
+	}
+}
+
+static int build_response(iterate_task *t, unsigned char *msg, int len, int rcode,
+		unsigned char *response) {
+	/*
+	 * The response to the caller's query.  The last server's response
+	 * is passed on as it is when it holds the whole CNAME chain, if
+	 * any; otherwise (or if the lookup failed) one is put together from the caller's question,
+	 * the CNAMEs followed and the last response's answer records for
+	 * the name the chain ended at, with the names written out in full.
+	 * Either way it has the caller's ID, RD as asked and RA set.
+	 *
+	 * OUTPUT: the length of the response
+	 */
+	dns_msg m;
+	int i, count;
+	if (msg != NULL && t->followed == 0 && len <= MAX_RESPONSE_SIZE) {
+		memcpy(response, msg, len);
+		response[0] = t->query[0];
+		response[1] = t->query[1];
+		response[2] = 0x80 | (t->query[2] & 0x01);
+		response[3] = 0x80 | RCODE(msg[3]);
+		return len;
+	}
+	int num_answers = t->chain_rrs;
+	memcpy(response, t->query, t->query_len);
+	response[2] = 0x80 | (t->query[2] & 0x01);
+	response[3] = 0x80 | rcode;
+	memset(response + 6, 0, 6);
+	int response_len = t->query_len;
+	memcpy(response + response_len, t->chain, t->chain_len);
+	response_len += t->chain_len;
+	count = 0;
+	if (msg != NULL && dns_msg_parse(&m, msg, len) == 0) {
+		dns_msg_section(&m, DNS_ANSWER, &count);
+	}
+	for (i = 0; i < count; i++) {
+		dns_msg_rr *rr = &m.rrs[i];
+		if (rr->type != t->qtype || !dns_name_equal(msg, len, rr->name_at, t->qname)) {
+			continue;
+		}
+		int rr_len = copy_rr(&m, rr, response + response_len, MAX_RESPONSE_SIZE - response_len);
+		if (rr_len < 0) {
+			break;
+		}
+		response_len += rr_len;
+		num_answers++;
+	}
+	response[6] = num_answers >> 8;
+	response[7] = num_answers & 0xff;
+	return response_len;
+}
+
+static int copy_rr(dns_msg *m, dns_msg_rr *rr, unsigned char *out, int out_len) {
+	/*
+	 * Copy a record of a parsed message to out without compression: the
+	 * owner written out in full, and the rdata too for CNAME and NS
+	 * records (the name that is all of it).
+	 *
+	 * OUTPUT: the length of the copy, or -1 if the record is malformed
+	 *         or doesn't fit
+	 */
+	unsigned char owner[DNS_NAME_MAX];
+	unsigned char target[DNS_NAME_MAX];
+	int end;
+	int owner_len = dns_name_expand(m->msg, m->len, rr->name_at, owner, &end);
+	if (owner_len < 0) {
+		return -1;
+	}
+	unsigned char *rdata = m->msg + rr->rdata_at;
+	int rdata_len = rr->rdata_len;
+	if (rr->type == CNAME || rr->type == TYPE_NS) {
+		rdata_len = dns_name_expand(m->msg, m->len, rr->rdata_at, target, &end);
+		rdata = target;
+		if (rdata_len < 0) {
+			return -1;
+		}
+	}
+	int rr_len = owner_len + 10 + rdata_len;
+	if (rr_len > out_len) {
+		return -1;
+	}
+	memcpy(out, owner, owner_len);
+	// type, class and TTL as they were
+	memcpy(out + owner_len, m->msg + rr->rdata_at - 10, 8);
+	out[owner_len + 8] = rdata_len >> 8;
+	out[owner_len + 9] = rdata_len & 0xff;
+	memcpy(out + owner_len + 10, rdata, rdata_len);
+	return rr_len;
+}
+
+static int in_zone(unsigned char *name, int name_len, unsigned char *zone, int zone_len) {
+	// whether a name is the zone or below it (both lower-case wire format)
+	while (name_len > zone_len) {
+		name_len -= name[0] + 1;
+		name += name[0] + 1;
+	}
+	return name_len == zone_len && memcmp(name, zone, zone_len) == 0;
+}
+
+static iterate_zone *zone_find(iterator *it, unsigned char *name, int name_len) {
+	// the unexpired delegation of a zone, or NULL
+	iterate_zone *z = it->zones[name_hash(name, name_len) % ITERATE_ZONE_BUCKETS];
+	for (; z != NULL; z = z->next) {
+		if (z->name_len == name_len && memcmp(z->name, name, name_len) == 0) {
+			return z->expires > now_seconds() ? z : NULL;
+		}
+	}
+	return NULL;
+}
+
+static void zone_add(iterator *it, unsigned char *name, int name_len, int *servers,
+		int num_servers, dns_rr_ttl ttl) {
+	// cache a delegation, replacing what was known of the zone; once
+	// ITERATE_ZONES_MAX are cached only known zones are updated
+	unsigned int bucket = name_hash(name, name_len) % ITERATE_ZONE_BUCKETS;
+	iterate_zone *z = it->zones[bucket];
+	while (z != NULL && (z->name_len != name_len || memcmp(z->name, name, name_len) != 0)) {
+		z = z->next;
+	}
+	if (z == NULL) {
+		if (it->num_zones == ITERATE_ZONES_MAX) {
+			return;
+		}
+		z = (iterate_zone *)malloc(sizeof(iterate_zone));
+		if (z == NULL) {
+			return;
+		}
+		memcpy(z->name, name, name_len);
+		z->name_len = name_len;
+		z->next = it->zones[bucket];
+		it->zones[bucket] = z;
+		it->num_zones++;
+	}
+	memcpy(z->servers, servers, sizeof(int) * num_servers);
+	z->num_servers = num_servers;
+	z->expires = now_seconds() + (ttl < ITERATE_TTL_MAX ? ttl : ITERATE_TTL_MAX);
+}
+
+static unsigned int name_hash(unsigned char *name, int name_len) {
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < name_len; i++) {
+		h = (h ^ name[i]) * 16777619u;
+	}
+	return h;
+}
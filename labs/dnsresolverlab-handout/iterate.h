@@ -0,0 +1,111 @@
+/*
+ * Iterative resolution for the DNS resolver - CS 360
+ * Resolves names the way a recursive server does instead of asking one
+ * that does.  A query starts at the root servers listed in a hints file
+ * and is sent, without RD, to the servers of the closest zone known to
+ * hold the name.  A server that doesn't have the name itself refers the
+ * query to the zone below (NS records in the authority section and the
+ * addresses of those name servers, the glue, in the additional section),
+ * and the query moves down the tree until a server answers for the name
+ * or says it doesn't exist.
+ *
+ * Every delegation learned is kept for its NS TTL, so later names in the
+ * same zones start at the closest zone cut known instead of at the root.
+ * A CNAME whose target isn't in the same response is followed with a
+ * new query for the target.  Glue is only taken for names inside the
+ * zone of the server that gave it (its bailiwick), so a server can't
+ * redirect names it isn't responsible for; a referral without usable
+ * glue has its name servers' addresses looked up as queries of their
+ * own first.
+ *
+ * Many resolutions run at once: each step is a query in one query
+ * engine (see upstream.h), which retransmits and fails over between the
+ * servers of each zone and keeps their RTTs from one query to the next.
+ *
+*/
+
+#ifndef ITERATE_H
+#define ITERATE_H
+
+#include <stdio.h>
+
+#include "resolver.h"
+#include "upstream.h"
+
+#define NAME_WIRE_MAX			256		// longest name in wire format
+#define ITERATE_ZONES_MAX		65536	// delegations cached
+#define ITERATE_ZONE_BUCKETS	16384
+#define ITERATE_TTL_MAX			86400	// longest a delegation is kept, in seconds
+#define ITERATE_REFERRALS_MAX	16		// referrals followed for one name
+#define ITERATE_CNAMES_MAX		8		// CNAMEs followed for one query
+#define ITERATE_DEPTH_MAX		3		// name server lookups nested in a lookup
+#define ITERATE_NS_MAX			UPSTREAM_MAX	// name servers taken from a referral
+
+typedef struct iterate_zone {
+	unsigned char name[NAME_WIRE_MAX];	// lower-case wire format
+	int name_len;
+	int servers[UPSTREAM_MAX];			// engine indexes of its name servers
+	int num_servers;
+	double expires;						// now_seconds() when it is no good
+	struct iterate_zone *next;			// hash chain
+} iterate_zone;
+
+typedef struct iterate_task {
+	void *iterator;						// the iterator it belongs to
+	unsigned char query[MAX_BUFFER_SIZE];	// the caller's query, for the response
+	int query_len;
+	unsigned char qname[NAME_WIRE_MAX];	// the name being looked up now
+	int qname_len;
+	unsigned short qtype;
+	unsigned char zone[NAME_WIRE_MAX];	// the zone whose servers are asked
+	int zone_len;
+	int servers[UPSTREAM_MAX];
+	int num_servers;
+	int referrals;
+	int cnames;
+	int depth;							// 0 for the caller's queries
+	unsigned char chain[MAX_BUFFER_SIZE];	// CNAME records followed, uncompressed
+	int chain_len;
+	int chain_rrs;
+	int followed;						// of them, from responses before the last
+	// a referral without glue, waiting for its name servers' addresses
+	unsigned char cut[NAME_WIRE_MAX];
+	int cut_len;
+	dns_rr_ttl cut_ttl;
+	unsigned char ns[ITERATE_NS_MAX][NAME_WIRE_MAX];
+	int num_ns;
+	int next_ns;
+	struct iterate_task *parent;		// the task waiting for this one's address
+	void *data;							// the caller's
+	struct iterate_task *next;			// free list
+} iterate_task;
+
+typedef struct {
+	upstream_engine engine;
+	unsigned short port;				// of every server, root or not
+	iterate_zone **zones;				// delegations by name
+	int num_zones;
+	int root[UPSTREAM_MAX];				// the root servers from the hints
+	int num_root;
+	iterate_task *tasks;
+	iterate_task *free;
+	int num_tasks;
+	int pending;						// caller's queries not yet reported
+	int max_queries;
+	upstream_done done;
+	unsigned long queries;				// sent to the engine
+	unsigned long referrals;
+	unsigned long cut_hits;				// lookups started below the root
+	unsigned long ns_lookups;			// name server addresses looked up
+	unsigned long cname_restarts;
+	unsigned long failed;				// SERVFAIL or no answer
+} iterator;
+
+int iterate_init(iterator *it, char *hints, unsigned short port, int max_queries, int num_socks,
+		upstream_done done);
+void iterate_free(iterator *it);
+int iterate_submit(iterator *it, unsigned char *msg, int len, void *data);
+void iterate_wait(iterator *it);
+void iterate_print_stats(iterator *it, FILE *out);
+
+#endif /* ITERATE_H */
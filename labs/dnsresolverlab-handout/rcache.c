@@ -0,0 +1,283 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/file.h>
+#include<sys/stat.h>
+
+#include "rcache.h"
+#include "dns_msg.h"
+
+#define RCODE_NOERROR		0
+#define RCODE_NXDOMAIN		3
+
+static int question_key(unsigned char *msg, int len, unsigned char *key);
+static int response_ttl(unsigned char *msg, int len, int *negative);
+static unsigned int hash_key(unsigned char *key, int len);
+static rcache_slot *find(rcache *c, unsigned char *key, int key_len, unsigned int hash);
+
+int rcache_open(rcache *c, char *file) {
+	/*
+	 * Set up a cache, kept in file if one is given and in memory
+	 * otherwise.  A file that isn't a cache of this layout (or is
+	 * empty) is started over.
+	 *
+	 * INPUT:  c: the cache
+	 * INPUT:  file: the cache file, or NULL
+	 * OUTPUT: 0 on success, -1 if no cache could be set up
+	 */
+	memset(c, 0, sizeof(rcache));
+	c->fd = -1;
+	c->map_len = sizeof(rcache_header) + sizeof(rcache_slot) * RCACHE_SETS * RCACHE_WAYS;
+	if (file != NULL) {
+		c->fd = open(file, O_RDWR | O_CREAT, 0644);
+		if (c->fd < 0) {
+			perror(file);
+		} else if (flock(c->fd, LOCK_EX | LOCK_NB) < 0) {
+			fprintf(stderr, "%s is in use, caching in memory only\n", file);
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+	struct stat st;
+	int fresh = 1;
+	if (c->fd >= 0) {
+		if (fstat(c->fd, &st) < 0 || (st.st_size != (off_t)c->map_len
+				&& ftruncate(c->fd, 0) < 0) || ftruncate(c->fd, c->map_len) < 0) {
+			perror(file);
+			close(c->fd);
+			return -1;
+		}
+		fresh = st.st_size != (off_t)c->map_len;
+		c->header = (rcache_header *)mmap(NULL, c->map_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED, c->fd, 0);
+	} else {
+		c->header = (rcache_header *)mmap(NULL, c->map_len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (c->header == MAP_FAILED) {
+		perror("mmap");
+		if (c->fd >= 0) {
+			close(c->fd);
+		}
+		c->header = NULL;
+		return -1;
+	}
+	c->slots = (rcache_slot *)(c->header + 1);
+	rcache_header *h = c->header;
+	if (!fresh && (memcmp(h->magic, RCACHE_MAGIC, sizeof(h->magic)) != 0
+			|| h->version != RCACHE_VERSION || h->slot_size != sizeof(rcache_slot)
+			|| h->sets != RCACHE_SETS || h->ways != RCACHE_WAYS)) {
+		fresh = 1;
+	}
+	if (fresh) {
+		// new pages of the file and anonymous memory are zero: all unused
+		memset(c->slots, 0, sizeof(rcache_slot) * RCACHE_SETS * RCACHE_WAYS);
+		memcpy(h->magic, RCACHE_MAGIC, sizeof(h->magic));
+		h->version = RCACHE_VERSION;
+		h->slot_size = sizeof(rcache_slot);
+		h->sets = RCACHE_SETS;
+		h->ways = RCACHE_WAYS;
+	}
+	return 0;
+}
+
+void rcache_close(rcache *c) {
+	if (c->header != NULL) {
+		munmap(c->header, c->map_len);
+	}
+	if (c->fd >= 0) {
+		// closing drops the lock
+		close(c->fd);
+	}
+	c->header = NULL;
+	c->slots = NULL;
+	c->fd = -1;
+}
+
+int rcache_get(rcache *c, unsigned char *query, int query_len, unsigned char *msg, int *prefetch) {
+	/*
+	 * Look up the response to a query.  The response is copied with the
+	 * query's ID in place of the one it was stored with.
+	 *
+	 * INPUT:  c: the cache
+	 * INPUT:  query, query_len: the query message
+	 * INPUT:  msg: where to copy the response (RCACHE_MSG_MAX bytes)
+	 * INPUT:  prefetch: set to 1 if the caller should look the query up
+	 *         again and rcache_put() the answer (it is popular and about
+	 *         to expire), 0 if not; NULL if the caller won't
+	 * OUTPUT: the length of the response, or 0 if it isn't cached
+	 */
+	unsigned char key[RCACHE_KEY_MAX];
+	int key_len = question_key(query, query_len, key);
+	if (key_len < 0) {
+		return 0;
+	}
+	unsigned int hash = hash_key(key, key_len);
+	rcache_slot *slot = find(c, key, key_len, hash);
+	long long now = time(NULL);
+	if (prefetch != NULL) {
+		*prefetch = 0;
+	}
+	if (slot == NULL) {
+		c->misses++;
+		return 0;
+	}
+	if (slot->expires <= now) {
+		slot->key_len = 0;
+		c->expired++;
+		c->misses++;
+		return 0;
+	}
+	memcpy(msg, slot->msg, slot->msg_len);
+	msg[0] = query[0];
+	msg[1] = query[1];
+	c->hits++;
+	if (slot->negative) {
+		c->negative_hits++;
+	}
+	slot->hits++;
+	if (prefetch != NULL && slot->hits >= RCACHE_PREFETCH_HITS
+			&& (slot->expires - now) * 100 <= (long long)slot->ttl * RCACHE_PREFETCH_PERCENT
+			&& now - slot->prefetched >= RCACHE_PREFETCH_RETRY) {
+		// one refresh at a time: the next hits use the entry as it is
+		slot->prefetched = now;
+		c->prefetches++;
+		*prefetch = 1;
+	}
+	return slot->msg_len;
+}
+
+void rcache_put(rcache *c, unsigned char *msg, int len) {
+	/*
+	 * Keep a response for as long as its TTLs allow.  It replaces the
+	 * entry for the same question, else an unused or expired slot of
+	 * its set, else the slot of the set that expires first.
+	 *
+	 * INPUT:  c: the cache
+	 * INPUT:  msg, len: the response
+	 */
+	unsigned char key[RCACHE_KEY_MAX];
+	int negative;
+	if (len > RCACHE_MSG_MAX) {
+		return;
+	}
+	int ttl = response_ttl(msg, len, &negative);
+	int key_len = question_key(msg, len, key);
+	if (ttl <= 0 || key_len < 0) {
+		return;
+	}
+	unsigned int hash = hash_key(key, key_len);
+	long long now = time(NULL);
+	rcache_slot *slot = find(c, key, key_len, hash);
+	if (slot == NULL) {
+		rcache_slot *set = c->slots + (hash & (RCACHE_SETS - 1)) * RCACHE_WAYS;
+		int i;
+		slot = &set[0];
+		for (i = 0; i < RCACHE_WAYS; i++) {
+			if (set[i].key_len == 0 || set[i].expires <= now) {
+				slot = &set[i];
+				break;
+			}
+			if (set[i].expires < slot->expires) {
+				slot = &set[i];
+			}
+		}
+	}
+	slot->hash = hash;
+	slot->key_len = key_len;
+	memcpy(slot->key, key, key_len);
+	slot->msg_len = len;
+	memcpy(slot->msg, msg, len);
+	slot->negative = negative;
+	slot->expires = now + ttl;
+	slot->ttl = ttl;
+	slot->hits = 0;
+	slot->prefetched = 0;
+	c->stored++;
+}
+
+void rcache_print_stats(rcache *c, FILE *out) {
+	unsigned long lookups = c->hits + c->misses;
+	fprintf(out, "  cache%s: %lu hits (%lu negative), %lu misses (%lu expired), "
+			"%.1f%% hit rate, %lu stored, %lu refreshes asked for\n", c->fd >= 0 ? " file" : "",
+			c->hits, c->negative_hits, c->misses, c->expired,
+			lookups > 0 ? 100.0 * c->hits / lookups : 0.0, c->stored, c->prefetches);
+}
+
+static int question_key(unsigned char *msg, int len, unsigned char *key) {
+	// the question section, lower-cased, or -1 if there isn't exactly one
+	if (len < DNS_HEADER_LEN || msg[4] != 0 || msg[5] != 1) {
+		return -1;
+	}
+	int key_len = dns_question_length(msg, len);
+	if (key_len < 0 || key_len > RCACHE_KEY_MAX) {
+		return -1;
+	}
+	int i;
+	for (i = 0; i < key_len; i++) {
+		unsigned char ch = msg[DNS_HEADER_LEN + i];
+		key[i] = ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+	}
+	return key_len;
+}
+
+static int response_ttl(unsigned char *msg, int len, int *negative) {
+	/*
+	 * How long a response may be cached: the smallest TTL of its
+	 * answers, or for NXDOMAIN and NODATA the smaller of the SOA's TTL
+	 * and its minimum field (RFC 2308).  0 means not at all.
+	 */
+	dns_msg m;
+	if (dns_msg_parse(&m, msg, len) < 0 || !(m.flags & 0x8000) || (m.flags & 0x0200)) {
+		// malformed, not a response, or truncated
+		return 0;
+	}
+	int rcode = m.flags & 0x0f;
+	if (rcode != RCODE_NOERROR && rcode != RCODE_NXDOMAIN) {
+		return 0;
+	}
+	*negative = rcode == RCODE_NXDOMAIN || m.count[DNS_ANSWER] == 0;
+	long ttl = -1;
+	int i;
+	for (i = 0; i < m.count[DNS_ANSWER] + m.count[DNS_AUTHORITY]; i++) {
+		dns_msg_rr *rr = &m.rrs[i];
+		if (i < m.count[DNS_ANSWER]) {
+			if (!*negative && (ttl < 0 || rr->ttl < ttl)) {
+				ttl = rr->ttl;
+			}
+		} else if (*negative && rr->type == DNS_TYPE_SOA && rr->rdata_len >= 20) {
+			unsigned char *p = msg + rr->rdata_at + rr->rdata_len - 4;
+			long minimum = ((long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			ttl = (long)rr->ttl < minimum ? (long)rr->ttl : minimum;
+		}
+	}
+	if (ttl < 0) {
+		ttl = *negative ? RCACHE_NEGATIVE_TTL : 0;
+	}
+	return ttl > RCACHE_TTL_MAX ? RCACHE_TTL_MAX : (int)ttl;
+}
+
+static unsigned int hash_key(unsigned char *key, int len) {
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ key[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static rcache_slot *find(rcache *c, unsigned char *key, int key_len, unsigned int hash) {
+	rcache_slot *set = c->slots + (hash & (RCACHE_SETS - 1)) * RCACHE_WAYS;
+	int i;
+	for (i = 0; i < RCACHE_WAYS; i++) {
+		if (set[i].key_len == key_len && set[i].hash == hash
+				&& memcmp(set[i].key, key, key_len) == 0) {
+			return &set[i];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,81 @@
+/*
+ * Response cache for the DNS resolver - CS 360
+ * Responses are kept by question (name, type and class) until the
+ * smallest TTL in their answer runs out.  NXDOMAIN and NODATA
+ * responses are cached too (negative caching, RFC 2308) for the SOA's
+ * negative TTL, or for RCACHE_NEGATIVE_TTL when the server sends no
+ * SOA.  Errors and truncated responses aren't cached.
+ *
+ * The table is set-associative with fixed-size slots, so it can live
+ * in a file mapped with mmap(): repeated runs of the resolver then
+ * start with the answers of the runs before.  Expiry times are wall
+ * clock times for the same reason.  Only one process uses a cache
+ * file at a time (flock); another one falls back to a cache in memory.
+ *
+ * Each entry counts its hits.  A hit on a popular entry (hit at least
+ * RCACHE_PREFETCH_HITS times) in the last RCACHE_PREFETCH_PERCENT of its
+ * TTL tells the caller to look the question up again in the background
+ * while the cached answer is used, so names that are asked for all the
+ * time are refreshed before they expire instead of all missing at once.
+ *
+*/
+
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include <stdio.h>
+#include <time.h>
+
+#define RCACHE_MAGIC		"DNSRCACH"	// 8 bytes, no NUL
+#define RCACHE_VERSION		2
+#define RCACHE_SETS			16384		// a power of two (64K slots, ~50 MB)
+#define RCACHE_WAYS			4			// slots per set
+#define RCACHE_KEY_MAX		(255 + 4)	// wire-format name, type and class
+#define RCACHE_MSG_MAX		512			// longest response that is cached
+#define RCACHE_TTL_MAX		86400		// nothing is kept longer than a day
+#define RCACHE_NEGATIVE_TTL	30			// for negative answers without an SOA
+#define RCACHE_PREFETCH_PERCENT	10		// refresh in the last 10% of the TTL
+#define RCACHE_PREFETCH_HITS	2		// hits that make an entry worth refreshing
+#define RCACHE_PREFETCH_RETRY	10		// seconds before a refresh that never came back is tried again
+
+typedef struct {
+	unsigned int hash;
+	unsigned short key_len;		// 0 = unused
+	unsigned short msg_len;
+	long long expires;			// wall clock time
+	long long prefetched;		// when a refresh was last asked for, 0 = never
+	unsigned int ttl;			// what the TTL was when it was stored
+	unsigned int hits;			// since it was stored
+	unsigned char negative;
+	unsigned char key[RCACHE_KEY_MAX];			// lower-case question
+	unsigned char msg[RCACHE_MSG_MAX];			// the response, ID and all
+} rcache_slot;
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int slot_size;		// sizeof(rcache_slot)
+	unsigned int sets;
+	unsigned int ways;
+} rcache_header;
+
+typedef struct {
+	rcache_header *header;
+	rcache_slot *slots;
+	size_t map_len;
+	int fd;					// the cache file, or -1 for a cache in memory
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long misses;
+	unsigned long expired;	// misses on an entry whose TTL ran out
+	unsigned long stored;
+	unsigned long prefetches;	// hits that asked for a refresh
+} rcache;
+
+int rcache_open(rcache *c, char *file);
+void rcache_close(rcache *c);
+int rcache_get(rcache *c, unsigned char *query, int query_len, unsigned char *msg, int *prefetch);
+void rcache_put(rcache *c, unsigned char *msg, int len);
+void rcache_print_stats(rcache *c, FILE *out);
+
+#endif /* RCACHE_H */
@@ -5,48 +5,24 @@
 #include<sys/socket.h>
 #include<netinet/in.h>
 #include <arpa/inet.h>
+#include<unistd.h>
 
-#define MAX_BUFFER_SIZE	1024
-
-#define BITS_IN_CHAR	8
-#define IS_POINTER(c)	(c & 0xc0)
-#define IS_QUERY(c)		!(c & 0x80)
-#define IS_RESPONSE(c)	(s & 0x80)
-#define OPCODE(c)		((c & 0x78)>>3)
-#define FLAGS(s)		(s & 0x07f0)
-#define AA_SET(f)		(f & 0x0400)
-#define TC_SET(f)		(f & 0x0200)
-#define RD_SET(f)		(f & 0x0100)
-#define RA_SET(f)		(f & 0x0080)
-#define Z_ST(f)			(f & 0x0040)
-#define AD_SET(f)		(f & 0x0020)
-#define CD_SET(f)		(f & 0x0010)
-#define RCODE(c)		(c & 0x0f)
-
-#define SWAP_ENDIAN_32(num)	(((num>>24)&0xff) | ((num<<8)&0xff0000) | ((num>>8)&0xff00) | ((num<<24)&0xff000000)) // byte 0 to byte 3
-
-#define TYPE_A			1
-#define CNAME			5
-
-// Set this to 1 to see debug messages, 0 to hide them
-#define DEBUG_MODE 1
-
-typedef unsigned int dns_rr_ttl;
-typedef unsigned short dns_rr_type;
-typedef unsigned short dns_rr_class;
-typedef unsigned short dns_rdata_len;
-typedef unsigned short dns_rr_count;
-typedef unsigned short dns_query_id;
-typedef unsigned short dns_flags;
+#include "resolver.h"
+#include "batch.h"
+#include "upstream.h"
+#include "iterate.h"
+#include "rcache.h"
+#include "dns_msg.h"
 
 typedef struct {
-	char *name;
-	dns_rr_type type;
-	dns_rr_class class;
-	dns_rr_ttl ttl;
-	dns_rdata_len rdata_len;
-	unsigned char *rdata;
-} dns_rr;
+	unsigned char *response;
+	int len;
+} received_message;
+
+int upstream_race = UPSTREAM_RACE;		// servers each query is sent to at once
+double upstream_drop_rate = 0;			// queries lost on purpose, for testing
+rcache *resolver_cache = NULL;			// responses from earlier queries (and runs)
+char *root_hints = NULL;				// resolve from the root servers in this file
 
 // the query for a connectino to www.example.com 
 unsigned char example_msg[] = {
@@ -61,26 +37,6 @@ unsigned char example_msg[] = {
 0x01
 };
 
-/*******************************************************************************
- * Function definitions
-*/
-void print_bytes(unsigned char *bytes, int byteslen);
-void canonicalize_name(char *name);
-int name_ascii_to_wire(char *name, unsigned char *wire);
-char *name_ascii_from_wire(unsigned char *wire, int *indexp);
-dns_rr rr_from_wire(unsigned char *wire, int *indexp, int query_only);
-int rr_to_wire(dns_rr rr, unsigned char *wire, int query_only);
-unsigned short create_dns_query(char *qname, dns_rr_type qtype, unsigned char *wire);
-char *get_answer_address(char *qname, dns_rr_type qtype, unsigned char *wire);
-int send_recv_message(unsigned char *request, int requestlen, unsigned char *response, char *server, unsigned short port);
-char *resolve(char *qname, char *server);
-int create_udp_socket(char* server, short port);
-void flushBuffer(char* buffer);
-
-
-
-
-
 void print_bytes(unsigned char *bytes, int byteslen) {
 	int i, j, byteslen_adjusted;
 	unsigned char c;
@@ -193,130 +149,18 @@ int name_ascii_to_wire(char *name, unsigned char *wire) {
 		 strncpy(wire_ptr,cur_label,len);
 		 wire_ptr += len;
 		 cur_label = strtok(NULL,delim);
-		 total_len += len;
+		 // the length byte and the label
+		 total_len += len + 1;
 	 }
 	 // add the terminating 00 to the end
 	 char c = 0x00;
 	 memcpy(wire_ptr,&c,sizeof(char));
-	 total_len += 4;
+	 total_len += 1;
 	 
 	 return total_len;
 
 }
 
-char *name_ascii_from_wire(unsigned char *wire, int *indexp) {
-	/* 
-	 * Extract the wire-formatted DNS name at the offset specified by
-	 * *indexp in the array of bytes provided (wire) and return its string
-	 * representation (dot-separated labels) in a char array allocated for
-	 * that purpose.  Update the value pointed to by indexp to the next
-	 * value beyond the name.
-	 *
-	 * INPUT:  wire: a pointer to an array of bytes
-	 * INPUT:  indexp, a pointer to the index in the wire where the
-	 *              wire-formatted name begins
-	 * OUTPUT: a string containing the string representation of the name,
-	 *              allocated on the heap.
-	 */
-	
-	int compressed = 0;
-	unsigned char* wire_ptr = wire;
-	unsigned char* name = (char*)malloc(sizeof(char)*MAX_BUFFER_SIZE);
-	char* name_ptr = name;
-	char* delim = ".";
-	wire_ptr += *indexp;
-	int label_len = (int)*wire_ptr;
-	while(label_len != 0){
-		if(label_len >= 192){
-			// we are looking at a pointer, get the offset and move the pointer
-			if(DEBUG_MODE){printf("Found a pointer!\n");}
-			wire_ptr++;
-			if(!compressed){(*indexp)++;}
-			int name_offset = (int)*wire_ptr;
-			wire_ptr = (wire + name_offset);
-			label_len = (int)(*wire_ptr); 
-			compressed = 1;
-		}else{
-			wire_ptr++;								// increment to start of label
-			if(!compressed){(*indexp)++;}
-			memcpy(name_ptr,wire_ptr,label_len);	// read the label
-			name_ptr += label_len;		
-			wire_ptr += label_len;					// increment to next length
-			if(!compressed){(*indexp) += label_len;}
-			label_len = (int)*wire_ptr;				// get the length of the label
-			if(label_len != 0){
-				memcpy(name_ptr,delim,sizeof(char));	// add the period
-				name_ptr++;
-			}
-		}
-	}
-	// increment past the trailing 0x00 or the pointer value
-	(*indexp)++;
-
-	return name;
-}
-
-dns_rr rr_from_wire(unsigned char *wire, int *indexp, int query_only) {
-	/* 
-	 * Extract the wire-formatted resource record at the offset specified by
-	 * *indexp in the array of bytes provided (wire) and return a 
-	 * dns_rr (struct) populated with its contents. Update the value
-	 * pointed to by indexp to the next value beyond the resource record.
-	 *
-	 * INPUT:  wire: a pointer to an array of bytes
-	 * INPUT:  indexp: a pointer to the index in the wire where the
-	 *              wire-formatted resource record begins
-	 * INPUT:  query_only: a boolean value (1 or 0) which indicates whether
-	 *              we are extracting a full resource record or only a
-	 *              query (i.e., in the question section of the DNS
-	 *              message).  In the case of the latter, the ttl,
-	 *              rdata_len, and rdata are skipped.
-	 * OUTPUT: the resource record (struct)
-	 */
-
-	unsigned char* wire_ptr = wire;
-	dns_rr rr;
-	wire_ptr += (*indexp);
-	// extract the name (but check for pointer)
-	if(((int)(*wire_ptr) < 192) && !query_only){
-		(*indexp) += 11;
-	}
-	rr.name = name_ascii_from_wire(wire,indexp);
-	wire_ptr = (wire + *indexp);
-	if(DEBUG_MODE){printf("RR Name: %s\n",rr.name);}
-	// extract the type
-	memcpy(&rr.type,wire_ptr,sizeof(dns_rr_type));
-	rr.type = ntohs(rr.type);
-	wire_ptr += sizeof(short);
-	(*indexp) += sizeof(short);
-	// extract the class
-	
-	memcpy(&rr.class,wire_ptr,sizeof(dns_rr_type));
-	rr.class = ntohs(rr.class);
-	wire_ptr += sizeof(short);
-	(*indexp) += sizeof(short);
-	// stop here unless the query only flag is not set
-	if(query_only == 0){
-		// extract the ttl
-		memcpy(&(rr.ttl),wire_ptr,sizeof(int));
-		wire_ptr += sizeof(int);
-		(*indexp) += sizeof(int);
-		// extract the record data length
-		memcpy(&rr.rdata_len,wire_ptr,sizeof(dns_rdata_len));
-		rr.rdata_len = ntohs(rr.rdata_len);
-		wire_ptr += sizeof(dns_rdata_len);
-		(*indexp) += sizeof(dns_rdata_len);
-		// extract a pointer to the record data
-		rr.rdata = wire_ptr;
-		// increment the index past the rdata 
-		(*indexp) += (int)rr.rdata_len;
-	}
-	
-	return rr;
-
-}
-
-
 int rr_to_wire(dns_rr rr, unsigned char *wire, int query_only) {
 	/* 
 	 * Convert a DNS resource record struct to DNS wire format, using the
@@ -341,7 +185,8 @@ unsigned short create_dns_query(char *qname, dns_rr_type qtype, unsigned char *w
 	/* 
 	 * Create a wire-formatted DNS (query) message using the provided byte
 	 * array (wire).  Create the header and question sections, including
-	 * the qname and qtype.
+	 * the qname and qtype, and an OPT record (EDNS(0)) so answers up to
+	 * EDNS_PAYLOAD bytes come back over UDP.
 	 *
 	 * INPUT:  qname: the string containing the name to be queried
 	 * INPUT:  qtype: the integer representation of type of the query (type A == 1)
@@ -380,154 +225,186 @@ unsigned short create_dns_query(char *qname, dns_rr_type qtype, unsigned char *w
 	 wire_ptr += sizeof(short);
 	 wire_len += (short) sizeof(short);
 
+	 // advertise the UDP payload we take
+	 wire_len = dns_opt_add(wire,wire_len,MAX_BUFFER_SIZE,EDNS_PAYLOAD,0);
+
 	 return wire_len;
 
 }
 
-char *get_answer_address(char *qname, dns_rr_type qtype, unsigned char *wire) {
+char *get_answer_address(char *qname, dns_rr_type qtype, unsigned char *wire, int len) {
 	/* 
 	 * Extract the IPv4 address from the answer section, following any
 	 * aliases that might be found, and return the string representation of
-	 * the IP address.  If no address is found, then return NULL.
+	 * the IP address.  If no address is found, then return NULL.  The
+	 * message is parsed in place (see dns_msg.h), so nothing is allocated;
+	 * the address is in inet_ntoa()'s buffer until the next call.
 	 *
 	 * INPUT:  qname: the string containing the name that was queried
 	 * INPUT:  qtype: the integer representation of type of the query (type A == 1)
 	 * INPUT:  wire: the pointer to the array of bytes representing the DNS wire message
+	 * INPUT:  len: the length of the message
 	 * OUTPUT: a string representing the IP address in the answer; or NULL if none is found
 	 */
 
-	 char* qname_ptr = qname;
-	 char* wire_ptr = wire;
-	 int offset = 0;
-	 dns_rr question_rr;
-	 dns_rr rr;
-	 // increment past the id and the flags and opcode
-	 wire_ptr += sizeof(int);
-	 offset += sizeof(int);
-	 // get the quantity info
-	 // get the number of questions
-	 short num_questions;
-	 memcpy(&num_questions,wire_ptr,sizeof(short));
-	 num_questions = ntohs(num_questions);
-	 if(DEBUG_MODE){printf("Num Questions: %d\n",num_questions);}
-	 wire_ptr += sizeof(dns_rr_count);
-	 offset += sizeof(dns_rr_count);
-	 // get the number of answer rr
-	 dns_rr_count num_answer_rr;
-	 memcpy(&num_answer_rr,wire_ptr,sizeof(dns_rr_count));
-	 num_answer_rr = ntohs(num_answer_rr);
-	 if(DEBUG_MODE){printf("Num Answer RR: %d\n",num_answer_rr);}
-	 wire_ptr += sizeof(dns_rr_count);
-	 offset += sizeof(dns_rr_count);
-	 // get the number of authority rr
-	 dns_rr_count num_auth_rr;
-	 memcpy(&num_auth_rr,wire_ptr,sizeof(dns_rr_count));
-	 num_auth_rr = ntohs(num_auth_rr);
-	 if(DEBUG_MODE){printf("Num Authority RR: %d\n",num_auth_rr);}
-	 wire_ptr += sizeof(dns_rr_count);
-	 offset += sizeof(dns_rr_count);
-	 // get the number of additional rr
-	 dns_rr_count num_add_rr;
-	 memcpy(&num_add_rr,wire_ptr,sizeof(dns_rr_count));
-	 num_add_rr = ntohs(num_add_rr);
-	 if(DEBUG_MODE){printf("Num Additional RR: %d\n",num_add_rr);}
-	 wire_ptr += sizeof(dns_rr_count);
-	 offset += sizeof(dns_rr_count);
-	 // extract and increment past the question section 
-	 if(DEBUG_MODE){printf("Getting Question RR\n");}
-	 question_rr = rr_from_wire(wire,&offset,1);
-	 if(DEBUG_MODE){printf("Quesiton Type: %d\n",question_rr.type);}
-	 // now start extracting resource records
-	 int rr_left = num_answer_rr + num_auth_rr + num_add_rr;
-	 while(rr_left){
-		 if(DEBUG_MODE){printf("Records Left: %d\n",rr_left);}
-		 if(DEBUG_MODE){printf("'Before' Offset: %d\n",offset);}
-		 rr = rr_from_wire(wire,&offset,0);
-		 if(DEBUG_MODE){printf("'After' Offset: %d\n'",offset);}
-		 rr_left--;
-		 if(strcmp(rr.name,qname_ptr) == 0){
-			 if(DEBUG_MODE){
-				 printf("Current RR Type: %d\n",rr.type);
-			 }
-			if(rr.type == qtype){
-				// extract the ip address and return
-				unsigned char* ip = (char*)malloc(sizeof(char)*rr.rdata_len);
-				if(DEBUG_MODE){
-					printf("IP Found!\n");
-					printf("Length: %d\n",rr.rdata_len);
-					printf("Byte representation of IP Address: %s\n",rr.rdata);
-				}
-				struct in_addr addr;
-				memcpy(&(addr.s_addr),rr.rdata,rr.rdata_len);
-				if(DEBUG_MODE){printf("Struct Value for IP: %d\n",addr.s_addr);}
-				//inet_ntop(AF_INET6,&addr,ip,rr.rdata_len);
-				ip = inet_ntoa(addr);
-				return ip;
-			}
-			else if(rr.type == CNAME){
-				// handle the alias
-				int tmp = offset - rr.rdata_len;
-				char* next_qname = name_ascii_from_wire(wire,&tmp);
-				canonicalize_name(next_qname);
-				qname_ptr = next_qname;
-				//offset--;
-				if(DEBUG_MODE){
-					printf("CNAME: looking up alias - %s\n",qname_ptr);
-				}
-			}
+	 dns_msg msg;
+	 char name[DNS_NAME_TEXT_MAX];
+	 int chain[DNS_CHAIN_MAX];
+	 int chain_len, i;
+	 if(dns_msg_parse(&msg,wire,len) < 0){
+		 if(DEBUG_MODE){printf("Malformed response\n");}
+		 return NULL;
+	 }
+	 if(DEBUG_MODE){
+		 printf("Num Questions: %d\n",msg.num_questions);
+		 printf("Num Answer RR: %d\n",msg.count[DNS_ANSWER]);
+		 printf("Num Authority RR: %d\n",msg.count[DNS_AUTHORITY]);
+		 printf("Num Additional RR: %d\n",msg.count[DNS_ADDITIONAL]);
+	 }
+	 // the response must be to the question that was asked
+	 if(msg.num_questions != 1 || msg.qtype != qtype ||
+			 dns_name_text(wire,len,msg.qname_at,name) < 0 || strcasecmp(name,qname) != 0){
+		 if(DEBUG_MODE){printf("Response is not for %s\n",qname);}
+		 return NULL;
+	 }
+	 int answer = dns_msg_answer(&msg,qtype,chain,&chain_len);
+	 if(DEBUG_MODE){
+		 for(i = 0; i < chain_len; i++){
+			 dns_name_text(wire,len,msg.rrs[chain[i]].rdata_at,name);
+			 printf("CNAME: looking up alias - %s\n",name);
 		 }
-		 else{
-			printf("Breaking Loop...\n");
-			break;
-		}
 	 }
+	 if(answer < 0 || msg.rrs[answer].rdata_len != sizeof(struct in_addr)){
+		 return NULL;
+	 }
+	 struct in_addr addr;
+	 memcpy(&addr.s_addr,wire + msg.rrs[answer].rdata_at,sizeof(addr.s_addr));
+	 return inet_ntoa(addr);
 
-	 return NULL;
+}
 
+void message_done(void *data, unsigned char *msg, int len) {
+	// the query engine's answer for send_recv_message
+	received_message *received = (received_message *)data;
+	if (msg != NULL) {
+		memcpy(received->response, msg, len);
+	}
+	received->len = msg != NULL ? len : -1;
 }
 
 int send_recv_message(unsigned char *request, int requestlen, unsigned char *response, char *server, unsigned short port) {
 	/* 
 	 * Send a message (request) over UDP to a server (server) and port
 	 * (port) and wait for a response, which is placed in another byte
-	 * array (response).  Create a socket, "connect()" it to the
-	 * appropriate destination, and then use send() and recv();
+	 * array (response).  The query engine retransmits the request with
+	 * exponential backoff and fails over between servers when server
+	 * is a comma-separated list (see upstream.h), so a lost packet
+	 * can't hang the resolver.
 	 *
 	 * INPUT:  request: a pointer to an array of bytes that should be sent
 	 * INPUT:  requestlen: the length of request, in bytes.
 	 * INPUT:  response: a pointer to an array of bytes in which the
-	 *             response should be received
-	 * OUTPUT: the size (bytes) of the response received
+	 *             response should be received (MAX_RESPONSE_SIZE bytes)
+	 * OUTPUT: the size (bytes) of the response received, or -1 if no
+	 *             server answered
 	 */
-	 if(DEBUG_MODE){printf("Creating socket...\n");}
-	 int sock = create_udp_socket(server,port);
+	 upstream_engine engine;
+	 received_message received = {response, 0};
+	 if(root_hints != NULL){
+		 return iterate_message(request,requestlen,response,port);
+	 }
+	 if(upstream_init(&engine,server,port,1,1,message_done) < 0){
+		 upstream_free(&engine);
+		 return -1;
+	 }
+	 if(upstream_race < engine.race){
+		 engine.race = upstream_race;
+	 }
+	 engine.drop_rate = upstream_drop_rate;
 	 if(DEBUG_MODE){
-		 printf("Socket created, socket id: %d\n",sock);
 	 	 printf("Request =");
 	 	 print_bytes(request,requestlen);
 	 	 printf("Sending request...\n");
 	 }
-	 send(sock,request,requestlen, 0);
-	 if(DEBUG_MODE){printf("Request sent, getting response....\n");}
-	 int bytes_received = recv(sock,response,MAX_BUFFER_SIZE, 0);
-	 if(DEBUG_MODE){printf("Information received!\n");}
-	 close(sock);
+	 upstream_submit(&engine,request,requestlen,&received);
+	 while(engine.pending > 0){
+		 upstream_wait(&engine);
+	 }
+	 if(DEBUG_MODE){
+		 printf("Information received!\n");
+		 upstream_print_stats(&engine,stdout);
+	 }
+	 upstream_free(&engine);
 
-	 return bytes_received;
+	 return received.len;
 }
 
-char *resolve(char *qname, char *server) {
-	short port = 8080;
+int iterate_message(unsigned char *request, int requestlen, unsigned char *response, unsigned short port) {
+	/*
+	 * Resolve a request iteratively, from the root servers in the hints
+	 * file down (see iterate.h), and place the response in response.
+	 *
+	 * INPUT:  request: a pointer to an array of bytes that should be sent
+	 * INPUT:  requestlen: the length of request, in bytes.
+	 * INPUT:  response: a pointer to an array of bytes in which the
+	 *             response should be received (MAX_RESPONSE_SIZE bytes)
+	 * INPUT:  port: the port the servers are asked on
+	 * OUTPUT: the size (bytes) of the response received, or -1 if no
+	 *             server answered
+	 */
+	 iterator it;
+	 received_message received = {response, 0};
+	 if(iterate_init(&it,root_hints,port,1,1,message_done) < 0){
+		 iterate_free(&it);
+		 return -1;
+	 }
+	 if(upstream_race < it.engine.race){
+		 it.engine.race = upstream_race;
+	 }
+	 it.engine.drop_rate = upstream_drop_rate;
+	 if(iterate_submit(&it,request,requestlen,&received) < 0){
+		 iterate_free(&it);
+		 return -1;
+	 }
+	 while(it.pending > 0){
+		 iterate_wait(&it);
+	 }
+	 if(DEBUG_MODE){
+		 printf("Information received!\n");
+		 iterate_print_stats(&it,stdout);
+	 }
+	 iterate_free(&it);
+
+	 return received.len;
+}
+
+char *resolve(char *qname, char *server, unsigned short port) {
 	unsigned char query_msg[MAX_BUFFER_SIZE]; 
-	unsigned char response[MAX_BUFFER_SIZE];
+	unsigned char response[MAX_RESPONSE_SIZE];
 
 	// build the query
 	dns_rr_type type = 1;
 	canonicalize_name(qname);
 	int query_len = create_dns_query(qname,type,query_msg);
 
-	// connect to the host
-	int response_size = send_recv_message(query_msg,query_len,response,server,port);
+	// answer from the cache, or connect to the host
+	int response_size = 0;
+	if(resolver_cache != NULL){
+		// a single lookup exits before a refresh could come back
+		response_size = rcache_get(resolver_cache,query_msg,query_len,response,NULL);
+	}
+	if(response_size == 0){
+		response_size = send_recv_message(query_msg,query_len,response,server,port);
+		if(response_size < 0){
+			return NULL;
+		}
+		if(resolver_cache != NULL){
+			rcache_put(resolver_cache,response,response_size);
+		}
+	}
+	if(DEBUG_MODE && resolver_cache != NULL){
+		rcache_print_stats(resolver_cache,stdout);
+	}
 	if(DEBUG_MODE){
 		printf("BYTES RECEIVED: %d\n",response_size);
 		printf("RESPONSE =");
@@ -535,15 +412,15 @@ char *resolve(char *qname, char *server) {
 	}
 
 	// extract the ip address from the response
-	char* ip_addr = get_answer_address(qname,type,response);
+	char* ip_addr = get_answer_address(qname,type,response,response_size);
 
 	return ip_addr;
 }
 
-int create_udp_socket(char* server, short port) {
+int create_udp_socket(char* server, unsigned short port) {
 	struct sockaddr_in resolver_addr = {
 		.sin_family = AF_INET, // Internet Address Family
-		.sin_port = htons(53), // DNS port, converted to big endian if host is little endian
+		.sin_port = htons(port), // DNS port, converted to big endian if host is little endian
 		.sin_addr = inet_addr(server) // Converting the dot notation (e.g., 8.8.8.8) to binary
 	};
 	// PF_INET for Internet Protocol family
@@ -568,12 +445,83 @@ int create_udp_socket(char* server, short port) {
 }
 
 
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-p port] [-r race] [-L loss %%] [-c cache file] <domain name> <servers>\n", prog);
+	fprintf(stderr, "       %s -b <names file|-> [-p port] [-r race] [-L loss %%] [-c cache file]\n"
+			"            [-n in flight] [-s sockets] <servers>\n", prog);
+	fprintf(stderr, "       %s -R <root hints> [-p port] [-r race] [-L loss %%] [-c cache file]\n"
+			"            [-b <names file|-> [-n in flight] [-s sockets] | <domain name>]\n", prog);
+	fprintf(stderr, "servers is a comma-separated list of address[:port]; with -R names are\n"
+			"resolved iteratively from the root servers in the hints file instead\n");
+	exit(1);
+}
+
 int main(int argc, char *argv[]) {
 	char *ip;
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <domain name> <server>\n", argv[0]);
-		exit(1);
+	char *batch_file = NULL;
+	char *cache_file = NULL;
+	rcache cache;
+	unsigned short port = DNS_PORT;
+	int in_flight = BATCH_IN_FLIGHT;
+	int sockets = BATCH_SOCKETS;
+	int c;
+	while ((c = getopt(argc, argv, "b:p:n:s:r:L:c:R:")) != -1) {
+		switch (c) {
+			case 'b':
+				batch_file = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				in_flight = atoi(optarg);
+				break;
+			case 's':
+				sockets = atoi(optarg);
+				break;
+			case 'r':
+				upstream_race = atoi(optarg) > 0 ? atoi(optarg) : 1;
+				break;
+			case 'L':
+				upstream_drop_rate = atof(optarg) / 100;
+				break;
+			case 'c':
+				cache_file = optarg;
+				break;
+			case 'R':
+				root_hints = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	// batches always cache (names repeat); single names only with a file
+	if ((batch_file != NULL || cache_file != NULL) && rcache_open(&cache, cache_file) == 0) {
+		resolver_cache = &cache;
+	}
+	if (batch_file != NULL) {
+		// resolve every name in the file, many at a time
+		if (argc - optind != (root_hints != NULL ? 0 : 1)) {
+			usage(argv[0]);
+		}
+		FILE *names = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+		if (names == NULL) {
+			perror(batch_file);
+			exit(1);
+		}
+		int status = batch_resolve(names, argv[optind], root_hints, port, in_flight, sockets, upstream_race,
+				upstream_drop_rate, resolver_cache, stdout);
+		if (resolver_cache != NULL) {
+			rcache_close(resolver_cache);
+		}
+		return status < 0 ? 1 : 0;
+	}
+	if (argc - optind != (root_hints != NULL ? 1 : 2)) {
+		usage(argv[0]);
+	}
+	ip = resolve(argv[optind], argv[optind + 1], port);
+	printf("%s => %s\n", argv[optind], ip == NULL ? "NONE" : ip);
+	if (resolver_cache != NULL) {
+		rcache_close(resolver_cache);
 	}
-	ip = resolve(argv[1], argv[2]);
-	printf("%s => %s\n", argv[1], ip == NULL ? "NONE" : ip);
 }
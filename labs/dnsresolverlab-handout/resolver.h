@@ -0,0 +1,70 @@
+/*
+ * Definitions shared by the DNS resolver's source files - CS 360
+ *
+*/
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#define MAX_BUFFER_SIZE	1024
+#define MAX_RESPONSE_SIZE	65535	// a response over TCP can be this long
+#define EDNS_PAYLOAD	1232	// UDP payload advertised in queries (EDNS(0))
+#define DNS_PORT		53
+
+#define BITS_IN_CHAR	8
+#define IS_POINTER(c)	(c & 0xc0)
+#define IS_QUERY(c)		!(c & 0x80)
+#define IS_RESPONSE(c)	(s & 0x80)
+#define OPCODE(c)		((c & 0x78)>>3)
+#define FLAGS(s)		(s & 0x07f0)
+#define AA_SET(f)		(f & 0x0400)
+#define TC_SET(f)		(f & 0x0200)
+#define RD_SET(f)		(f & 0x0100)
+#define RA_SET(f)		(f & 0x0080)
+#define Z_ST(f)			(f & 0x0040)
+#define AD_SET(f)		(f & 0x0020)
+#define CD_SET(f)		(f & 0x0010)
+#define RCODE(c)		(c & 0x0f)
+
+#define SWAP_ENDIAN_32(num)	(((num>>24)&0xff) | ((num<<8)&0xff0000) | ((num>>8)&0xff00) | ((num<<24)&0xff000000)) // byte 0 to byte 3
+
+#define TYPE_A			1
+#define CNAME			5
+
+// Set this to 1 to see debug messages, 0 to hide them
+#define DEBUG_MODE 1
+
+typedef unsigned int dns_rr_ttl;
+typedef unsigned short dns_rr_type;
+typedef unsigned short dns_rr_class;
+typedef unsigned short dns_rdata_len;
+typedef unsigned short dns_rr_count;
+typedef unsigned short dns_query_id;
+typedef unsigned short dns_flags;
+
+typedef struct {
+	char *name;
+	dns_rr_type type;
+	dns_rr_class class;
+	dns_rr_ttl ttl;
+	dns_rdata_len rdata_len;
+	unsigned char *rdata;
+} dns_rr;
+
+/*******************************************************************************
+ * Function definitions
+*/
+void print_bytes(unsigned char *bytes, int byteslen);
+void canonicalize_name(char *name);
+int name_ascii_to_wire(char *name, unsigned char *wire);
+int rr_to_wire(dns_rr rr, unsigned char *wire, int query_only);
+unsigned short create_dns_query(char *qname, dns_rr_type qtype, unsigned char *wire);
+char *get_answer_address(char *qname, dns_rr_type qtype, unsigned char *wire, int len);
+int send_recv_message(unsigned char *request, int requestlen, unsigned char *response, char *server, unsigned short port);
+int iterate_message(unsigned char *request, int requestlen, unsigned char *response, unsigned short port);
+char *resolve(char *qname, char *server, unsigned short port);
+int create_udp_socket(char* server, unsigned short port);
+void flushBuffer(char* buffer);
+void message_done(void *data, unsigned char *msg, int len);
+
+#endif /* RESOLVER_H */
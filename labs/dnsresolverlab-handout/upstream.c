@@ -0,0 +1,781 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<fcntl.h>
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<arpa/inet.h>
+
+#include "upstream.h"
+#include "dns_msg.h"
+
+#define UPSTREAM_RCVBUF		(1 << 20)	// socket receive buffer, for bursts of responses
+#define SRTT_DECAY			0.98		// unused servers look a little faster each time
+#define SRTT_WEIGHT			0.3			// how much an answer's RTT moves the SRTT
+#define SERVER_HASH_SIZE	(2 * UPSTREAM_KNOWN_MAX)	// server table slots by address
+
+static int parse_servers(upstream_engine *e, char *servers, unsigned short port);
+static unsigned int server_hash(struct sockaddr_in *addr);
+static void send_attempt(upstream_engine *e, upstream_query *q, double now);
+static void timed_out(upstream_engine *e, upstream_query *q, double now);
+static void receive(upstream_engine *e, int sock);
+static void tcp_start(upstream_engine *e, upstream_query *q, int s, double now);
+static void tcp_event(upstream_engine *e, upstream_query *q);
+static void tcp_fail(upstream_engine *e, upstream_query *q);
+static void tcp_close(upstream_query *q);
+static void finish(upstream_engine *e, upstream_query *q, unsigned char *msg, int len);
+static void release(upstream_engine *e, upstream_query *q);
+static void penalize(upstream_engine *e, upstream_query *q);
+static void rtt_sample(upstream *u, double rtt);
+static double rto(upstream *u);
+static int same_question(unsigned char *query, int query_len, unsigned char *msg, int len);
+static void heap_push(upstream_engine *e, upstream_query *q);
+static void heap_remove(upstream_engine *e, upstream_query *q);
+static void heap_fix(upstream_engine *e, int at);
+static void heap_swap(upstream_engine *e, int a, int b);
+
+int upstream_init(upstream_engine *e, char *servers, unsigned short port, int max_queries,
+		int num_socks, upstream_done done) {
+	/*
+	 * Set up an engine for up to max_queries pending queries.
+	 *
+	 * INPUT:  e: the engine
+	 * INPUT:  servers: the servers, "address[:port]" separated by commas,
+	 *         or NULL if every query will be given its own
+	 * INPUT:  port: the port of servers that don't give one
+	 * INPUT:  max_queries: the most queries pending at once
+	 * INPUT:  num_socks: how many sockets to spread the queries over
+	 * INPUT:  done: called with each query's outcome
+	 * OUTPUT: 0 on success, -1 on error (the engine must still be freed)
+	 */
+	int i;
+	memset(e, 0, sizeof(upstream_engine));
+	e->epoll_fd = -1;
+	e->done = done;
+	e->race = UPSTREAM_RACE;
+	e->seed = time(NULL) ^ getpid();
+	if (num_socks < 1) {
+		num_socks = 1;
+	} else if (num_socks > UPSTREAM_SOCKETS_MAX) {
+		num_socks = UPSTREAM_SOCKETS_MAX;
+	}
+	// keep each socket's ID space at most half used (counting draining
+	// queries) so a free ID is found fast
+	if (max_queries > num_socks * (UPSTREAM_IDS / 4)) {
+		max_queries = num_socks * (UPSTREAM_IDS / 4);
+	} else if (max_queries < 1) {
+		max_queries = 1;
+	}
+	e->max_queries = max_queries;
+	e->num_slots = 2 * max_queries;
+	e->servers = (upstream *)malloc(sizeof(upstream) * UPSTREAM_KNOWN_MAX);
+	e->server_slots = (int *)calloc(SERVER_HASH_SIZE, sizeof(int));
+	if (e->servers == NULL || e->server_slots == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if (servers != NULL && parse_servers(e, servers, port) < 0) {
+		return -1;
+	}
+	e->ids = (upstream_query **)calloc((size_t)num_socks * UPSTREAM_IDS, sizeof(upstream_query *));
+	e->queries = (upstream_query *)malloc(sizeof(upstream_query) * e->num_slots);
+	e->heap = (upstream_query **)malloc(sizeof(upstream_query *) * e->num_slots);
+	if (e->ids == NULL || e->queries == NULL || e->heap == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (i = 0; i < e->num_slots; i++) {
+		e->queries[i].next = i + 1 < e->num_slots ? &e->queries[i + 1] : NULL;
+		e->queries[i].tcp_fd = -1;
+		e->queries[i].tcp_in = NULL;
+	}
+	e->free = &e->queries[0];
+	e->epoll_fd = epoll_create1(0);
+	if (e->epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (i = 0; i < num_socks; i++) {
+		int sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+		if (sock < 0) {
+			perror("socket");
+			return -1;
+		}
+		int rcvbuf = UPSTREAM_RCVBUF;
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		e->socks[e->num_socks++] = sock;
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+	}
+	return 0;
+}
+
+void upstream_free(upstream_engine *e) {
+	int i;
+	for (i = 0; i < e->num_socks; i++) {
+		close(e->socks[i]);
+	}
+	for (i = 0; e->queries != NULL && i < e->num_slots; i++) {
+		tcp_close(&e->queries[i]);
+	}
+	if (e->epoll_fd >= 0) {
+		close(e->epoll_fd);
+	}
+	free(e->servers);
+	free(e->server_slots);
+	free(e->ids);
+	free(e->queries);
+	free(e->heap);
+	memset(e, 0, sizeof(upstream_engine));
+	e->epoll_fd = -1;
+}
+
+int upstream_submit(upstream_engine *e, unsigned char *msg, int len, void *data) {
+	/*
+	 * Start a query to the servers given to upstream_init.
+	 *
+	 * INPUT:  e: the engine
+	 * INPUT:  msg, len: the query message
+	 * INPUT:  data: passed to the done function
+	 * OUTPUT: 0 if the query was sent, -1 if max_queries are pending
+	 */
+	int list[UPSTREAM_MAX];
+	int i;
+	for (i = 0; i < e->num_listed; i++) {
+		list[i] = i;
+	}
+	return upstream_submit_to(e, msg, len, list, e->num_listed, data);
+}
+
+int upstream_submit_to(upstream_engine *e, unsigned char *msg, int len, int *servers,
+		int num_servers, void *data) {
+	/*
+	 * Start a query to a list of servers.  The engine copies the message
+	 * and gives it an ID that is free on the socket it is sent from.
+	 *
+	 * INPUT:  e: the engine
+	 * INPUT:  msg, len: the query message
+	 * INPUT:  servers, num_servers: the servers to ask, as returned by
+	 *         upstream_server (at most UPSTREAM_MAX are used)
+	 * INPUT:  data: passed to the done function
+	 * OUTPUT: 0 if the query was sent, -1 if max_queries are pending or
+	 *         there are no servers
+	 */
+	int i;
+	if (e->pending >= e->max_queries || len > MAX_BUFFER_SIZE || num_servers < 1) {
+		return -1;
+	}
+	if (e->free == NULL) {
+		// stop waiting on the racers of the longest-answered query
+		release(e, e->drain_oldest);
+	}
+	upstream_query *q = e->free;
+	e->free = q->next;
+	memcpy(q->msg, msg, len);
+	q->len = len;
+	q->data = data;
+	q->attempts = 0;
+	q->draining = 0;
+	q->num_servers = num_servers < UPSTREAM_MAX ? num_servers : UPSTREAM_MAX;
+	for (i = 0; i < q->num_servers; i++) {
+		q->servers[i] = servers[i];
+	}
+	memset(q->sent_at, 0, sizeof(q->sent_at));
+	memset(q->tries, 0, sizeof(q->tries));
+	memset(q->waiting, 0, sizeof(q->waiting));
+
+	q->sock = e->next_sock;
+	e->next_sock = (e->next_sock + 1) % e->num_socks;
+	upstream_query **ids = e->ids + (size_t)q->sock * UPSTREAM_IDS;
+	unsigned int id = rand_r(&e->seed) & 0xffff;
+	while (ids[id] != NULL) {
+		id = (id + 1) & 0xffff;
+	}
+	q->id = id;
+	q->msg[0] = id >> 8;
+	q->msg[1] = id & 0xff;
+	ids[id] = q;
+
+	double now = now_seconds();
+	q->give_up = now + QUERY_LIFETIME;
+	send_attempt(e, q, now);
+	heap_push(e, q);
+	e->pending++;
+	return 0;
+}
+
+int upstream_server(upstream_engine *e, struct sockaddr_in *addr) {
+	/*
+	 * Find a server in the engine's table, adding it (with a small
+	 * random SRTT, as BIND does, so new servers are spread over) if it
+	 * isn't there yet.
+	 *
+	 * INPUT:  e: the engine
+	 * INPUT:  addr: the server's address and port
+	 * OUTPUT: the server's index, or -1 if the table is full
+	 */
+	unsigned int slot = server_hash(addr) % SERVER_HASH_SIZE;
+	while (e->server_slots[slot] != 0) {
+		upstream *u = &e->servers[e->server_slots[slot] - 1];
+		if (u->addr.sin_addr.s_addr == addr->sin_addr.s_addr && u->addr.sin_port == addr->sin_port) {
+			return e->server_slots[slot] - 1;
+		}
+		slot = (slot + 1) % SERVER_HASH_SIZE;
+	}
+	if (e->num_servers == UPSTREAM_KNOWN_MAX) {
+		return -1;
+	}
+	upstream *u = &e->servers[e->num_servers];
+	memset(u, 0, sizeof(upstream));
+	u->addr.sin_family = AF_INET;
+	u->addr.sin_addr = addr->sin_addr;
+	u->addr.sin_port = addr->sin_port;
+	u->srtt = (1 + rand_r(&e->seed) % 32) / 1000.0;
+	e->server_slots[slot] = ++e->num_servers;
+	return e->num_servers - 1;
+}
+
+void upstream_wait(upstream_engine *e) {
+	/*
+	 * Wait for responses until the next retransmission is due, handle
+	 * the ones that came, then retransmit or give up on every query
+	 * whose time is up.  An event number past the UDP sockets is a TCP
+	 * retry, for the query in that slot.
+	 */
+	int timeout = -1;
+	int i, n;
+	if (e->heap_size > 0) {
+		timeout = (int)((e->heap[0]->deadline - now_seconds()) * 1000) + 1;
+		if (timeout < 0) {
+			timeout = 0;
+		}
+	}
+	struct epoll_event events[UPSTREAM_SOCKETS_MAX];
+	n = epoll_wait(e->epoll_fd, events, UPSTREAM_SOCKETS_MAX, timeout);
+	if (n < 0 && errno != EINTR) {
+		perror("epoll_wait");
+	}
+	for (i = 0; i < n; i++) {
+		unsigned int at = events[i].data.u32;
+		if (at < UPSTREAM_SOCKETS_MAX) {
+			receive(e, at);
+		} else if (e->queries[at - UPSTREAM_SOCKETS_MAX].tcp_fd >= 0) {
+			// (unless the query was finished by an earlier event)
+			tcp_event(e, &e->queries[at - UPSTREAM_SOCKETS_MAX]);
+		}
+	}
+	double now = now_seconds();
+	while (e->heap_size > 0 && e->heap[0]->deadline <= now) {
+		timed_out(e, e->heap[0], now);
+	}
+}
+
+void upstream_print_stats(upstream_engine *e, FILE *out) {
+	int i;
+	for (i = 0; i < e->num_servers; i++) {
+		upstream *u = &e->servers[i];
+		fprintf(out, "  %s:%d: srtt %.2f ms, delay %.2f ms, rto %.0f ms, %lu sent, %lu answered, "
+				"%lu timeouts\n", inet_ntoa(u->addr.sin_addr), ntohs(u->addr.sin_port),
+				u->srtt * 1000, u->delay * 1000, rto(u) * 1000, u->sent, u->answered, u->timeouts);
+	}
+	fprintf(out, "  %lu retransmissions, %lu queries failed, %lu late or stray responses\n",
+			e->retransmits, e->failed, e->stray);
+	fprintf(out, "  %lu truncated answers retried over TCP, %lu of them failed\n",
+			e->truncated, e->tcp_failed);
+}
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_servers(upstream_engine *e, char *servers, unsigned short port) {
+	// "address[:port],..." into e->servers, as the default list
+	char list[MAX_BUFFER_SIZE];
+	char *save = NULL;
+	char *server;
+	snprintf(list, sizeof(list), "%s", servers);
+	for (server = strtok_r(list, ",", &save); server != NULL; server = strtok_r(NULL, ",", &save)) {
+		if (e->num_servers == UPSTREAM_MAX) {
+			fprintf(stderr, "Too many servers (at most %d)\n", UPSTREAM_MAX);
+			return -1;
+		}
+		struct sockaddr_in addr;
+		char *colon = strchr(server, ':');
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_port = htons(colon != NULL ? atoi(colon + 1) : port);
+		if (colon != NULL) {
+			*colon = '\0';
+		}
+		if (inet_pton(AF_INET, server, &addr.sin_addr) != 1) {
+			fprintf(stderr, "Bad server address: %s\n", server);
+			return -1;
+		}
+		upstream_server(e, &addr);
+	}
+	if (e->num_servers == 0) {
+		fprintf(stderr, "No servers given\n");
+		return -1;
+	}
+	e->num_listed = e->num_servers;
+	if (e->race > e->num_servers) {
+		e->race = e->num_servers;
+	}
+	return 0;
+}
+
+static unsigned int server_hash(struct sockaddr_in *addr) {
+	// FNV-1a over the address and port
+	unsigned char key[6];
+	unsigned int h = 2166136261u;
+	int i;
+	memcpy(key, &addr->sin_addr.s_addr, 4);
+	memcpy(key + 4, &addr->sin_port, 2);
+	for (i = 0; i < 6; i++) {
+		h = (h ^ key[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void send_attempt(upstream_engine *e, upstream_query *q, double now) {
+	/*
+	 * Send a query to the e->race of its servers it has been sent to
+	 * least, lowest SRTT first, and set when to try again: the slowest of
+	 * their retransmission timeouts, doubled for every earlier attempt.
+	 */
+	int chosen[UPSTREAM_MAX];
+	int i, j, busy;
+	int race = e->race < q->num_servers ? e->race : q->num_servers;
+	memset(chosen, 0, sizeof(chosen));
+	for (j = 0; j < race; j++) {
+		int best = -1;
+		// suspect servers that are already being probed only if there's
+		// no one else
+		for (busy = 0; busy < 2 && best < 0; busy++) {
+			for (i = 0; i < q->num_servers; i++) {
+				upstream *u = &e->servers[q->servers[i]];
+				if (chosen[i] || (!busy && u->suspect && now < u->probe_until)) {
+					continue;
+				}
+				if (best < 0 || q->tries[i] < q->tries[best] || (q->tries[i] == q->tries[best]
+						&& u->srtt < e->servers[q->servers[best]].srtt)) {
+					best = i;
+				}
+			}
+		}
+		chosen[best] = 1;
+	}
+	double timeout = 0;
+	for (i = 0; i < q->num_servers; i++) {
+		upstream *u = &e->servers[q->servers[i]];
+		if (!chosen[i]) {
+			u->srtt *= SRTT_DECAY;
+			continue;
+		}
+		if (rto(u) > timeout) {
+			timeout = rto(u);
+		}
+		if (u->suspect) {
+			// back off further for each probe that went unanswered
+			double interval = rto(u) * (1 << (u->strikes < 4 ? u->strikes : 4));
+			u->probe_until = now + (interval < RTO_MAX ? interval : RTO_MAX);
+		}
+		q->waiting[i] = 1;
+		q->sent_at[i] = now;
+		if (q->tries[i] < 255) {
+			q->tries[i]++;
+		}
+		u->sent++;
+		if (e->drop_rate > 0 && rand_r(&e->seed) < e->drop_rate * RAND_MAX) {
+			// lost on the way, on purpose
+			continue;
+		}
+		// a send that fails (a full socket buffer) is as good as lost
+		sendto(e->socks[q->sock], q->msg, q->len, 0, (struct sockaddr *)&u->addr,
+				sizeof(u->addr));
+	}
+	timeout *= 1 << q->attempts;
+	if (timeout > RTO_MAX) {
+		timeout = RTO_MAX;
+	}
+	q->deadline = now + timeout;
+	if (q->deadline > q->give_up) {
+		q->deadline = q->give_up;
+	}
+	if (q->attempts > 0) {
+		e->retransmits++;
+	}
+	q->attempts++;
+}
+
+static void timed_out(upstream_engine *e, upstream_query *q, double now) {
+	// no answer in time: raise the silent servers' SRTT and try again,
+	// or give up
+	penalize(e, q);
+	if (q->draining) {
+		release(e, q);
+		return;
+	}
+	if (q->tcp_fd >= 0) {
+		tcp_fail(e, q);
+		return;
+	}
+	if (q->attempts >= QUERY_ATTEMPTS || now >= q->give_up) {
+		e->failed++;
+		finish(e, q, NULL, 0);
+		return;
+	}
+	send_attempt(e, q, now);
+	heap_fix(e, q->heap_at);
+}
+
+static void receive(upstream_engine *e, int sock) {
+	/*
+	 * Take every response waiting on a socket and finish the queries
+	 * they answer.  A response counts only if it comes from one of the
+	 * query's servers that it was sent to and repeats its question.  Answers to
+	 * draining queries are only used for their RTT.  A truncated answer
+	 * (TC set, or longer than EDNS_PAYLOAD) starts a TCP retry instead.
+	 */
+	unsigned char buffers[UPSTREAM_RECV][EDNS_PAYLOAD];
+	struct sockaddr_in addrs[UPSTREAM_RECV];
+	struct iovec iov[UPSTREAM_RECV];
+	struct mmsghdr msgs[UPSTREAM_RECV];
+	int i, s, n;
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < UPSTREAM_RECV; i++) {
+		iov[i].iov_base = buffers[i];
+		iov[i].iov_len = EDNS_PAYLOAD;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+	upstream_query **ids = e->ids + (size_t)sock * UPSTREAM_IDS;
+	do {
+		for (i = 0; i < UPSTREAM_RECV; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+		n = recvmmsg(e->socks[sock], msgs, UPSTREAM_RECV, MSG_DONTWAIT, NULL);
+		double now = now_seconds();
+		for (i = 0; i < n; i++) {
+			unsigned char *msg = buffers[i];
+			int len = msgs[i].msg_len;
+			upstream_query *q = len >= 12 ? ids[(msg[0] << 8) | msg[1]] : NULL;
+			for (s = 0; q != NULL && s < q->num_servers; s++) {
+				upstream *u = &e->servers[q->servers[s]];
+				if (addrs[i].sin_addr.s_addr == u->addr.sin_addr.s_addr
+						&& addrs[i].sin_port == u->addr.sin_port) {
+					break;
+				}
+			}
+			if (q == NULL || s == q->num_servers || q->tries[s] == 0
+					|| !same_question(q->msg, q->len, msg, len)) {
+				e->stray++;
+				continue;
+			}
+			upstream *u = &e->servers[q->servers[s]];
+			double since = now - q->sent_at[s];
+			// an RTT is only known if there was one send to this server
+			// (Karn's algorithm), otherwise the time since the last send
+			// is at least a lower bound for the timeout's floor
+			if (q->tries[s] == 1 && q->waiting[s]) {
+				rtt_sample(u, since);
+			}
+			u->delay = u->answered == 0 ? since : 0.875 * u->delay + 0.125 * since;
+			u->last_answer = now;
+			u->answered++;
+			u->suspect = 0;
+			u->strikes = 0;
+			q->waiting[s] = 0;
+			if (q->draining) {
+				if (memchr(q->waiting, 1, q->num_servers) == NULL) {
+					release(e, q);
+				}
+			} else if ((msg[2] & 0x02) || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+				if (q->tcp_fd < 0) {
+					tcp_start(e, q, s, now);
+				}
+			} else {
+				finish(e, q, msg, len);
+			}
+		}
+	} while (n == UPSTREAM_RECV);
+}
+
+static void tcp_start(upstream_engine *e, upstream_query *q, int s, double now) {
+	/*
+	 * Ask server s again over TCP for an answer that came back truncated.
+	 * The query waits on the connection (for up to TCP_TIMEOUT) instead
+	 * of being retransmitted.
+	 */
+	upstream *u = &e->servers[q->servers[s]];
+	struct epoll_event ev;
+	e->truncated++;
+	q->tcp_in = (unsigned char *)malloc(TCP_IN_MAX);
+	q->tcp_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	q->tcp_sent = 0;
+	q->tcp_in_len = 0;
+	ev.events = EPOLLOUT | EPOLLIN;
+	ev.data.u32 = UPSTREAM_SOCKETS_MAX + (q - e->queries);
+	if (q->tcp_in == NULL || q->tcp_fd < 0
+			|| (connect(q->tcp_fd, (struct sockaddr *)&u->addr, sizeof(u->addr)) < 0 && errno != EINPROGRESS)
+			|| epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, q->tcp_fd, &ev) < 0) {
+		perror("TCP retry");
+		tcp_fail(e, q);
+		return;
+	}
+	q->deadline = now + TCP_TIMEOUT;
+	heap_fix(e, q->heap_at);
+}
+
+static void tcp_event(upstream_engine *e, upstream_query *q) {
+	/*
+	 * Move a TCP retry along: once connected, send the query with its
+	 * length in front, then read the response and finish the query with
+	 * it.  A connection that fails, closes early or answers something
+	 * else fails the query.
+	 */
+	unsigned char out[MAX_BUFFER_SIZE + 2];
+	int out_len = q->len + 2;
+	int n;
+	if (q->tcp_sent < out_len) {
+		out[0] = q->len >> 8;
+		out[1] = q->len & 0xff;
+		memcpy(out + 2, q->msg, q->len);
+		n = send(q->tcp_fd, out + q->tcp_sent, out_len - q->tcp_sent, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (n < 0) {
+			tcp_fail(e, q);
+			return;
+		}
+		q->tcp_sent += n;
+		if (q->tcp_sent < out_len) {
+			return;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = UPSTREAM_SOCKETS_MAX + (q - e->queries);
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_MOD, q->tcp_fd, &ev);
+	}
+	n = recv(q->tcp_fd, q->tcp_in + q->tcp_in_len, TCP_IN_MAX - q->tcp_in_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (n <= 0) {
+		tcp_fail(e, q);
+		return;
+	}
+	q->tcp_in_len += n;
+	if (q->tcp_in_len < 2) {
+		return;
+	}
+	int len = (q->tcp_in[0] << 8) | q->tcp_in[1];
+	if (q->tcp_in_len < len + 2) {
+		return;
+	}
+	unsigned char *msg = q->tcp_in + 2;
+	if (len < 12 || msg[0] != q->msg[0] || msg[1] != q->msg[1] || !same_question(q->msg, q->len, msg, len)) {
+		tcp_fail(e, q);
+		return;
+	}
+	finish(e, q, msg, len);
+}
+
+static void tcp_fail(upstream_engine *e, upstream_query *q) {
+	// a TCP retry that went nowhere fails its query
+	e->tcp_failed++;
+	e->failed++;
+	finish(e, q, NULL, 0);
+}
+
+static void tcp_close(upstream_query *q) {
+	// done with a query's TCP retry, if it has one
+	if (q->tcp_fd >= 0) {
+		close(q->tcp_fd);
+		q->tcp_fd = -1;
+	}
+	free(q->tcp_in);
+	q->tcp_in = NULL;
+}
+
+static void finish(upstream_engine *e, upstream_query *q, unsigned char *msg, int len) {
+	// report a query's outcome, then keep it until the other servers it
+	// was raced to answer or time out
+	e->pending--;
+	e->done(q->data, msg, len);
+	tcp_close(q);
+	if (msg == NULL || memchr(q->waiting, 1, q->num_servers) == NULL) {
+		release(e, q);
+		return;
+	}
+	q->draining = 1;
+	q->next = NULL;
+	q->prev = e->drain_newest;
+	if (e->drain_newest != NULL) {
+		e->drain_newest->next = q;
+	} else {
+		e->drain_oldest = q;
+	}
+	e->drain_newest = q;
+}
+
+static void release(upstream_engine *e, upstream_query *q) {
+	// free a finished query's ID and slot
+	heap_remove(e, q);
+	e->ids[(size_t)q->sock * UPSTREAM_IDS + q->id] = NULL;
+	if (q->draining) {
+		if (q->prev != NULL) {
+			q->prev->next = q->next;
+		} else {
+			e->drain_oldest = q->next;
+		}
+		if (q->next != NULL) {
+			q->next->prev = q->prev;
+		} else {
+			e->drain_newest = q->prev;
+		}
+	}
+	q->next = e->free;
+	e->free = q;
+}
+
+static void penalize(upstream_engine *e, upstream_query *q) {
+	// double the SRTT of the servers that didn't answer in time, and
+	// make it at least their retransmission timeout.  A server that
+	// has answered since the query was sent is alive and isn't blamed
+	int i;
+	for (i = 0; i < q->num_servers; i++) {
+		if (q->waiting[i]) {
+			upstream *u = &e->servers[q->servers[i]];
+			u->timeouts++;
+			q->waiting[i] = 0;
+			if (u->last_answer > q->sent_at[i]) {
+				continue;
+			}
+			if (u->suspect && u->strikes < 255) {
+				u->strikes++;
+			}
+			u->suspect = 1;
+			u->srtt = u->srtt * 2 > rto(u) ? u->srtt * 2 : rto(u);
+			if (u->srtt > SRTT_MAX) {
+				u->srtt = SRTT_MAX;
+			}
+		}
+	}
+}
+
+static void rtt_sample(upstream *u, double rtt) {
+	// the ranking SRTT as in BIND, the RTT and variance for the
+	// timeout as in RFC 6298
+	if (u->samples == 0) {
+		u->srtt = rtt;
+		u->rtt = rtt;
+		u->rttvar = rtt / 2;
+	} else {
+		double diff = u->rtt > rtt ? u->rtt - rtt : rtt - u->rtt;
+		u->srtt = (1 - SRTT_WEIGHT) * u->srtt + SRTT_WEIGHT * rtt;
+		u->rttvar = 0.75 * u->rttvar + 0.25 * diff;
+		u->rtt = 0.875 * u->rtt + 0.125 * rtt;
+	}
+	u->samples++;
+}
+
+static double rto(upstream *u) {
+	// how long to wait for this server before trying again: the RTT and
+	// its variance as in RFC 6298, but never less than the delay its
+	// answers have shown lately
+	if (u->samples == 0) {
+		return RTO_INITIAL;
+	}
+	double timeout = u->rtt + 4 * u->rttvar;
+	double floor = RTO_DELAY_FACTOR * u->delay;
+	if (timeout < floor) {
+		timeout = floor;
+	}
+	if (timeout < RTO_MIN) {
+		return RTO_MIN;
+	}
+	return timeout > RTO_MAX ? RTO_MAX : timeout;
+}
+
+static int same_question(unsigned char *query, int query_len, unsigned char *msg, int len) {
+	/*
+	 * Check that a response is for the question that was sent: the
+	 * response must be a response, ask one question, and repeat the
+	 * query's question (names compared without regard to case).  What
+	 * follows the question (the query's OPT record) isn't repeated.
+	 */
+	int i;
+	int question_end = DNS_HEADER_LEN + dns_question_length(query, query_len);
+	if (len < question_end || !(msg[2] & 0x80)) {
+		return 0;
+	}
+	if (msg[4] != 0 || msg[5] != 1) {
+		return 0;
+	}
+	for (i = 12; i < question_end; i++) {
+		unsigned char a = query[i];
+		unsigned char c = msg[i];
+		if (a != c && (a | 0x20) != (c | 0x20)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void heap_push(upstream_engine *e, upstream_query *q) {
+	int at = e->heap_size++;
+	e->heap[at] = q;
+	q->heap_at = at;
+	heap_fix(e, at);
+}
+
+static void heap_remove(upstream_engine *e, upstream_query *q) {
+	int at = q->heap_at;
+	int last = --e->heap_size;
+	if (at != last) {
+		heap_swap(e, at, last);
+		heap_fix(e, at);
+	}
+	e->heap[last] = NULL;
+}
+
+static void heap_fix(upstream_engine *e, int at) {
+	// move the entry at at up or down to where its deadline belongs
+	int size = e->heap_size;
+	while (at > 0 && e->heap[at]->deadline < e->heap[(at - 1) / 2]->deadline) {
+		heap_swap(e, at, (at - 1) / 2);
+		at = (at - 1) / 2;
+	}
+	while (1) {
+		int child = 2 * at + 1;
+		if (child >= size) {
+			break;
+		}
+		if (child + 1 < size && e->heap[child + 1]->deadline < e->heap[child]->deadline) {
+			child++;
+		}
+		if (e->heap[at]->deadline <= e->heap[child]->deadline) {
+			break;
+		}
+		heap_swap(e, at, child);
+		at = child;
+	}
+}
+
+static void heap_swap(upstream_engine *e, int a, int b) {
+	upstream_query *q = e->heap[a];
+	e->heap[a] = e->heap[b];
+	e->heap[b] = q;
+	e->heap[a]->heap_at = a;
+	e->heap[b]->heap_at = b;
+}
@@ -0,0 +1,161 @@
+/*
+ * Query engine for the DNS resolver - CS 360
+ * Sends queries to a list of upstream servers and retransmits them
+ * until one answers.  Servers are ranked by a smoothed RTT (SRTT)
+ * kept the way BIND does: answers pull it toward the measured RTT, a
+ * timeout doubles it and servers that aren't used drift back down so
+ * they get tried again.  A query is raced to the best-ranked servers
+ * at once; when no answer comes within the retransmission timeout
+ * (from the measured RTTs and their variance, as in TCP) it is sent
+ * again, to the servers that now rank best, with the timeout doubled
+ * each time (exponential backoff).  Retries go to servers the query
+ * hasn't been sent to before the ones it has, and a silent server
+ * loses its place to the others (failover).
+ *
+ * A timeout only counts against a server that hasn't answered anything
+ * since the query was sent to it.  A server that is answering other
+ * queries is alive and the query was lost or is stuck in its queue, so
+ * its SRTT is left to the RTTs measured.  A server that has gone quiet
+ * gets one query at a time until it answers again, at longer and longer
+ * intervals, so queries don't pile up on a dead server while they wait
+ * to find out it is dead.
+ *
+ * The timeout never goes below twice the delay the server's answers
+ * actually show, queueing included.  Retransmitted queries can't give
+ * an RTT (Karn's algorithm) but the time since their last send is a
+ * lower bound on it, so a server whose queue grows pushes its timeout
+ * up instead of drawing more retransmissions.
+ *
+ * A raced query is reported as soon as the first answer comes, but
+ * its ID stays reserved until the other servers answer or time out,
+ * so their RTTs are measured and a server that never answers is
+ * found out even when another always wins.
+ *
+ * Each query can have its own list of servers (an iterative resolver
+ * asks each zone's servers in turn).  The engine keeps the RTTs of every
+ * server it has been given, so what it learns about a zone's servers
+ * carries over to the next query sent to them.
+ *
+ * Queries go out with an EDNS(0) OPT record, so answers up to
+ * EDNS_PAYLOAD bytes come back in one datagram.  An answer with the TC
+ * bit set (it didn't fit even so) is asked for again from the same
+ * server over TCP, where it does (RFC 7766); the query stays pending
+ * until the TCP answer comes, or a racer's UDP answer that wasn't
+ * truncated.  The connection is non-blocking and watched with the rest.
+ *
+ * Pending queries are kept in a heap ordered by when each one must be
+ * retransmitted or given up on, and the sockets are watched with epoll.
+ *
+*/
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "resolver.h"
+
+#define UPSTREAM_MAX		8		// servers in a list
+#define UPSTREAM_KNOWN_MAX	4096	// servers the engine keeps RTTs for
+#define UPSTREAM_RACE		2		// servers a query is sent to at once
+#define UPSTREAM_SOCKETS_MAX	64
+#define UPSTREAM_IDS		65536	// query IDs per socket
+#define UPSTREAM_RECV		32		// responses taken per recvmmsg() call
+#define RTO_INITIAL			0.25	// seconds to wait on a server with no RTT yet
+#define RTO_MIN				0.005	// below this timers aren't precise enough
+#define RTO_DELAY_FACTOR	2		// the timeout is at least this times the delay seen
+#define RTO_MAX				2.0
+#define SRTT_MAX			RTO_MAX	// a silent server's SRTT goes no higher
+#define QUERY_ATTEMPTS		5		// sends (to UPSTREAM_RACE servers each) per query
+#define QUERY_LIFETIME		5.0		// seconds before a query is given up on
+#define TCP_TIMEOUT			2.0		// seconds for the TCP retry of a truncated answer
+#define TCP_IN_MAX			(MAX_RESPONSE_SIZE + 2)	// a TCP response and its length
+
+typedef struct {
+	struct sockaddr_in addr;
+	double srtt;			// ranking SRTT in seconds (with timeout penalties)
+	double rtt;				// measured RTTs only, for the timeout
+	double rttvar;
+	int samples;			// RTTs measured so far
+	double delay;			// smoothed delay of every answer (RTT or lower bound)
+	double last_answer;		// when the server last answered anything
+	int suspect;			// timed out since its last answer
+	int strikes;			// timeouts in a row while suspect
+	double probe_until;		// a suspect server gets one query at a time
+	unsigned long sent;
+	unsigned long answered;
+	unsigned long timeouts;	// attempts this server didn't answer
+} upstream;
+
+typedef struct upstream_query {
+	unsigned char msg[MAX_BUFFER_SIZE];
+	int len;
+	int sock;
+	unsigned short id;
+	int attempts;
+	double deadline;		// when the current attempt times out
+	double give_up;
+	unsigned short servers[UPSTREAM_MAX];	// the query's servers, by engine index
+	int num_servers;
+	// the rest are by position in servers
+	double sent_at[UPSTREAM_MAX];		// last send to each server (0 = never)
+	unsigned char tries[UPSTREAM_MAX];	// sends to each server
+	unsigned char waiting[UPSTREAM_MAX];	// sent to in the current attempt, no answer yet
+	int draining;			// answered, waiting for the other racers
+	int tcp_fd;				// the TCP retry of a truncated answer, or -1
+	int tcp_sent;			// bytes of the query (and its length) sent on it
+	unsigned char *tcp_in;	// what has been read of the response (TCP_IN_MAX)
+	int tcp_in_len;
+	int heap_at;
+	void *data;				// the caller's
+	struct upstream_query *next;	// free list or draining list
+	struct upstream_query *prev;
+} upstream_query;
+
+// called once per query with its response, or with msg NULL if it failed
+typedef void (*upstream_done)(void *data, unsigned char *msg, int len);
+
+typedef struct {
+	upstream *servers;		// every server known, UPSTREAM_KNOWN_MAX of them
+	int num_servers;
+	int num_listed;			// servers given to upstream_init, the default list
+	int *server_slots;		// open-addressed index of servers by address (+1)
+	int race;
+	int socks[UPSTREAM_SOCKETS_MAX];
+	int num_socks;
+	int next_sock;
+	int epoll_fd;
+	upstream_query **ids;	// query by socket * UPSTREAM_IDS + ID
+	upstream_query *queries;
+	int num_slots;			// twice max_queries, to leave room for draining
+	upstream_query *free;
+	upstream_query *drain_oldest;	// answered queries still waiting on racers
+	upstream_query *drain_newest;
+	upstream_query **heap;	// pending and draining queries by deadline
+	int heap_size;
+	int pending;			// queries not yet reported
+	int max_queries;
+	upstream_done done;
+	double drop_rate;		// fraction of sends dropped on purpose, for testing
+	unsigned int seed;
+	unsigned long retransmits;
+	unsigned long failed;
+	unsigned long truncated;	// truncated answers asked for again over TCP
+	unsigned long tcp_failed;
+	unsigned long stray;	// responses that matched no pending query (mostly
+							// race losers answering after the winner)
+} upstream_engine;
+
+int upstream_init(upstream_engine *e, char *servers, unsigned short port, int max_queries,
+		int num_socks, upstream_done done);
+void upstream_free(upstream_engine *e);
+int upstream_submit(upstream_engine *e, unsigned char *msg, int len, void *data);
+int upstream_submit_to(upstream_engine *e, unsigned char *msg, int len, int *servers,
+		int num_servers, void *data);
+int upstream_server(upstream_engine *e, struct sockaddr_in *addr);
+void upstream_wait(upstream_engine *e);
+void upstream_print_stats(upstream_engine *e, FILE *out);
+double now_seconds();
+
+#endif /* UPSTREAM_H */
@@ -0,0 +1,160 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<time.h>
+
+#include "answer_cache.h"
+#include "dns_msg.h"
+
+#define HEADER_LEN		12
+#define QUESTION_AT		10		// where the question starts in a slot's data
+
+static int question_len(unsigned char *request, int len);
+static unsigned int hash_question(unsigned char *question, int len, int flags);
+
+answer_cache *answer_cache_new() {
+	/*
+	 * Allocate an empty cache.
+	 *
+	 * OUTPUT: the cache, or NULL if memory could not be allocated
+	 */
+	answer_cache *cache = (answer_cache *)calloc(1, sizeof(answer_cache));
+	if (cache == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	cache->slots = (answer_slot *)calloc(ANSWER_CACHE_SLOTS, sizeof(answer_slot));
+	if (cache->slots == NULL) {
+		perror("calloc");
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void answer_cache_free(answer_cache *cache) {
+	if (cache != NULL) {
+		free(cache->slots);
+		free(cache);
+	}
+}
+
+void answer_cache_clear(answer_cache *cache) {
+	int i;
+	for (i = 0; i < ANSWER_CACHE_SLOTS; i++) {
+		cache->slots[i].key_len = 0;
+	}
+}
+
+int answer_cache_get(answer_cache *cache, unsigned char *request, int len,
+		int edns, int max, unsigned char *response, time_t now) {
+	/*
+	 * Answer a request from the cache.  The request must already have
+	 * passed is_valid_request().
+	 *
+	 * INPUT:  cache: this thread's cache
+	 * INPUT:  request, len: the query received
+	 * INPUT:  edns: 0 if it has no OPT record, 1 if it has, 2 if the
+	 *              OPT record has the DO flag set
+	 * INPUT:  max: the longest response the client takes
+	 * INPUT:  response: where to write the response
+	 * INPUT:  now: the current time
+	 * OUTPUT: the length of the response, or 0 on a miss (nothing cached
+	 *              for the question, one of its records has expired or
+	 *              the response is longer than max)
+	 */
+	int qlen = question_len(request, len);
+	if (qlen <= 0) {
+		return 0;
+	}
+	int rd = request[2] & 1;
+	unsigned int hash = hash_question(request + HEADER_LEN, qlen, rd | edns << 1);
+	answer_slot *s = &cache->slots[hash & (ANSWER_CACHE_SLOTS - 1)];
+	if (s->key_len != qlen || s->hash != hash || (s->data[0] & 1) != rd || s->edns != edns
+			|| memcmp(s->data + QUESTION_AT, request + HEADER_LEN, qlen) != 0
+			|| (s->num_ttls > 0 && now >= s->valid_until) || s->len + 2 > max) {
+		cache->misses++;
+		return 0;
+	}
+	cache->hits++;
+	memcpy(response, request, 2);
+	memcpy(response + 2, s->data, s->len);
+	int i;
+	for (i = 0; i < s->num_ttls; i++) {
+		unsigned long ttl = (unsigned long)(s->expires[i] - now);
+		unsigned char *p = response + 2 + s->ttl_at[i];
+		p[0] = (ttl >> 24) & 0xff;
+		p[1] = (ttl >> 16) & 0xff;
+		p[2] = (ttl >> 8) & 0xff;
+		p[3] = ttl & 0xff;
+	}
+	return s->len + 2;
+}
+
+void answer_cache_put(answer_cache *cache, unsigned char *request, int len,
+		int edns, unsigned char *response, int response_len, int num_ttls,
+		int *ttl_at, time_t *expires) {
+	/*
+	 * Remember a response that was just built, replacing whatever was in
+	 * its slot.  Responses that are too long or have too many records
+	 * are not kept.
+	 *
+	 * INPUT:  cache: this thread's cache
+	 * INPUT:  request, len: the query that was answered
+	 * INPUT:  edns: how the query used EDNS (see answer_cache_get())
+	 * INPUT:  response, response_len: the response that was built
+	 * INPUT:  num_ttls: the number of answer records in the response
+	 * INPUT:  ttl_at: offset of each answer record's TTL in the response
+	 * INPUT:  expires: when each answer record expires
+	 */
+	int qlen = question_len(request, len);
+	if (qlen <= 0 || response_len - 2 > ANSWER_CACHE_DATA
+			|| num_ttls > ANSWER_CACHE_TTLS) {
+		return;
+	}
+	int rd = request[2] & 1;
+	unsigned int hash = hash_question(request + HEADER_LEN, qlen, rd | edns << 1);
+	answer_slot *s = &cache->slots[hash & (ANSWER_CACHE_SLOTS - 1)];
+	s->hash = hash;
+	s->key_len = qlen;
+	s->edns = edns;
+	s->len = response_len - 2;
+	memcpy(s->data, response + 2, s->len);
+	s->num_ttls = num_ttls;
+	int i;
+	for (i = 0; i < num_ttls; i++) {
+		s->ttl_at[i] = ttl_at[i] - 2;
+		s->expires[i] = expires[i];
+		if (i == 0 || expires[i] < s->valid_until) {
+			s->valid_until = expires[i];
+		}
+	}
+}
+
+static int question_len(unsigned char *request, int len) {
+	/*
+	 * Length of the question section (name, type and class) of a
+	 * request, or -1 if it runs past the end of the request, the name
+	 * is compressed or it doesn't fit in a slot.
+	 */
+	int qlen = dns_question_length(request, len);
+	if (qlen > ANSWER_CACHE_DATA - QUESTION_AT) {
+		return -1;
+	}
+	return qlen;
+}
+
+static unsigned int hash_question(unsigned char *question, int len, int flags) {
+	/*
+	 * 32-bit FNV-1a over the question bytes and the RD flag and EDNS use.
+	 */
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) {
+		hash ^= question[i];
+		hash *= 16777619u;
+	}
+	hash ^= flags;
+	hash *= 16777619u;
+	return hash;
+}
@@ -0,0 +1,53 @@
+/*
+ * Cache of finished responses for the DNS server - CS 360
+ * A response is stored after its header's ID, exactly as it was sent,
+ * keyed by the question section, the RD flag and the request's use of
+ * EDNS (the response has an OPT record with the DO flag echoed).  It is
+ * only handed out when it fits in what the new request takes.  A hit copies the
+ * stored bytes behind the new ID and rewrites the TTLs, so repeated
+ * questions skip parsing, the db lookup and the wire encoding.
+ *
+ * Each server thread has its own cache, so there is no locking.
+ *
+*/
+
+#ifndef ANSWER_CACHE_H
+#define ANSWER_CACHE_H
+
+#include <time.h>
+
+#include "dns.h"
+
+#define ANSWER_CACHE_SLOTS	4096	// responses kept per thread (a power of two)
+#define ANSWER_CACHE_DATA	1232	// longest response that is cached (a common EDNS payload)
+#define ANSWER_CACHE_TTLS	32		// most records in a cached response
+
+typedef struct {
+	unsigned int hash;
+	int key_len;				// question bytes (+ RD) at the front of data, 0 = unused
+	int len;					// response length without the 2-byte ID
+	int edns;					// 0 without EDNS, 1 with it, 2 with DO set
+	int num_ttls;
+	time_t valid_until;			// the first of the records' expiry times
+	unsigned short ttl_at[ANSWER_CACHE_TTLS];	// TTL offsets in the response
+	time_t expires[ANSWER_CACHE_TTLS];			// when each of those records expires
+	unsigned char data[ANSWER_CACHE_DATA];		// response from the flags on
+} answer_slot;
+
+typedef struct {
+	answer_slot *slots;
+	unsigned long generation;	// the db generation the responses came from
+	unsigned long hits;
+	unsigned long misses;
+} answer_cache;
+
+answer_cache *answer_cache_new();
+void answer_cache_free(answer_cache *cache);
+void answer_cache_clear(answer_cache *cache);
+int answer_cache_get(answer_cache *cache, unsigned char *request, int len,
+		int edns, int max, unsigned char *response, time_t now);
+void answer_cache_put(answer_cache *cache, unsigned char *request, int len,
+		int edns, unsigned char *response, int response_len, int num_ttls,
+		int *ttl_at, time_t *expires);
+
+#endif /* ANSWER_CACHE_H */
@@ -0,0 +1,63 @@
+/*
+ * Cache database compiler - CS 360
+ * Loads a db text file and writes it as a snapshot (see db_snapshot.h)
+ * that the server maps at startup instead of parsing the text.  Give
+ * the server the snapshot's path in place of the text file's; it tells
+ * the two apart by the snapshot's magic.
+ *
+ * Usage: db_compile [-t threads] <db file> <snapshot file>
+ *
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+
+#include "zone_load.h"
+#include "db_snapshot.h"
+
+double seconds();
+
+int main(int argc, char *argv[]) {
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int c;
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+			case 't':
+				threads = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t threads] <db file> <snapshot file>\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "Usage: %s [-t threads] <db file> <snapshot file>\n", argv[0]);
+		exit(1);
+	}
+
+	db_store store;
+	memset(&store, 0, sizeof(store));
+	double start = seconds();
+	int loaded = zone_load(argv[optind], &store, threads);
+	if (loaded < 0) {
+		exit(EXIT_FAILURE);
+	}
+	double parsed = seconds();
+	if (snapshot_write(&store, argv[optind + 1]) < 0) {
+		store_free(&store);
+		exit(EXIT_FAILURE);
+	}
+	printf("%d records: parsed in %.2f s, snapshot written in %.2f s\n",
+			loaded, parsed - start, seconds() - parsed);
+	store_free(&store);
+	return 0;
+}
+
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
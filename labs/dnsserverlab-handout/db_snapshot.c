@@ -0,0 +1,191 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+#include "db_snapshot.h"
+
+static unsigned long long align_up(unsigned long long at);
+static int write_section(int fd, void *data, size_t len, unsigned long long at);
+static int check_header(snapshot_header *h, size_t file_len);
+
+int snapshot_write(db_store *store, char *file) {
+	/*
+	 * Write a store to a snapshot file.  The snapshot is written to
+	 * file.tmp and renamed into place, so a server that has the old
+	 * file mapped keeps its copy and one watching the file sees a
+	 * complete new one appear.
+	 *
+	 * INPUT:  store: the store (loaded and finished)
+	 * INPUT:  file: the path of the snapshot
+	 * OUTPUT: 0 on success, -1 on error
+	 */
+	snapshot_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.byte_order = SNAPSHOT_BYTE_ORDER;
+	h.entry_size = sizeof(dns_db_entry);
+	h.slot_size = sizeof(store_slot);
+	h.size = store->size;
+	h.mask = store->mask;
+	h.arena_len = store->arena_len;
+	h.node_size = sizeof(store_node);
+	h.num_nodes = store->num_nodes;
+	h.edges_mask = store->edges_mask;
+	h.db_at = align_up(sizeof(h));
+	h.slots_at = align_up(h.db_at + (unsigned long long)h.size * h.entry_size);
+	h.nodes_at = align_up(h.slots_at + ((unsigned long long)h.mask + 1) * h.slot_size);
+	h.edges_at = align_up(h.nodes_at + (unsigned long long)h.num_nodes * h.node_size);
+	h.arena_at = align_up(h.edges_at + ((unsigned long long)h.edges_mask + 1) * h.slot_size);
+	h.file_len = h.arena_at + h.arena_len;
+
+	size_t tmp_len = strlen(file) + 5;
+	char *tmp = (char *)malloc(tmp_len);
+	if (tmp == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	snprintf(tmp, tmp_len, "%s.tmp", file);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (write_section(fd, &h, sizeof(h), 0) < 0
+			|| write_section(fd, store->db, (size_t)h.size * h.entry_size, h.db_at) < 0
+			|| write_section(fd, store->slots, ((size_t)h.mask + 1) * h.slot_size, h.slots_at) < 0
+			|| write_section(fd, store->nodes, (size_t)h.num_nodes * h.node_size, h.nodes_at) < 0
+			|| write_section(fd, store->edges, ((size_t)h.edges_mask + 1) * h.slot_size, h.edges_at) < 0
+			|| write_section(fd, store->arena, h.arena_len, h.arena_at) < 0
+			|| ftruncate(fd, h.file_len) < 0
+			|| fsync(fd) < 0) {
+		perror(tmp);
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, file) < 0) {
+		perror(file);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+int snapshot_map(char *file, db_store *store) {
+	/*
+	 * Map a snapshot read-only and point the store at it.  Nothing is
+	 * read but the header; the records are paged in as lookups touch
+	 * them.  store_free() unmaps it.
+	 *
+	 * INPUT:  file: the path of the snapshot
+	 * INPUT:  store: the store to set up
+	 * OUTPUT: 0 on success, SNAPSHOT_NOT_SNAPSHOT if the file doesn't
+	 *         start with the snapshot magic (a db text file), or -1 if
+	 *         it can't be read or is a bad or incompatible snapshot
+	 */
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror(file);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror(file);
+		close(fd);
+		return -1;
+	}
+	snapshot_header h;
+	if (st.st_size < (off_t)sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+			|| memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+		close(fd);
+		return SNAPSHOT_NOT_SNAPSHOT;
+	}
+	if (check_header(&h, st.st_size) < 0) {
+		fprintf(stderr, "%s: not a usable snapshot (version %u)\n", file, h.version);
+		close(fd);
+		return -1;
+	}
+	unsigned char *map = (unsigned char *)mmap(NULL, h.file_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	memset(store, 0, sizeof(db_store));
+	store->db = (dns_db_entry *)(map + h.db_at);
+	store->size = h.size;
+	store->max = h.size;
+	store->slots = (store_slot *)(map + h.slots_at);
+	store->mask = h.mask;
+	store->nodes = (store_node *)(map + h.nodes_at);
+	store->num_nodes = h.num_nodes;
+	store->nodes_max = h.num_nodes;
+	store->edges = (store_slot *)(map + h.edges_at);
+	store->edges_mask = h.edges_mask;
+	store->arena = map + h.arena_at;
+	store->arena_len = h.arena_len;
+	store->arena_max = h.arena_len;
+	store->map = map;
+	store->map_len = h.file_len;
+	return 0;
+}
+
+static unsigned long long align_up(unsigned long long at) {
+	return (at + SNAPSHOT_ALIGN - 1) & ~(unsigned long long)(SNAPSHOT_ALIGN - 1);
+}
+
+static int write_section(int fd, void *data, size_t len, unsigned long long at) {
+	// pwrite() may write less than asked for large sections
+	unsigned char *p = (unsigned char *)data;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, at);
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+		at += n;
+	}
+	return 0;
+}
+
+static int check_header(snapshot_header *h, size_t file_len) {
+	/*
+	 * Check that a snapshot was written by this build on this kind of
+	 * machine and that its sections lie inside the file.
+	 */
+	if (h->version != SNAPSHOT_VERSION || h->byte_order != SNAPSHOT_BYTE_ORDER
+			|| h->entry_size != sizeof(dns_db_entry) || h->slot_size != sizeof(store_slot)
+			|| h->node_size != sizeof(store_node)) {
+		return -1;
+	}
+	// the index is a power of two and at most half full
+	if (((h->mask + 1) & h->mask) != 0 || h->mask == 0xffffffff
+			|| h->size > (h->mask + 1) / 2) {
+		return -1;
+	}
+	// so is the name tree's, and it has at least the root
+	if (((h->edges_mask + 1) & h->edges_mask) != 0 || h->edges_mask == 0xffffffff
+			|| h->num_nodes == 0 || h->num_nodes > (h->edges_mask + 1) / 2) {
+		return -1;
+	}
+	if (h->file_len > file_len || h->db_at < sizeof(*h)
+			|| h->db_at + (unsigned long long)h->size * h->entry_size > h->slots_at
+			|| h->slots_at + ((unsigned long long)h->mask + 1) * h->slot_size > h->nodes_at
+			|| h->nodes_at + (unsigned long long)h->num_nodes * h->node_size > h->edges_at
+			|| h->edges_at + ((unsigned long long)h->edges_mask + 1) * h->slot_size > h->arena_at
+			|| h->arena_at + h->arena_len > h->file_len) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Binary snapshots of the DNS server's cache database - CS 360
+ * A snapshot is a built db_store (records, hash index, name tree and arena)
+ * written to a file exactly as it sits in memory.  The store only
+ * refers to its own parts by index and arena offset, so the file
+ * can be mapped read-only at any address and used as is: starting
+ * from a snapshot costs the same no matter how many records it
+ * holds, and servers mapping the same file share its pages.
+ *
+ * Snapshots are written by db_compile and are only meant to be read
+ * on the machine type (byte order, struct layout) that wrote them.
+ * Replace a snapshot by renaming a new file over it, never by
+ * rewriting it in place: a server may have the old one mapped.
+ *
+*/
+
+#ifndef DB_SNAPSHOT_H
+#define DB_SNAPSHOT_H
+
+#include "db_store.h"
+
+#define SNAPSHOT_MAGIC		"DNSSNAP"	// 8 bytes with the NUL
+#define SNAPSHOT_VERSION	2
+#define SNAPSHOT_BYTE_ORDER	0x01020304
+#define SNAPSHOT_ALIGN		4096		// sections start on a page
+#define SNAPSHOT_NOT_SNAPSHOT	1		// snapshot_map(): the file is something else
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int byte_order;	// SNAPSHOT_BYTE_ORDER as the writer stored it
+	unsigned int entry_size;	// sizeof(dns_db_entry)
+	unsigned int slot_size;		// sizeof(store_slot)
+	unsigned int size;			// number of records
+	unsigned int mask;			// number of index slots - 1
+	unsigned int arena_len;
+	unsigned int node_size;		// sizeof(store_node)
+	unsigned int num_nodes;
+	unsigned int edges_mask;	// number of edge slots - 1
+	unsigned long long db_at;	// file offsets of the sections
+	unsigned long long slots_at;
+	unsigned long long nodes_at;
+	unsigned long long edges_at;
+	unsigned long long arena_at;
+	unsigned long long file_len;
+} snapshot_header;
+
+int snapshot_write(db_store *store, char *file);
+int snapshot_map(char *file, db_store *store);
+
+#endif /* DB_SNAPSHOT_H */
@@ -0,0 +1,589 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<time.h>
+#include<sys/mman.h>
+
+#include "db_store.h"
+
+static unsigned int hash_name(unsigned char *name, int len);
+static unsigned int hash_key(unsigned int name_hash, dns_rr_type type);
+static void lower_name(unsigned char *name, int len);
+static unsigned int arena_append(db_store *store, unsigned char *data, int len);
+static unsigned int intern_name(db_store *store, unsigned char *name, int len,
+		unsigned int *hash);
+static unsigned int find_slot(db_store *store, unsigned char *name, int len,
+		dns_rr_type type, unsigned int hash);
+static void advise_huge(void *addr, size_t len);
+static void build_tree(db_store *store);
+static int tree_add(db_store *store, unsigned int name);
+static unsigned int hash_edge(int parent, unsigned char *label);
+static unsigned int find_edge(db_store *store, int parent, unsigned char *label,
+		unsigned int hash);
+static void grow_edges(db_store *store);
+
+int store_init(db_store *store, int num_records, size_t arena_size) {
+	/*
+	 * Allocate an empty store for num_records records.  The record index
+	 * and the name table are kept at most half full so probe runs stay
+	 * short (every record can bring two new names: its owner and a name
+	 * in its rdata).
+	 *
+	 * INPUT:  store: the store to set up
+	 * INPUT:  num_records: how many records will be added (at most)
+	 * INPUT:  arena_size: a guess at the bytes of names and rdata, or 0
+	 * OUTPUT: 0 on success, -1 if memory could not be allocated
+	 */
+	unsigned int size = 16;
+	while (size < (unsigned int)num_records * 2) {
+		size <<= 1;
+	}
+	memset(store, 0, sizeof(db_store));
+	store->max = num_records > 0 ? num_records : 1;
+	store->db = (dns_db_entry *)malloc(sizeof(dns_db_entry) * store->max);
+	store->slots = (store_slot *)malloc(sizeof(store_slot) * size);
+	store->names = (store_slot *)malloc(sizeof(store_slot) * size * 2);
+	store->tails = (int *)malloc(sizeof(int) * size);
+	// without a guess, 16 bytes of names per record; the arena grows if needed
+	store->arena_max = arena_size > 0 ? arena_size : 16 * (size_t)store->max;
+	if (store->arena_max > 0xffffffffUL) {
+		// arena offsets are 32 bits
+		store->arena_max = 0xffffffffUL;
+	}
+	store->arena = (unsigned char *)malloc(store->arena_max);
+	if (store->db == NULL || store->slots == NULL || store->names == NULL
+			|| store->tails == NULL || store->arena == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	// these are big and read at random, fewer TLB misses with huge pages
+	advise_huge(store->db, sizeof(dns_db_entry) * store->max);
+	advise_huge(store->slots, sizeof(store_slot) * size);
+	advise_huge(store->names, sizeof(store_slot) * size * 2);
+	advise_huge(store->tails, sizeof(int) * size);
+	advise_huge(store->arena, store->arena_max);
+	unsigned int i;
+	for (i = 0; i < size; i++) {
+		store->slots[i].entry = STORE_EMPTY;
+	}
+	for (i = 0; i < size * 2; i++) {
+		store->names[i].entry = STORE_EMPTY;
+	}
+	store->mask = size - 1;
+	store->names_mask = size * 2 - 1;
+	return 0;
+}
+
+int store_add(db_store *store, unsigned char *name, dns_rr_type type, dns_rr_class class,
+		dns_rr_ttl ttl, unsigned char *rdata, int rdata_len) {
+	/*
+	 * Add a record and index it.  Records sharing a name and type are
+	 * chained in the order they were added so the first one in the db
+	 * file is found first.
+	 *
+	 * INPUT:  store: the store
+	 * INPUT:  name: the owner name in wire format (any case)
+	 * INPUT:  type, class, ttl: the record's fields
+	 * INPUT:  rdata: the record data in wire format (for name types,
+	 *              the wire-format name)
+	 * INPUT:  rdata_len: the length of rdata
+	 * OUTPUT: the index of the new record, or -1 if the store is full
+	 */
+	int name_len = wire_name_len(name);
+	if (store->size == store->max || name_len > NAME_WIRE_MAX
+			|| (RDATA_IS_NAME(type) && wire_name_len(rdata) > NAME_WIRE_MAX)) {
+		return -1;
+	}
+	int entry = store->size++;
+	dns_db_entry *e = &store->db[entry];
+	unsigned int name_hash;
+	e->name = intern_name(store, name, name_len, &name_hash);
+	e->type = type;
+	e->class = class;
+	e->ttl = ttl;
+	e->rdata_len = rdata_len;
+	if (RDATA_IS_NAME(type)) {
+		unsigned int rdata_hash;
+		e->rdata.offset = intern_name(store, rdata, rdata_len, &rdata_hash);
+	} else if (rdata_len <= RDATA_INLINE) {
+		memcpy(e->rdata.bytes, rdata, rdata_len);
+	} else {
+		e->rdata.offset = arena_append(store, rdata, rdata_len);
+	}
+	e->hash = hash_key(name_hash, type);
+	e->next = STORE_EMPTY;
+
+	unsigned int slot = find_slot(store, store->arena + e->name, name_len, type, e->hash);
+	if (store->slots[slot].entry == STORE_EMPTY) {
+		store->slots[slot].hash = e->hash;
+		store->slots[slot].entry = entry;
+	} else {
+		store->db[store->tails[slot]].next = entry;
+	}
+	store->tails[slot] = entry;
+	return entry;
+}
+
+void store_finish(db_store *store) {
+	/*
+	 * Loading is done: build the name tree, drop the name table and
+	 * chain tails (they are only needed while adding) and give back the
+	 * unused ends of the record array and arena.
+	 */
+	build_tree(store);
+	free(store->names);
+	store->names = NULL;
+	free(store->tails);
+	store->tails = NULL;
+	if (store->size > 0) {
+		store->db = (dns_db_entry *)realloc(store->db, sizeof(dns_db_entry) * store->size);
+		store->max = store->size;
+	}
+	if (store->arena_len > 0) {
+		store->arena = (unsigned char *)realloc(store->arena, store->arena_len);
+		store->arena_max = store->arena_len;
+	}
+}
+
+void store_free(db_store *store) {
+	if (store->map != NULL) {
+		// a mapped snapshot: nothing was allocated
+		munmap(store->map, store->map_len);
+		memset(store, 0, sizeof(db_store));
+		return;
+	}
+	free(store->db);
+	free(store->slots);
+	free(store->names);
+	free(store->tails);
+	free(store->arena);
+	free(store->nodes);
+	free(store->edges);
+	memset(store, 0, sizeof(db_store));
+}
+
+int store_lookup(db_store *store, unsigned char *name, dns_rr_type type) {
+	/*
+	 * Find the first record for a name and type.  Follow the records'
+	 * next fields for the rest of the records with the same key.
+	 *
+	 * INPUT:  store: the store
+	 * INPUT:  name: the domain name in wire format (any case)
+	 * INPUT:  type: the record type
+	 * OUTPUT: index of the first matching record, or STORE_EMPTY
+	 */
+	unsigned char key[NAME_WIRE_MAX + 1];
+	int len = wire_name_len(name);
+	if (len > NAME_WIRE_MAX) {
+		return STORE_EMPTY;
+	}
+	memcpy(key, name, len);
+	lower_name(key, len);
+	unsigned int hash = hash_key(hash_name(key, len), type);
+	return store->slots[find_slot(store, key, len, type, hash)].entry;
+}
+
+int store_closest(db_store *store, unsigned char *name, int *at) {
+	/*
+	 * Find a name's closest encloser: the node of the name itself if
+	 * it is in the tree, otherwise of the closest domain above it that
+	 * is.  Walks down from the root a label at a time.
+	 *
+	 * INPUT:  store: the store (finished)
+	 * INPUT:  name: the domain name in wire format (any case)
+	 * OUTPUT: at: where in name the encloser's name starts, 0 if the
+	 *         name itself is in the tree
+	 * OUTPUT: the encloser's node (STORE_ROOT at worst)
+	 */
+	unsigned char key[NAME_WIRE_MAX + 1];
+	int labels[NAME_WIRE_MAX / 2 + 1];
+	int len = wire_name_len(name);
+	int n = 0;
+	int node = STORE_ROOT;
+	*at = len - 1;
+	if (len > NAME_WIRE_MAX || store->nodes == NULL) {
+		return node;
+	}
+	memcpy(key, name, len);
+	lower_name(key, len);
+	int i;
+	for (i = 0; key[i] != 0; i += key[i] + 1) {
+		labels[n++] = i;
+	}
+	while (n > 0) {
+		n--;
+		unsigned int slot = find_edge(store, node, key + labels[n],
+				hash_edge(node, key + labels[n]));
+		if (store->edges[slot].entry == STORE_EMPTY) {
+			break;
+		}
+		node = store->edges[slot].entry;
+		*at = labels[n];
+	}
+	return node;
+}
+
+int store_child(db_store *store, int node, unsigned char *label) {
+	/*
+	 * Find the node of a name one label below a node's name.
+	 *
+	 * INPUT:  store: the store (finished)
+	 * INPUT:  node: the parent's node
+	 * INPUT:  label: the label, length first, lower case
+	 * OUTPUT: the child's node, or STORE_EMPTY if there is none
+	 */
+	if (store->nodes == NULL) {
+		return STORE_EMPTY;
+	}
+	return store->edges[find_edge(store, node, label, hash_edge(node, label))].entry;
+}
+
+unsigned char *store_name(db_store *store, dns_db_entry *entry) {
+	return store->arena + entry->name;
+}
+
+unsigned char *store_rdata(db_store *store, dns_db_entry *entry) {
+	if (RDATA_IS_NAME(entry->type) || entry->rdata_len > RDATA_INLINE) {
+		return store->arena + entry->rdata.offset;
+	}
+	return entry->rdata.bytes;
+}
+
+int store_rr_to_wire(db_store *store, int entry, unsigned char *owner, dns_rr_ttl ttl,
+		unsigned char *msg, int at, int room, compress_table *names, int *ttl_at) {
+	/*
+	 * Write a record in wire format straight from the store.  With a
+	 * suffix table the owner name and the names in the rdata (see
+	 * rdata_to_wire) are compressed against the names already in the
+	 * message.
+	 *
+	 * INPUT:  store: the store
+	 * INPUT:  entry: index of the record
+	 * INPUT:  owner: the owner name to write in wire format (a name a
+	 *         wildcard record answers for), or NULL for the record's
+	 * INPUT:  ttl: the TTL to send (what is left of the record's TTL)
+	 * INPUT:  msg: the start of the message being built
+	 * INPUT:  at: where in the message to write the record
+	 * INPUT:  room: how many bytes are free at msg + at
+	 * INPUT:  names: the message's suffix table, or NULL to not compress
+	 * OUTPUT: ttl_at: where the TTL was written (if not NULL)
+	 * OUTPUT: the length of the wire-formatted record, or -1 if it
+	 *              doesn't fit
+	 */
+	dns_db_entry *e = &store->db[entry];
+	unsigned char *wire = msg + at;
+	unsigned char *name = owner != NULL ? owner : store->arena + e->name;
+	int len;
+	if (names != NULL) {
+		len = compress_name(names, msg, at, name, room);
+	} else {
+		len = wire_name_len(name);
+		len = len > room ? -1 : len;
+		if (len > 0) {
+			memcpy(wire, name, len);
+		}
+	}
+	if (len < 0 || len + 10 > room) {
+		return -1;
+	}
+	wire[len++] = e->type >> 8;
+	wire[len++] = e->type & 0xff;
+	wire[len++] = e->class >> 8;
+	wire[len++] = e->class & 0xff;
+	if (ttl_at != NULL) {
+		*ttl_at = at + len;
+	}
+	wire[len++] = (ttl >> 24) & 0xff;
+	wire[len++] = (ttl >> 16) & 0xff;
+	wire[len++] = (ttl >> 8) & 0xff;
+	wire[len++] = ttl & 0xff;
+	int rdata_len = rdata_to_wire(e->type, store_rdata(store, e), e->rdata_len,
+			msg, at + len + 2, room - len - 2, names);
+	if (rdata_len < 0) {
+		return -1;
+	}
+	wire[len++] = rdata_len >> 8;
+	wire[len++] = rdata_len & 0xff;
+	return len + rdata_len;
+}
+
+int wire_name_len(unsigned char *name) {
+	/*
+	 * Length of an uncompressed wire-format name, including the final
+	 * zero label.  Stops counting past NAME_WIRE_MAX.
+	 */
+	int len = 0;
+	while (name[len] != 0 && len <= NAME_WIRE_MAX) {
+		len += name[len] + 1;
+	}
+	return len + 1;
+}
+
+static void lower_name(unsigned char *name, int len) {
+	// label lengths are at most 63 so they are never mistaken for letters
+	int i;
+	for (i = 0; i < len; i++) {
+		if (name[i] >= 'A' && name[i] <= 'Z') {
+			name[i] += 32;
+		}
+	}
+}
+
+static unsigned int hash_name(unsigned char *name, int len) {
+	/*
+	 * 32-bit FNV-1a over the name bytes.
+	 */
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) {
+		hash ^= name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static unsigned int hash_key(unsigned int name_hash, dns_rr_type type) {
+	// carry on the FNV-1a over the type bytes
+	name_hash ^= type >> 8;
+	name_hash *= 16777619u;
+	name_hash ^= type & 0xff;
+	name_hash *= 16777619u;
+	return name_hash;
+}
+
+static unsigned int arena_append(db_store *store, unsigned char *data, int len) {
+	if (store->arena_len + len > store->arena_max) {
+		while (store->arena_len + len > store->arena_max) {
+			store->arena_max *= 2;
+		}
+		store->arena = (unsigned char *)realloc(store->arena, store->arena_max);
+		if (store->arena == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	unsigned int offset = store->arena_len;
+	memcpy(store->arena + offset, data, len);
+	store->arena_len += len;
+	return offset;
+}
+
+static unsigned int intern_name(db_store *store, unsigned char *name, int len,
+		unsigned int *hash) {
+	/*
+	 * Return the arena offset of the lower-cased name, adding it to the
+	 * arena the first time it is seen.  The name's hash is kept in the
+	 * table so probing rarely has to look at the arena.
+	 *
+	 * OUTPUT: hash: the hash of the lower-cased name
+	 */
+	unsigned char key[NAME_WIRE_MAX + 1];
+	memcpy(key, name, len);
+	lower_name(key, len);
+	*hash = hash_name(key, len);
+	unsigned int slot = *hash & store->names_mask;
+	while (store->names[slot].entry != STORE_EMPTY) {
+		unsigned int offset = store->names[slot].entry;
+		if (store->names[slot].hash == *hash
+				&& wire_name_len(store->arena + offset) == len
+				&& memcmp(store->arena + offset, key, len) == 0) {
+			return offset;
+		}
+		slot = (slot + 1) & store->names_mask;
+	}
+	unsigned int offset = arena_append(store, key, len);
+	store->names[slot].hash = *hash;
+	store->names[slot].entry = offset;
+	return offset;
+}
+
+static unsigned int find_slot(db_store *store, unsigned char *name, int len,
+		dns_rr_type type, unsigned int hash) {
+	/*
+	 * Linear probe from the key's home slot to either the slot holding
+	 * the key or the first empty slot.  The stored hash is compared
+	 * before the name bytes so most mismatches cost one integer compare.
+	 */
+	unsigned int slot = hash & store->mask;
+	while (store->slots[slot].entry != STORE_EMPTY) {
+		dns_db_entry *e = &store->db[store->slots[slot].entry];
+		if (store->slots[slot].hash == hash && e->type == type
+				&& wire_name_len(store->arena + e->name) == len
+				&& memcmp(store->arena + e->name, name, len) == 0) {
+			break;
+		}
+		slot = (slot + 1) & store->mask;
+	}
+	return slot;
+}
+
+static void build_tree(db_store *store) {
+	/*
+	 * Add every owner name to the name tree, with the domains above it,
+	 * and flag the nodes with what their names have.  The root's node
+	 * is added first so it is STORE_ROOT.
+	 */
+	unsigned int size = 16;
+	while (size < (unsigned int)store->size) {
+		size <<= 1;
+	}
+	store->nodes_max = size;
+	store->nodes = (store_node *)malloc(sizeof(store_node) * store->nodes_max);
+	store->edges = (store_slot *)malloc(sizeof(store_slot) * size * 2);
+	if (store->nodes == NULL || store->edges == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	unsigned int i;
+	for (i = 0; i < size * 2; i++) {
+		store->edges[i].entry = STORE_EMPTY;
+	}
+	store->edges_mask = size * 2 - 1;
+	unsigned int root_hash;
+	store->nodes[STORE_ROOT].name = intern_name(store, (unsigned char *)"", 1, &root_hash);
+	store->nodes[STORE_ROOT].parent = -1;
+	store->nodes[STORE_ROOT].flags = 0;
+	store->num_nodes = 1;
+	int e;
+	int node = STORE_ROOT;
+	for (e = 0; e < store->size; e++) {
+		dns_db_entry *entry = &store->db[e];
+		// a name's records usually come together
+		if (e == 0 || entry->name != store->db[e - 1].name) {
+			node = tree_add(store, entry->name);
+		}
+		store->nodes[node].flags |= NODE_DATA;
+		if (entry->type == TYPE_NS) {
+			store->nodes[node].flags |= NODE_NS;
+		} else if (entry->type == TYPE_SOA) {
+			store->nodes[node].flags |= NODE_SOA;
+		}
+	}
+	store->nodes = (store_node *)realloc(store->nodes, sizeof(store_node) * store->num_nodes);
+	store->nodes_max = store->num_nodes;
+}
+
+static int tree_add(db_store *store, unsigned int name) {
+	/*
+	 * Find the node of an interned name, adding it and the domains above
+	 * it that aren't in the tree yet.
+	 *
+	 * OUTPUT: the name's node
+	 */
+	unsigned char *wire = store->arena + name;
+	int labels[NAME_WIRE_MAX / 2 + 1];
+	int n = 0;
+	int i;
+	for (i = 0; wire[i] != 0; i += wire[i] + 1) {
+		labels[n++] = i;
+	}
+	int node = STORE_ROOT;
+	while (n > 0) {
+		n--;
+		unsigned char *label = wire + labels[n];
+		unsigned int hash = hash_edge(node, label);
+		unsigned int slot = find_edge(store, node, label, hash);
+		if (store->edges[slot].entry != STORE_EMPTY) {
+			node = store->edges[slot].entry;
+			continue;
+		}
+		if (store->num_nodes == store->nodes_max) {
+			store->nodes_max *= 2;
+			store->nodes = (store_node *)realloc(store->nodes,
+					sizeof(store_node) * store->nodes_max);
+			if (store->nodes == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		int child = store->num_nodes++;
+		store->nodes[child].name = name + labels[n];
+		store->nodes[child].parent = node;
+		store->nodes[child].flags = 0;
+		store->nodes[node].flags |= NODE_PARENT;
+		if (label[0] == 1 && label[1] == '*') {
+			store->nodes[node].flags |= NODE_WILDCARD;
+		}
+		store->edges[slot].hash = hash;
+		store->edges[slot].entry = child;
+		if ((unsigned int)store->num_nodes * 2 > store->edges_mask + 1) {
+			grow_edges(store);
+		}
+		node = child;
+	}
+	return node;
+}
+
+static unsigned int hash_edge(int parent, unsigned char *label) {
+	// FNV-1a over the parent's node number and then the label
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i = 0; i < 4; i++) {
+		hash ^= ((unsigned int)parent >> (8 * i)) & 0xff;
+		hash *= 16777619u;
+	}
+	for (i = 0; i <= label[0]; i++) {
+		hash ^= label[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static unsigned int find_edge(db_store *store, int parent, unsigned char *label,
+		unsigned int hash) {
+	/*
+	 * Linear probe for a node by its parent and label, like find_slot:
+	 * either the slot holding it or the first empty slot.
+	 */
+	unsigned int slot = hash & store->edges_mask;
+	while (store->edges[slot].entry != STORE_EMPTY) {
+		store_node *node = &store->nodes[store->edges[slot].entry];
+		unsigned char *name = store->arena + node->name;
+		if (store->edges[slot].hash == hash && node->parent == parent
+				&& memcmp(name, label, label[0] + 1) == 0) {
+			break;
+		}
+		slot = (slot + 1) & store->edges_mask;
+	}
+	return slot;
+}
+
+static void grow_edges(db_store *store) {
+	// double the edge table and put every node back in it
+	unsigned int size = (store->edges_mask + 1) * 2;
+	store_slot *edges = (store_slot *)malloc(sizeof(store_slot) * size);
+	if (edges == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	unsigned int i;
+	for (i = 0; i < size; i++) {
+		edges[i].entry = STORE_EMPTY;
+	}
+	for (i = 0; i <= store->edges_mask; i++) {
+		if (store->edges[i].entry == STORE_EMPTY) {
+			continue;
+		}
+		unsigned int slot = store->edges[i].hash & (size - 1);
+		while (edges[slot].entry != STORE_EMPTY) {
+			slot = (slot + 1) & (size - 1);
+		}
+		edges[slot] = store->edges[i];
+	}
+	free(store->edges);
+	store->edges = edges;
+	store->edges_mask = size - 1;
+}
+
+static void advise_huge(void *addr, size_t len) {
+	/*
+	 * Ask for transparent huge pages on the 2MB-aligned part of a big
+	 * allocation.  Only a hint: nothing changes if the kernel says no.
+	 */
+	unsigned long huge = 1UL << 21;
+	unsigned long start = ((unsigned long)addr + huge - 1) & ~(huge - 1);
+	unsigned long end = ((unsigned long)addr + len) & ~(huge - 1);
+	if (end > start) {
+		madvise((void *)start, end - start, MADV_HUGEPAGE);
+	}
+}
@@ -0,0 +1,109 @@
+/*
+ * Hash index over the DNS server's cache database - CS 360
+ * Records are found by their canonical wire-format name and type
+ * with open addressing, so a lookup costs the same no matter how
+ * many records the db file holds.
+ *
+ * Records are packed: every name (owner names and names inside
+ * rdata) is stored once, lower-cased and in wire format, in one
+ * arena, small rdata lives inside the record and larger rdata is
+ * appended to the same arena.
+ *
+ * The names also form a tree, read from the root down one label at a
+ * time (com, then example, then www), with a node for every owner name
+ * and every domain above one.  A node is found from its parent and its
+ * label in a hash table, so finding a name's closest encloser (the
+ * name itself, or the closest domain above it that is in the tree)
+ * takes one probe per label.  Each node points at its name's tail in
+ * the arena, so the domains names share are stored once, and is
+ * flagged with what is there: records, a delegation (NS), a zone apex
+ * (SOA), a wildcard (*) below it.  The tree is built by store_finish().
+ *
+*/
+
+#ifndef DB_STORE_H
+#define DB_STORE_H
+
+#include <time.h>
+#include <stddef.h>
+
+#include "dns.h"
+#include "name_compress.h"
+#include "rdata.h"
+
+#define NAME_WIRE_MAX		255		// longest name in wire format
+#define STORE_EMPTY			-1
+#define RDATA_INLINE		4		// rdata this size or smaller is kept in the record
+
+// types whose rdata is a single domain name (interned like owner names)
+#define RDATA_IS_NAME(t)	((t) == CNAME || (t) == TYPE_NS)
+
+typedef struct {
+	unsigned int name;		// arena offset of the owner name
+	union {
+		unsigned int offset;				// arena offset of the rdata
+		unsigned char bytes[RDATA_INLINE];	// or the rdata itself
+	} rdata;
+	dns_rr_ttl ttl;			// seconds after the db was loaded that it expires
+	unsigned int hash;		// hash of the name and type, computed once at load
+	int next;				// next entry with the same name and type (-1 = none)
+	dns_rr_type type;
+	dns_rr_class class;
+	dns_rdata_len rdata_len;
+} dns_db_entry;
+
+typedef struct {
+	unsigned int hash;
+	int entry;				// index into the db, STORE_EMPTY if unused
+} store_slot;
+
+// what a node of the name tree has
+#define NODE_DATA			0x01	// records
+#define NODE_NS				0x02	// NS records
+#define NODE_SOA			0x04	// an SOA record
+#define NODE_WILDCARD		0x08	// a * name below it
+#define NODE_PARENT			0x10	// names below it
+#define STORE_ROOT			0		// the root's node
+
+typedef struct {
+	unsigned int name;		// arena offset of the name (the tail of an owner name)
+	int parent;				// the node of the domain above it, -1 for the root
+	unsigned int flags;		// NODE_*
+} store_node;
+
+typedef struct {
+	dns_db_entry *db;		// the records, in file order
+	int size;
+	int max;
+	store_slot *slots;		// name + type index into db
+	unsigned int mask;		// number of slots - 1 (a power of two)
+	unsigned char *arena;	// names and rdata
+	unsigned int arena_len;
+	size_t arena_max;
+	store_slot *names;		// interning table while loading (entry = arena offset)
+	unsigned int names_mask;
+	int *tails;				// last entry of each slot's chain while loading
+	store_node *nodes;		// the name tree
+	int num_nodes;
+	int nodes_max;
+	store_slot *edges;		// parent node + label index into nodes
+	unsigned int edges_mask;
+	void *map;				// the snapshot the store lives in, or NULL (see db_snapshot.h)
+	size_t map_len;
+} db_store;
+
+int store_init(db_store *store, int num_records, size_t arena_size);
+int store_add(db_store *store, unsigned char *name, dns_rr_type type, dns_rr_class class,
+		dns_rr_ttl ttl, unsigned char *rdata, int rdata_len);
+void store_finish(db_store *store);
+void store_free(db_store *store);
+int store_lookup(db_store *store, unsigned char *name, dns_rr_type type);
+int store_closest(db_store *store, unsigned char *name, int *at);
+int store_child(db_store *store, int node, unsigned char *label);
+unsigned char *store_name(db_store *store, dns_db_entry *entry);
+unsigned char *store_rdata(db_store *store, dns_db_entry *entry);
+int store_rr_to_wire(db_store *store, int entry, unsigned char *owner, dns_rr_ttl ttl,
+		unsigned char *msg, int at, int room, compress_table *names, int *ttl_at);
+int wire_name_len(unsigned char *name);
+
+#endif /* DB_STORE_H */
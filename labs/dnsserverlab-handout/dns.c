@@ -99,10 +99,11 @@ int name_ascii_to_wire(char *name, unsigned char *wire) {
 	 char delim[2] = ".";
 
 	 char* cur_label;
+	 char* save_ptr;
 	 size_t len, total_len = 0;
 
-	 // get the first token
-	 cur_label = strtok(name_buffer,delim);
+	 // get the first token (strtok_r, the server calls this from many threads)
+	 cur_label = strtok_r(name_buffer,delim,&save_ptr);
 
 	 // get the remaining tokenized labels
 	 while(cur_label != NULL){
@@ -113,7 +114,7 @@ int name_ascii_to_wire(char *name, unsigned char *wire) {
 		 total_len++;
 		 strncpy(wire_ptr,cur_label,len);
 		 wire_ptr += len;
-		 cur_label = strtok(NULL,delim);
+		 cur_label = strtok_r(NULL,delim,&save_ptr);
 		 total_len += len;
 	 }
 	 // add the terminating 00 to the end
@@ -124,118 +125,6 @@ int name_ascii_to_wire(char *name, unsigned char *wire) {
 	 return total_len;
 }
 
-char *name_ascii_from_wire(unsigned char *wire, int *indexp) {
-	/* 
-	 * Extract the wire-formatted DNS name at the offset specified by
-	 * *indexp in the array of bytes provided (wire) and return its string
-	 * representation (dot-separated labels) in a char array allocated for
-	 * that purpose.  Update the value pointed to by indexp to the next
-	 * value beyond the name.
-	 *
-	 * INPUT:  wire: a pointer to an array of bytes
-	 * INPUT:  indexp, a pointer to the index in the wire where the
-	 *              wire-formatted name begins
-	 * OUTPUT: a string containing the string representation of the name,
-	 *              allocated on the heap.
-	 */
-
-	int compressed = 0;
-	unsigned char* wire_ptr = wire;
-	unsigned char* name = (char*)malloc(sizeof(char)*BUFFER_MAX);
-	memset(name,0,BUFFER_MAX);
-	char* name_ptr = name;
-	char* delim = ".";
-	wire_ptr += *indexp;
-	int label_len = (int)*wire_ptr;
-	while(label_len != 0){
-		if(label_len >= COMPRESSED_VAL){
-			// we are looking at a pointer, get the offset and move the pointer
-			wire_ptr++;
-			if(!compressed){(*indexp)++;}
-			int name_offset = (int)*wire_ptr;
-			wire_ptr = (wire + name_offset);
-			label_len = (int)(*wire_ptr); 
-			compressed = 1;
-		}else{
-			wire_ptr++;								// increment to start of label
-			if(!compressed){(*indexp)++;}
-			memcpy(name_ptr,wire_ptr,label_len);	// read the label
-			name_ptr += label_len;		
-			wire_ptr += label_len;					// increment to next length
-			if(!compressed){(*indexp) += label_len;}
-			label_len = (int)*wire_ptr;				// get the length of the label
-			if(label_len != 0){
-				memcpy(name_ptr,delim,sizeof(char));	// add the period
-				name_ptr++;
-			}
-		}
-	}
-	// increment past the trailing 0x00 or the pointer value
-	(*indexp)++;
-
-	return name;
-}
-
-dns_rr rr_from_wire(unsigned char *wire, int *indexp, int query_only) {
-	/* 
-	 * Extract the wire-formatted resource record at the offset specified by
-	 * *indexp in the array of bytes provided (wire) and return a 
-	 * dns_rr (struct) populated with its contents. Update the value
-	 * pointed to by indexp to the next value beyond the resource record.
-	 *
-	 * INPUT:  wire: a pointer to an array of bytes
-	 * INPUT:  indexp: a pointer to the index in the wire where the
-	 *              wire-formatted resource record begins
-	 * INPUT:  query_only: a boolean value (1 or 0) which indicates whether
-	 *              we are extracting a full resource record or only a
-	 *              query (i.e., in the question section of the DNS
-	 *              message).  In the case of the latter, the ttl,
-	 *              rdata_len, and rdata are skipped.
-	 * OUTPUT: the resource record (struct)
-	 */
-
-	unsigned char* wire_ptr = wire;
-	dns_rr rr;
-	wire_ptr += (*indexp);
-	// extract the name (but check for pointer)
-	if(((int)(*wire_ptr) < COMPRESSED_VAL) && !query_only){
-		(*indexp) += 11;
-	}
-	rr.name = name_ascii_from_wire(wire,indexp);
-	wire_ptr = (wire + *indexp);
-	// extract the type
-	memcpy(&rr.type,wire_ptr,sizeof(dns_rr_type));
-	rr.type = ntohs(rr.type);
-	wire_ptr += sizeof(short);
-	(*indexp) += sizeof(short);
-	// extract the class
-	
-	memcpy(&rr.class,wire_ptr,sizeof(dns_rr_type));
-	rr.class = ntohs(rr.class);
-	wire_ptr += sizeof(short);
-	(*indexp) += sizeof(short);
-	// stop here unless the query only flag is not set
-	if(query_only == 0){
-		// extract the ttl
-		memcpy(&(rr.ttl),wire_ptr,sizeof(int));
-		rr.ttl = SWAP_ENDIAN_32(rr.ttl);
-		wire_ptr += sizeof(int);
-		(*indexp) += sizeof(int);
-		// extract the record data length
-		memcpy(&rr.rdata_len,wire_ptr,sizeof(dns_rdata_len));
-		rr.rdata_len = ntohs(rr.rdata_len);
-		wire_ptr += sizeof(dns_rdata_len);
-		(*indexp) += sizeof(dns_rdata_len);
-		// extract a pointer to the record data
-		rr.rdata = wire_ptr;
-		// increment the index past the rdata 
-		(*indexp) += (int)rr.rdata_len;
-	}
-	
-	return rr;
-}
-
-
 int rr_to_wire(dns_rr rr, unsigned char *wire, int query_only) {
 	/* 
 	 * Convert a DNS resource record struct to DNS wire format, using the
@@ -5,10 +5,16 @@
  * 
 */
 
-#define BUFFER_MAX			1024
+#ifndef DNS_H
+#define DNS_H
+
+#define BUFFER_MAX			1024	// longest query taken
+#define UDP_MSG_MAX			4096	// longest UDP response, to clients whose EDNS payload allows it
+#define TCP_MSG_MAX			65535	// longest TCP response (its length prefix is 16 bits)
+#define EDNS_PAYLOAD		BUFFER_MAX	// UDP payload the server says it takes
 #define COMPRESSED_VAL		192
-#define QUESTION 			1		// use when extracting a question rr with rr_from_wire
-#define RESOURCE_RECORD		0		// use when extracting a resource record in full
+#define QUESTION 			1		// use when writing a question rr with rr_to_wire
+#define RESOURCE_RECORD		0		// use when writing a resource record in full
 
 #define BITS_IN_CHAR	8
 #define IS_POINTER(s)	((s)& 0xc0)
@@ -20,6 +26,7 @@
 #define FLAGS(s)		((s) & 0x07f0)
 #define AA_SET(f)		((f) & 0x0400)
 #define TC_SET(f)		((f) & 0x0200)
+#define SET_TC(f)		((f) | 0x0200)
 #define RD_SET(f)		((f) & 0x0100)
 #define SET_RD(f)		((f) | 0x0100)
 #define RA_SET(f)		((f) & 0x0080)
@@ -33,7 +40,12 @@
 #define SWAP_ENDIAN_32(num)	(((num>>24)&0xff) | ((num<<8)&0xff0000) | ((num>>8)&0xff00) | ((num<<24)&0xff000000)) 
 
 #define TYPE_A			1
+#define TYPE_NS			2
 #define CNAME			5
+#define TYPE_SOA		6
+#define TYPE_MX			15
+#define TYPE_TXT		16
+#define TYPE_AAAA		28
 
 #define DEBUG_MODE		0
 
@@ -57,6 +69,6 @@ typedef struct {
 void print_bytes(unsigned char *bytes, int byteslen);
 void canonicalize_name(char *name);
 int name_ascii_to_wire(char *name, unsigned char *wire);
-char *name_ascii_from_wire(unsigned char *wire, int *indexp);
-dns_rr rr_from_wire(unsigned char *wire, int *indexp, int query_only);
 int rr_to_wire(dns_rr rr, unsigned char *wire, int query_only);
+
+#endif /* DNS_H */
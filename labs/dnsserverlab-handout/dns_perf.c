@@ -0,0 +1,596 @@
+/*
+ * Load generator for the DNS server - CS 360
+ * Replays a mix of queries against a server at a target rate, in the
+ * style of dnsperf, over UDP or over a few TCP connections with the
+ * queries pipelined.  The mix is read from a file: a cache database
+ * file (each record's name and type are asked for) or a list of names,
+ * each optionally followed by a type.  A share of the queries can go to
+ * generated names that don't exist (a random label in front of a name
+ * from the mix), which no answer cache can have seen.  With -e the
+ * queries carry an EDNS(0) OPT record advertising that UDP payload.
+ *
+ * Queries go out at the target rate whether or not earlier ones have
+ * been answered, up to a limit on how many are outstanding; one not
+ * answered within the timeout is lost.  At the end the rate achieved,
+ * the loss, the response codes and the latency percentiles are printed.
+ *
+ * Usage: dns_perf [-s server] [-p port] [-d query file] [-q qps] [-l seconds]
+ *            [-n queries] [-x nonexistent %] [-T] [-c connections]
+ *            [-o outstanding] [-t timeout ms] [-e EDNS payload]
+ *
+*/
+
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+
+#include "dns.h"
+#include "db_store.h"
+#include "rdata.h"
+
+#define PERF_IDS			65536	// queries in flight are told apart by ID
+#define PERF_MSG_MAX		65535
+#define PERF_CONNS_MAX		64
+#define PERF_IN_MAX			65536	// TCP bytes read and not yet parsed
+#define PERF_OUT_MAX		16384	// TCP bytes queued and not yet sent
+#define PERF_WAIT_MAX		0.01	// longest poll, in seconds
+#define PERF_LINE_MAX		4096
+#define PERF_OPT_LEN		11		// an OPT record without options
+
+typedef struct {
+	int fd;
+	unsigned char in[PERF_IN_MAX];
+	int in_len;
+	unsigned char out[PERF_OUT_MAX];
+	int out_len;
+} perf_conn;
+
+typedef struct {
+	double sent_at;
+	int pending;
+} perf_slot;
+
+typedef struct {
+	unsigned char *pool;		// the queries, one after another
+	int *at;
+	int *len;
+	int count;
+	int max;
+	int pool_len;
+	int pool_max;
+} perf_mix;
+
+// the run
+struct sockaddr_in server;
+int use_tcp;
+int num_conns = 4;
+int edns_payload;			// 0 for queries without an OPT record
+perf_conn *conns;
+perf_slot slots[PERF_IDS];
+long next_seq;				// queries sent
+long oldest;				// the oldest query that may still be pending
+int outstanding;
+long answered, lost, late, truncated, closed;
+long rcodes[16];
+double last_answer;
+float *latencies;			// ms, one per answer
+long num_latencies, max_latencies;
+
+int read_mix(char *file, perf_mix *mix);
+int add_query(perf_mix *mix, unsigned char *name, int name_len, dns_rr_type type);
+int build_query(perf_mix *mix, long seq, int nx_percent, unsigned char *msg);
+int send_query(unsigned char *msg, int len, long seq);
+void read_udp();
+int read_tcp(perf_conn *conn);
+void handle_response(unsigned char *msg, int len, double now);
+void expire(double now, double timeout);
+int open_conn(perf_conn *conn);
+void report(double elapsed, double qps);
+int compare_float(const void *a, const void *b);
+double seconds();
+
+int main(int argc, char *argv[]) {
+	char *address = "127.0.0.1";
+	unsigned short port = 53;
+	char *file = "db.txt";
+	double qps = 0;
+	double limit = 10;
+	long max_queries = 0;
+	int nx_percent = 0;
+	int max_outstanding = 100;
+	double timeout = 1.0;
+	int c, i;
+	while ((c = getopt(argc, argv, "s:p:d:q:l:n:x:Tc:o:t:e:")) != -1) {
+		switch (c) {
+			case 's':
+				address = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'd':
+				file = optarg;
+				break;
+			case 'q':
+				qps = atof(optarg);
+				break;
+			case 'l':
+				limit = atof(optarg);
+				break;
+			case 'n':
+				max_queries = atol(optarg);
+				break;
+			case 'x':
+				nx_percent = atoi(optarg);
+				break;
+			case 'T':
+				use_tcp = 1;
+				break;
+			case 'c':
+				num_conns = atoi(optarg);
+				break;
+			case 'o':
+				max_outstanding = atoi(optarg);
+				break;
+			case 't':
+				timeout = atoi(optarg) / 1000.0;
+				break;
+			case 'e':
+				edns_payload = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s server] [-p port] [-d query file] [-q qps] [-l seconds]\n"
+						"           [-n queries] [-x nonexistent %%] [-T] [-c connections]\n"
+						"           [-o outstanding] [-t timeout ms] [-e EDNS payload]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (num_conns < 1 || num_conns > PERF_CONNS_MAX) {
+		fprintf(stderr, "between 1 and %d connections\n", PERF_CONNS_MAX);
+		exit(1);
+	}
+	if (max_outstanding < 1 || max_outstanding >= PERF_IDS) {
+		max_outstanding = PERF_IDS - 1;
+	}
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &server.sin_addr) != 1) {
+		fprintf(stderr, "%s: not an IPv4 address\n", address);
+		exit(1);
+	}
+	perf_mix mix;
+	if (read_mix(file, &mix) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	srand(time(NULL) ^ getpid());
+
+	int num_fds = use_tcp ? num_conns : 1;
+	conns = (perf_conn *)calloc(num_fds, sizeof(perf_conn));
+	struct pollfd *fds = (struct pollfd *)calloc(num_fds, sizeof(struct pollfd));
+	if (conns == NULL || fds == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < num_fds; i++) {
+		if (open_conn(&conns[i]) < 0) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unsigned char msg[BUFFER_MAX + PERF_OPT_LEN];
+	double start = seconds();
+	double stop = start + limit;
+	last_answer = start;
+	while (1) {
+		double now = seconds();
+		int sending = now < stop && (max_queries == 0 || next_seq < max_queries);
+		double wait = PERF_WAIT_MAX;
+		if (sending) {
+			// every query due by now, as far as the limits allow
+			long due = qps > 0 ? (long)((now - start) * qps) + 1 : next_seq + max_outstanding;
+			while (next_seq < due && outstanding < max_outstanding
+					&& next_seq - oldest < PERF_IDS
+					&& (max_queries == 0 || next_seq < max_queries)) {
+				int len = build_query(&mix, next_seq, nx_percent, msg);
+				if (send_query(msg, len, next_seq) < 0) {
+					break;
+				}
+				slots[next_seq % PERF_IDS].sent_at = now;
+				slots[next_seq % PERF_IDS].pending = 1;
+				outstanding++;
+				next_seq++;
+			}
+			if (qps > 0 && next_seq >= due) {
+				// sleep until the next one is due
+				double next = start + next_seq / qps - now;
+				wait = next < wait ? next : wait;
+			}
+		} else if (outstanding == 0) {
+			break;
+		}
+		for (i = 0; i < num_fds; i++) {
+			fds[i].fd = conns[i].fd;
+			fds[i].events = POLLIN | (conns[i].out_len > 0 ? POLLOUT : 0);
+		}
+		struct timespec ts;
+		ts.tv_sec = 0;
+		ts.tv_nsec = wait > 0 ? (long)(wait * 1e9) : 0;
+		if (ppoll(fds, num_fds, &ts, NULL) < 0 && errno != EINTR) {
+			perror("ppoll");
+			exit(EXIT_FAILURE);
+		}
+		if (!use_tcp) {
+			read_udp();
+		} else {
+			for (i = 0; i < num_fds; i++) {
+				if (read_tcp(&conns[i]) < 0) {
+					// the server closed it; what was pending on it times out
+					closed++;
+					close(conns[i].fd);
+					if (open_conn(&conns[i]) < 0) {
+						exit(EXIT_FAILURE);
+					}
+				}
+			}
+		}
+		expire(seconds(), timeout);
+	}
+	report((last_answer > start ? last_answer : seconds()) - start, qps);
+	return 0;
+}
+
+int read_mix(char *file, perf_mix *mix) {
+	/*
+	 * Read the queries to replay.  A line with a TTL and class after the
+	 * name is a database record and its name and type are asked for;
+	 * otherwise the line is a name and, optionally, a type (A if not).
+	 *
+	 * OUTPUT: 0, or -1 if the file can't be read or has no queries
+	 */
+	char line[PERF_LINE_MAX];
+	unsigned char name[NAME_WIRE_MAX];
+	memset(mix, 0, sizeof(perf_mix));
+	FILE *f = fopen(file, "r");
+	if (f == NULL) {
+		perror(file);
+		return -1;
+	}
+	int skipped = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *tokens[4];
+		int num_tokens = 0;
+		char *p = strtok(line, " \t\r\n");
+		while (p != NULL && num_tokens < 4) {
+			tokens[num_tokens++] = p;
+			p = strtok(NULL, " \t\r\n");
+		}
+		if (num_tokens == 0 || tokens[0][0] == '#' || tokens[0][0] == ';') {
+			continue;
+		}
+		char *type_text = num_tokens > 1 ? tokens[1] : "A";
+		if (num_tokens == 4 && strcasecmp(tokens[2], "IN") == 0) {
+			type_text = tokens[3];
+		}
+		dns_rr_type type = rr_type_from_text(type_text);
+		if (type == 0) {
+			type = atoi(type_text);
+		}
+		int name_len = name_from_text(tokens[0], name);
+		if (type == 0 || name_len < 0) {
+			skipped++;
+			continue;
+		}
+		if (add_query(mix, name, name_len, type) < 0) {
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	if (skipped > 0) {
+		fprintf(stderr, "%s: %d lines skipped\n", file, skipped);
+	}
+	if (mix->count == 0) {
+		fprintf(stderr, "%s: no queries\n", file);
+		return -1;
+	}
+	return 0;
+}
+
+int add_query(perf_mix *mix, unsigned char *name, int name_len, dns_rr_type type) {
+	// add a query (header, name, type and class IN) to the mix
+	int len = 12 + name_len + 4;
+	if (mix->count == mix->max) {
+		mix->max = mix->max ? mix->max * 2 : 1024;
+		mix->at = (int *)realloc(mix->at, mix->max * sizeof(int));
+		mix->len = (int *)realloc(mix->len, mix->max * sizeof(int));
+	}
+	if (mix->pool_len + len > mix->pool_max) {
+		mix->pool_max = mix->pool_max ? mix->pool_max * 2 : 65536;
+		mix->pool = (unsigned char *)realloc(mix->pool, mix->pool_max);
+	}
+	if (mix->at == NULL || mix->len == NULL || mix->pool == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	unsigned char *msg = mix->pool + mix->pool_len;
+	memset(msg, 0, 12);
+	msg[2] = 0x01;		// RD
+	msg[5] = 1;
+	memcpy(msg + 12, name, name_len);
+	msg[12 + name_len] = type >> 8;
+	msg[13 + name_len] = type & 0xff;
+	msg[14 + name_len] = 0;
+	msg[15 + name_len] = 1;
+	mix->at[mix->count] = mix->pool_len;
+	mix->len[mix->count] = len;
+	mix->count++;
+	mix->pool_len += len;
+	return 0;
+}
+
+int build_query(perf_mix *mix, long seq, int nx_percent, unsigned char *msg) {
+	/*
+	 * The query to send next: the mix in order, over and over, with
+	 * nx_percent of them asking for a random name below the mix's name
+	 * instead.  Its ID is the low 16 bits of its sequence number.  With
+	 * edns_payload set an OPT record goes on the end.
+	 *
+	 * OUTPUT: the length of the query
+	 */
+	int k = seq % mix->count;
+	unsigned char *query = mix->pool + mix->at[k];
+	int len = mix->len[k];
+	if (nx_percent > 0 && rand() % 100 < nx_percent && len + 9 <= 12 + NAME_WIRE_MAX + 4) {
+		memcpy(msg, query, 12);
+		msg[12] = 8;
+		snprintf((char *)msg + 13, 9, "%08x", (unsigned int)rand());
+		memcpy(msg + 21, query + 12, len - 12);
+		len += 9;
+	} else {
+		memcpy(msg, query, len);
+	}
+	msg[0] = (seq >> 8) & 0xff;
+	msg[1] = seq & 0xff;
+	if (edns_payload > 0) {
+		// root owner, type OPT (41), the payload as its class, TTL 0
+		unsigned char opt[PERF_OPT_LEN] = {0, 0, 41, edns_payload >> 8, edns_payload & 0xff, 0, 0, 0, 0, 0, 0};
+		memcpy(msg + len, opt, PERF_OPT_LEN);
+		msg[11] = 1;
+		len += PERF_OPT_LEN;
+	}
+	return len;
+}
+
+int send_query(unsigned char *msg, int len, long seq) {
+	/*
+	 * Send a query over UDP, or queue it on one of the TCP connections
+	 * (taking turns) with its length in front.
+	 *
+	 * OUTPUT: 0, or -1 if it can't go now (the socket buffer or the
+	 *         connection's queue is full)
+	 */
+	if (!use_tcp) {
+		if (send(conns[0].fd, msg, len, 0) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				return -1;
+			}
+			if (errno == ECONNREFUSED) {
+				// an earlier query found nothing listening; this one
+				// may still get there, or it times out
+				return 0;
+			}
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+	perf_conn *conn = &conns[seq % num_conns];
+	if (conn->out_len + len + 2 > PERF_OUT_MAX) {
+		return -1;
+	}
+	conn->out[conn->out_len] = len >> 8;
+	conn->out[conn->out_len + 1] = len & 0xff;
+	memcpy(conn->out + conn->out_len + 2, msg, len);
+	conn->out_len += len + 2;
+	int n = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+	if (n > 0) {
+		memmove(conn->out, conn->out + n, conn->out_len - n);
+		conn->out_len -= n;
+	}
+	return 0;
+}
+
+void read_udp() {
+	// take every response waiting on the UDP socket
+	unsigned char msg[PERF_MSG_MAX];
+	while (1) {
+		int n = recv(conns[0].fd, msg, sizeof(msg), 0);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED) {
+				perror("recv");
+				exit(EXIT_FAILURE);
+			}
+			if (errno != EINTR && errno != ECONNREFUSED) {
+				return;
+			}
+			continue;
+		}
+		handle_response(msg, n, seconds());
+	}
+}
+
+int read_tcp(perf_conn *conn) {
+	/*
+	 * Send what is queued on a TCP connection and take every complete
+	 * response that has come in.
+	 *
+	 * OUTPUT: 0, or -1 if the connection has been closed
+	 */
+	if (conn->out_len > 0) {
+		int n = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+		if (n > 0) {
+			memmove(conn->out, conn->out + n, conn->out_len - n);
+			conn->out_len -= n;
+		} else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			return -1;
+		}
+	}
+	while (1) {
+		int n = recv(conn->fd, conn->in + conn->in_len, PERF_IN_MAX - conn->in_len, 0);
+		if (n == 0) {
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		conn->in_len += n;
+		double now = seconds();
+		int pos = 0;
+		while (conn->in_len - pos >= 2) {
+			int len = (conn->in[pos] << 8) | conn->in[pos + 1];
+			if (conn->in_len - pos < len + 2) {
+				break;
+			}
+			handle_response(conn->in + pos + 2, len, now);
+			pos += len + 2;
+		}
+		memmove(conn->in, conn->in + pos, conn->in_len - pos);
+		conn->in_len -= pos;
+		if (conn->in_len == PERF_IN_MAX) {
+			// a response longer than the buffer: nothing more can be read
+			return -1;
+		}
+	}
+}
+
+void handle_response(unsigned char *msg, int len, double now) {
+	// match a response to its query by ID and record its latency
+	if (len < 12 || !(msg[2] & 0x80)) {
+		return;
+	}
+	perf_slot *slot = &slots[(msg[0] << 8) | msg[1]];
+	if (!slot->pending) {
+		late++;
+		return;
+	}
+	slot->pending = 0;
+	outstanding--;
+	answered++;
+	rcodes[msg[3] & 0x0f]++;
+	if (msg[2] & 0x02) {
+		truncated++;
+	}
+	if (num_latencies == max_latencies) {
+		max_latencies = max_latencies ? max_latencies * 2 : 65536;
+		latencies = (float *)realloc(latencies, max_latencies * sizeof(float));
+		if (latencies == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	latencies[num_latencies++] = (now - slot->sent_at) * 1000;
+	last_answer = now;
+}
+
+void expire(double now, double timeout) {
+	// count the queries not answered within the timeout as lost, oldest
+	// first, so their IDs can be used again
+	while (oldest < next_seq) {
+		perf_slot *slot = &slots[oldest % PERF_IDS];
+		if (slot->pending) {
+			if (now - slot->sent_at < timeout) {
+				break;
+			}
+			slot->pending = 0;
+			outstanding--;
+			lost++;
+		}
+		oldest++;
+	}
+}
+
+int open_conn(perf_conn *conn) {
+	// a non-blocking socket connected to the server, UDP or TCP
+	conn->in_len = 0;
+	conn->out_len = 0;
+	conn->fd = socket(AF_INET, use_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (conn->fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(conn->fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		perror("connect");
+		return -1;
+	}
+	if (use_tcp) {
+		int one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	} else {
+		int size = 4 * 1024 * 1024;
+		setsockopt(conn->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+void report(double elapsed, double qps) {
+	char target[64];
+	if (qps > 0) {
+		snprintf(target, sizeof(target), "target %.0f qps", qps);
+	} else {
+		strcpy(target, "as fast as answered");
+	}
+	printf("%ld queries sent over %s to %s:%d in %.2f s (%s)\n", next_seq, use_tcp ? "TCP" : "UDP",
+			inet_ntoa(server.sin_addr), ntohs(server.sin_port), elapsed, target);
+	if (next_seq == 0) {
+		return;
+	}
+	printf("  %ld answered (%.2f%%), %ld lost (%.2f%%), %ld late", answered, 100.0 * answered / next_seq,
+			lost, 100.0 * lost / next_seq, late);
+	if (use_tcp) {
+		printf(", %ld connections closed by the server", closed);
+	}
+	printf("\n  achieved %.0f qps\n", elapsed > 0 ? answered / elapsed : 0.0);
+	printf("  response codes: NOERROR %ld, FORMERR %ld, SERVFAIL %ld, NXDOMAIN %ld, other %ld; %ld truncated\n",
+			rcodes[0], rcodes[1], rcodes[2], rcodes[3],
+			answered - rcodes[0] - rcodes[1] - rcodes[2] - rcodes[3], truncated);
+	if (num_latencies == 0) {
+		return;
+	}
+	qsort(latencies, num_latencies, sizeof(float), compare_float);
+	double sum = 0;
+	long i;
+	for (i = 0; i < num_latencies; i++) {
+		sum += latencies[i];
+	}
+	printf("  latency ms: avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+			sum / num_latencies, latencies[num_latencies * 50 / 100], latencies[num_latencies * 90 / 100],
+			latencies[num_latencies * 99 / 100], latencies[num_latencies * 999 / 1000],
+			latencies[num_latencies - 1]);
+}
+
+int compare_float(const void *a, const void *b) {
+	float x = *(const float *)a;
+	float y = *(const float *)b;
+	return x < y ? -1 : x > y;
+}
+
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
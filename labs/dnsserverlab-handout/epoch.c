@@ -0,0 +1,82 @@
+#include<stdio.h>
+#include<unistd.h>
+
+#include "epoch.h"
+
+#define EPOCH_WAIT_USEC		1000	// how long the writer sleeps between checks
+
+void epoch_init(epoch_ptr *ptr, void *data) {
+	int i;
+	atomic_store(&ptr->current, data);
+	atomic_store(&ptr->epoch, 1);
+	atomic_store(&ptr->num_readers, 0);
+	for (i = 0; i < EPOCH_MAX_READERS; i++) {
+		atomic_store(&ptr->readers[i], EPOCH_IDLE);
+	}
+}
+
+int epoch_register(epoch_ptr *ptr) {
+	/*
+	 * Give a thread its reader slot.  Call once per thread.
+	 *
+	 * OUTPUT: the reader number, or -1 if there are too many readers
+	 */
+	int reader = atomic_fetch_add(&ptr->num_readers, 1);
+	if (reader >= EPOCH_MAX_READERS) {
+		fprintf(stderr, "epoch: too many reader threads\n");
+		return -1;
+	}
+	return reader;
+}
+
+void *epoch_enter(epoch_ptr *ptr, int reader) {
+	/*
+	 * Start using the data.  The pointer returned stays valid until
+	 * epoch_exit() is called; don't hold it across anything that blocks,
+	 * or a writer waits for as long.
+	 *
+	 * INPUT:  ptr: the shared pointer
+	 * INPUT:  reader: the thread's reader number
+	 * OUTPUT: the current data
+	 */
+	// announce the epoch before looking at the pointer (both seq_cst) so a
+	// writer that swaps after this sees us and waits
+	atomic_store(&ptr->readers[reader], atomic_load(&ptr->epoch));
+	return atomic_load(&ptr->current);
+}
+
+void epoch_exit(epoch_ptr *ptr, int reader) {
+	atomic_store(&ptr->readers[reader], EPOCH_IDLE);
+}
+
+void *epoch_current(epoch_ptr *ptr) {
+	// for code that runs while nothing can be published
+	return atomic_load(&ptr->current);
+}
+
+void *epoch_publish(epoch_ptr *ptr, void *data) {
+	/*
+	 * Make data the current version and wait until no reader can still
+	 * be using the previous one.  Readers keep running the whole time,
+	 * only the calling thread waits.  Only one thread may publish.
+	 *
+	 * INPUT:  ptr: the shared pointer
+	 * INPUT:  data: the new version
+	 * OUTPUT: the previous version, which the caller can now free
+	 */
+	void *old = atomic_exchange(&ptr->current, data);
+	unsigned long epoch = atomic_fetch_add(&ptr->epoch, 1) + 1;
+	int num_readers = atomic_load(&ptr->num_readers);
+	int i;
+	if (num_readers > EPOCH_MAX_READERS) {
+		num_readers = EPOCH_MAX_READERS;
+	}
+	for (i = 0; i < num_readers; i++) {
+		// a reader that entered before the swap may hold the old version
+		unsigned long seen;
+		while ((seen = atomic_load(&ptr->readers[i])) != EPOCH_IDLE && seen < epoch) {
+			usleep(EPOCH_WAIT_USEC);
+		}
+	}
+	return old;
+}
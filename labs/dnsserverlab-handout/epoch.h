@@ -0,0 +1,33 @@
+/*
+ * Epoch-based publishing of shared data - CS 360
+ * One pointer (the server's record db) is read by every server thread
+ * and replaced, now and then, by another thread.  Readers never lock:
+ * they note the current epoch while they hold the pointer, and the
+ * writer frees an old version only once every reader that could have
+ * seen it has moved on.
+ *
+*/
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdatomic.h>
+
+#define EPOCH_MAX_READERS	256
+#define EPOCH_IDLE			0		// reader holds nothing
+
+typedef struct {
+	_Atomic(void *) current;
+	atomic_ulong epoch;
+	atomic_int num_readers;
+	atomic_ulong readers[EPOCH_MAX_READERS];	// epoch each reader entered in
+} epoch_ptr;
+
+void epoch_init(epoch_ptr *ptr, void *data);
+int epoch_register(epoch_ptr *ptr);
+void *epoch_enter(epoch_ptr *ptr, int reader);
+void epoch_exit(epoch_ptr *ptr, int reader);
+void *epoch_current(epoch_ptr *ptr);
+void *epoch_publish(epoch_ptr *ptr, void *data);
+
+#endif /* EPOCH_H */
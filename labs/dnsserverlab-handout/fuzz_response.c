@@ -0,0 +1,90 @@
+/*
+ * libFuzzer target for the DNS server's get_response() - CS 360
+ * Each input is a query, handed to get_response() the way the UDP and
+ * TCP servers hand it one: 12 to BUFFER_MAX bytes, here in a buffer of
+ * exactly that size so AddressSanitizer catches a read past the end.
+ * Queries are answered from a db loaded once (db.txt, or the file named
+ * by DNS_FUZZ_DB), each twice over UDP so the answer cache is fuzzed as
+ * well and once over TCP.  A response longer than the transport allows
+ * (512 bytes over UDP unless the query has an OPT record) or with the
+ * wrong ID aborts.
+ *
+ * server.c is built with its main() renamed (-Dmain=server_main).
+ *
+ * Usage: fuzz_response [libFuzzer options] [corpus dir]
+ *        fuzz_replay <query file>...   (the gcc build, for replaying
+ *                                       crashes without clang)
+ *
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+
+#include "dns.h"
+#include "answer_cache.h"
+
+#define FUZZ_DB		"db.txt"
+
+// server.c
+extern char *cachedb_file;
+extern int load_threads;
+extern __thread answer_cache *thread_answers;
+void init_db();
+int get_response(unsigned char *request, int len, unsigned char *response, int tcp);
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+	// libFuzzer's options are its own
+	(void)argc;
+	(void)argv;
+	cachedb_file = getenv("DNS_FUZZ_DB") != NULL ? getenv("DNS_FUZZ_DB") : FUZZ_DB;
+	load_threads = 1;
+	init_db();
+	thread_answers = answer_cache_new();
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (size < 12 || size > BUFFER_MAX) {
+		// the servers never pass these on
+		return 0;
+	}
+	unsigned char *request = (unsigned char *)malloc(size);
+	unsigned char *response = (unsigned char *)malloc(TCP_MSG_MAX);
+	memcpy(request, data, size);
+	int pass;
+	for (pass = 0; pass < 3; pass++) {
+		int tcp = pass == 2;
+		int len = get_response(request, size, response, tcp);
+		int max = tcp ? TCP_MSG_MAX : (request[10] == 0 && request[11] == 0) ? 512 : UDP_MSG_MAX;
+		if (len < 12 || len > max || memcmp(response, request, 2) != 0) {
+			abort();
+		}
+	}
+	free(request);
+	free(response);
+	return 0;
+}
+
+#ifdef FUZZ_REPLAY
+#undef main
+int main(int argc, char *argv[]) {
+	// run the target on each file named
+	static uint8_t data[65536];
+	int i;
+	LLVMFuzzerInitialize(&argc, &argv);
+	for (i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			continue;
+		}
+		size_t size = fread(data, 1, sizeof(data), f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(data, size);
+		printf("%s: %zu bytes, ok\n", argv[i], size);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,119 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+
+#include "name_compress.h"
+
+static int same_name(unsigned char *msg, int at, unsigned char *name);
+static unsigned char lower(unsigned char c);
+
+void compress_init(compress_table *table) {
+	table->count = 0;
+}
+
+void compress_add(compress_table *table, unsigned char *msg, int at) {
+	/*
+	 * Remember every suffix of a name that was written uncompressed at
+	 * msg + at (for instance the question name), up to the first pointer.
+	 *
+	 * INPUT:  table: the message's suffix table
+	 * INPUT:  msg: the start of the message
+	 * INPUT:  at: where the name starts in the message
+	 */
+	while (msg[at] != 0 && !IS_POINTER(msg[at])) {
+		if (table->count == COMPRESS_MAX || at > COMPRESS_OFFSET_MAX) {
+			return;
+		}
+		table->at[table->count++] = at;
+		at += msg[at] + 1;
+	}
+}
+
+int compress_name(compress_table *table, unsigned char *msg, int at,
+		unsigned char *name, int room) {
+	/*
+	 * Write a name at msg + at, replacing its longest suffix that is
+	 * already in the message with a pointer, and remember the suffixes
+	 * that were written out in full.
+	 *
+	 * INPUT:  table: the message's suffix table
+	 * INPUT:  msg: the start of the message
+	 * INPUT:  at: where to write the name
+	 * INPUT:  name: the name in uncompressed wire format
+	 * INPUT:  room: how many bytes are free at msg + at
+	 * OUTPUT: the number of bytes written, or -1 if it doesn't fit
+	 */
+	unsigned short added[COMPRESS_MAX];
+	int num_added = 0;
+	int len = 0;
+	int i;
+	while (*name != 0) {
+		for (i = 0; i < table->count; i++) {
+			if (same_name(msg, table->at[i], name)) {
+				break;
+			}
+		}
+		if (i < table->count) {
+			if (len + 2 > room) {
+				return -1;
+			}
+			unsigned short pointer = COMPRESS_POINTER | table->at[i];
+			msg[at + len] = pointer >> 8;
+			msg[at + len + 1] = pointer & 0xff;
+			len += 2;
+			break;
+		}
+		// no earlier copy of this suffix, write the label
+		if (len + *name + 1 > room) {
+			return -1;
+		}
+		if (num_added < COMPRESS_MAX && at + len <= COMPRESS_OFFSET_MAX) {
+			added[num_added++] = at + len;
+		}
+		memcpy(msg + at + len, name, *name + 1);
+		len += *name + 1;
+		name += *name + 1;
+	}
+	if (*name == 0) {
+		if (len + 1 > room) {
+			return -1;
+		}
+		msg[at + len++] = 0;
+	}
+	// only now is the name complete in the message, so it can be matched
+	for (i = 0; i < num_added && table->count < COMPRESS_MAX; i++) {
+		table->at[table->count++] = added[i];
+	}
+	return len;
+}
+
+static int same_name(unsigned char *msg, int at, unsigned char *name) {
+	/*
+	 * Compare the (possibly compressed) name at msg + at with an
+	 * uncompressed name, ignoring case.  Only pointers this server wrote
+	 * are followed, and those always point backwards.
+	 */
+	while (1) {
+		while (IS_POINTER(msg[at])) {
+			at = ((msg[at] & 0x3f) << 8) | msg[at + 1];
+		}
+		if (msg[at] != *name) {
+			return 0;
+		}
+		if (*name == 0) {
+			return 1;
+		}
+		int i;
+		for (i = 1; i <= *name; i++) {
+			if (lower(msg[at + i]) != lower(name[i])) {
+				return 0;
+			}
+		}
+		at += *name + 1;
+		name += *name + 1;
+	}
+}
+
+static unsigned char lower(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
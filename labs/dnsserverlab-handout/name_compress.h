@@ -0,0 +1,28 @@
+/*
+ * DNS name compression for responses - CS 360
+ * Remembers where names were written in the message being built so
+ * later names can end in a pointer (RFC 1035 4.1.4) to a suffix that
+ * is already there instead of repeating it.
+ *
+*/
+
+#ifndef NAME_COMPRESS_H
+#define NAME_COMPRESS_H
+
+#include "dns.h"
+
+#define COMPRESS_MAX		64			// suffixes remembered per message
+#define COMPRESS_OFFSET_MAX	0x3fff		// pointers only reach the first 16K
+#define COMPRESS_POINTER	0xc000
+
+typedef struct {
+	int count;
+	unsigned short at[COMPRESS_MAX];	// message offsets where a suffix starts
+} compress_table;
+
+void compress_init(compress_table *table);
+void compress_add(compress_table *table, unsigned char *msg, int at);
+int compress_name(compress_table *table, unsigned char *msg, int at,
+		unsigned char *name, int room);
+
+#endif /* NAME_COMPRESS_H */
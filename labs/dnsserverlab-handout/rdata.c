@@ -0,0 +1,258 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<strings.h>
+#include<arpa/inet.h>
+
+#include "rdata.h"
+#include "db_store.h"
+
+static int txt_from_text(char *text, unsigned char *rdata);
+
+dns_rr_type rr_type_from_text(char *text) {
+	/*
+	 * The type number for a type mnemonic from the db file ("A", "MX",
+	 * ...), or 0 if the type isn't supported.
+	 */
+	if (strcasecmp(text, "A") == 0) {
+		return TYPE_A;
+	} else if (strcasecmp(text, "NS") == 0) {
+		return TYPE_NS;
+	} else if (strcasecmp(text, "CNAME") == 0) {
+		return CNAME;
+	} else if (strcasecmp(text, "SOA") == 0) {
+		return TYPE_SOA;
+	} else if (strcasecmp(text, "MX") == 0) {
+		return TYPE_MX;
+	} else if (strcasecmp(text, "TXT") == 0) {
+		return TYPE_TXT;
+	} else if (strcasecmp(text, "AAAA") == 0) {
+		return TYPE_AAAA;
+	}
+	return 0;
+}
+
+int rdata_from_text(dns_rr_type type, char *text, unsigned char *rdata) {
+	/*
+	 * Convert the rdata column of a db file line to wire format.
+	 *
+	 *   A      192.0.2.1
+	 *   AAAA   2001:db8::1
+	 *   NS     ns1.example.com
+	 *   CNAME  www.example.com
+	 *   MX     10 mail.example.com
+	 *   SOA    ns1.example.com admin.example.com serial refresh retry expire minimum
+	 *   TXT    "one string" "another string" or bare words
+	 *
+	 * INPUT:  type: the record type
+	 * INPUT:  text: the rdata column (the rest of the line)
+	 * INPUT:  rdata: where to write the wire-format rdata (RDATA_MAX bytes)
+	 * OUTPUT: the length of the rdata, or -1 if the text isn't valid
+	 */
+	char name1[RDATA_MAX];
+	char name2[RDATA_MAX];
+	unsigned int numbers[5];
+	unsigned short preference;
+	int len, len2, i;
+	switch (type) {
+		case TYPE_A:
+			return inet_pton(AF_INET, text, rdata) == 1 ? 4 : -1;
+		case TYPE_AAAA:
+			return inet_pton(AF_INET6, text, rdata) == 1 ? 16 : -1;
+		case TYPE_NS:
+		case CNAME:
+			if (sscanf(text, "%s", name1) != 1) {
+				return -1;
+			}
+			return name_from_text(name1, rdata);
+		case TYPE_MX:
+			if (sscanf(text, "%hu %s", &preference, name1) != 2) {
+				return -1;
+			}
+			rdata[0] = preference >> 8;
+			rdata[1] = preference & 0xff;
+			len = name_from_text(name1, rdata + 2);
+			return len < 0 ? -1 : len + 2;
+		case TYPE_SOA:
+			if (sscanf(text, "%s %s %u %u %u %u %u", name1, name2, &numbers[0],
+					&numbers[1], &numbers[2], &numbers[3], &numbers[4]) != 7) {
+				return -1;
+			}
+			len = name_from_text(name1, rdata);
+			if (len < 0) {
+				return -1;
+			}
+			len2 = name_from_text(name2, rdata + len);
+			if (len2 < 0) {
+				return -1;
+			}
+			len += len2;
+			for (i = 0; i < 5; i++) {
+				rdata[len++] = (numbers[i] >> 24) & 0xff;
+				rdata[len++] = (numbers[i] >> 16) & 0xff;
+				rdata[len++] = (numbers[i] >> 8) & 0xff;
+				rdata[len++] = numbers[i] & 0xff;
+			}
+			return len;
+		case TYPE_TXT:
+			return txt_from_text(text, rdata);
+	}
+	return -1;
+}
+
+int rdata_to_wire(dns_rr_type type, unsigned char *rdata, int rdata_len,
+		unsigned char *msg, int at, int room, compress_table *names) {
+	/*
+	 * Write stored rdata into a message.  Names in NS, CNAME, MX and SOA
+	 * rdata are compressed when a suffix table is given (RFC 3597 allows
+	 * it for these types only); everything else is copied as is.
+	 *
+	 * INPUT:  type: the record type
+	 * INPUT:  rdata, rdata_len: the stored (uncompressed) rdata
+	 * INPUT:  msg: the start of the message being built
+	 * INPUT:  at: where in the message to write the rdata
+	 * INPUT:  room: how many bytes are free at msg + at
+	 * INPUT:  names: the message's suffix table, or NULL to not compress
+	 * OUTPUT: the number of bytes written, or -1 if it doesn't fit
+	 */
+	int len = 0;
+	int n;
+	if (names == NULL || (type != TYPE_NS && type != CNAME && type != TYPE_MX
+			&& type != TYPE_SOA)) {
+		if (rdata_len > room) {
+			return -1;
+		}
+		memcpy(msg + at, rdata, rdata_len);
+		return rdata_len;
+	}
+	if (type == TYPE_MX) {
+		if (room < 2) {
+			return -1;
+		}
+		memcpy(msg + at, rdata, 2);
+		len = 2;
+	}
+	n = compress_name(names, msg, at + len, rdata + len, room - len);
+	if (n < 0) {
+		return -1;
+	}
+	if (type != TYPE_SOA) {
+		return len + n;
+	}
+	// the mailbox name, then the five numbers
+	int mname_len = wire_name_len(rdata);
+	len += n;
+	n = compress_name(names, msg, at + len, rdata + mname_len, room - len);
+	if (n < 0 || len + n + SOA_NUMBERS > room) {
+		return -1;
+	}
+	len += n;
+	memcpy(msg + at + len, rdata + rdata_len - SOA_NUMBERS, SOA_NUMBERS);
+	return len + SOA_NUMBERS;
+}
+
+unsigned char *rdata_target(dns_rr_type type, unsigned char *rdata) {
+	/*
+	 * The host name in NS and MX rdata, whose addresses go in the
+	 * additional section, or NULL for other types.
+	 */
+	if (type == TYPE_NS) {
+		return rdata;
+	}
+	if (type == TYPE_MX) {
+		return rdata + 2;
+	}
+	return NULL;
+}
+
+int name_from_text(char *text, unsigned char *wire) {
+	/*
+	 * Convert a dotted name to wire format, checking that it is a legal
+	 * DNS name (labels of 1 to 63 bytes, 255 bytes in all).  A trailing
+	 * dot is allowed and "." is the root.
+	 *
+	 * INPUT:  text: the name
+	 * INPUT:  wire: where to write the name (NAME_WIRE_MAX bytes)
+	 * OUTPUT: the length of the wire-format name, or -1 if it isn't legal
+	 */
+	return name_from_chars(text, strlen(text), wire);
+}
+
+int name_from_chars(const char *text, int text_len, unsigned char *wire) {
+	// name_from_text() for a name that isn't NUL-terminated
+	const char *end = text + text_len;
+	int len = 0;
+	if (text_len == 1 && text[0] == '.') {
+		wire[0] = 0;
+		return 1;
+	}
+	while (text < end) {
+		const char *dot = memchr(text, '.', end - text);
+		int label = dot == NULL ? (int)(end - text) : (int)(dot - text);
+		if (label == 0 || label > 63 || len + label + 2 > NAME_WIRE_MAX) {
+			return -1;
+		}
+		wire[len++] = label;
+		memcpy(wire + len, text, label);
+		len += label;
+		text += label;
+		if (text < end) {
+			// skip the dot
+			text++;
+		}
+	}
+	wire[len++] = 0;
+	return len;
+}
+
+static int txt_from_text(char *text, unsigned char *rdata) {
+	/*
+	 * TXT rdata is a run of length-prefixed strings.  Each string in the
+	 * text is either in double quotes (\" and \\ are escapes) or a bare
+	 * word.
+	 */
+	int len = 0;
+	while (1) {
+		while (*text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') {
+			text++;
+		}
+		if (*text == '\0') {
+			break;
+		}
+		if (len >= RDATA_MAX) {
+			return -1;
+		}
+		int start = len++;
+		if (*text == '"') {
+			text++;
+			while (*text != '"') {
+				if (*text == '\0') {
+					// no closing quote
+					return -1;
+				}
+				if (*text == '\\' && text[1] != '\0') {
+					text++;
+				}
+				if (len - start > TXT_STRING_MAX || len >= RDATA_MAX) {
+					return -1;
+				}
+				rdata[len++] = *text++;
+			}
+			text++;
+		} else {
+			while (*text != '\0' && *text != ' ' && *text != '\t'
+					&& *text != '\r' && *text != '\n') {
+				if (len - start > TXT_STRING_MAX || len >= RDATA_MAX) {
+					return -1;
+				}
+				rdata[len++] = *text++;
+			}
+		}
+		rdata[start] = len - start - 1;
+	}
+	// a TXT record holds at least one (maybe empty) string
+	if (len == 0) {
+		return -1;
+	}
+	return len;
+}
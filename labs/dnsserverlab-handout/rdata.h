@@ -0,0 +1,29 @@
+/*
+ * Record data for the DNS server's record types - CS 360
+ * Turns the rdata column of the cache database file into wire format
+ * once, when the file is loaded, and writes it into responses with
+ * the names inside it compressed.
+ *
+ * Types: A, NS, CNAME, SOA, MX, TXT, AAAA.
+ *
+*/
+
+#ifndef RDATA_H
+#define RDATA_H
+
+#include "dns.h"
+#include "name_compress.h"
+
+#define RDATA_MAX			BUFFER_MAX	// longest rdata read from the file
+#define TXT_STRING_MAX		255			// longest single TXT string
+#define SOA_NUMBERS			20			// serial, refresh, retry, expire, minimum
+
+dns_rr_type rr_type_from_text(char *text);
+int rdata_from_text(dns_rr_type type, char *text, unsigned char *rdata);
+int rdata_to_wire(dns_rr_type type, unsigned char *rdata, int rdata_len,
+		unsigned char *msg, int at, int room, compress_table *names);
+unsigned char *rdata_target(dns_rr_type type, unsigned char *rdata);
+int name_from_text(char *text, unsigned char *wire);
+int name_from_chars(const char *text, int text_len, unsigned char *wire);
+
+#endif /* RDATA_H */
@@ -0,0 +1,184 @@
+#include<stdio.h>
+#include<string.h>
+#include<netinet/in.h>
+
+#include "rrl.h"
+#include "dns_msg.h"
+
+// a bucket's word: tag (24 bits), time (16), balance + 32768 (16), drops (8)
+#define BUCKET(tag, t, balance, drops) \
+	(((unsigned long long)(tag) << 40) | ((unsigned long long)((t) & 0xffff) << 24) \
+	| ((unsigned long long)((balance) + 32768) << 8) | ((drops) & 0xff))
+#define BUCKET_TAG(w)		((unsigned int)((w) >> 40))
+#define BUCKET_TIME(w)		((int)(((w) >> 24) & 0xffff))
+#define BUCKET_BALANCE(w)	((int)(((w) >> 8) & 0xffff) - 32768)
+#define BUCKET_DROPS(w)		((int)((w) & 0xff))
+
+// kinds of response, each counted apart
+#define KIND_ANSWER		1
+#define KIND_EMPTY		2		// NODATA or a referral
+#define KIND_NXDOMAIN	3
+#define KIND_ERROR		4
+
+static unsigned int hash_key(struct sockaddr_storage *client, unsigned char *response, int len);
+
+void rrl_init(rrl *r, int rate, int slip) {
+	/*
+	 * Set up a rate limiter with every bucket empty.
+	 *
+	 * INPUT:  r: the rate limiter
+	 * INPUT:  rate: responses a second allowed per bucket (at most
+	 *         RRL_RATE_MAX), 0 for no limit
+	 * INPUT:  slip: every slip-th response over the limit is sent
+	 *         truncated instead of dropped, 0 for none
+	 */
+	int i;
+	r->rate = rate < RRL_RATE_MAX ? rate : RRL_RATE_MAX;
+	r->slip = slip;
+	for (i = 0; i < RRL_BUCKETS; i++) {
+		atomic_init(&r->buckets[i], 0);
+	}
+	memset(r->counters, 0, sizeof(r->counters));
+}
+
+int rrl_check(rrl *r, int thread, struct sockaddr_storage *client, unsigned char *response,
+		int len, time_t now) {
+	/*
+	 * Count a response against its bucket.  A bucket that hasn't been
+	 * used for RRL_WINDOW seconds (or that another key had) starts full,
+	 * with a second's worth of responses; otherwise it gets rate tokens
+	 * for each second since it was last used, up to that much again.
+	 * Each response takes one.  An empty bucket goes into debt, up to
+	 * RRL_WINDOW seconds' worth, so a client that keeps flooding stays
+	 * limited until it stops.
+	 *
+	 * INPUT:  r: the rate limiter
+	 * INPUT:  thread: the calling thread's number, for its counters
+	 * INPUT:  client: where the query came from
+	 * INPUT:  response, len: the response built for it
+	 * INPUT:  now: the current time
+	 * OUTPUT: RRL_SEND, RRL_DROP, or RRL_SLIP_TC to send it truncated
+	 *         (see rrl_slip())
+	 */
+	rrl_counters *c = &r->counters[thread & (RRL_THREADS - 1)];
+	c->responses++;
+	if (r->rate == 0) {
+		return RRL_SEND;
+	}
+	unsigned int hash = hash_key(client, response, len);
+	unsigned int tag = hash >> 8;
+	atomic_ullong *bucket = &r->buckets[hash & (RRL_BUCKETS - 1)];
+	int debt = r->rate * RRL_WINDOW < 32767 ? r->rate * RRL_WINDOW : 32767;
+	unsigned long long old = atomic_load_explicit(bucket, memory_order_relaxed);
+	unsigned long long new;
+	int action;
+	do {
+		int age = ((int)now - BUCKET_TIME(old)) & 0xffff;
+		int balance = r->rate;
+		int drops = 0;
+		if (old != 0 && BUCKET_TAG(old) == tag && age < RRL_WINDOW) {
+			balance = BUCKET_BALANCE(old) + age * r->rate;
+			if (balance > r->rate) {
+				balance = r->rate;
+			}
+			drops = BUCKET_DROPS(old);
+		}
+		if (balance > -debt) {
+			balance--;
+		}
+		action = RRL_SEND;
+		if (balance < 0) {
+			drops++;
+			action = r->slip > 0 && drops % r->slip == 0 ? RRL_SLIP_TC : RRL_DROP;
+		}
+		new = BUCKET(tag, now, balance, drops);
+	} while (!atomic_compare_exchange_weak_explicit(bucket, &old, new,
+			memory_order_relaxed, memory_order_relaxed));
+	if (action == RRL_DROP) {
+		c->dropped++;
+	} else if (action == RRL_SLIP_TC) {
+		c->slipped++;
+	}
+	return action;
+}
+
+int rrl_slip(unsigned char *response, int len) {
+	/*
+	 * Cut a response down to its header and question, with TC set, so
+	 * the client asks again over TCP.
+	 *
+	 * OUTPUT: the new length of the response
+	 */
+	int at = DNS_HEADER_LEN;
+	if (len <= DNS_HEADER_LEN || response[4] != 0 || response[5] != 1) {
+		response[2] |= 0x02;
+		return len < DNS_HEADER_LEN ? len : DNS_HEADER_LEN;
+	}
+	while (at < len && response[at] != 0) {
+		at += response[at] + 1;
+	}
+	// the zero label, type and class
+	at += 5;
+	if (at > len) {
+		at = DNS_HEADER_LEN;
+		response[5] = 0;
+	}
+	response[2] |= 0x02;
+	memset(response + 6, 0, 6);
+	return at;
+}
+
+void rrl_print_stats(rrl *r, FILE *out) {
+	unsigned long responses = 0, dropped = 0, slipped = 0;
+	int i;
+	for (i = 0; i < RRL_THREADS; i++) {
+		responses += r->counters[i].responses;
+		dropped += r->counters[i].dropped;
+		slipped += r->counters[i].slipped;
+	}
+	fprintf(out, "RRL: %lu UDP responses, %lu limited: %lu dropped, %lu slipped (rate %d/s, slip %d)\n",
+			responses, dropped + slipped, dropped, slipped, r->rate, r->slip);
+	fflush(out);
+}
+
+static unsigned int hash_key(struct sockaddr_storage *client, unsigned char *response, int len) {
+	/*
+	 * 32-bit FNV-1a over a response's bucket key: the client's netblock
+	 * (the same for an IPv4 client whether or not it arrives v4-mapped),
+	 * the kind of response and (for answers and empty answers) the
+	 * question name, lower-cased.
+	 */
+	unsigned int hash = 2166136261u;
+	unsigned char *block;
+	int block_len, i, kind;
+	if (client->ss_family == AF_INET6) {
+		struct in6_addr *addr = &((struct sockaddr_in6 *)client)->sin6_addr;
+		// a socket bound to :: gets IPv4 clients as ::ffff:a.b.c.d,
+		// whose /24 is in the last four bytes
+		block = IN6_IS_ADDR_V4MAPPED(addr) ? addr->s6_addr + 12 : addr->s6_addr;
+		block_len = IN6_IS_ADDR_V4MAPPED(addr) ? 3 : 7;
+	} else {
+		block = (unsigned char *)&((struct sockaddr_in *)client)->sin_addr.s_addr;
+		block_len = 3;
+	}
+	for (i = 0; i < block_len; i++) {
+		hash = (hash ^ block[i]) * 16777619u;
+	}
+	int rcode = len >= DNS_HEADER_LEN ? response[3] & 0x0f : 2;
+	int answers = len >= DNS_HEADER_LEN ? (response[6] << 8) | response[7] : 0;
+	if (rcode == 3) {
+		kind = KIND_NXDOMAIN;
+	} else if (rcode != 0) {
+		kind = KIND_ERROR;
+	} else {
+		kind = answers > 0 ? KIND_ANSWER : KIND_EMPTY;
+	}
+	hash = (hash ^ kind) * 16777619u;
+	if (kind == KIND_ANSWER || kind == KIND_EMPTY) {
+		for (i = DNS_HEADER_LEN; i < len && response[i] != 0; i++) {
+			unsigned char b = response[i];
+			hash = (hash ^ (b >= 'A' && b <= 'Z' ? b + 32 : b)) * 16777619u;
+		}
+	}
+	return hash;
+}
@@ -0,0 +1,63 @@
+/*
+ * Response rate limiting for the DNS server's UDP answers - CS 360
+ * A UDP server answers whoever a query claims to come from, so it can
+ * be used to flood a victim with answers bigger than the queries, and
+ * a flood of queries can take all its time.  Responses are counted
+ * the way BIND's RRL does: per client netblock (/24, or /56 for IPv6),
+ * kind of response and name, against a token bucket that refills at
+ * a fixed rate.  Once a bucket is empty its responses are dropped,
+ * except that every slip-th one goes out truncated (TC set, only the
+ * question) so a real client behind a forged flood retries over TCP,
+ * which can't be forged.
+ *
+ * NXDOMAIN and error responses are counted per netblock without the
+ * name, so a flood of random names is still one bucket.
+ *
+ * The buckets are a fixed-size table shared by every UDP thread with
+ * no locks: each bucket is one 64-bit word (a tag from the key's hash,
+ * when it was last used, its token balance and its drop count) updated
+ * with compare-and-swap.  Two keys whose hashes fall in the same
+ * bucket take it over from each other, which only ever lets responses
+ * through.  The counters are kept per thread.
+ *
+*/
+
+#ifndef RRL_H
+#define RRL_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define RRL_BUCKETS		65536	// a power of two
+#define RRL_WINDOW		15		// seconds of debt a flooded bucket can run up
+#define RRL_RATE_MAX	32767	// responses a second a bucket can allow
+#define RRL_SLIP		2		// default: every second dropped response slips
+#define RRL_THREADS		256		// threads with their own counters
+
+// what rrl_check() says to do with a response
+#define RRL_SEND		0
+#define RRL_DROP		1
+#define RRL_SLIP_TC		2
+
+typedef struct {
+	unsigned long responses;
+	unsigned long dropped;
+	unsigned long slipped;
+} __attribute__((aligned(64))) rrl_counters;
+
+typedef struct {
+	int rate;					// responses a second per bucket, 0 = no limit
+	int slip;					// 0 = drop them all
+	atomic_ullong buckets[RRL_BUCKETS];
+	rrl_counters counters[RRL_THREADS];
+} rrl;
+
+void rrl_init(rrl *r, int rate, int slip);
+int rrl_check(rrl *r, int thread, struct sockaddr_storage *client, unsigned char *response,
+		int len, time_t now);
+int rrl_slip(unsigned char *response, int len);
+void rrl_print_stats(rrl *r, FILE *out);
+
+#endif /* RRL_H */
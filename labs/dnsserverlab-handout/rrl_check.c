@@ -0,0 +1,71 @@
+/*
+ * Check of the response rate limiter's client netblocks - CS 360
+ * Runs rrl_check() with a limit of one response a second on made-up
+ * clients and checks which of them share a bucket: IPv4 clients in the
+ * same /24 must, whether they arrive as IPv4 or v4-mapped IPv6
+ * (::ffff:a.b.c.d, how a socket bound to :: sees them), and clients in
+ * different /24s or /56s must not.
+ *
+ * Usage: rrl_check
+ *
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<arpa/inet.h>
+
+#include "rrl.h"
+#include "dns_msg.h"
+
+int check(char *what, char *first, char *second, int shared);
+void make_client(char *text, struct sockaddr_storage *client);
+
+// an answer for example.com, the same for every client
+unsigned char response[] = {
+	0x42, 0x42, 0x81, 0x80, 0, 1, 0, 1, 0, 0, 0, 0,
+	7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1
+};
+
+int main() {
+	int failed = 0;
+	failed += check("v4-mapped, different /24s", "::ffff:192.0.2.1", "::ffff:198.51.100.1", 0);
+	failed += check("v4-mapped, same /24", "::ffff:192.0.2.1", "::ffff:192.0.2.200", 1);
+	failed += check("IPv4 and v4-mapped, same /24", "192.0.2.1", "::ffff:192.0.2.9", 1);
+	failed += check("IPv4, different /24s", "192.0.2.1", "192.0.3.1", 0);
+	failed += check("IPv6, same /56", "2001:db8:0:100::1", "2001:db8:0:1ff::2", 1);
+	failed += check("IPv6, different /56s", "2001:db8:0:100::1", "2001:db8:0:200::1", 0);
+	return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int check(char *what, char *first, char *second, int shared) {
+	/*
+	 * Use up the first client's bucket, then see whether the second
+	 * client is limited too.
+	 *
+	 * OUTPUT: 0 if they share a bucket exactly when they should, 1 if not
+	 */
+	static rrl r;
+	struct sockaddr_storage a, b;
+	rrl_init(&r, 1, 0);
+	make_client(first, &a);
+	make_client(second, &b);
+	rrl_check(&r, 0, &a, response, sizeof(response), 1000);
+	int limited = rrl_check(&r, 0, &b, response, sizeof(response), 1000) != RRL_SEND;
+	printf("%s: %s and %s %s a bucket: %s\n", what, first, second,
+			limited ? "share" : "don't share", limited == shared ? "ok" : "FAILED");
+	return limited != shared;
+}
+
+void make_client(char *text, struct sockaddr_storage *client) {
+	memset(client, 0, sizeof(*client));
+	if (strchr(text, ':') != NULL) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)client;
+		sin6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, text, &sin6->sin6_addr);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)client;
+		sin->sin_family = AF_INET;
+		inet_pton(AF_INET, text, &sin->sin_addr);
+	}
+}
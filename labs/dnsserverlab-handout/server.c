@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,125 +9,296 @@
 #include <time.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
 
 #include "dns.h"
+#include "dns_msg.h"
+#include "db_store.h"
+#include "answer_cache.h"
+#include "rrl.h"
+#include "epoch.h"
+#include "zone_load.h"
+#include "db_snapshot.h"
 
 
 // PROGRAM CONSTANTS AND TYPES --------------------------------
-#define MAX_ENTRIES 		1024
-#define DNS_MSG_MAX 		4096
 #define LISTEN_QUEUE_SIZE	1024
+#define MAX_CNAME_CHAIN		16
+#define MAX_RESPONSE_RRS	4096	// answer and additional records in one response (a TCP one full of A records)
+#define EXPIRES(db,e)		((db)->start + (time_t)(e)->ttl)
+#define UDP_BATCH			32		// queries taken per recvmmsg() call
+#define TCP_MAX_CONNECTIONS	256		// open TCP connections at once
+#define TCP_IDLE_TIMEOUT	10		// seconds before an idle connection is closed
+#define TCP_MAX_EVENTS		64
+#define TCP_IN_MAX			(4 * (BUFFER_MAX + 2))	// room for a few pipelined queries
+#define TCP_OUT_MAX			65536	// stop reading while this much is unsent
+#define RELOAD_EVENTS_MAX	4096	// inotify events read at once
 
 typedef struct {
-	dns_rr rr;
-	time_t expires;
-} dns_db_entry;
+	db_store store;
+	time_t start;				// when the file was read, TTLs count from here
+	unsigned long generation;	// 1 for the first load, +1 per reload
+} cache_db;
 
-dns_db_entry cachedb[MAX_ENTRIES];
-time_t cachedb_start;
+typedef struct {
+	unsigned char *msg;					// the response being built
+	int len;
+	int max;							// how long it may get
+	compress_table names;				// where names start in it, for compression
+	int num_rrs;						// answer, authority and additional records so far
+	int entries[MAX_RESPONSE_RRS];		// the db entry of each record
+	int ttl_at[MAX_RESPONSE_RRS];		// where each record's TTL is
+	time_t expires[MAX_RESPONSE_RRS];	// when each record expires
+} dns_response;
+
+typedef struct {
+	int fd;
+	time_t last_active;
+	unsigned char in[TCP_IN_MAX];	// length-prefixed queries read so far
+	int in_len;
+	unsigned char *out;				// length-prefixed responses not yet sent
+	int out_len;
+	int out_pos;
+	int out_max;
+	int closing;					// the client has closed its side
+} tcp_conn;
+
+epoch_ptr cachedb;					// the cache_db being served
 char *cachedb_file;
+char *bind_address;					// address to serve on, NULL for all of them
+int udp_threads;
+int load_threads;						// threads parsing the db file
+rrl rate_limit;							// UDP response rate limiting, shared by the workers
+__thread answer_cache *thread_answers;	// responses already built by this thread
+__thread int thread_reader = -1;		// this thread's reader number for cachedb
+__thread cache_db *thread_db;			// the db this thread is answering from
+unsigned char tcp_response[TCP_MSG_MAX];	// a TCP response being built (one TCP thread)
 
 // FUNCTION DEFINITIONS ---------------------------------------
 void init_db();
-int is_valid_request(unsigned char* request);
-dns_rr get_question(unsigned char *request);
-int get_response(unsigned char *request, int len, unsigned char *response);
+cache_db *load_db(char *file, unsigned long generation);
+void reload_db();
+void *reload_thread(void *arg);
+void db_enter();
+void db_exit();
+int is_valid_request(unsigned char* request, int len);
+int get_edns(unsigned char *request, int len, dns_msg_rr *opt);
+int get_response(unsigned char *request, int len, unsigned char *response, int tcp);
+int find_rrset(cache_db *db, unsigned char *name, dns_rr_type type, time_t now);
+int add_rrset(dns_response *r, cache_db *db, int i, unsigned char *owner, time_t now);
+int name_exists(cache_db *db, unsigned char *name, time_t now);
+unsigned char *find_source(cache_db *db, unsigned char *name, time_t now);
+int find_soa(cache_db *db, unsigned char *name, time_t now);
+int find_cut(cache_db *db, unsigned char *name, time_t now);
 void serve_udp(char* port);
+void *udp_worker(void *arg);
 void serve_tcp(char* port);
+void *tcp_thread(void *arg);
+void start_servers(char* port);
+int tcp_read(tcp_conn *conn);
+int tcp_answer(tcp_conn *conn);
+int tcp_write(tcp_conn *conn);
+void tcp_watch(int epoll_fd, tcp_conn *conn);
 int create_server_socket(char* port, int protocol);
 void printCache();
 
 void init_db() {
 	/* 
-	 * Import the cache database from the file specified by cachedb_file.
-	 * Reset cachedb_start to the current time.  Zero the expiration
-	 * for all unused cache entries to invalidate them.  Read each line in
-	 * the file, create a dns_rr structure for each, set the expires time
-	 * based on the current time and the TTL read from the file, and create
-	 * an entry in the cachedb.  Zero the expiration for all unused cache
-	 * entries to invalidate them.
+	 * Import the cache database from the file specified by cachedb_file
+	 * and make it the db the servers answer from.  Each record expires
+	 * its TTL after the time the file was read.
+	 *
+	 * The db can be replaced while the server runs (see reload_db), so
+	 * it is reached through cachedb with epoch_enter()/db_enter().
 	 *
 	 * INPUT:  None
 	 * OUTPUT: None
 	 */
 	 if(DEBUG_MODE){printf("INITIALIZING CACHE...\n");}
-	 // initialize the start time 
-	 time(&cachedb_start);
-
-	 // set up buffers
-	 char line[BUFFER_MAX];
-	 int rr_num = 0;
-	 char host[BUFFER_MAX];
-	 char class[BUFFER_MAX];
-	 char type[BUFFER_MAX];
-	 char data[BUFFER_MAX];
-	 int t;
-	 // open the file and read
-	 FILE* db_file = fopen(cachedb_file,"r");
-	 while(fgets(line,sizeof(line),db_file)){
-		memset(host,0,BUFFER_MAX);
-		memset(class,0,BUFFER_MAX);
-		memset(type,0,BUFFER_MAX);
-		memset(data,0,BUFFER_MAX);
-		t = 0;
-		sscanf(line,"%s %d %s %s %s",host,&t,class,type,data);
-		// enter rr name
-		char* name = (char*)malloc(sizeof(char)*strlen(host));
-		memcpy(name,host,strlen(host));
-		cachedb[rr_num].rr.name = name;
-		// enter rr ttl
-		cachedb[rr_num].rr.ttl = (dns_rr_ttl) t;
-		// enter rr class
-		if(strcmp(class,"IN") == 0){
-			cachedb[rr_num].rr.class = 1;
-		}else{
-			cachedb[rr_num].rr.class = 0;
-		}
-		// enter rr type
-		if(strcmp(type,"A") == 0){
-			cachedb[rr_num].rr.type = TYPE_A;
-		}else if(strcmp(type,"CNAME") == 0){
-			cachedb[rr_num].rr.type = CNAME;
-		}
-		else{
-			cachedb[rr_num].rr.type = 0;
-		}
-		// enter rr rdata_len and rdata (for TYPE_A and CNAME)
-		if(cachedb[rr_num].rr.type == TYPE_A){
-			cachedb[rr_num].rr.rdata_len = sizeof(int);
-			cachedb[rr_num].rr.rdata = (char*)malloc(sizeof(int));;
-			memset(cachedb[rr_num].rr.rdata,0,sizeof(int));
-			inet_pton(AF_INET,data,cachedb[rr_num].rr.rdata);
-		}
-		else if(cachedb[rr_num].rr.type == CNAME){
-			cachedb[rr_num].rr.rdata = (char*)malloc(sizeof(char)*BUFFER_MAX);
-			memset(cachedb[rr_num].rr.rdata,0,BUFFER_MAX);
-			int datalen = name_ascii_to_wire(data,cachedb[rr_num].rr.rdata);
-			cachedb[rr_num].rr.rdata_len = datalen;
-		}
-		// set the cache entry expire time
-		cachedb[rr_num].expires = (cachedb_start + (time_t)t);
-		rr_num++;
-		memset(line,0,BUFFER_MAX);
+	 cache_db* db = load_db(cachedb_file,1);
+	 if(db == NULL){
+		 exit(EXIT_FAILURE);
 	 }
-	 // close the file
-	 fclose(db_file);
+	 epoch_init(&cachedb,db);
 	 if(DEBUG_MODE){printCache();}
 	 return;
 }
 
-int is_valid_request(unsigned char *request) {
+cache_db *load_db(char *file, unsigned long generation) {
+	/*
+	 * Read a cache database file into a new cache_db.  Each line is
+	 * name, TTL, class, type and the rdata (see rdata_from_text); the
+	 * file is parsed by zone_load with up to load_threads threads.  A
+	 * snapshot written by db_compile is mapped instead of parsed.
+	 *
+	 * INPUT:  file: the path of the cache database file
+	 * INPUT:  generation: the generation number to give the new db
+	 * OUTPUT: the new db, or NULL if the file could not be read or there
+	 *         was not enough memory
+	 */
+	 cache_db* db = (cache_db*)malloc(sizeof(cache_db));
+	 if(db == NULL){
+		 perror("malloc");
+		 return NULL;
+	 }
+	 // TTLs count from now
+	 time(&db->start);
+	 db->generation = generation;
+	 memset(&db->store,0,sizeof(db_store));
+	 int mapped = snapshot_map(file,&db->store);
+	 if(mapped < 0){
+		 free(db);
+		 return NULL;
+	 }
+	 if(mapped == SNAPSHOT_NOT_SNAPSHOT && zone_load(file,&db->store,load_threads) < 0){
+		 store_free(&db->store);
+		 free(db);
+		 return NULL;
+	 }
+	 return db;
+}
+
+void reload_db() {
+	/*
+	 * Read cachedb_file again and swap the new db in.  Queries keep being
+	 * answered from the old db while the file is read; once the new one
+	 * is published, the old one is freed as soon as no server thread is
+	 * still answering from it.  If the file can't be read the old db
+	 * stays.
+	 */
+	cache_db* old = (cache_db*)epoch_current(&cachedb);
+	cache_db* db = load_db(cachedb_file,old->generation + 1);
+	if(db == NULL){
+		fprintf(stderr,"Reload of %s failed, still serving the old records\n",cachedb_file);
+		return;
+	}
+	old = (cache_db*)epoch_publish(&cachedb,db);
+	printf("Reloaded %s: %d records\n",cachedb_file,db->store.size);
+	fflush(stdout);
+	store_free(&old->store);
+	free(old);
+	if(DEBUG_MODE){printCache();}
+}
+
+void *reload_thread(void *arg) {
+	/*
+	 * Reload the db on SIGHUP, or when cachedb_file is rewritten or
+	 * replaced.  The directory is watched rather than the file because
+	 * editors and deploy tools usually write a new file and rename it
+	 * over the old one.  SIGUSR1 prints the rate limiter's counters.
+	 * Both signals must be blocked in every thread.
+	 */
+	(void)arg;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask,SIGHUP);
+	sigaddset(&mask,SIGUSR1);
+	int sig_fd = signalfd(-1,&mask,SFD_CLOEXEC);
+	if(sig_fd == -1){
+		perror("signalfd");
+		return NULL;
+	}
+	// split cachedb_file into its directory and file name
+	char dir[PATH_MAX];
+	char* base = strrchr(cachedb_file,'/');
+	if(base == NULL){
+		strcpy(dir,".");
+		base = cachedb_file;
+	}
+	else{
+		snprintf(dir,sizeof(dir),"%.*s",(int)(base - cachedb_file),cachedb_file);
+		if(dir[0] == '\0'){
+			strcpy(dir,"/");
+		}
+		base++;
+	}
+	int watch_fd = inotify_init1(IN_CLOEXEC);
+	if(watch_fd == -1 || inotify_add_watch(watch_fd,dir,IN_CLOSE_WRITE | IN_MOVED_TO) == -1){
+		perror("inotify");
+		// SIGHUP still works
+	}
+
+	struct pollfd fds[2];
+	fds[0].fd = sig_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = watch_fd;
+	fds[1].events = POLLIN;
+	char events[RELOAD_EVENTS_MAX] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(1){
+		if(poll(fds,2,-1) == -1){
+			if(errno != EINTR){
+				perror("poll");
+				return NULL;
+			}
+			continue;
+		}
+		int reload = 0;
+		if(fds[0].revents & POLLIN){
+			struct signalfd_siginfo info;
+			if(read(sig_fd,&info,sizeof(info)) == sizeof(info)){
+				if(info.ssi_signo == SIGUSR1){
+					rrl_print_stats(&rate_limit,stdout);
+				}
+				else{
+					reload = 1;
+				}
+			}
+		}
+		if(fds[1].revents & POLLIN){
+			int n = read(watch_fd,events,sizeof(events));
+			int pos = 0;
+			while(pos < n){
+				struct inotify_event* ev = (struct inotify_event*)(events + pos);
+				if(ev->len > 0 && strcmp(ev->name,base) == 0){
+					reload = 1;
+				}
+				pos += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		if(reload){
+			reload_db();
+		}
+	}
+}
+
+void db_enter() {
+	/*
+	 * Pin the current db for this thread until db_exit().  Called around
+	 * a batch of queries, never while blocked waiting for more.
+	 */
+	thread_db = (cache_db*)epoch_enter(&cachedb,thread_reader);
+}
+
+void db_exit() {
+	epoch_exit(&cachedb,thread_reader);
+	thread_db = NULL;
+}
+
+int is_valid_request(unsigned char *request, int len) {
 	/* 
 	 * Check that the request received is a valid query.
 	 *
 	 * INPUT:  request: a pointer to the array of bytes representing the
 	 *                  request received by the server
+	 * INPUT:  len: the length (number of bytes) of the request
 	 * OUTPUT: a boolean value (1 or 0) which indicates whether the request
 	 *                  is valid.  0 should be returned if the QR flag is
 	 *                  set (1), if the opcode is non-zero (not a standard
-	 *                  query), or if there are no questions in the query
-	 *                  (question count != 1).
+	 *                  query), if there are no questions in the query
+	 *                  (question count != 1), or if the question doesn't
+	 *                  fit in the request (see dns_question_length()).
 	 */
+	 if(len < 12){
+		 return 0;
+	 }
 	 int index = 2;			// we need to start by skipping the ID 
 	 short code_n_flags;	// we will copy the QR, Opcode, flags, and Rcode 
 	 memcpy(&code_n_flags,request+index,sizeof(short));
@@ -150,31 +322,45 @@ int is_valid_request(unsigned char *request) {
 		 if(DEBUG_MODE){printf("NO QUESTIONS\n");}
 		 return 0;
 	 }
+	 // the question is parsed without any further checks, so it must
+	 // lie entirely within the bytes received
+	 if(dns_question_length(request,len) < 0){
+		 if(DEBUG_MODE){printf("BAD QUESTION\n");}
+		 return 0;
+	 }
 
 	 return 1;
 }
 
-dns_rr get_question(unsigned char *request) {
-	/* 
-	 * Return a dns_rr for the question, including the query name and type.
+int get_edns(unsigned char *request, int len, dns_msg_rr *opt) {
+	/*
+	 * Find the OPT record of a valid request, if the client sent one
+	 * (EDNS(0), RFC 6891).
 	 *
-	 * INPUT:  request: a pointer to the array of bytes representing the
-	 *                  request received by the server.
-	 * OUTPUT: a dns_rr structure for the question.
+	 * INPUT:  request, len: the request, already checked by
+	 *                  is_valid_request()
+	 * INPUT:  opt: set to the OPT record, if there is one
+	 * OUTPUT: 1 if the request has an OPT record, 0 if it has none, -1
+	 *                  if its records don't parse or it has more than
+	 *                  one OPT record (answered with FORMERR)
 	 */
-
-	 int index;
-	 dns_rr question;
-	 memset(&question,0,sizeof(dns_rr));
-	 // we need to start extracting the record after the id, QR, opcode, flags, and
-	 // other information
-	 index = sizeof(int) * 3;		// based on DNS structure format
-	 question = rr_from_wire(request,&index,QUESTION);
-
-	 return question;
+	 if(request[10] == 0 && request[11] == 0){
+		 // nothing in the additional section, the usual case
+		 return 0;
+	 }
+	 dns_msg m;
+	 if(dns_msg_parse(&m,request,len) < 0){
+		 return -1;
+	 }
+	 int i = dns_msg_opt(&m);
+	 if(i < 0){
+		 return i == -1 ? 0 : -1;
+	 }
+	 *opt = m.rrs[i];
+	 return 1;
 }
 
-int get_response(unsigned char *request, int len, unsigned char *response) {
+int get_response(unsigned char *request, int len, unsigned char *response, int tcp) {
 	/* 
 	 * Handle a request and produce the appropriate response.
 	 *
@@ -201,22 +387,53 @@ int get_response(unsigned char *request, int len, unsigned char *response) {
 	 *   (expiration - current time > 0).
 	 *
 	 *     If no match is found:
-	 *       the answer count will be 0, the response code will
-	 *       be 3 (NXDOMAIN or name does not exist).
+	 *       the answer count will be 0 (apart from any CNAMEs) and the
+	 *       zone's SOA goes in the authority section so the answer can be
+	 *       cached (RFC 2308).  The response code will be 0 (NOERROR,
+	 *       "NODATA") if the name exists: it has records of other types
+	 *       or names below it (an empty non-terminal).  It will be 3
+	 *       (NXDOMAIN or name does not exist) if it has neither.
 	 *
 	 *     Otherwise (a match is found):
-	 *       the answer count will be 1 (positive), the response code will
-	 *       be 0 (NOERROR), and the appropriate RR will be added to the
-	 *       answer section.  The TTL for the RR in the answer section
-	 *       should be updated to expiration - current time.
+	 *       the response code will be 0 (NOERROR), and every unexpired
+	 *       record with that name and type will be added to the answer
+	 *       section, after any CNAMEs that led to it.  The TTL for each RR
+	 *       in the answer section should be updated to expiration -
+	 *       current time.  The A and AAAA records of hosts named in NS and
+	 *       MX answers go in the additional section.  If the answer
+	 *       doesn't fit, the TC bit is set so the client retries over TCP.
+	 *
+	 *   A name that isn't in the db but whose closest encloser (the
+	 *   closest domain above it that is) has a wildcard, *.encloser, is
+	 *   answered from the wildcard's records as if they were its own
+	 *   (RFC 4592).
+	 *
+	 *   A name below a zone cut in a zone the server has the SOA of (a
+	 *   subdomain delegated with NS records) gets a referral instead: the
+	 *   response code 0 (NOERROR), no answers (apart from any CNAMEs),
+	 *   the delegation's NS records in the authority section and the
+	 *   addresses of its name servers (glue) in the additional section.
 	 *
 	 *   Return the length of the response message.
 	 *
+	 * A response over UDP fits in 512 bytes, or in the UDP payload the
+	 * client advertised in an OPT record (EDNS(0)) up to UDP_MSG_MAX;
+	 * over TCP it can be TCP_MSG_MAX long.  A request with an OPT record
+	 * gets one back with the server's payload and the client's DO flag,
+	 * or the RCODE BADVERS if it asks for an EDNS version other than 0.
+	 *
+	 * Valid queries are looked up in the calling thread's answer cache
+	 * first; a hit is the cached response with the request's ID and the
+	 * TTLs brought up to date.  Built responses are added to the cache.
+	 *
 	 * INPUT:  request: a pointer to the array of bytes representing the
 	 *                  request received by the server.
-	 * INPUT:  len: the length (number of bytes) of the request
+	 * INPUT:  len: the length (number of bytes) of the request, at least
+	 *                  12 (a header); nothing past it is read
 	 * INPUT:  response: a pointer to the array of bytes where the response
-	 *                  message should be constructed.
+	 *                  message should be constructed (UDP_MSG_MAX bytes,
+	 *                  or TCP_MSG_MAX over TCP).
+	 * INPUT:  tcp: 1 if the request came over TCP, 0 over UDP
 	 * OUTPUT: the length of the response message.
 	 */
 
@@ -234,12 +451,42 @@ int get_response(unsigned char *request, int len, unsigned char *response) {
 		code_n_flags = SET_RD(code_n_flags);
 	 }
 	 // verify it is a valid request
-	 if(!is_valid_request(request)){
+	 dns_msg_rr opt;
+	 int edns = 0;
+	 if(!is_valid_request(request,len) || (edns = get_edns(request,len,&opt)) < 0){
 		 code_n_flags = SET_FORMERR(code_n_flags);
+		 code_n_flags = htons(code_n_flags);
 		 memcpy(response+index,&code_n_flags,sizeof(short));
+		 // the response buffer is reused, clear the section counts
+		 memset(response+index+sizeof(short),0,sizeof(short)*4);
 		 if(DEBUG_MODE){printf("INVALID QUESTION!!\n");}
 		 return 12;
 	 }
+	 // the longest response the client takes, and for the answer cache
+	 // how it used EDNS: 0 not at all, 1, or 2 with the DO flag set
+	 int max = tcp ? TCP_MSG_MAX : DNS_UDP_MIN;
+	 int edns_key = 0;
+	 if(edns){
+		 if(!tcp && opt.class > DNS_UDP_MIN){
+			 max = opt.class < UDP_MSG_MAX ? opt.class : UDP_MSG_MAX;
+		 }
+		 edns_key = (opt.ttl & DNS_EDNS_DO) ? 2 : 1;
+	 }
+	 time_t now = time(NULL);
+	 // server threads have pinned the db with db_enter(); anything else
+	 // (a single-threaded caller) can't race with a reload
+	 cache_db* db = thread_db != NULL ? thread_db : (cache_db*)epoch_current(&cachedb);
+	 if(thread_answers != NULL && thread_answers->generation != db->generation){
+		 // the db was reloaded, nothing cached is good any more
+		 answer_cache_clear(thread_answers);
+		 thread_answers->generation = db->generation;
+	 }
+	 if(thread_answers != NULL){
+		 int cached_len = answer_cache_get(thread_answers,request,len,edns_key,max,response,now);
+		 if(cached_len > 0){
+			 return cached_len;
+		 }
+	 }
 	 code_n_flags = htons(code_n_flags);
 	 memcpy(response+index,&code_n_flags,sizeof(short));
 	 int cnf_index = index;
@@ -252,126 +499,452 @@ int get_response(unsigned char *request, int len, unsigned char *response) {
 	 memset(response+index,0,sizeof(short)*3);
 	 int answer_rr_count_index = index;
 	 index += sizeof(short)*3;
-	 // build the question name
-	 dns_rr question = get_question(request);
-	 int name_len = name_ascii_to_wire(question.name,(response+index));
-	 index += name_len;
-	 // copy the question type
-	 short n_type = htons(question.type);
-	 memcpy(response+index,&n_type,sizeof(short));
-	 index += sizeof(short);
-	 // copy the question class
-	 short n_class = htons(question.class);
-	 memcpy(response+index,&n_class,sizeof(short));
-	 index += sizeof(short);
+	 // copy the question (name, type and class) straight from the
+	 // request; is_valid_request() checked it fits.  Nothing from dns.c
+	 // (or a prebuilt dns.o with its strtok()) runs on this path
+	 int question_len = dns_question_length(request,len);
+	 memcpy(response+index,request+12,question_len);
+	 index += question_len;
+	 int name_len = question_len - 2*sizeof(short);
+	 dns_rr_type qtype = (request[12+name_len] << 8) | request[12+name_len+1];
+	 if(edns && DNS_EDNS_VERSION(opt.ttl) != 0){
+		 // only version 0 is spoken: BADVERS, which lives in the OPT
+		 // record, and nothing else
+		 return dns_opt_add(response,index,max,EDNS_PAYLOAD,DNS_EDNS_BADVERS << 24);
+	 }
 
-	 // find unexpired entry with matching name and type in cache  
-	 int i;
+	 // find unexpired entries with matching name and type in cache  
+	 int i, k;
+	 int hops;
 	 short num_answers = 0;
-	 dns_db_entry cur;
-	 time_t remaining;
+	 short num_authority = 0;
+	 short num_additional = 0;
 	 int found = 0;
-	 char* qname = question.name;
-	 for(i = 0; i < MAX_ENTRIES && cachedb[i].rr.name != NULL; i++){
-		 cur = cachedb[i];
-		 // update the ttl of the entry
-		 remaining =  cur.expires - time(NULL);
-		 cur.rr.ttl = remaining;
-		 if(DEBUG_MODE){
-			 printf("CACHE ENTRY: %s %d %d %d %s\n",
-			 	cur.rr.name,cur.rr.ttl,cur.rr.class,cur.rr.type,cur.rr.rdata);
+	 int referral = STORE_EMPTY;
+	 int full = 0;
+	 int truncated = 0;
+	 dns_response r;
+	 r.msg = response;
+	 r.len = index;
+	 r.max = max - (edns ? DNS_OPT_LEN : 0);
+	 r.num_rrs = 0;
+	 // the question name was just written to the response in wire format
+	 unsigned char* qname = response + index - name_len - 2*sizeof(short);
+	 // answers are compressed against the question and each other
+	 compress_init(&r.names);
+	 compress_add(&r.names,response,qname - response);
+	 for(hops = 0; hops < MAX_CNAME_CHAIN && !found && !full; hops++){
+		 // a delegated name is answered by the servers it is delegated to
+		 referral = find_cut(db,qname,now);
+		 if(referral != STORE_EMPTY){
+			 break;
 		 }
-		 // check whether the name matches
-		 if(strcmp(cur.rr.name,qname) == 0 && (remaining > 0)){
-			 if(cur.rr.type == question.type){
-				// found a match, update the time 
-				found = 1;
-				num_answers++;
-				// add the resource record
-				int rr_len = rr_to_wire(cur.rr,(response+index),RESOURCE_RECORD);
-				index += rr_len;
-				break;
-			 }
-			 else if(cur.rr.type == CNAME){
-				// found a CNAME record, append to response and keep looking
-				if(DEBUG_MODE){printf("FOUND CNAME...\n");}
-				num_answers++;
-				int rr_len = rr_to_wire(cur.rr,(response+index),RESOURCE_RECORD);
-				index += rr_len;
-				int tmp = 0;
-				qname = name_ascii_from_wire(cur.rr.rdata,&(tmp));
-				i = 0;
+		 // the records are the name's own or a wildcard's, which are
+		 // sent with the name in place of the wildcard
+		 unsigned char* source = find_source(db,qname,now);
+		 if(source == NULL){
+			 break;
+		 }
+		 unsigned char* owner = source == qname ? NULL : qname;
+		 // look for the type asked for, then for a CNAME to follow
+		 i = find_rrset(db,source,qtype,now);
+		 if(i != STORE_EMPTY){
+			 // found a match, answer with the whole set
+			 found = 1;
+			 full = (add_rrset(&r,db,i,owner,now) < 0);
+			 break;
+		 }
+		 if(qtype == CNAME){
+			 break;
+		 }
+		 i = find_rrset(db,source,CNAME,now);
+		 if(i == STORE_EMPTY){
+			 break;
+		 }
+		 // found a CNAME record, keep looking for its target
+		 if(DEBUG_MODE){printf("FOUND CNAME...\n");}
+		 full = (add_rrset(&r,db,i,owner,now) < 0);
+		 qname = store_rdata(&db->store,&db->store.db[i]);
+	 }
+	 // an answer that doesn't fit is cut short, not left out quietly
+	 truncated = full;
+	 num_answers = r.num_rrs;
+	 int name_found = found || referral != STORE_EMPTY || find_source(db,qname,now) != NULL;
+	 if(!found && !full){
+		 // a referral names the servers to ask, otherwise no data for the
+		 // (last) name: the zone's SOA says for how long that may be cached
+		 i = referral != STORE_EMPTY ? referral : find_soa(db,qname,now);
+		 if(i != STORE_EMPTY && add_rrset(&r,db,i,NULL,now) < 0){
+			 full = truncated = 1;
+		 }
+		 num_authority = r.num_rrs - num_answers;
+	 }
+	 // addresses of the hosts named in NS and MX answers and referrals go
+	 // in the additional section, each set once
+	 int glue[MAX_RESPONSE_RRS];
+	 int num_glue = 0;
+	 for(k = 0; k < num_answers + num_authority && !full; k++){
+		 dns_db_entry* e = &db->store.db[r.entries[k]];
+		 unsigned char* target = rdata_target(e->type,store_rdata(&db->store,e));
+		 if(target == NULL){
+			 continue;
+		 }
+		 dns_rr_type glue_types[2] = {TYPE_A, TYPE_AAAA};
+		 int t, g;
+		 for(t = 0; t < 2 && !full; t++){
+			 i = find_rrset(db,target,glue_types[t],now);
+			 for(g = 0; g < num_glue && glue[g] != i; g++);
+			 if(i == STORE_EMPTY || g < num_glue || num_glue == MAX_RESPONSE_RRS){
+				 continue;
 			 }
+			 glue[num_glue++] = i;
+			 // glue is optional, stop adding it when the response is full
+			 full = (add_rrset(&r,db,i,NULL,now) < 0);
 		 }
 	 }
-	 // if no record found return NXDOMAIN in the RCode
-	 if(!found){
+	 num_additional = r.num_rrs - num_answers - num_authority;
+	 index = r.len;
+	 // if the name doesn't exist return NXDOMAIN in the RCode
+	 if(!name_found || truncated){
 		code_n_flags = ntohs(code_n_flags);
-		code_n_flags = SET_NXDOMAIN(code_n_flags);
+		code_n_flags = truncated ? SET_TC(code_n_flags) : SET_NXDOMAIN(code_n_flags);
 		code_n_flags = htons(code_n_flags);
 		memcpy((response+cnf_index),&code_n_flags,sizeof(short));
 	 }
 
-	 // update the answer count
+	 // update the answer, authority and additional counts
 	 if(num_answers != 0){
-		num_answers = htons(num_answers);
-	 	memcpy((response+answer_rr_count_index),&num_answers,sizeof(short));
+		short n_answers = htons(num_answers);
+	 	memcpy((response+answer_rr_count_index),&n_answers,sizeof(short));
+	 }
+	 if(num_authority != 0){
+		short n_authority = htons(num_authority);
+	 	memcpy((response+answer_rr_count_index+sizeof(short)),&n_authority,sizeof(short));
+	 }
+	 if(num_additional != 0){
+		short n_additional = htons(num_additional);
+	 	memcpy((response+answer_rr_count_index+2*sizeof(short)),&n_additional,sizeof(short));
+	 }
+	 if(edns){
+		 // room for it was kept
+		 index = dns_opt_add(response,index,max,EDNS_PAYLOAD,opt.ttl & DNS_EDNS_DO);
+	 }
+	 // a truncated response depends on how long the client let it be
+	 if(thread_answers != NULL && !truncated){
+		 answer_cache_put(thread_answers,request,len,edns_key,response,index,r.num_rrs,r.ttl_at,r.expires);
 	 }
 
 	 // return the length of the response
 	 return index;
 }
 
+int find_rrset(cache_db *db, unsigned char *name, dns_rr_type type, time_t now) {
+	/*
+	 * Find the first unexpired record with a name and type.
+	 *
+	 * INPUT:  db: the db to look in
+	 * INPUT:  name: the name in wire format
+	 * INPUT:  type: the record type
+	 * INPUT:  now: the current time
+	 * OUTPUT: index of the record in db->store, or STORE_EMPTY
+	 */
+	int i = store_lookup(&db->store,name,type);
+	while(i != STORE_EMPTY && EXPIRES(db,&db->store.db[i]) - now <= 0){
+		i = db->store.db[i].next;
+	}
+	return i;
+}
+
+int name_exists(cache_db *db, unsigned char *name, time_t now) {
+	/*
+	 * Check whether a name has any unexpired records, of whatever type.
+	 * The store is indexed by name and type, so each type the server
+	 * serves is looked up in turn.
+	 *
+	 * INPUT:  db: the db to look in
+	 * INPUT:  name: the name in wire format
+	 * INPUT:  now: the current time
+	 * OUTPUT: 1 if the name has records, 0 if not
+	 */
+	dns_rr_type types[] = {TYPE_A, TYPE_NS, CNAME, TYPE_SOA, TYPE_MX, TYPE_TXT, TYPE_AAAA};
+	int t;
+	for(t = 0; t < (int)(sizeof(types) / sizeof(types[0])); t++){
+		if(find_rrset(db,name,types[t],now) != STORE_EMPTY){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+unsigned char *find_source(cache_db *db, unsigned char *name, time_t now) {
+	/*
+	 * Find the name whose records answer for a name: the name itself if
+	 * it exists (it has records, or names below it), otherwise the
+	 * wildcard below its closest encloser if there is one (RFC 4592).
+	 * A name that exists is never answered from a wildcard, and neither
+	 * is one below a name that exists but not in the db.
+	 *
+	 * INPUT:  db: the db to look in
+	 * INPUT:  name: the name in wire format
+	 * INPUT:  now: the current time
+	 * OUTPUT: name, the wildcard's name (in the db), or NULL if the name
+	 *         doesn't exist
+	 */
+	int at;
+	int node = store_closest(&db->store,name,&at);
+	store_node* n = &db->store.nodes[node];
+	if(at > 0){
+		if(!(n->flags & NODE_WILDCARD)){
+			return NULL;
+		}
+		node = store_child(&db->store,node,(unsigned char*)"\001*");
+		n = &db->store.nodes[node];
+		name = db->store.arena + n->name;
+	}
+	if((n->flags & NODE_PARENT) || ((n->flags & NODE_DATA) && name_exists(db,name,now))){
+		return name;
+	}
+	return NULL;
+}
+
+int find_soa(cache_db *db, unsigned char *name, time_t now) {
+	/*
+	 * Find the SOA of the zone a name is in: the SOA of the name itself
+	 * or of the closest domain above it that has one.  Only the domains
+	 * in the db's name tree that have one are looked up.
+	 *
+	 * INPUT:  db: the db to look in
+	 * INPUT:  name: the name in wire format
+	 * INPUT:  now: the current time
+	 * OUTPUT: index of the SOA record in db->store, or STORE_EMPTY
+	 */
+	int at;
+	int node = store_closest(&db->store,name,&at);
+	// nodes and names go up together, a label at a time
+	for(name += at; node >= 0; node = db->store.nodes[node].parent){
+		if(db->store.nodes[node].flags & NODE_SOA){
+			int i = find_rrset(db,name,TYPE_SOA,now);
+			if(i != STORE_EMPTY){
+				return i;
+			}
+		}
+		name += name[0] + 1;
+	}
+	return STORE_EMPTY;
+}
+
+int find_cut(cache_db *db, unsigned char *name, time_t now) {
+	/*
+	 * Find the delegation a name falls under: the NS records of the
+	 * closest domain to the zone's apex, between the name (included)
+	 * and the closest domain above it with an SOA, that has NS records
+	 * but no SOA.  Names in a db without SOAs (a plain cache) are never
+	 * delegated.
+	 *
+	 * INPUT:  db: the db to look in
+	 * INPUT:  name: the name in wire format
+	 * INPUT:  now: the current time
+	 * OUTPUT: index of the delegation's NS records in db->store, or
+	 *         STORE_EMPTY if the name isn't delegated
+	 */
+	int cut = STORE_EMPTY;
+	int at;
+	int node = store_closest(&db->store,name,&at);
+	// names below the closest encloser have no records
+	for(name += at; node >= 0; node = db->store.nodes[node].parent){
+		unsigned int flags = db->store.nodes[node].flags;
+		if((flags & NODE_SOA) && find_rrset(db,name,TYPE_SOA,now) != STORE_EMPTY){
+			return cut;
+		}
+		int i = (flags & NODE_NS) ? find_rrset(db,name,TYPE_NS,now) : STORE_EMPTY;
+		if(i != STORE_EMPTY){
+			cut = i;
+		}
+		name += name[0] + 1;
+	}
+	return STORE_EMPTY;
+}
+
+int add_rrset(dns_response *r, cache_db *db, int i, unsigned char *owner, time_t now) {
+	/*
+	 * Add the unexpired records from entry i on (all with the same name
+	 * and type) to a response, with their remaining TTLs.  Either the
+	 * whole set goes in or none of it does.
+	 *
+	 * INPUT:  r: the response being built
+	 * INPUT:  db: the db the records are in
+	 * INPUT:  i: index of the first record of the set
+	 * INPUT:  owner: the name to send them under (for a wildcard's
+	 *         records), or NULL for their own
+	 * INPUT:  now: the current time
+	 * OUTPUT: the number of records added, or -1 if the set doesn't fit
+	 */
+	int len = r->len;
+	int num_rrs = r->num_rrs;
+	int num_names = r->names.count;
+	for(; i != STORE_EMPTY; i = db->store.db[i].next){
+		dns_db_entry* e = &db->store.db[i];
+		time_t remaining = EXPIRES(db,e) - now;
+		if(remaining <= 0){
+			continue;
+		}
+		if(DEBUG_MODE){
+			printf("CACHE ENTRY: %d %d %d %d\n",i,(int)remaining,e->class,e->type);
+		}
+		int rr_len = -1;
+		if(r->num_rrs < MAX_RESPONSE_RRS){
+			rr_len = store_rr_to_wire(&db->store,i,owner,(dns_rr_ttl)remaining,r->msg,r->len,
+					r->max-r->len,&r->names,&r->ttl_at[r->num_rrs]);
+		}
+		if(rr_len < 0){
+			// out of room, take the whole set back out
+			r->len = len;
+			r->num_rrs = num_rrs;
+			r->names.count = num_names;
+			return -1;
+		}
+		r->entries[r->num_rrs] = i;
+		r->expires[r->num_rrs] = EXPIRES(db,e);
+		r->num_rrs++;
+		r->len += rr_len;
+	}
+	return r->num_rrs - num_rrs;
+}
+
 void serve_udp(char* port) {
 	/* 
 	 * Listen for and respond to DNS requests over UDP.
-	 * Initialize the cache.  Initialize the socket.  Receive datagram
-	 * requests over UDP, and return the appropriate responses to the
-	 * client.
+	 * The cache has already been initialized by main (it is shared with
+	 * the TCP server).  Start udp_threads workers, each with its
+	 * own socket bound to the same port with SO_REUSEPORT, so the kernel
+	 * spreads incoming queries across them.  The calling thread becomes
+	 * the last worker.
 	 *
 	 * INPUT:  port: a numerical port on which the server should listen.
 	*/
-	unsigned char request[BUFFER_MAX];
-	unsigned char response[BUFFER_MAX];
-	struct sockaddr_storage addr;
-	socklen_t addr_len = sizeof(struct sockaddr_storage);
-	int request_len, response_len;
+	int i;
+	pthread_t tid;
+	for(i = 1; i < udp_threads; i++){
+		int *sock = (int*)malloc(sizeof(int));
+		*sock = create_server_socket(port,SOCK_DGRAM);
+		if(pthread_create(&tid,NULL,udp_worker,sock) != 0){
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(tid);
+	}
+	int *sock = (int*)malloc(sizeof(int));
+	*sock = create_server_socket(port,SOCK_DGRAM);
+	udp_worker(sock);
+}
 
-	// initialize the database cache
-	init_db();
+void *udp_worker(void *arg) {
+	/*
+	 * Answer queries on one UDP socket in batches: recvmmsg() takes up
+	 * to UDP_BATCH datagrams at once, every one gets a response, and
+	 * sendmmsg() sends the whole batch back.  Responses over the rate
+	 * limit (see rrl.h) are left out of the batch or cut down to TC.
+	 *
+	 * INPUT:  arg: pointer to the socket (freed here)
+	 */
+	int sock = *(int*)arg;
+	free(arg);
+	thread_answers = answer_cache_new();
+	thread_reader = epoch_register(&cachedb);
+	if(thread_reader == -1){
+		exit(EXIT_FAILURE);
+	}
 
-	// create the listening socket
-	int sock = create_server_socket(port,SOCK_DGRAM);
+	unsigned char requests[UDP_BATCH][BUFFER_MAX];
+	unsigned char responses[UDP_BATCH][UDP_MSG_MAX];
+	struct sockaddr_storage addrs[UDP_BATCH];
+	struct iovec in_iov[UDP_BATCH];
+	struct iovec out_iov[UDP_BATCH];
+	struct mmsghdr in_msgs[UDP_BATCH];
+	struct mmsghdr out_msgs[UDP_BATCH];
+	int i;
+
+	memset(in_msgs,0,sizeof(in_msgs));
+	memset(out_msgs,0,sizeof(out_msgs));
+	for(i = 0; i < UDP_BATCH; i++){
+		in_iov[i].iov_base = requests[i];
+		in_iov[i].iov_len = BUFFER_MAX;
+		in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+		in_msgs[i].msg_hdr.msg_iovlen = 1;
+		in_msgs[i].msg_hdr.msg_name = &addrs[i];
+		out_iov[i].iov_base = responses[i];
+		out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+		out_msgs[i].msg_hdr.msg_iovlen = 1;
+		out_msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
 
 	while(1){
-		// reset the buffers
-		memset(request,0,BUFFER_MAX);
-		memset(response,0,BUFFER_MAX);
-		addr_len = sizeof(struct sockaddr_storage);
-		// wait for data
-		request_len = recvfrom(sock,request,BUFFER_MAX,MSG_WAITALL,
-									(struct sockaddr *)&addr, &addr_len);
-	    if(DEBUG_MODE){printf("REQUEST--------");print_bytes(request,request_len);}
-		// read the request and put it into the response
-		response_len = get_response(request,request_len,response);
-		if(DEBUG_MODE){printf("RESPONSE-------");print_bytes(response,response_len);}
-		// send the response back to the client
-		if(sendto(sock,response,response_len,0,(struct sockaddr*)&addr, addr_len) < 0){
-			perror("sendto");
+		for(i = 0; i < UDP_BATCH; i++){
+			in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		}
+		// block for the first datagram, then take whatever else is queued
+		int count = recvmmsg(sock,in_msgs,UDP_BATCH,MSG_WAITFORONE,NULL);
+		if(count < 0){
+			if(errno != EINTR){
+				perror("recvmmsg");
+			}
+			continue;
+		}
+		int out = 0;
+		time_t now = time(NULL);
+		db_enter();
+		for(i = 0; i < count; i++){
+			int request_len = in_msgs[i].msg_len;
+			if(request_len < 12){
+				// too short to even have a header, drop it
+				continue;
+			}
+			if(DEBUG_MODE){printf("REQUEST--------");print_bytes(requests[i],request_len);}
+			// read the request and put it into the response
+			int response_len = get_response(requests[i],request_len,responses[i],0);
+			if(DEBUG_MODE){printf("RESPONSE-------");print_bytes(responses[i],response_len);}
+			// the worker's epoch reader number doubles as its counter slot
+			int action = rrl_check(&rate_limit,thread_reader,&addrs[i],responses[i],response_len,now);
+			if(action == RRL_DROP){
+				continue;
+			}
+			if(action == RRL_SLIP_TC){
+				response_len = rrl_slip(responses[i],response_len);
+			}
+			out_iov[out].iov_base = responses[i];
+			out_iov[out].iov_len = response_len;
+			out_msgs[out].msg_hdr.msg_name = &addrs[i];
+			out_msgs[out].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+			out++;
+		}
+		db_exit();
+		// send the responses back to the clients
+		int sent = 0;
+		while(sent < out){
+			int n = sendmmsg(sock,&out_msgs[sent],out - sent,0);
+			if(n < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				perror("sendmmsg");
+				// skip the datagram that failed and carry on with the rest
+				n = 1;
+			}
+			sent += n;
 		}
 	}
 
 	close(sock);
-
+	return NULL;
 }
 
 void serve_tcp(char* port) {
 	/* 
 	 * Listen for and respond to DNS requests over TCP.
-	 * Initialize the cache.  Initialize the socket.  Receive requests
-	 * requests over TCP, ensuring that the entire request is received, and
-	 * return the appropriate responses to the client, ensuring that the
-	 * entire response is transmitted.
+	 * Initialize the socket.  Receive requests over TCP, ensuring that
+	 * the entire request is received, and return the appropriate
+	 * responses to the client, ensuring that the entire response is
+	 * transmitted.
 	 *
 	 * Note that for requests, the first two bytes (a 16-bit (unsigned
 	 * short) integer in network byte order) read indicate the size (bytes)
@@ -379,11 +952,244 @@ void serve_tcp(char* port) {
 	 * those two bytes.  For the responses, you will need to similarly send
 	 * the size in two bytes before sending the actual DNS response.
 	 *
-	 * In both cases you will want to loop until you have sent or received
-	 * the entire message.
+	 * All connections are handled by one epoll loop.  A client may send
+	 * many queries without waiting (RFC 7766 pipelining); every complete
+	 * query in the read buffer is answered and the responses are queued
+	 * on the connection.  Reading stops while too much output is queued,
+	 * idle connections are closed after TCP_IDLE_TIMEOUT seconds, and
+	 * connections past TCP_MAX_CONNECTIONS are refused.
 	 *
 	 * INPUT:  port: a numerical port on which the server should listen.
 	 */
+	tcp_conn *conns[TCP_MAX_CONNECTIONS];
+	struct epoll_event ev;
+	struct epoll_event events[TCP_MAX_EVENTS];
+	int num_conns = 0;
+	int i, n;
+
+	memset(conns,0,sizeof(conns));
+	thread_answers = answer_cache_new();
+	thread_reader = epoch_register(&cachedb);
+	if(thread_reader == -1){
+		exit(EXIT_FAILURE);
+	}
+	int sock = create_server_socket(port,SOCK_STREAM);
+	fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) | O_NONBLOCK);
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd == -1){
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	// the listener is the only event without a connection
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,sock,&ev) == -1){
+		perror("epoll_ctl: listener");
+		exit(EXIT_FAILURE);
+	}
+
+	while(1){
+		int nfds = epoll_wait(epoll_fd,events,TCP_MAX_EVENTS,1000);
+		if(nfds == -1 && errno != EINTR){
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+		db_enter();
+		for(n = 0; n < nfds; n++){
+			tcp_conn *conn = (tcp_conn*)events[n].data.ptr;
+			if(conn == NULL){
+				// take every waiting connection
+				int fd;
+				while((fd = accept4(sock,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1){
+					if(num_conns == TCP_MAX_CONNECTIONS){
+						if(DEBUG_MODE){printf("TCP: too many connections, refusing\n");}
+						close(fd);
+						continue;
+					}
+					conn = (tcp_conn*)calloc(1,sizeof(tcp_conn));
+					conn->fd = fd;
+					time(&conn->last_active);
+					for(i = 0; conns[i] != NULL; i++);
+					conns[i] = conn;
+					num_conns++;
+					ev.events = EPOLLIN | EPOLLRDHUP;
+					ev.data.ptr = conn;
+					epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&ev);
+				}
+				if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+					perror("accept4");
+				}
+				continue;
+			}
+			int ok = 1;
+			if(events[n].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+				ok = (tcp_read(conn) == 0 && tcp_answer(conn) == 0);
+			}
+			if(ok && conn->out_len > conn->out_pos){
+				ok = (tcp_write(conn) == 0);
+			}
+			if(ok && conn->closing && conn->out_len == conn->out_pos){
+				// everything asked for has been answered
+				ok = 0;
+			}
+			if(ok){
+				tcp_watch(epoll_fd,conn);
+			}
+			else{
+				for(i = 0; conns[i] != conn; i++);
+				conns[i] = NULL;
+				num_conns--;
+				close(conn->fd);
+				free(conn->out);
+				free(conn);
+			}
+		}
+		db_exit();
+		// sweep out the idle connections
+		time_t now = time(NULL);
+		for(i = 0; i < TCP_MAX_CONNECTIONS; i++){
+			if(conns[i] != NULL && now - conns[i]->last_active >= TCP_IDLE_TIMEOUT){
+				if(DEBUG_MODE){printf("TCP: closing idle connection\n");}
+				close(conns[i]->fd);
+				free(conns[i]->out);
+				free(conns[i]);
+				conns[i] = NULL;
+				num_conns--;
+			}
+		}
+	}
+}
+
+void *tcp_thread(void *arg) {
+	serve_tcp((char*)arg);
+	return NULL;
+}
+
+int tcp_read(tcp_conn *conn) {
+	/*
+	 * Read whatever the client has sent, as much as fits in the read
+	 * buffer.  Nothing is read while too many responses are waiting to
+	 * be sent, which pushes back on a client that doesn't read them.
+	 *
+	 * OUTPUT: 0 to keep the connection, -1 to close it
+	 */
+	while(conn->in_len < TCP_IN_MAX && conn->out_len - conn->out_pos < TCP_OUT_MAX){
+		int n = recv(conn->fd,conn->in + conn->in_len,TCP_IN_MAX - conn->in_len,0);
+		if(n == 0){
+			conn->closing = 1;
+			break;
+		}
+		if(n < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		conn->in_len += n;
+		time(&conn->last_active);
+	}
+	return 0;
+}
+
+int tcp_answer(tcp_conn *conn) {
+	/*
+	 * Answer every complete query in the read buffer, appending each
+	 * response (with its length prefix) to the output buffer.
+	 *
+	 * OUTPUT: 0 to keep the connection, -1 if the client sent a message
+	 *         that cannot be a DNS query (or there is no memory to
+	 *         answer it)
+	 */
+	int pos = 0;
+	while(conn->in_len - pos >= 2){
+		int len = (conn->in[pos] << 8) | conn->in[pos + 1];
+		if(len < 12 || len > BUFFER_MAX){
+			// we can't answer it and can't find the next message after it
+			return -1;
+		}
+		if(conn->in_len - pos < len + 2){
+			break;
+		}
+		if(DEBUG_MODE){printf("REQUEST--------");print_bytes(conn->in + pos + 2,len);}
+		// get_response() reads only the len bytes of this query, never
+		// the pipelined query behind it (is_valid_request() checks the
+		// question against len).  A response can be TCP_MSG_MAX long but
+		// seldom is, so it is built here and only its length is queued
+		int response_len = get_response(conn->in + pos + 2,len,tcp_response,1);
+		if(DEBUG_MODE){printf("RESPONSE-------");print_bytes(tcp_response,response_len);}
+		if(conn->out_max - conn->out_len < response_len + 2){
+			int out_max = conn->out_max ? conn->out_max : 4 * (BUFFER_MAX + 2);
+			while(out_max - conn->out_len < response_len + 2){
+				out_max *= 2;
+			}
+			unsigned char *out = (unsigned char*)realloc(conn->out,out_max);
+			if(out == NULL){
+				perror("realloc");
+				return -1;
+			}
+			conn->out = out;
+			conn->out_max = out_max;
+		}
+		unsigned char *response = conn->out + conn->out_len;
+		response[0] = (response_len >> 8) & 0xff;
+		response[1] = response_len & 0xff;
+		memcpy(response + 2,tcp_response,response_len);
+		conn->out_len += response_len + 2;
+		pos += len + 2;
+	}
+	// keep the partial query for the next read
+	memmove(conn->in,conn->in + pos,conn->in_len - pos);
+	conn->in_len -= pos;
+	return 0;
+}
+
+int tcp_write(tcp_conn *conn) {
+	/*
+	 * Send as much of the queued output as the socket will take.
+	 *
+	 * OUTPUT: 0 to keep the connection, -1 to close it
+	 */
+	while(conn->out_pos < conn->out_len){
+		int n = send(conn->fd,conn->out + conn->out_pos,conn->out_len - conn->out_pos,MSG_NOSIGNAL);
+		if(n < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		conn->out_pos += n;
+		time(&conn->last_active);
+	}
+	if(conn->out_pos == conn->out_len){
+		conn->out_pos = 0;
+		conn->out_len = 0;
+	}
+	return 0;
+}
+
+void tcp_watch(int epoll_fd, tcp_conn *conn) {
+	/*
+	 * Pick the events the connection needs next: input unless its output
+	 * is backed up (or the client is done sending), output while anything
+	 * is left to send.
+	 */
+	struct epoll_event ev;
+	ev.events = 0;
+	if(!conn->closing && conn->out_len - conn->out_pos < TCP_OUT_MAX){
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	}
+	if(conn->out_len > conn->out_pos){
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.ptr = conn;
+	epoll_ctl(epoll_fd,EPOLL_CTL_MOD,conn->fd,&ev);
 }
 
 int create_server_socket(char* port, int protocol) {
@@ -412,8 +1218,15 @@ int create_server_socket(char* port, int protocol) {
 	 *  On Linux binding to :: also binds to 0.0.0.0
 	 *  Null is fine for TCP, but UDP needs both
 	 *  See https://blog.powerdns.com/2012/10/08/on-binding-datagram-udp-sockets-to-the-any-addresses/
+	 *
+	 *  With -a only the address given is bound, so several servers can
+	 *  share a port on different addresses (127.0.0.2, 127.0.0.3, ...)
 	 */
-	ret = getaddrinfo(protocol == SOCK_DGRAM ? "::" : NULL, port, &hints, &addr_list);
+	if (bind_address != NULL) {
+		ret = getaddrinfo(bind_address, port, &hints, &addr_list);
+	} else {
+		ret = getaddrinfo(protocol == SOCK_DGRAM ? "::" : NULL, port, &hints, &addr_list);
+	}
 	if (ret != 0) {
 		fprintf(stderr, "Failed in getaddrinfo: %s\n", gai_strerror(ret));
 		exit(EXIT_FAILURE);
@@ -434,6 +1247,17 @@ int create_server_socket(char* port, int protocol) {
 			continue;
 		}
 
+		// Every UDP worker binds its own socket to the port and the
+		// kernel hashes each client to one of them
+		if (protocol == SOCK_DGRAM) {
+			ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+			if (ret == -1) {
+				perror("setsockopt");
+				close(sock);
+				continue;
+			}
+		}
+
 		ret = bind(sock, addr_ptr->ai_addr, addr_ptr->ai_addrlen);
 		if (ret == -1) {
 			perror("bind");
@@ -462,21 +1286,79 @@ int create_server_socket(char* port, int protocol) {
 	return sock;
 }
 
+void start_servers(char* port) {
+	/*
+	 * Load the cache database, which both servers answer from, then
+	 * serve TCP on its own thread and UDP on this one.  Another thread
+	 * reloads the database on SIGHUP or when its file changes, and prints
+	 * the rate limiter's counters on SIGUSR1; both are blocked before any
+	 * thread starts so only that thread takes them.
+	 */
+	init_db();
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask,SIGHUP);
+	sigaddset(&mask,SIGUSR1);
+	pthread_sigmask(SIG_BLOCK,&mask,NULL);
+	pthread_t tid;
+	if(pthread_create(&tid,NULL,reload_thread,NULL) != 0){
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(tid);
+	if(pthread_create(&tid,NULL,tcp_thread,port) != 0){
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(tid);
+	serve_udp(port);
+}
+
 int main(int argc, char *argv[]) {
 	unsigned short port;
-	int argindex = 1, daemonize = 0;
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s [-d] <cache file> <port>\n", argv[0]);
+	int argindex, daemonize = 0;
+	int c;
+	int rate = 0;
+	int slip = RRL_SLIP;
+	// one UDP worker per CPU unless told otherwise
+	udp_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	load_threads = udp_threads;
+	while ((c = getopt(argc, argv, "dt:l:a:r:s:")) != -1) {
+		switch (c) {
+			case 'd':
+				daemonize = 1;
+				break;
+			case 't':
+				udp_threads = atoi(optarg);
+				break;
+			case 'l':
+				load_threads = atoi(optarg);
+				break;
+			case 'a':
+				bind_address = optarg;
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 's':
+				slip = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-d] [-t threads] [-l load threads] [-a address]\n"
+						"           [-r responses/s] [-s slip] <cache file> <port>\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "Usage: %s [-d] [-t threads] [-l load threads] [-a address]\n"
+				"           [-r responses/s] [-s slip] <cache file> <port>\n", argv[0]);
 		exit(1);
 	}
-	if (argc > 3) {
-	       	if (strcmp(argv[1], "-d") != 0) {
-			fprintf(stderr, "Usage: %s [-d] <cache file> <port>\n", argv[0]);
-			exit(1);
-		}
-		argindex++;
-		daemonize = 1;
+	if (udp_threads < 1) {
+		udp_threads = 1;
 	}
+	rrl_init(&rate_limit, rate > 0 ? rate : 0, slip > 0 ? slip : 0);
+	argindex = optind;
 	cachedb_file = argv[argindex++];
 	port = atoi(argv[argindex]);
 
@@ -491,8 +1373,8 @@ int main(int argc, char *argv[]) {
 		if(pid == 0){
 			// child
 			printf("\nChild PID: %d\n",getpid());
-			// start udp server
-			serve_udp(argv[argindex]);
+			// start the tcp and udp servers
+			start_servers(argv[argindex]);
 			_exit(EXIT_SUCCESS);
 		}
 		else{
@@ -501,17 +1383,19 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	else{
-		// start with UDP...
-		serve_udp(argv[argindex]);
+		start_servers(argv[argindex]);
 	}
 	return 0;
 }
 
 void printCache(){
 	int i;
-	 for(i = 0; i < BUFFER_MAX && cachedb[i].rr.name != NULL; i++){
-		 printf("DATABASE CACHE ENTRY: %s %d %d %d %d %s\n",
-			 	cachedb[i].rr.name,cachedb[i].rr.ttl,cachedb[i].rr.class,
-				cachedb[i].rr.type,cachedb[i].rr.rdata_len,cachedb[i].rr.rdata);
+	cache_db* db = (cache_db*)epoch_current(&cachedb);
+	 for(i = 0; i < db->store.size; i++){
+		 dns_db_entry* e = &db->store.db[i];
+		 char name[DNS_NAME_TEXT_MAX];
+		 dns_name_text(store_name(&db->store,e),DNS_NAME_MAX,0,name);
+		 printf("DATABASE CACHE ENTRY: %s %d %d %d %d\n",
+			 	name,e->ttl,e->class,e->type,e->rdata_len);
 	 }
 }
@@ -0,0 +1,102 @@
+/*
+ * Benchmark for the cache database loader - CS 360
+ * Writes a db file of generated records (A, CNAME, AAAA and MX, with
+ * some large record sets) unless one is given, then times zone_load
+ * on it and prints the load rate.
+ *
+ * Usage: zone_bench [-n lines] [-t threads] [file]
+ *
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+
+#include "zone_load.h"
+
+#define BENCH_LINES		10000000
+#define BENCH_FILE		"/tmp/zone_bench.txt"
+
+void write_zone(char *file, long lines);
+double seconds();
+
+int main(int argc, char *argv[]) {
+	long lines = BENCH_LINES;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	char *file = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+			case 'n':
+				lines = atol(optarg);
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n lines] [-t threads] [file]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind < argc) {
+		file = argv[optind];
+	} else {
+		file = BENCH_FILE;
+		printf("Writing %ld records to %s\n", lines, file);
+		write_zone(file, lines);
+	}
+
+	db_store store;
+	memset(&store, 0, sizeof(store));
+	double start = seconds();
+	int loaded = zone_load(file, &store, threads);
+	double elapsed = seconds() - start;
+	if (loaded < 0) {
+		exit(EXIT_FAILURE);
+	}
+	printf("%d records in %.2f s with %d thread(s): %.0f records/s\n",
+			loaded, elapsed, threads, loaded / elapsed);
+	store_free(&store);
+	return 0;
+}
+
+void write_zone(char *file, long lines) {
+	/*
+	 * 60% A, 20% CNAME, 10% AAAA, and 10% MX records spread over 1000
+	 * zone apexes, so the MX sets have a thousand records each.
+	 */
+	FILE *f = fopen(file, "w");
+	if (f == NULL) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+	long i;
+	for (i = 0; i < lines; i++) {
+		switch (i % 10) {
+			case 0: case 1: case 2: case 3: case 4: case 5:
+				fprintf(f, "host%ld.zone%ld.example.com 3600 IN A 10.%ld.%ld.%ld\n",
+						i, i % 1000, (i >> 16) & 255, (i >> 8) & 255, i & 255);
+				break;
+			case 6: case 7:
+				fprintf(f, "alias%ld.zone%ld.example.com 3600 IN CNAME host%ld.zone%ld.example.com\n",
+						i, i % 1000, i - 1, (i - 1) % 1000);
+				break;
+			case 8:
+				fprintf(f, "host%ld.zone%ld.example.com 3600 IN AAAA 2001:db8::%lx\n",
+						i, i % 1000, i & 0xffff);
+				break;
+			default:
+				fprintf(f, "zone%ld.example.com 3600 IN MX 10 host%ld.zone%ld.example.com\n",
+						i % 1000, i - 3, (i - 3) % 1000);
+		}
+	}
+	fclose(f);
+}
+
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
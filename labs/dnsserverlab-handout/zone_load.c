@@ -0,0 +1,372 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+#include "zone_load.h"
+#include "rdata.h"
+
+typedef struct {
+	unsigned char name[NAME_WIRE_MAX + 1];
+	int name_len;
+	dns_rr_type type;
+	dns_rr_class class;
+	dns_rr_ttl ttl;
+	unsigned char rdata[RDATA_MAX];
+	int rdata_len;
+} zone_rr;
+
+// how a parsed record is laid out in a chunk's buffer, before its name
+// and rdata bytes
+typedef struct {
+	dns_rr_ttl ttl;
+	dns_rr_type type;
+	dns_rr_class class;
+	unsigned short name_len;
+	unsigned short rdata_len;
+} zone_rec;
+
+typedef struct {
+	const char *start;		// the lines this thread parses
+	const char *end;
+	db_store *store;		// add the records straight to this store, or
+	unsigned char *out;		// keep them, as zone_rec + name + rdata
+	size_t out_len;
+	size_t out_max;
+	int failed;				// ran out of memory
+} zone_chunk;
+
+static int parse_line(const char *line, const char *end, zone_rr *rr);
+static int next_token(const char **p, const char *end, const char **token);
+static int ipv4_from_chars(const char *text, int len, unsigned char *rdata);
+static void *parse_chunk(void *arg);
+static long count_lines(const char *data, size_t size);
+
+int zone_load(char *file, db_store *store, int threads) {
+	/*
+	 * Load a cache database file into an empty store: size the store
+	 * from the number of lines, parse every line and add the records in
+	 * the order they appear in the file.  Bad lines are reported and
+	 * skipped.
+	 *
+	 * INPUT:  file: the path of the file
+	 * INPUT:  store: the store to fill (store_init is called here)
+	 * INPUT:  threads: how many threads may parse at once
+	 * OUTPUT: the number of records loaded, or -1 if the file could not
+	 *         be read or there was not enough memory
+	 */
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open");
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	const char *data = NULL;
+	if (size > 0) {
+		data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return -1;
+		}
+		madvise((void *)data, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	// wire-format names take about as many bytes as their text, so the
+	// file size is enough arena for all the names and rdata
+	if (store_init(store, count_lines(data, size), size) != 0) {
+		if (data != NULL) {
+			munmap((void *)data, size);
+		}
+		return -1;
+	}
+
+	// one thread per ZONE_MIN_CHUNK of the file, at most threads of them
+	if (threads > ZONE_THREADS_MAX) {
+		threads = ZONE_THREADS_MAX;
+	}
+	if ((size_t)threads > size / ZONE_MIN_CHUNK) {
+		threads = size / ZONE_MIN_CHUNK;
+	}
+	if (threads <= 1) {
+		// parse straight into the store
+		zone_chunk chunk;
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.start = data;
+		chunk.end = data + size;
+		chunk.store = store;
+		parse_chunk(&chunk);
+		store_finish(store);
+	} else {
+		// split the file at line starts and parse the pieces side by side
+		zone_chunk chunks[ZONE_THREADS_MAX];
+		pthread_t tids[ZONE_THREADS_MAX];
+		int i;
+		const char *start = data;
+		for (i = 0; i < threads; i++) {
+			const char *end = data + size / threads * (i + 1);
+			if (i == threads - 1) {
+				end = data + size;
+			} else if (end < start) {
+				end = start;
+			} else {
+				const char *nl = memchr(end, '\n', data + size - end);
+				end = nl == NULL ? data + size : nl + 1;
+			}
+			memset(&chunks[i], 0, sizeof(zone_chunk));
+			chunks[i].start = start;
+			chunks[i].end = end;
+			start = end;
+			if (pthread_create(&tids[i], NULL, parse_chunk, &chunks[i]) != 0) {
+				perror("pthread_create");
+				// parse it here instead
+				parse_chunk(&chunks[i]);
+				tids[i] = 0;
+			}
+		}
+		int failed = 0;
+		for (i = 0; i < threads; i++) {
+			if (tids[i] != 0) {
+				pthread_join(tids[i], NULL);
+			}
+			// add the records in file order
+			size_t pos = 0;
+			while (!failed && pos < chunks[i].out_len) {
+				zone_rec rec;
+				memcpy(&rec, chunks[i].out + pos, sizeof(rec));
+				pos += sizeof(rec);
+				unsigned char *name = chunks[i].out + pos;
+				unsigned char *rdata = name + rec.name_len;
+				pos += rec.name_len + rec.rdata_len;
+				store_add(store, name, rec.type, rec.class, rec.ttl, rdata, rec.rdata_len);
+			}
+			failed |= chunks[i].failed;
+			free(chunks[i].out);
+		}
+		store_finish(store);
+		if (failed) {
+			fprintf(stderr, "Not enough memory to load %s\n", file);
+			munmap((void *)data, size);
+			return -1;
+		}
+	}
+	if (data != NULL) {
+		munmap((void *)data, size);
+	}
+	return store->size;
+}
+
+static void *parse_chunk(void *arg) {
+	/*
+	 * Parse a range of lines, adding the records to the chunk's store
+	 * or, when parsing in parallel, to the chunk's output buffer.
+	 */
+	zone_chunk *chunk = (zone_chunk *)arg;
+	const char *line = chunk->start;
+	zone_rr record;
+	zone_rr *rr = &record;
+	while (line < chunk->end) {
+		const char *nl = memchr(line, '\n', chunk->end - line);
+		const char *end = nl == NULL ? chunk->end : nl;
+		int parsed = parse_line(line, end, rr);
+		line = end + 1;
+		if (parsed <= 0) {
+			continue;
+		}
+		if (chunk->store != NULL) {
+			store_add(chunk->store, rr->name, rr->type, rr->class, rr->ttl,
+					rr->rdata, rr->rdata_len);
+			continue;
+		}
+		if (chunk->failed) {
+			continue;
+		}
+		size_t need = sizeof(zone_rec) + rr->name_len + rr->rdata_len;
+		if (chunk->out_len + need > chunk->out_max) {
+			size_t max = chunk->out_max;
+			while (chunk->out_len + need > max) {
+				max = max < (1 << 16) ? (1 << 16) : max * 2;
+			}
+			unsigned char *out = (unsigned char *)realloc(chunk->out, max);
+			if (out == NULL) {
+				chunk->failed = 1;
+				continue;
+			}
+			chunk->out = out;
+			chunk->out_max = max;
+		}
+		zone_rec rec;
+		rec.ttl = rr->ttl;
+		rec.type = rr->type;
+		rec.class = rr->class;
+		rec.name_len = rr->name_len;
+		rec.rdata_len = rr->rdata_len;
+		unsigned char *out = chunk->out + chunk->out_len;
+		memcpy(out, &rec, sizeof(rec));
+		memcpy(out + sizeof(rec), rr->name, rr->name_len);
+		memcpy(out + sizeof(rec) + rr->name_len, rr->rdata, rr->rdata_len);
+		chunk->out_len += need;
+	}
+	return NULL;
+}
+
+static int parse_line(const char *line, const char *end, zone_rr *rr) {
+	/*
+	 * Split a line into its name, TTL, class and type columns and the
+	 * rdata (the rest of the line), and convert them.  A and name rdata
+	 * are converted in place; other types go through rdata_from_text.
+	 *
+	 * INPUT:  line, end: the line, without its newline
+	 * INPUT:  rr: where to put the record
+	 * OUTPUT: 1 for a record, 0 for a blank or short line (skipped
+	 *         quietly, like the sscanf loader did) and -1 for a bad one
+	 */
+	const char *p = line;
+	const char *host, *ttl, *class, *type;
+	int host_len, ttl_len, class_len, type_len;
+	if ((host_len = next_token(&p, end, &host)) == 0
+			|| (ttl_len = next_token(&p, end, &ttl)) == 0
+			|| (class_len = next_token(&p, end, &class)) == 0
+			|| (type_len = next_token(&p, end, &type)) == 0) {
+		return 0;
+	}
+	// the rdata column, trimmed
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+		end--;
+	}
+	if (p == end) {
+		return 0;
+	}
+
+	rr->name_len = name_from_chars(host, host_len, rr->name);
+	if (rr->name_len < 0) {
+		fprintf(stderr, "Bad name, skipping: %.*s\n", host_len, host);
+		return -1;
+	}
+	// the TTL is a plain decimal number
+	unsigned long t = 0;
+	int i;
+	for (i = 0; i < ttl_len && ttl[i] >= '0' && ttl[i] <= '9' && t <= 0xffffffffUL; i++) {
+		t = t * 10 + (ttl[i] - '0');
+	}
+	if (i < ttl_len || t > 0xffffffffUL) {
+		fprintf(stderr, "Bad TTL, skipping: %.*s\n", (int)(end - line), line);
+		return -1;
+	}
+	rr->ttl = (dns_rr_ttl)t;
+	rr->class = (class_len == 2 && class[0] == 'I' && class[1] == 'N') ? 1 : 0;
+	if (type_len == 1 && type[0] == 'A') {
+		rr->type = TYPE_A;
+	} else {
+		char type_text[8];
+		if (type_len >= (int)sizeof(type_text)) {
+			type_len = sizeof(type_text) - 1;
+		}
+		memcpy(type_text, type, type_len);
+		type_text[type_len] = '\0';
+		rr->type = rr_type_from_text(type_text);
+	}
+	if (rr->type == 0) {
+		fprintf(stderr, "Unsupported record type, skipping: %.*s\n", (int)(end - line), line);
+		return -1;
+	}
+
+	const char *rdata = p;
+	int rdata_len = end - p;
+	if (rr->type == TYPE_A) {
+		rr->rdata_len = ipv4_from_chars(rdata, rdata_len, rr->rdata);
+	} else if (RDATA_IS_NAME(rr->type)) {
+		rdata_len = next_token(&p, end, &rdata);
+		rr->rdata_len = name_from_chars(rdata, rdata_len, rr->rdata);
+	} else if (rdata_len < RDATA_MAX) {
+		char text[RDATA_MAX];
+		memcpy(text, rdata, rdata_len);
+		text[rdata_len] = '\0';
+		rr->rdata_len = rdata_from_text(rr->type, text, rr->rdata);
+	} else {
+		rr->rdata_len = -1;
+	}
+	if (rr->rdata_len < 0) {
+		fprintf(stderr, "Bad rdata, skipping: %.*s\n", (int)(end - line), line);
+		return -1;
+	}
+	return 1;
+}
+
+static int next_token(const char **p, const char *end, const char **token) {
+	/*
+	 * Find the next run of characters that aren't spaces or tabs.
+	 *
+	 * OUTPUT: the token's length (0 at the end of the line); *p is moved
+	 *         past it
+	 */
+	const char *s = *p;
+	while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) {
+		s++;
+	}
+	*token = s;
+	while (s < end && *s != ' ' && *s != '\t' && *s != '\r') {
+		s++;
+	}
+	*p = s;
+	return s - *token;
+}
+
+static int ipv4_from_chars(const char *text, int len, unsigned char *rdata) {
+	/*
+	 * Dotted-quad IPv4 address to 4 bytes (what inet_pton accepts).
+	 *
+	 * OUTPUT: 4, or -1 if text isn't an address
+	 */
+	const char *end = text + len;
+	int octet;
+	for (octet = 0; octet < 4; octet++) {
+		int value = 0;
+		int digits = 0;
+		while (text < end && *text >= '0' && *text <= '9' && digits < 4) {
+			value = value * 10 + (*text++ - '0');
+			digits++;
+		}
+		if (digits == 0 || digits == 4 || value > 255) {
+			return -1;
+		}
+		rdata[octet] = value;
+		if (octet < 3) {
+			if (text == end || *text != '.') {
+				return -1;
+			}
+			text++;
+		}
+	}
+	return text == end ? 4 : -1;
+}
+
+static long count_lines(const char *data, size_t size) {
+	// one record at most per line, the last line may have no newline
+	long lines = 0;
+	const char *p = data;
+	const char *end = data + size;
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		lines++;
+		if (nl == NULL) {
+			break;
+		}
+		p = nl + 1;
+	}
+	return lines;
+}
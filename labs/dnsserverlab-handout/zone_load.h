@@ -0,0 +1,22 @@
+/*
+ * Fast loader for the DNS server's cache database files - CS 360
+ * The file is mapped rather than read line by line, lines are found
+ * with memchr() (vectorized in glibc) and each line is split and
+ * converted by hand instead of with sscanf().  Large files can be
+ * parsed by several threads, each taking a range of lines; the
+ * records are still added to the store in file order.
+ *
+*/
+
+#ifndef ZONE_LOAD_H
+#define ZONE_LOAD_H
+
+#include "dns.h"
+#include "db_store.h"
+
+#define ZONE_THREADS_MAX	64
+#define ZONE_MIN_CHUNK		(1 << 20)	// don't split files into pieces smaller than this
+
+int zone_load(char *file, db_store *store, int threads);
+
+#endif /* ZONE_LOAD_H */
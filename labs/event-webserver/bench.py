@@ -0,0 +1,113 @@
+# Latency / throughput benchmark over the www/ asset set
+#
+# Run the server once with the "tcp" lines in http.conf turned on and once
+# with them turned off (or pointed at a config without them) and compare:
+#
+#   ./server -p 8080 -c http.conf        &&  python bench.py localhost:8080
+#   ./server -p 8080 -c plain.conf       &&  python bench.py localhost:8080
+#
+# where plain.conf is a copy of http.conf with the "tcp" lines removed.
+#
+# For every file it reports the median and 99th percentile request latency
+# and the throughput for two workloads:
+#   keep-alive - back to back requests over one persistent connection
+#   new-conn   - a fresh connection for every request
+
+from __future__ import print_function
+
+import optparse
+import os
+import socket
+import sys
+import time
+
+def read_response(sock, pending):
+    # read until the headers are in
+    while b"\r\n\r\n" not in pending:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed while reading headers")
+        pending += data
+    head, pending = pending.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(value.strip())
+    # then read the body
+    while len(pending) < length:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed while reading body")
+        pending += data
+    return length, pending[length:]
+
+def percentile(samples, pct):
+    ordered = sorted(samples)
+    index = int(round((pct / 100.0) * (len(ordered) - 1)))
+    return ordered[index]
+
+def run_keepalive(host, port, uri, count):
+    request = ("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (uri, host)).encode()
+    sock = socket.create_connection((host, port))
+    latencies = []
+    total = 0
+    pending = b""
+    start = time.time()
+    for i in range(count):
+        t0 = time.time()
+        sock.sendall(request)
+        length, pending = read_response(sock, pending)
+        latencies.append(time.time() - t0)
+        total += length
+    elapsed = time.time() - start
+    sock.close()
+    return latencies, total, elapsed
+
+def run_newconn(host, port, uri, count):
+    request = ("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (uri, host)).encode()
+    latencies = []
+    total = 0
+    start = time.time()
+    for i in range(count):
+        t0 = time.time()
+        sock = socket.create_connection((host, port))
+        sock.sendall(request)
+        length, pending = read_response(sock, b"")
+        latencies.append(time.time() - t0)
+        total += length
+        sock.close()
+    elapsed = time.time() - start
+    return latencies, total, elapsed
+
+def report(name, uri, latencies, total, elapsed):
+    print("%-10s %-22s %9.3f %9.3f %10.1f %10.2f" % (name, uri,
+        percentile(latencies, 50) * 1000, percentile(latencies, 99) * 1000,
+        len(latencies) / elapsed, (total / elapsed) / 1000000))
+    sys.stdout.flush()
+
+if __name__ == "__main__":
+    parser = optparse.OptionParser(usage="%prog hostname[:port] -n [requests] -r [docroot]", version="%prog 1.0")
+    parser.add_option("-n", "--requests", dest="requests", type="int", default=200,
+                      help= "requests per file and workload")
+    parser.add_option("-r", "--root", dest="root", default="www",
+                      help= "document root to take the asset list from")
+    (options, args) = parser.parse_args()
+
+    if len(args) < 1:
+        parser.error("You must specifiy a host:port argument.")
+    hostparts = args[0].split(':')
+    host = hostparts[0]
+    port = 80
+    if len(hostparts) > 1:
+        port = int(hostparts[1])
+
+    uris = ["/" + name for name in sorted(os.listdir(options.root))]
+
+    print("Host: %s, Port: %d, Requests per file: %d" % (host, port, options.requests))
+    print("%-10s %-22s %9s %9s %10s %10s" % ("workload", "uri", "p50 (ms)", "p99 (ms)", "req/s", "MB/s"))
+    print("-" * 76)
+    for uri in uris:
+        report("keep-alive", uri, *run_keepalive(host, port, uri, options.requests))
+    for uri in uris:
+        report("new-conn", uri, *run_newconn(host, port, uri, options.requests))
@@ -0,0 +1,324 @@
+/**
+ * Memory-mapped file store
+ * Maps the small files of the document root once at startup so
+ * responses can be written straight out of memory with writev()
+ *
+ * @author: Braden Hitchcock
+ * @class: CS 360 (CS 324 Systems Programming)
+ * Brigham Young University
+ *
+ **/
+
+#include "file_store.h"
+
+extern int vflag;
+
+static int map_file(file_entry_t* entry, int fd);
+static int fill_arena(file_store_t* store, int* fds);
+static void file_store_free(file_store_t* store);
+
+
+/**********************************************************************************
+***********************************************************************************
+** Reads the "cache" lines from the config file into the given options struct.
+** Lines look like "cache <option> <value>" where value is on/off or a number.
+**/
+void load_store_opts(char* config_path, store_opts_t* opts){
+	opts->enabled = DEFAULT_STORE_ENABLED;
+	opts->max_file = DEFAULT_STORE_MAX_FILE;
+	opts->hugepages = DEFAULT_STORE_HUGEPAGES;
+
+	FILE* config = fopen(config_path,"r");
+	if(config == NULL){
+		return;
+	}
+	char line[STORE_PATH_MAX];
+	char key[STORE_PATH_MAX];
+	char name[STORE_PATH_MAX];
+	char value[STORE_PATH_MAX];
+	while(fgets(line,sizeof(line),config)){
+		if(sscanf(line,"%s %s %s",key,name,value) != 3 || strcmp(key,"cache") != 0){
+			continue;
+		}
+		int num;
+		if(strcmp(value,"on") == 0){
+			num = 1;
+		}else if(strcmp(value,"off") == 0){
+			num = 0;
+		}else{
+			num = atoi(value);
+		}
+		if(strcmp(name,"enabled") == 0){
+			opts->enabled = num;
+		}else if(strcmp(name,"max_file") == 0){
+			opts->max_file = num;
+		}else if(strcmp(name,"hugepages") == 0){
+			opts->hugepages = num;
+		}else{
+			fprintf(stderr,"Unknown cache option in config: %s\n",name);
+		}
+	}
+	fclose(config);
+	if(vflag){
+		printf("Cache options: enabled=%d max_file=%d hugepages=%d\n",
+			opts->enabled,opts->max_file,opts->hugepages);
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Builds a new store from every regular file in root that is no bigger than
+** the configured limit. The store starts with one reference owned by the
+** caller. Returns NULL if the directory cannot be read
+**/
+file_store_t* file_store_build(char* root, store_opts_t* opts){
+	DIR* dir = opendir(root);
+	if(dir == NULL){
+		perror("opendir");
+		return NULL;
+	}
+	file_store_t* store = (file_store_t*)calloc(1,sizeof(file_store_t));
+	strncpy(store->root,root,STORE_PATH_MAX-1);
+	store->refs = 1;
+	time(&store->last_check);
+
+	struct stat attrib;
+	if(stat(root,&attrib) == 0){
+		store->root_mtime = attrib.st_mtime;
+	}
+
+	int fds[STORE_MAX_ENTRIES];
+	struct dirent* dent;
+	while((dent = readdir(dir)) != NULL && store->num_entries < STORE_MAX_ENTRIES){
+		file_entry_t* entry = &store->entries[store->num_entries];
+		if(snprintf(entry->path,STORE_PATH_MAX,"%s/%s",root,dent->d_name) >= STORE_PATH_MAX){
+			// too long to keep, it is served from disk instead
+			continue;
+		}
+		int fd = open(entry->path,O_RDONLY);
+		if(fd < 0){
+			continue;
+		}
+		if(fstat(fd,&attrib) == -1 || !S_ISREG(attrib.st_mode)
+				|| attrib.st_size > opts->max_file){
+			close(fd);
+			continue;
+		}
+		entry->size = attrib.st_size;
+		entry->mtime = attrib.st_mtime;
+		entry->ctime = attrib.st_ctime;
+		fds[store->num_entries] = fd;
+		store->num_entries++;
+	}
+	closedir(dir);
+
+	// hugepages need one anonymous arena, otherwise map each file directly
+	int i;
+	int mapped = 0;
+	if(opts->hugepages){
+		mapped = (fill_arena(store,fds) == 0);
+	}
+	for(i = 0; i < store->num_entries; i++){
+		if(!mapped && map_file(&store->entries[i],fds[i]) == -1){
+			// leave it out of the store, the read() path will still serve it
+			store->entries[i].data = NULL;
+			store->entries[i].path[0] = '\0';
+		}
+		close(fds[i]);
+	}
+	if(vflag){
+		printf("File store: %d files from %s (%s)\n",store->num_entries,root,
+			store->arena ? "hugepage arena" : "file mappings");
+	}
+	return store;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Maps a single file read-only, asking the kernel to fault the whole file in
+** now so the first request does not pay for it
+**/
+static int map_file(file_entry_t* entry, int fd){
+	if(entry->size == 0){
+		// nothing to map, an empty body is still a valid entry
+		entry->data = (unsigned char*)"";
+		return 0;
+	}
+	void* map = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if(map == MAP_FAILED){
+		perror("mmap");
+		return -1;
+	}
+	// past the end of a file that shrank meanwhile the mapping would fault
+	struct stat attrib;
+	if(fstat(fd,&attrib) == -1 || attrib.st_size != (off_t)entry->size){
+		munmap(map, entry->size);
+		return -1;
+	}
+	madvise(map, entry->size, MADV_WILLNEED);
+	entry->map = map;
+	entry->map_len = entry->size;
+	entry->data = (unsigned char*)map;
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Copies every file into one anonymous arena backed by hugepages so the whole
+** hot set costs a single TLB entry. Tries reserved hugepages first and falls
+** back to transparent hugepages. A file that can't be read in full (it shrank
+** or failed after it was sized) is left out, the read() path will serve it.
+** Returns -1 if nothing could be allocated
+**/
+static int fill_arena(file_store_t* store, int* fds){
+	size_t total = 0;
+	int i;
+	for(i = 0; i < store->num_entries; i++){
+		total += store->entries[i].size;
+	}
+	size_t len = ((total / HUGEPAGE_SIZE) + 1) * HUGEPAGE_SIZE;
+	void* arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(arena == MAP_FAILED){
+		arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(arena == MAP_FAILED){
+			perror("mmap: arena");
+			return -1;
+		}
+		madvise(arena, len, MADV_HUGEPAGE);
+	}
+
+	size_t offset = 0;
+	for(i = 0; i < store->num_entries; i++){
+		file_entry_t* entry = &store->entries[i];
+		size_t done = 0;
+		while(done < entry->size){
+			ssize_t n = pread(fds[i], (unsigned char*)arena + offset + done,
+				entry->size - done, done);
+			if(n <= 0){
+				break;
+			}
+			done += n;
+		}
+		if(done < entry->size){
+			// the headers would promise bytes the arena doesn't have
+			entry->data = NULL;
+			entry->path[0] = '\0';
+			continue;
+		}
+		entry->data = (unsigned char*)arena + offset;
+		offset += done;
+	}
+	mprotect(arena, len, PROT_READ);
+	store->arena = (unsigned char*)arena;
+	store->arena_len = len;
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Finds the entry for the given path (e.g. www/index.html), or NULL
+**/
+file_entry_t* file_store_lookup(file_store_t* store, char* path){
+	if(store == NULL){
+		return NULL;
+	}
+	int i;
+	for(i = 0; i < store->num_entries; i++){
+		if(store->entries[i].data != NULL && strcmp(store->entries[i].path,path) == 0){
+			return &store->entries[i];
+		}
+	}
+	return NULL;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Checks (at most every STORE_CHECK_TIME seconds) whether any stored file or
+** the directory itself changed. If so a new store is built and returned and
+** the caller's reference to the old one is dropped; clients still sending
+** from the old store keep it alive until they finish
+**/
+file_store_t* file_store_refresh(file_store_t* store, store_opts_t* opts){
+	if(store == NULL){
+		return NULL;
+	}
+	time_t now;
+	time(&now);
+	if(now - store->last_check < STORE_CHECK_TIME){
+		return store;
+	}
+	store->last_check = now;
+
+	int changed = 0;
+	struct stat attrib;
+	if(stat(store->root,&attrib) == -1 || attrib.st_mtime != store->root_mtime){
+		changed = 1;
+	}
+	int i;
+	for(i = 0; i < store->num_entries && !changed; i++){
+		file_entry_t* entry = &store->entries[i];
+		if(entry->data == NULL){
+			continue;
+		}
+		if(stat(entry->path,&attrib) == -1 || attrib.st_mtime != entry->mtime
+				|| attrib.st_size != (off_t)entry->size){
+			changed = 1;
+		}
+	}
+	if(!changed){
+		return store;
+	}
+
+	if(vflag) printf("File store: %s changed, remapping...\n",store->root);
+	file_store_t* fresh = file_store_build(store->root,opts);
+	if(fresh == NULL){
+		return store;
+	}
+	file_store_put(store);
+	return fresh;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Reference counting for store generations
+**/
+void file_store_get(file_store_t* store){
+	store->refs++;
+	return;
+}
+
+void file_store_put(file_store_t* store){
+	store->refs--;
+	if(store->refs <= 0){
+		file_store_free(store);
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Unmaps all of the memory held by a store generation
+**/
+static void file_store_free(file_store_t* store){
+	int i;
+	for(i = 0; i < store->num_entries; i++){
+		if(store->entries[i].map != NULL){
+			munmap(store->entries[i].map,store->entries[i].map_len);
+		}
+	}
+	if(store->arena != NULL){
+		munmap(store->arena,store->arena_len);
+	}
+	free(store);
+	return;
+}
@@ -0,0 +1,71 @@
+/*
+ * Header file for file_store.c
+ * Memory-mapped store for the small, hot files in the document
+ * root so they can be sent straight from memory
+ *
+ * @author: Braden Hitchcock
+ * @class: CS 360 (CS 324 Systems Programming)
+*/
+
+#ifndef FILE_STORE_H
+#define FILE_STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Store defaults (overridden by "cache" lines in the config file)
+//
+#define DEFAULT_STORE_ENABLED       0
+#define DEFAULT_STORE_MAX_FILE      65536   // largest file worth mapping (bytes)
+#define DEFAULT_STORE_HUGEPAGES     0       // copy the hot set into a hugepage arena
+
+#define STORE_MAX_ENTRIES   64
+#define STORE_PATH_MAX      256
+#define STORE_CHECK_TIME    2               // seconds between change checks
+#define HUGEPAGE_SIZE       (2 * 1024 * 1024)
+
+typedef struct store_opts {
+    int enabled;                    // serve small files from the store
+    int max_file;                   // size limit for a file to be stored
+    int hugepages;                  // back the hot set with hugepages
+} store_opts_t;
+
+typedef struct file_entry {
+    char path[STORE_PATH_MAX];      // path relative to the server (www/x.html)
+    unsigned char* data;            // start of the file contents in memory
+    size_t size;                    // size of the file in bytes
+    time_t mtime;                   // modification time when it was mapped
+    time_t ctime;                   // change time (sent as Last-Modified)
+    void* map;                      // file-backed mapping (NULL in an arena)
+    size_t map_len;                 // length of the file-backed mapping
+} file_entry_t;
+
+// One generation of the store. Clients sending from it hold a reference
+// so a rebuild never unmaps memory that is still being written out.
+typedef struct file_store {
+    file_entry_t entries[STORE_MAX_ENTRIES];
+    int num_entries;
+    char root[STORE_PATH_MAX];      // directory the store was built from
+    time_t root_mtime;              // catches files being added or removed
+    unsigned char* arena;           // hugepage arena holding every file
+    size_t arena_len;
+    int refs;                       // the server's reference + active clients
+    time_t last_check;              // last time the files were checked
+} file_store_t;
+
+void load_store_opts(char* config_path, store_opts_t* opts);
+file_store_t* file_store_build(char* root, store_opts_t* opts);
+file_entry_t* file_store_lookup(file_store_t* store, char* path);
+file_store_t* file_store_refresh(file_store_t* store, store_opts_t* opts);
+void file_store_get(file_store_t* store);
+void file_store_put(file_store_t* store);
+
+#endif /* FILE_STORE_H */
@@ -11,11 +11,22 @@
 
 #include "http_server.h"
 
-#define SERVER_ROOT_DIR		"www"
-
 // Setup from global variables
 int vflag;
 bool server_running = FALSE;
+volatile sig_atomic_t upgrade_requested = FALSE;
+bool server_draining = FALSE;
+char** server_argv;
+tcp_opts_t tcp_opts;
+store_opts_t store_opts;
+file_store_t* file_store = NULL;
+limit_opts_t limit_opts;
+rate_table_t* rate_table = NULL;
+cgi_opts_t cgi_opts;
+
+// sent to clients turned away at accept time for having too many connections
+#define TOO_MANY_CONNECTIONS	"HTTP/1.1 429 Too Many Requests\r\n" \
+				"Content-Length: 0\r\nConnection: close\r\n\r\n"
 
 
 int main(int argc, char* argv[]) {
@@ -25,6 +36,8 @@ int main(int argc, char* argv[]) {
 
 	vflag = 0;
 	port = DEFAULT_PORT;
+	config_path = DEFAULT_CONFIG;
+	server_argv = argv;
 
 	int c;
 	while ((c = getopt(argc, argv, "vp:c:t:q:")) != -1) {
@@ -35,6 +48,9 @@ int main(int argc, char* argv[]) {
 			case 'p':
 				port = optarg;
 				break;
+			case 'c':
+				config_path = optarg;
+				break;
 			case '?':
 				if (optopt == 'p' || optopt == 'c') {
 					fprintf(stderr, "Option -%c requires an argument\n", optopt);
@@ -59,7 +75,21 @@ int main(int argc, char* argv[]) {
 		perror("sigaction:");
 		exit(EXIT_FAILURE);
 	}
+	// SIGUSR2 starts a new copy of the server and hands it the listener
+	if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+		perror("sigaction:");
+		exit(EXIT_FAILURE);
+	}
+	// a CGI script that exits before reading its input must not kill us
+	signal(SIGPIPE, SIG_IGN);
 	
+	// read the socket tuning options from the config file
+	load_tcp_opts(config_path,&tcp_opts);
+	load_store_opts(config_path,&store_opts);
+	load_limit_opts(config_path,&limit_opts);
+	load_cgi_opts(config_path,&cgi_opts);
+	rate_table = rate_table_create(&limit_opts);
+
 	if(vflag) printf("Starting the server...\n");
 
 	// create a list of clients
@@ -85,6 +115,13 @@ int main(int argc, char* argv[]) {
 			clients[n] = NULL;
 		}
 	}
+	if(file_store != NULL){
+		file_store_put(file_store);
+	}
+	if(rate_table != NULL){
+		rate_print_stats(rate_table);
+		free(rate_table);
+	}
 	if(vflag) printf("Exiting....\n");
 	return 0;
 }
@@ -94,12 +131,15 @@ int main(int argc, char* argv[]) {
 /**********************************************************************************
 *********************************************************************************** 
 ** Signal handler for SIGINT to terminate all loops and
-** clean up memory
+** clean up memory, and SIGUSR2 to start a binary upgrade
 **/
 void signal_handler(int signum){
 	if(signum == SIGINT){
 		server_running = FALSE;
 	}
+	else if(signum == SIGUSR2){
+		upgrade_requested = TRUE;
+	}
 	return;
 }
 
@@ -109,9 +149,9 @@ void signal_handler(int signum){
 ** Prints the correct usage of the program to the user
 **/
 void usage(char* name) {
-	printf("Usage: %s [-v] [-p port]\n", name);
+	printf("Usage: %s [-v] [-p port] [-c config-file]\n", name);
 	printf("Example:\n");
-        printf("\t%s -v -p 8080\n", name);
+        printf("\t%s -v -p 8080 -c http.conf\n", name);
 	return;
 }
 
@@ -130,12 +170,32 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 	struct epoll_event ev;
 	struct epoll_event events[MAX_EVENTS];
 
-	// create the server socket
-	int server_sock = create_server_socket(port, SOCK_STREAM);
+	// create the server socket, or take it over from the process we are replacing
+	int server_sock;
+	char* handoff = getenv(HANDOFF_ENV);
+	if(handoff != NULL){
+		unsetenv(HANDOFF_ENV);
+		server_sock = receive_listener(atoi(handoff));
+		if(server_sock == -1){
+			fprintf(stderr,"Failed to take over the listening socket\n");
+			return -1;
+		}
+	}
+	else{
+		server_sock = create_server_socket(port, SOCK_STREAM);
+		set_listener_opts(server_sock,&tcp_opts);
+	}
+	// never leak the listener into an upgraded process except on purpose
+	fcntl(server_sock, F_SETFD, FD_CLOEXEC);
+
+	// map the small files of the document root
+	if(store_opts.enabled){
+		file_store = file_store_build(SERVER_ROOT_DIR,&store_opts);
+	}
 
 	// create the epoll socket
 	if(vflag) printf("Creating epoll file descriptor...\n");
-	if((epoll_fd = epoll_create1(0)) == -1){
+	if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1){
 		perror("epoll_create1");
 		return -1;
 	}
@@ -146,6 +206,24 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 	server_t server;
 	server.fd = server_sock;
 
+	// CGI pipes and processes are watched through one more descriptor
+	server_t backends;
+	if((backends.fd = upload_init()) == -1){
+		return -1;
+	}
+	// the new process's ack during a binary upgrade
+	server_t upgrade;
+	upgrade.fd = -1;
+	pid_t upgrade_pid = 0;
+	time_t upgrade_started = 0;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = (void*)&backends;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, backends.fd, &ev) == -1){
+		perror("epoll_ctl: backends");
+		return -1;
+	}
+
 	// set up the events for the server socket
 	ev.events = EPOLLIN;
 	ev.data.ptr = (void*)&server;
@@ -159,6 +237,36 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 
 	while (server_running) {
 
+		// start a binary upgrade if one was requested. We keep serving
+		// until the new process acks the listener
+		if(upgrade_requested && !server_draining && upgrade.fd == -1){
+			upgrade_requested = FALSE;
+			upgrade.fd = hand_off_listener(server.fd,&upgrade_pid);
+			if(upgrade.fd != -1){
+				time(&upgrade_started);
+				ev.events = EPOLLIN;
+				ev.data.ptr = (void*)&upgrade;
+				if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upgrade.fd, &ev) == -1){
+					perror("epoll_ctl: upgrade");
+					abandon_handoff(&upgrade,upgrade_pid);
+				}
+			}
+		}
+		if(upgrade.fd != -1 && time(NULL) - upgrade_started >= HANDOFF_TIMEOUT){
+			// don't wait forever if the new binary never gets going
+			abandon_handoff(&upgrade,upgrade_pid);
+		}
+		if(server_draining){
+			int active = 0;
+			for(n = 0; n < MAX_CLIENTS; n++){
+				if(clients[n] != NULL) active++;
+			}
+			if(active == 0){
+				if(vflag) printf("All clients drained, exiting...\n");
+				return 0;
+			}
+		}
+
 		// wait for an event to occur on one of the registered sockets
 		if(vflag) printf("Waiting for events...\n");
 		nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, EPOLL_TIMEOUT);
@@ -175,8 +283,35 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 		}
 
 		// time to handle each of the events
+		int backends_ready = FALSE;
 		for(n = 0; n < nfds; n++){
 
+			// CGI events are handled once the clients' own events are done,
+			// since waking a client may free it
+			if(events[n].data.ptr == &backends){
+				backends_ready = TRUE;
+				continue;
+			}
+
+			// the upgraded process answered (or died)
+			if(events[n].data.ptr == &upgrade){
+				char ack;
+				if(recv(upgrade.fd,&ack,1,MSG_DONTWAIT) != 1){
+					abandon_handoff(&upgrade,upgrade_pid);
+					continue;
+				}
+				close(upgrade.fd);
+				upgrade.fd = -1;
+				// the new process owns the listener now, stop accepting
+				// and finish off the clients we already have
+				if(vflag) printf("Listener handed off, draining clients...\n");
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server.fd, NULL);
+				close(server.fd);
+				server_draining = TRUE;
+				drop_idle_clients(epoll_fd,clients);
+				continue;
+			}
+
 			// check to see if we need to handle the server
 			if(events[n].data.ptr == &server){
 				if(vflag) printf("Handeling event on server socket...\n");
@@ -205,6 +340,14 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 			// we are looking at a client, handle it
 			client_t* client = (client_t*)events[n].data.ptr;
 			if(vflag) printf("Handling Client[%d] event...\n",client->fd);
+			if(client->state == LINGERING){
+				// only the client's FIN is wanted now
+				discard_input(client);
+				if(client->state == DISCONNECTED){
+					remove_client(epoll_fd,clients,client);
+				}
+				continue;
+			}
 			if(events[n].events & EPOLLIN){
 				if(vflag) printf("Client[%d] - Receiving headers...\n",client->fd);
 				if(receive_requests(client) == 0){
@@ -221,13 +364,34 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 			if(events[n].events & EPOLLOUT){
 				if(vflag) printf("Client[%d] - Sending response...\n",client->fd);
 				if(send_responses(client) == 0){
-					// we only get here if the state has changed back
-					// to RECEIVING
-					ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
-					ev.data.ptr = (void*)client;
-					if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
-						perror("epoll_ctl: switching to input events");
-						return -1;
+					// while draining, a request that got here before the response
+					// went out is still answered (and told the connection closes)
+					int more = FALSE;
+					if(server_draining && !client->closing && recv_data(client) == 0){
+						more = strstr((char*)client->recv_buf.data,"\r\n\r\n") != NULL;
+					}
+					if(client->closing || (server_draining && !more)){
+						// done with this client, the new process gets its next request
+						linger_close(epoll_fd,client);
+					}
+					else{
+						// we only get here if the state has changed back
+						// to RECEIVING
+						ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+						ev.data.ptr = (void*)client;
+						if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+							perror("epoll_ctl: switching to input events");
+							return -1;
+						}
+						// a request that came in behind a body is already in the
+						// buffer and will not raise another edge, handle it now
+						if(client->recv_buf.length > 0 && receive_requests(client) == 0){
+							ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+								perror("epoll_ctl: switching to output events");
+								return -1;
+							}
+						}
 					}
 				}
 			}
@@ -237,24 +401,35 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 				}
 			}
 			if(client->state == DISCONNECTED){
-				if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
-					perror("epoll_ctl: removing client");
-					exit(EXIT_FAILURE);
-				}
-				printf("client disconnected\n");
-				// remove from our list of clients
-				int i;
-				for(i = 0; i < MAX_CLIENTS; i++){
-					if(clients[i] == client){
-						clients[i] = NULL;
-						break;
+				remove_client(epoll_fd,clients,client);
+			}
+		}
+
+		// carry on with the clients whose CGI took more input or finished
+		if(backends_ready){
+			client_t* woken[MAX_CLIENTS];
+			int num_woken = upload_events(woken,MAX_CLIENTS);
+			int i;
+			for(i = 0; i < num_woken; i++){
+				client_t* client = woken[i];
+				int ready = client->state == RUNNING_CGI ? begin_responses(client) : receive_requests(client);
+				if(ready == 0){
+					ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+					ev.data.ptr = (void*)client;
+					if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+						perror("epoll_ctl: switching to output events");
+						return -1;
 					}
 				}
-				close(client->fd);
-				free_client(client);
+				if(client->state == DISCONNECTED){
+					remove_client(epoll_fd,clients,client);
+				}
 			}
 		}
 
+		// pick up any changes to the mapped files
+		file_store = file_store_refresh(file_store,&store_opts);
+
 		// sweep the list of clients
 		int i;
 		for(i = 0; i < MAX_CLIENTS; i++){
@@ -263,7 +438,13 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 				time_t now;
 				time(&now);
 				time_t diff = (now - clients[i]->last_active) * 1000;
-				if(diff >= EXPIRE_TIME){
+				// nothing comes from a client while its CGI runs, the
+				// CGI gets its own (longer) limit, a closing client a shorter one
+				time_t limit = clients[i]->state == RUNNING_CGI ? CGI_TIMEOUT : EXPIRE_TIME;
+				if(clients[i]->state == LINGERING){
+					limit = LINGER_TIME;
+				}
+				if(diff >= limit){
 					if(vflag) printf("Client[%d] - idle too long, disconnecting...\n",clients[i]->fd);
 					close(clients[i]->fd);
 					free_client(clients[i]);
@@ -275,6 +456,245 @@ int http_server_run(char* config_path, char* port, client_t* clients[]){
 	return 0;
 }
 
+/**********************************************************************************
+*********************************************************************************** 
+** Binary upgrade
+** Starts a fresh copy of the server (exec'ing whatever binary is installed now)
+** and passes it the listening socket over a Unix socket pair with SCM_RIGHTS.
+** Returns our end of the pair, which becomes readable once the new process
+** acks that it is accepting (or closes if it died), and sets the new pid.
+** Returns -1 if the upgrade failed and this process should keep serving
+**/
+int hand_off_listener(int listen_fd, pid_t* pid){
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1){
+		perror("socketpair");
+		return -1;
+	}
+	// only the child's end of the pair survives the exec
+	fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+
+	if(vflag) printf("Starting the upgraded server...\n");
+	*pid = fork();
+	if(*pid < 0){
+		perror("fork");
+		close(pair[0]);
+		close(pair[1]);
+		return -1;
+	}
+	if(*pid == 0){
+		// child - become the new server
+		char fd_str[16];
+		sprintf(fd_str,"%d",pair[1]);
+		setenv(HANDOFF_ENV,fd_str,1);
+		execvp(server_argv[0],server_argv);
+		perror("execvp");
+		_exit(EXIT_FAILURE);
+	}
+	close(pair[1]);
+
+	// the socket buffer takes the descriptor, this doesn't wait on the child
+	if(send_fd(pair[0],listen_fd) == -1){
+		server_t upgrade;
+		upgrade.fd = pair[0];
+		abandon_handoff(&upgrade,*pid);
+		return -1;
+	}
+	return pair[0];
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Gives up on an upgrade whose new process didn't ack in time (or died): it
+** is stopped before it can start accepting next to us, and we keep serving
+**/
+void abandon_handoff(server_t* upgrade, pid_t pid){
+	fprintf(stderr,"Upgraded server did not take the listener, still serving\n");
+	close(upgrade->fd);
+	upgrade->fd = -1;
+	kill(pid,SIGKILL);
+	waitpid(pid,NULL,0);
+	return;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** The new side of a binary upgrade. Takes the listening socket off the Unix
+** socket and acknowledges it so the old process can stop accepting
+**/
+int receive_listener(int unix_sock){
+	int listen_fd = recv_fd(unix_sock);
+	if(listen_fd == -1){
+		close(unix_sock);
+		return -1;
+	}
+	char ack = 1;
+	if(send(unix_sock,&ack,1,0) != 1){
+		perror("send: handoff ack");
+	}
+	close(unix_sock);
+	if(vflag) printf("Took over listening socket %d\n",listen_fd);
+	return listen_fd;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Sends a file descriptor over a Unix socket as SCM_RIGHTS ancillary data
+**/
+int send_fd(int unix_sock, int fd){
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control,0,sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+
+	if(sendmsg(unix_sock,&msg,0) == -1){
+		perror("sendmsg");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Receives a file descriptor sent with send_fd(). Returns -1 on failure
+**/
+int recv_fd(int unix_sock){
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if(recvmsg(unix_sock,&msg,0) <= 0){
+		perror("recvmsg");
+		return -1;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+		fprintf(stderr,"recv_fd: no file descriptor received\n");
+		return -1;
+	}
+	int fd;
+	memcpy(&fd,CMSG_DATA(cmsg),sizeof(int));
+	return fd;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** While draining, keep-alive clients that are sitting idle between requests
+** can be closed right away - their next request will go to the new process.
+** Whatever the socket already holds is read first: a request that arrived but
+** hasn't been handled yet is answered instead
+**/
+void drop_idle_clients(int epoll_fd, client_t* clients[]){
+	struct epoll_event ev;
+	int i;
+	for(i = 0; i < MAX_CLIENTS; i++){
+		client_t* client = clients[i];
+		if(client == NULL || client->state != RECEIVING_HEADERS){
+			continue;
+		}
+		if(client->recv_buf.length == 0 && recv_data(client) == 0 && client->recv_buf.length == 0){
+			if(vflag) printf("Client[%d] - idle, closing for upgrade...\n",client->fd);
+			linger_close(epoll_fd,client);
+		}
+		else if(client->recv_buf.length > 0 && receive_requests(client) == 0){
+			// the data was read here, no edge will come for it
+			ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = (void*)client;
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1){
+				perror("epoll_ctl: switching to output events");
+				client->state = DISCONNECTED;
+			}
+		}
+		if(client->state == DISCONNECTED){
+			remove_client(epoll_fd,clients,client);
+		}
+	}
+	return;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Closes a connection without losing what was sent on it. Closing a socket
+** with unread data makes the kernel reset the connection, which can throw
+** away responses the client hasn't read yet. So only our side is shut down;
+** the client gets its FIN after the last response, and whatever it still sends
+** is read and dropped until it closes too (or LINGER_TIME runs out)
+**/
+void linger_close(int epoll_fd, client_t* client){
+	struct epoll_event ev;
+	shutdown(client->fd,SHUT_WR);
+	client->state = LINGERING;
+	time(&client->last_active);
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = (void*)client;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1){
+		perror("epoll_ctl: lingering");
+		client->state = DISCONNECTED;
+		return;
+	}
+	// the FIN may already be here, and no new edge would tell us
+	discard_input(client);
+	return;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Reads and drops whatever a lingering client sends. The client is
+** DISCONNECTED once it has closed its side
+**/
+void discard_input(client_t* client){
+	char scratch[BUFFER_MAX];
+	while(1){
+		int bytes_read = recv(client->fd,scratch,sizeof(scratch),0);
+		if(bytes_read > 0){
+			continue;
+		}
+		if(bytes_read == -1 && errno == EINTR){
+			continue;
+		}
+		if(bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			return;
+		}
+		// closed, or broken
+		client->state = DISCONNECTED;
+		return;
+	}
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Receive a New Client
@@ -292,8 +712,20 @@ client_t* get_new_client(int sock){
 		return NULL;
 	}
 
-	// make the new socket descriptor nonblocking
+	// turn the client away if its address already has too many connections
+	rate_entry_t* limit = rate_lookup(rate_table,&addr);
+	if(rate_connect(rate_table,limit) != 0){
+		if(vflag) printf("Refusing connection, too many from this address\n");
+		send(new_fd,TOO_MANY_CONNECTIONS,strlen(TOO_MANY_CONNECTIONS),MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(new_fd);
+		return NULL;
+	}
+
+	// make the new socket descriptor nonblocking, and keep it out of any
+	// upgraded process we exec so draining really closes the connection
 	set_blocking(new_fd, 0);
+	fcntl(new_fd, F_SETFD, FD_CLOEXEC);
+	set_client_opts(new_fd,&tcp_opts);
 
 	// get some information about the connecting client
 	char client_hostname[NI_MAXHOST];
@@ -302,6 +734,7 @@ client_t* get_new_client(int sock){
 		       NI_MAXHOST, client_port, NI_MAXSERV, 0);
 	if (ret != 0) {
 		fprintf(stderr, "Failed in getnameinfo: %s\n", gai_strerror(ret));
+		rate_disconnect(limit);
 		close(new_fd);
 		return NULL;
 	}
@@ -310,6 +743,7 @@ client_t* get_new_client(int sock){
 	// create the new client_t structure
 	client_t* client = (client_t*)calloc(1,sizeof(client_t));
 	client->fd = new_fd;
+	client->limit = limit;
 
 	// initialize the client state
 	client->state = RECEIVING_HEADERS;
@@ -334,6 +768,9 @@ client_t* get_new_client(int sock){
 ** Frees struct data associated with a client
 **/
 void free_client(client_t* client){
+	release_body(client);
+	upload_reset(client);
+	rate_disconnect(client->limit);
 	if(client->recv_buf.data) free(client->recv_buf.data);
 	if(client->send_buf.data) free(client->send_buf.data);
 	int i;
@@ -346,6 +783,30 @@ void free_client(client_t* client){
 }
 
 
+/**********************************************************************************
+*********************************************************************************** 
+** Takes a disconnected client out of epoll and the client list and frees it
+**/
+void remove_client(int epoll_fd, client_t* clients[], client_t* client){
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+		perror("epoll_ctl: removing client");
+		exit(EXIT_FAILURE);
+	}
+	printf("client disconnected\n");
+	// remove from our list of clients
+	int i;
+	for(i = 0; i < MAX_CLIENTS; i++){
+		if(clients[i] == client){
+			clients[i] = NULL;
+			break;
+		}
+	}
+	close(client->fd);
+	free_client(client);
+	return;
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Client Request Handler
@@ -353,44 +814,129 @@ void free_client(client_t* client){
 ** Returns either when the server is terminated or the client disconnects
 **/
 int receive_requests(client_t* client){
-	if(recv_data(client) != 0){
-		client->state = DISCONNECTED;
-		return 1;
-	}
-	// check to see if we have read a full request
-	if( strstr(client->recv_buf.data,"\r\n\r\n") != NULL){
-		// if we get here, we have received a full request. Parse it
-		client->status = request_to_struct(client);
-		if(vflag) printf("RECEIVED REQUEST:\n%s\n", client->recv_buf.data);
-		// clear the send buffer in preparation
-		memset(client->send_buf.data,0,client->send_buf.max_length);
-		client->send_buf.position = 0;
-		client->send_buf.length = 0;
-		if(client->status == STATUS_OK){
-			// build the response header
-			build_ok_header(client);
+	int ret;
+	int ready = FALSE;
+	do{
+		if(client->state == RECEIVING_BODY && upload_paused(client)){
+			// leave the rest in the socket until the CGI catches up,
+			// upload_events() wakes us again
+			return 1;
 		}
-		else{
-			build_error_header(client);
+		ret = recv_data(client);
+		if(ret == 1){
+			client->state = DISCONNECTED;
+			return 1;
 		}
-		client->state = SENDING_HEADERS;
-		// return 0 to indicate state has changed
-		return 0;
+		if(client->state == RUNNING_CGI){
+			// a pipelined request, it is parsed once the response is out
+			break;
+		}
+		if(client->state == RECEIVING_HEADERS){
+			// check to see if we have read a full request
+			if(strstr(client->recv_buf.data,"\r\n\r\n") == NULL){
+				if(ret == 2){
+					// the headers don't fit in the buffer, answer and hang up
+					if(vflag) printf("Client[%d] - request headers too large\n",client->fd);
+					client->status = STATUS_BAD_REQUEST;
+					client->closing = TRUE;
+					client->recv_buf.position = client->recv_buf.length;
+					ready = TRUE;
+					break;
+				}
+				continue;
+			}
+			// if we get here, we have received a full request. Parse it
+			if(vflag) printf("RECEIVED REQUEST:\n%s\n", client->recv_buf.data);
+			client->status = request_to_struct(client);
+			ready = TRUE;
+			if(client->status != STATUS_OK){
+				client->recv_buf.position = client->recv_buf.length;
+				break;
+			}
+			// the last request parsed may have a body behind it
+			int body = upload_begin(client);
+			if(body == -1){
+				client->upload.status = STATUS_BAD_REQUEST;
+				client->closing = TRUE;
+				client->recv_buf.position = client->recv_buf.length;
+				break;
+			}
+			if(body == 0){
+				break;
+			}
+			ready = FALSE;
+			client->state = RECEIVING_BODY;
+		}
+		if(client->state == RECEIVING_BODY){
+			// hand over what we have and make room for the rest
+			int done = upload_feed(client);
+			compact_recv_buf(client);
+			if(done == -1){
+				// lost track of the framing, answer and hang up
+				client->upload.status = STATUS_BAD_REQUEST;
+				client->closing = TRUE;
+				client->recv_buf.position = client->recv_buf.length;
+				ready = TRUE;
+				break;
+			}
+			if(done == 1){
+				upload_finish(client);
+				if(upload_waiting(client)){
+					// the CGI still has input to take or hasn't exited,
+					// upload_events() wakes us when its output is ready
+					client->state = RUNNING_CGI;
+					time(&client->last_active);
+					return 1;
+				}
+				ready = TRUE;
+				break;
+			}
+		}
+	}while(ret == 2);
+
+	if(!ready){
+		return 1;
 	}
-	return 1;
+	return begin_responses(client);
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Builds the first response of the requests that were received and gets the
+** client ready to send. Returns 0 to indicate the state has changed
+**/
+int begin_responses(client_t* client){
+	// clear the send buffer in preparation
+	memset(client->send_buf.data,0,client->send_buf.max_length);
+	client->send_buf.position = 0;
+	client->send_buf.length = 0;
+	// build the response header
+	build_header(client);
+	// hold partial segments until every response is queued
+	set_cork(client->fd,TRUE);
+	client->state = SENDING_HEADERS;
+	// return 0 to indicate state has changed
+	return 0;
 }
 
 /**********************************************************************************
 *********************************************************************************** 
 ** Client Receive Data Handler
 ** Reads data from the buffer of a client socket descriptor that has data in it
-** It will read data until the data buffer for this event is empty
+** It will read data until the data buffer for this event is empty or full.
+** Returns 0 once the socket is drained, 1 on error, or 2 if the buffer filled
+** up first (call again once the buffered data has been used)
 **/
 int recv_data(client_t* client) {
-	char temp_buffer[BUFFER_MAX];
 	int bytes_read;
 	while (1) {
-		bytes_read = recv(client->fd, temp_buffer, BUFFER_MAX, 0);
+		// always leave room for the terminating NUL the parser relies on
+		int room = client->recv_buf.max_length - client->recv_buf.length - 1;
+		if (room == 0) {
+			return 2;
+		}
+		bytes_read = recv(client->fd, &client->recv_buf.data[client->recv_buf.length], room, 0);
 		if (bytes_read == -1) {
 			if (errno == EWOULDBLOCK || errno == EAGAIN) {
 				break; /* We've read all we can for the moment, stop */
@@ -417,15 +963,29 @@ int recv_data(client_t* client) {
 		// stamp the timer
 		time(&client->last_active);
 
-		/* now append the new data recieved to the client's recv buffer */
-		memcpy(&(client->recv_buf.data)[client->recv_buf.length], temp_buffer, bytes_read);
+		/* the data went straight into the client's recv buffer */
 		client->recv_buf.length += bytes_read;
-
+		client->recv_buf.data[client->recv_buf.length] = '\0';
 	}
 	return 0;
 }
 
 
+/**********************************************************************************
+*********************************************************************************** 
+** Drops the part of the receive buffer that has been used (everything before
+** the buffer position) and moves whatever is left to the front
+**/
+void compact_recv_buf(client_t* client){
+	int left = client->recv_buf.length - client->recv_buf.position;
+	memmove(client->recv_buf.data, &client->recv_buf.data[client->recv_buf.position], left);
+	memset(&client->recv_buf.data[left], 0, client->recv_buf.max_length - left);
+	client->recv_buf.length = left;
+	client->recv_buf.position = 0;
+	return;
+}
+
+
 
 /**********************************************************************************
 *********************************************************************************** 
@@ -435,14 +995,27 @@ int recv_data(client_t* client) {
 **/
 int send_responses(client_t* client){
 	// first thing we should do is check the status of the client request
-	if(client->state == SENDING_HEADERS){
+	if(client->state == SENDING_HEADERS && client->body != NULL){
+		// the header and the mapped body go out together
+		if(send_mapped(client) == 0){
+			release_body(client);
+			client->send_buf.position = 0;
+			client->send_buf.length = 0;
+			client->state = SENDING_BODY;
+		}
+	}
+	else if(client->state == SENDING_HEADERS){
 		if(send_data(client) == 0){
 			// clear the send buffer in preparation
 			memset(client->send_buf.data,0,client->send_buf.max_length);
 			client->send_buf.position = 0;
 			client->send_buf.length = 0;
 			// build the response body
-			if(client->status == STATUS_OK){
+			if(client->response_built){
+				// the body went out with the header
+				client->response_built = FALSE;
+			}
+			else if(client->status == STATUS_OK){
 				build_ok_body(client);
 			}
 			else{
@@ -460,12 +1033,12 @@ int send_responses(client_t* client){
 				// prep the buffer again by clearing it
 				memset(client->send_buf.data,0,client->send_buf.max_length);
 				client->send_buf.position = 0;
-				if(client->status == STATUS_OK){
-					build_ok_header(client);
-				}
-				else{
-					build_error_header(client);
-				}
+				// every request that made it into the list parsed fine, so
+				// a failure on the last one doesn't carry over to this one
+				client->status = STATUS_OK;
+				build_header(client);
+				// the socket may still be writable, no new edge would tell us
+				return send_responses(client);
 			}
 			else{
 				// we have finished sending all the responses
@@ -476,9 +1049,12 @@ int send_responses(client_t* client){
 				}
 				client->cur_request = 0;
 				client->num_requests = 0;
-				memset(client->recv_buf.data,0,BUFFER_MAX);
-				client->recv_buf.length = 0;
+				upload_reset(client);
+				// keep anything that arrived behind the parsed requests
+				compact_recv_buf(client);
 				memset(client->requests,0,sizeof(http_request)*MAX_REQUESTS);
+				// flush whatever is left in the corked socket
+				set_cork(client->fd,FALSE);
 				// change the state
 				client->state = RECEIVING_HEADERS;
 				return 0;
@@ -582,11 +1158,17 @@ int request_to_struct(client_t* client){
 				char* value = (char*)malloc(BUFFER_MAX);
 				memset(name,0,BUFFER_MAX);
 				memset(value,0,BUFFER_MAX);
-				sscanf(request_line,"%s %s",name,value);
-				if(strcmp(name,"Host:") == 0){
+				// the value is the rest of the line (it may contain spaces)
+				sscanf(request_line,"%s %[^\r\n]",name,value);
+				if(strcmp(name,"Host:") == 0 && httpr->host == NULL){
 					httpr->host = value;
 					free(name);
 				}
+				else if(header_index == HEADER_MAX - 1){
+					// no room left, drop the header
+					free(name);
+					free(value);
+				}
 				else{
 					str_replace(name,":","\0");
 					headers[header_index].name = name;
@@ -607,6 +1189,18 @@ int request_to_struct(client_t* client){
 
 		// get the next request
 		request = cur_request + 3;
+		client->recv_buf.position = request - (char*)client->recv_buf.data;
+
+		// a body comes next on the wire, the requests behind it are parsed
+		// once it has been read
+		if(strcmp(httpr->method,"POST") == 0
+				|| request_header(httpr,"Content-Length") != NULL
+				|| request_header(httpr,"Transfer-Encoding") != NULL){
+			break;
+		}
+		if(client->num_requests == MAX_REQUESTS){
+			break;
+		}
 		cur_request = strstr(request,"\r\n\r\n");
 
 	}
@@ -615,6 +1209,36 @@ int request_to_struct(client_t* client){
 }
 
 
+/**********************************************************************************
+*********************************************************************************** 
+** Builds the response header for the current request, charging the client's
+** rate limit bucket first. A client over its limit gets a 429 instead
+**/
+int build_header(client_t* client){
+	if(client->status == STATUS_OK && rate_take(rate_table,client->limit) != 0){
+		client->status = STATUS_TOO_MANY_REQUESTS;
+	}
+	int length;
+	if(client->status == STATUS_OK && client->upload.handler != NULL
+			&& client->cur_request == client->upload.request){
+		length = upload_response(client);
+	}
+	else if(client->status == STATUS_OK){
+		length = build_ok_header(client);
+	}
+	else{
+		length = build_error_header(client);
+	}
+	// the last response before we hang up (or hand over to an upgraded
+	// server) says so, so the client doesn't send more on this connection
+	if((client->closing || server_draining) && client->cur_request >= client->num_requests - 1){
+		client->closing = TRUE;
+		set_connection_close(client);
+	}
+	return length;
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Build a response to an HTTP request in the given char pointer
@@ -637,6 +1261,29 @@ int build_ok_header(client_t* client){
 	}else{
 		sprintf(filepath,"%s%s",SERVER_ROOT_DIR,request.uri);
 	}
+
+	// small files are answered straight from the store without touching disk
+	file_entry_t* entry = file_store_lookup(file_store,filepath);
+	if(entry != NULL){
+		length += sprintf(response,"%s ",request.version);
+		length += sprintf(response+length,"200 OK\r\n");
+		set_date_header(response,&length);
+		set_servername_header(response,&length,SERVER_NAME);
+		set_content_type_header(response,&length,request.filetype);
+		set_content_length_header(response,&length,(int)entry->size);
+		set_modified_date_header(response,&length,entry->ctime);
+		length += sprintf(response+length,"\r\n");
+		client->send_buf.length = length;
+		client->body = entry->data;
+		client->body_length = entry->size;
+		client->body_position = 0;
+		client->store = file_store;
+		file_store_get(file_store);
+		time(&client->last_active);
+		if(vflag) printf("RESPONSE HEAD (mapped):\n%s\n",response);
+		return length;
+	}
+
 	int file_descriptor = open(filepath,O_RDONLY);
 	if(file_descriptor < 0){
 		int error_code = errno;
@@ -781,6 +1428,72 @@ int send_data(struct client* client) {
 }
 
 
+/**********************************************************************************
+*********************************************************************************** 
+** Sends the rest of the header in the send buffer together with the mapped
+** body using writev(), so a small file costs one system call and no copies.
+** Returns 0 once everything is sent, or 1 if there is still data to send
+**/
+int send_mapped(client_t* client) {
+	struct iovec iov[2];
+	while (1) {
+		int head_left = client->send_buf.length - client->send_buf.position;
+		int body_left = client->body_length - client->body_position;
+		if (head_left + body_left == 0) {
+			return 0;
+		}
+		int n = 0;
+		if (head_left > 0) {
+			iov[n].iov_base = &client->send_buf.data[client->send_buf.position];
+			iov[n].iov_len = head_left;
+			n++;
+		}
+		if (body_left > 0) {
+			iov[n].iov_base = &client->body[client->body_position];
+			iov[n].iov_len = body_left;
+			n++;
+		}
+		ssize_t bytes_sent = writev(client->fd, iov, n);
+		if (bytes_sent == -1) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				return 1; /* We've sent all we can for the moment */
+			}
+			else if (errno == EINTR) {
+				if(!server_running){
+					return 1;
+				}
+				continue; /* continue upon interrupt */
+			}
+			else {
+				if(errno != EPIPE && errno != ECONNRESET) perror("writev");
+				client->state = DISCONNECTED;
+				return 1;
+			}
+		}
+		// account for the header first, then the body
+		int from_head = bytes_sent < head_left ? bytes_sent : head_left;
+		client->send_buf.position += from_head;
+		client->body_position += bytes_sent - from_head;
+	}
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Drops the client's hold on a mapped body (if it has one)
+**/
+void release_body(client_t* client){
+	if(client->store != NULL){
+		file_store_put(client->store);
+	}
+	client->store = NULL;
+	client->body = NULL;
+	client->body_length = 0;
+	client->body_position = 0;
+	return;
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Function to set the date header
@@ -816,6 +1529,34 @@ int set_content_type_header(char* response, int* length, char* type){
 }
 
 
+/**********************************************************************************
+*********************************************************************************** 
+** Adds "Connection: close" to the header of the response in the send buffer
+**/
+void set_connection_close(client_t* client){
+	char header[] = "\r\nConnection: close";
+	int header_len = strlen(header);
+	char* response = (char*)client->send_buf.data;
+	char* end = strstr(response,"\r\n\r\n");
+	if(end == NULL){
+		return;
+	}
+	if(client->send_buf.length + header_len + 1 > client->send_buf.max_length){
+		client->send_buf.max_length = client->send_buf.length + header_len + 1;
+		client->send_buf.data = realloc(client->send_buf.data,client->send_buf.max_length);
+		response = (char*)client->send_buf.data;
+		end = strstr(response,"\r\n\r\n");
+	}
+	// the blank line and anything after it (a built body) move down
+	int at = end - response;
+	memmove(response + at + header_len,response + at,client->send_buf.length - at);
+	memcpy(response + at,header,header_len);
+	client->send_buf.length += header_len;
+	response[client->send_buf.length] = '\0';
+	return;
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Function to set the content length in header
@@ -867,6 +1608,9 @@ int build_error_header(client_t* client){
 		case STATUS_NOT_FOUND:
 			length += sprintf(response+length,"404 Not Found\r\n");
 			break;
+		case STATUS_TOO_MANY_REQUESTS:
+			length += sprintf(response+length,"429 Too Many Requests\r\n");
+			break;
 		case STATUS_NOT_IMPLEMENTED:
 			length += sprintf(response+length,"501 Not Implemented\r\n");
 			break;
@@ -893,6 +1637,9 @@ int build_error_header(client_t* client){
 		case STATUS_NOT_FOUND:
 				data = "<h1>404 - Not Found</h1>";
 				break;
+		case STATUS_TOO_MANY_REQUESTS:
+				data = "<h1>429 - Too Many Requests</h1>";
+				break;
 		case STATUS_NOT_IMPLEMENTED:
 				data = "<h1>501 - Not Implemented</h1>";
 				break;
@@ -904,6 +1651,10 @@ int build_error_header(client_t* client){
 	set_content_length_header(response,&length,content_len);
 	// set the date last modified
 	set_modified_date_header(response,&length,time(NULL));
+	// tell a rate limited client when to come back
+	if(status == STATUS_TOO_MANY_REQUESTS){
+		set_header("Retry-After","1",response,&length);
+	}
 	// add extra CRLF
 	length += sprintf(response+length,"\r\n");
 	// add the body
@@ -1056,6 +1807,119 @@ int set_blocking(int sock, int blocking) {
         return 0;
 }
 
+/**********************************************************************************
+*********************************************************************************** 
+** Reads the "tcp" lines from the config file into the given options struct.
+** Lines look like "tcp <option> <value>" where value is on/off or a number.
+** Anything missing (including the whole file) keeps its default value.
+**/
+void load_tcp_opts(char* config_path, tcp_opts_t* opts){
+	opts->nodelay = DEFAULT_TCP_NODELAY;
+	opts->cork = DEFAULT_TCP_CORK;
+	opts->defer_accept = DEFAULT_TCP_DEFER_ACCEPT;
+	opts->fastopen = DEFAULT_TCP_FASTOPEN;
+
+	FILE* config = fopen(config_path,"r");
+	if(config == NULL){
+		if(vflag) printf("No config file found, using default TCP options\n");
+		return;
+	}
+	char line[BUFFER_MAX];
+	char key[BUFFER_MAX];
+	char name[BUFFER_MAX];
+	char value[BUFFER_MAX];
+	while(fgets(line,sizeof(line),config)){
+		if(sscanf(line,"%s %s %s",key,name,value) != 3 || strcmp(key,"tcp") != 0){
+			continue;
+		}
+		int num;
+		if(strcmp(value,"on") == 0){
+			num = TRUE;
+		}else if(strcmp(value,"off") == 0){
+			num = FALSE;
+		}else{
+			num = atoi(value);
+		}
+		if(strcmp(name,"nodelay") == 0){
+			opts->nodelay = num;
+		}else if(strcmp(name,"cork") == 0){
+			opts->cork = num;
+		}else if(strcmp(name,"defer_accept") == 0){
+			opts->defer_accept = num;
+		}else if(strcmp(name,"fastopen") == 0){
+			opts->fastopen = num;
+		}else{
+			fprintf(stderr,"Unknown tcp option in config: %s\n",name);
+		}
+	}
+	fclose(config);
+	if(vflag){
+		printf("TCP options: nodelay=%d cork=%d defer_accept=%d fastopen=%d\n",
+			opts->nodelay,opts->cork,opts->defer_accept,opts->fastopen);
+	}
+	return;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Applies the listener options to the server socket. These are only hints to
+** the kernel, so a failure is reported but the server keeps running
+**/
+int set_listener_opts(int sock, tcp_opts_t* opts){
+	int ret = 0;
+	if(opts->defer_accept > 0){
+		if(setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept,
+				sizeof(opts->defer_accept)) == -1){
+			perror("setsockopt: TCP_DEFER_ACCEPT");
+			ret = -1;
+		}
+	}
+	if(opts->fastopen > 0){
+		if(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen,
+				sizeof(opts->fastopen)) == -1){
+			perror("setsockopt: TCP_FASTOPEN");
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Applies the per-connection options to a newly accepted client socket
+**/
+int set_client_opts(int sock, tcp_opts_t* opts){
+	if(opts->nodelay){
+		int optval = 1;
+		if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)) == -1){
+			perror("setsockopt: TCP_NODELAY");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**********************************************************************************
+*********************************************************************************** 
+** Corks or uncorks a client socket so a response header and body go out
+** together in full segments. Uncorking flushes anything still queued.
+** Does nothing unless corking is turned on in the config
+**/
+int set_cork(int sock, int corked){
+	if(!tcp_opts.cork){
+		return 0;
+	}
+	if(setsockopt(sock, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked)) == -1){
+		perror("setsockopt: TCP_CORK");
+		return -1;
+	}
+	return 0;
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Frees the pointers inside of a http_request struct
@@ -1076,6 +1940,22 @@ void freeRequestStruct(http_request request){
 }
 
 
+/**********************************************************************************
+*********************************************************************************** 
+** Returns the value of a request header (names are matched without case)
+** or NULL if the request doesn't have it
+**/
+char* request_header(http_request* request, char* name){
+	int i;
+	for(i = 0; i < HEADER_MAX && request->headers[i].name != NULL; i++){
+		if(strcasecmp(request->headers[i].name,name) == 0){
+			return request->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+
 /**********************************************************************************
 *********************************************************************************** 
 ** Simple helper function to replace a substring with the given string
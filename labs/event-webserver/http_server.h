@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <netdb.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -29,11 +30,19 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "file_store.h"
+#include "rate_limit.h"
+#include "upload.h"
 
 #define SERVER_NAME     "Prestige/CS360 (Ubuntu 64-bit)"
 
 #define DEFAULT_PORT	"8080"
 #define DEFAULT_CONFIG	"http.conf"
+#define SERVER_ROOT_DIR	"www"
 
 #define DEFAULT_NUM_THREADS     8
 #define DEFAULT_QUEUE_SIZE      10
@@ -51,6 +60,20 @@
 
 #define EPOLL_TIMEOUT     2500
 #define EXPIRE_TIME       5000
+#define CGI_TIMEOUT       30000             // a CGI may run this long once its input is in
+#define LINGER_TIME       2000              // how long a closing client gets to send its FIN
+
+// Binary upgrade (SIGUSR2) - the new process finds its end of the
+// Unix socket carrying the listener in this environment variable
+#define HANDOFF_ENV       "HTTP_SERVER_HANDOFF_FD"
+#define HANDOFF_TIMEOUT   5                 // seconds to wait for the new process's ack
+
+// TCP tuning defaults (overridden by "tcp" lines in the config file)
+//
+#define DEFAULT_TCP_NODELAY         FALSE
+#define DEFAULT_TCP_CORK            FALSE
+#define DEFAULT_TCP_DEFER_ACCEPT    0       // seconds, 0 = off
+#define DEFAULT_TCP_FASTOPEN        0       // pending TFO queue length, 0 = off
 
 // HTTP Request Types
 //
@@ -68,6 +91,7 @@
 #define STATUS_BAD_REQUEST          400     // bad http request (cannot parse)
 #define STATUS_FORBIDDEN            403     // no access permision
 #define STATUS_NOT_FOUND            404     // file not found
+#define STATUS_TOO_MANY_REQUESTS    429     // client is over its rate limit
 #define STATUS_NOT_IMPLEMENTED      501     // request method not supported
 #define STATUS_INTERNAL_ERROR       500     // other error while serving request
 
@@ -106,8 +130,10 @@ typedef struct{
 enum state {
     RECEIVING_HEADERS,
     RECEIVING_BODY,
+    RUNNING_CGI,                    // body is in, waiting for the CGI's output
     SENDING_HEADERS,
     SENDING_BODY,
+    LINGERING,                      // our side is shut down, reading until the client closes
     DISCONNECTED
 };
 
@@ -128,12 +154,29 @@ typedef struct client {
     http_request* requests;         // request this client has received
     int num_requests;               // total number of requests
     int cur_request;                // current request being handled
+    unsigned char* body;            // response body sent from the file store
+    int body_length;                // length of the mapped body
+    int body_position;              // how much of the mapped body has been sent
+    file_store_t* store;            // store generation the body belongs to
+    rate_entry_t* limit;            // rate limit entry for the client address
+    upload_t upload;                // request body being streamed in
+    int response_built;             // send buffer already holds the whole response
+    int closing;                    // close once the responses are out
 } client_t;
 
 typedef struct server {
     int fd;
 } server_t;
 
+// TCP socket tuning options
+//
+typedef struct tcp_opts {
+    int nodelay;                    // disable Nagle on client sockets
+    int cork;                       // cork header + body into full segments
+    int defer_accept;               // wake accept() only once data arrives
+    int fastopen;                   // allow data in the SYN (TFO queue length)
+} tcp_opts_t;
+
 // Structs for threading
 //
 typedef unsigned int bool;
@@ -163,30 +206,51 @@ typedef struct param{
 void usage(char* name);
 int create_server_socket(char* port, int protocol);
 int set_blocking(int sock, int blocking);
+void load_tcp_opts(char* config_path, tcp_opts_t* opts);
+int set_listener_opts(int sock, tcp_opts_t* opts);
+int set_client_opts(int sock, tcp_opts_t* opts);
+int set_cork(int sock, int corked);
 int http_server_run(char* config_path, char* port, client_t* clients[]);
 client_t* get_new_client(int sock);
 void signal_handler(int signum);
+// binary upgrade functions
+int hand_off_listener(int listen_fd, pid_t* pid);
+void abandon_handoff(server_t* upgrade, pid_t pid);
+int receive_listener(int unix_sock);
+int send_fd(int unix_sock, int fd);
+int recv_fd(int unix_sock);
+void drop_idle_clients(int epoll_fd, client_t* clients[]);
+void linger_close(int epoll_fd, client_t* client);
+void discard_input(client_t* client);
 // queue functions
 void push(queue_item_t* queue, int* q_size, queue_item_t item);
 queue_item_t pop(queue_item_t* queue, int* q_size);
 // http request handler functions
 int receive_requests(client_t* client);
+int begin_responses(client_t* client);
 int send_responses(client_t* client);
 int request_to_struct(client_t* client);
+int build_header(client_t* client);
 int build_ok_header(client_t* client);
 int build_ok_body(client_t* client);
 int build_error_header(client_t* client);
 int build_error_body(client_t* client);
 int recv_data(client_t* client);
+void compact_recv_buf(client_t* client);
 int send_data(client_t* client);
+int send_mapped(client_t* client);
+void release_body(client_t* client);
 int set_date_header(char* response, int* length);
 int set_servername_header(char* response, int* length, char* name);
 int set_content_type_header(char* response, int* length, char* type);
 int set_content_length_header(char* response, int* length, int content_length);
 int set_modified_date_header(char* response, int* length, time_t date);
 int set_header(char* name, char* value, char* response, int* offset);
+void set_connection_close(client_t* client);
+char* request_header(http_request* request, char* name);
 void freeRequestStruct(http_request request);
 void free_client(client_t* client);
+void remove_client(int epoll_fd, client_t* clients[], client_t* client);
 void str_replace(char *target, const char *needle, const char *replacement);
 char* concat(const char *s1, const char *s2);
 char* get_filename_ext(char* filename);
@@ -0,0 +1,240 @@
+/**
+ * Per client rate limiting
+ * Token buckets and connection counts keyed by client address.
+ * Every check is a hash, a short probe and a coarse clock read so
+ * it is cheap enough to run on every accept and every request
+ *
+ * @author: Braden Hitchcock
+ * @class: CS 360 (CS 324 Systems Programming)
+ * Brigham Young University
+ *
+ **/
+
+#include "rate_limit.h"
+
+extern int vflag;
+
+static int64_t now_ms();
+static void addr_key(struct sockaddr_storage* addr, uint64_t key[2]);
+static uint64_t hash_key(uint64_t key[2]);
+
+
+/**********************************************************************************
+***********************************************************************************
+** Reads the "limit" lines from the config file into the given options struct.
+** Lines look like "limit <option> <number>"
+**/
+void load_limit_opts(char* config_path, limit_opts_t* opts){
+	opts->rate = DEFAULT_LIMIT_RATE;
+	opts->burst = DEFAULT_LIMIT_BURST;
+	opts->connections = DEFAULT_LIMIT_CONNECTIONS;
+
+	FILE* config = fopen(config_path,"r");
+	if(config == NULL){
+		return;
+	}
+	char line[256];
+	char key[256];
+	char name[256];
+	int value;
+	while(fgets(line,sizeof(line),config)){
+		if(sscanf(line,"%s %s %d",key,name,&value) != 3 || strcmp(key,"limit") != 0){
+			continue;
+		}
+		if(strcmp(name,"rate") == 0){
+			opts->rate = value;
+		}else if(strcmp(name,"burst") == 0){
+			opts->burst = value;
+		}else if(strcmp(name,"connections") == 0){
+			opts->connections = value;
+		}else{
+			fprintf(stderr,"Unknown limit option in config: %s\n",name);
+		}
+	}
+	fclose(config);
+	if(opts->burst <= 0){
+		opts->burst = opts->rate;
+	}
+	if(vflag){
+		printf("Limit options: rate=%d burst=%d connections=%d\n",
+			opts->rate,opts->burst,opts->connections);
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Allocates an empty table. Returns NULL if neither limit is turned on
+**/
+rate_table_t* rate_table_create(limit_opts_t* opts){
+	if(opts->rate <= 0 && opts->connections <= 0){
+		return NULL;
+	}
+	rate_table_t* table = (rate_table_t*)calloc(1,sizeof(rate_table_t));
+	table->opts = *opts;
+	return table;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Finds (or claims) the entry for a client address. A new entry starts with a
+** full bucket. Slots whose address has no open connections and has been quiet
+** for RATE_IDLE_MS are reused. If no slot is free within RATE_MAX_PROBE the
+** client is not tracked and NULL is returned (it is let through)
+**/
+rate_entry_t* rate_lookup(rate_table_t* table, struct sockaddr_storage* addr){
+	if(table == NULL){
+		return NULL;
+	}
+	uint64_t key[2];
+	addr_key(addr,key);
+	uint64_t slot = hash_key(key);
+	int64_t now = now_ms();
+	rate_entry_t* reuse = NULL;
+	int i;
+	for(i = 0; i < RATE_MAX_PROBE; i++){
+		rate_entry_t* entry = &table->entries[(slot + i) & (RATE_TABLE_SIZE - 1)];
+		if(entry->used && entry->addr[0] == key[0] && entry->addr[1] == key[1]){
+			return entry;
+		}
+		if(reuse == NULL && (!entry->used
+				|| (entry->conns == 0 && now - entry->last_ms > RATE_IDLE_MS))){
+			reuse = entry;
+		}
+		if(!entry->used){
+			// the address would have been in this run of slots
+			break;
+		}
+	}
+	if(reuse == NULL){
+		table->untracked++;
+		return NULL;
+	}
+	reuse->addr[0] = key[0];
+	reuse->addr[1] = key[1];
+	reuse->tokens = (int64_t)table->opts.burst * MILLI_TOKENS;
+	reuse->last_ms = now;
+	reuse->conns = 0;
+	reuse->used = 1;
+	return reuse;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Counts a new connection from the entry's address. Returns 0 if it may stay
+** open, or -1 if the address is already at its connection cap
+**/
+int rate_connect(rate_table_t* table, rate_entry_t* entry){
+	if(entry == NULL){
+		return 0;
+	}
+	if(table->opts.connections > 0 && entry->conns >= (uint32_t)table->opts.connections){
+		table->refused++;
+		return -1;
+	}
+	entry->conns++;
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Releases a connection counted by rate_connect()
+**/
+void rate_disconnect(rate_entry_t* entry){
+	if(entry != NULL && entry->conns > 0){
+		entry->conns--;
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Takes one token for a request. Returns 0 if the request may be served, or
+** -1 if the bucket is empty and the client should get a 429
+**/
+int rate_take(rate_table_t* table, rate_entry_t* entry){
+	if(table == NULL || entry == NULL || table->opts.rate <= 0){
+		if(table != NULL) table->allowed++;
+		return 0;
+	}
+	int64_t now = now_ms();
+	int64_t max = (int64_t)table->opts.burst * MILLI_TOKENS;
+	// one ms at a rate of r tokens/sec refills r milli-tokens
+	entry->tokens += (now - entry->last_ms) * table->opts.rate;
+	if(entry->tokens > max){
+		entry->tokens = max;
+	}
+	entry->last_ms = now;
+	if(entry->tokens < MILLI_TOKENS){
+		table->limited++;
+		return -1;
+	}
+	entry->tokens -= MILLI_TOKENS;
+	table->allowed++;
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Prints the counters kept by the table
+**/
+void rate_print_stats(rate_table_t* table){
+	if(table == NULL){
+		return;
+	}
+	printf("Rate limiting: %lu requests allowed, %lu limited (429), "
+		"%lu connections refused, %lu clients untracked\n",
+		table->allowed,table->limited,table->refused,table->untracked);
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Coarse monotonic clock in milliseconds (served from the vDSO, no syscall)
+**/
+static int64_t now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Turns a client address into a 128 bit key. IPv4 addresses are stored in
+** their v4-mapped form so a dual stack listener sees one key per client
+**/
+static void addr_key(struct sockaddr_storage* addr, uint64_t key[2]){
+	unsigned char bytes[16];
+	memset(bytes,0,sizeof(bytes));
+	if(addr->ss_family == AF_INET){
+		struct sockaddr_in* in = (struct sockaddr_in*)addr;
+		bytes[10] = 0xff;
+		bytes[11] = 0xff;
+		memcpy(&bytes[12],&in->sin_addr,4);
+	}
+	else if(addr->ss_family == AF_INET6){
+		struct sockaddr_in6* in6 = (struct sockaddr_in6*)addr;
+		memcpy(bytes,&in6->sin6_addr,16);
+	}
+	memcpy(key,bytes,16);
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Mixes the two halves of a key into a table index
+**/
+static uint64_t hash_key(uint64_t key[2]){
+	uint64_t h = (key[0] * 0x9E3779B97F4A7C15ULL) ^ (key[1] * 0xC2B2AE3D27D4EB4FULL);
+	h ^= h >> 29;
+	return h;
+}
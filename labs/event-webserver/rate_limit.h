@@ -0,0 +1,63 @@
+/*
+ * Header file for rate_limit.c
+ * Per client IP token buckets and connection caps kept in a
+ * small open addressing hash table
+ *
+ * @author: Braden Hitchcock
+ * @class: CS 360 (CS 324 Systems Programming)
+*/
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Limit defaults (overridden by "limit" lines in the config file)
+//
+#define DEFAULT_LIMIT_RATE          0       // requests per second per IP, 0 = off
+#define DEFAULT_LIMIT_BURST         0       // bucket size, 0 = same as the rate
+#define DEFAULT_LIMIT_CONNECTIONS   0       // open connections per IP, 0 = off
+
+#define RATE_TABLE_SIZE     4096            // must be a power of two
+#define RATE_MAX_PROBE      8               // slots looked at before giving up
+#define RATE_IDLE_MS        60000           // idle entries can be reused after this
+#define MILLI_TOKENS        1000            // tokens are kept in 1/1000ths
+
+typedef struct limit_opts {
+    int rate;                       // tokens added per second
+    int burst;                      // most tokens a bucket can hold
+    int connections;                // most open connections per address
+} limit_opts_t;
+
+typedef struct rate_entry {
+    uint64_t addr[2];               // address as IPv6 (IPv4 is v4-mapped)
+    int64_t tokens;                 // current bucket level in milli-tokens
+    int64_t last_ms;                // last refill time
+    uint32_t conns;                 // open connections from this address
+    uint32_t used;                  // slot holds an address
+} rate_entry_t;
+
+typedef struct rate_table {
+    limit_opts_t opts;
+    rate_entry_t entries[RATE_TABLE_SIZE];
+    unsigned long allowed;          // requests let through
+    unsigned long limited;          // requests answered with 429
+    unsigned long refused;          // connections turned away at accept
+    unsigned long untracked;        // lookups that found no free slot
+} rate_table_t;
+
+void load_limit_opts(char* config_path, limit_opts_t* opts);
+rate_table_t* rate_table_create(limit_opts_t* opts);
+rate_entry_t* rate_lookup(rate_table_t* table, struct sockaddr_storage* addr);
+int rate_connect(rate_table_t* table, rate_entry_t* entry);
+void rate_disconnect(rate_entry_t* entry);
+int rate_take(rate_table_t* table, rate_entry_t* entry);
+void rate_print_stats(rate_table_t* table);
+
+#endif /* RATE_LIMIT_H */
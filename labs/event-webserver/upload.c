@@ -0,0 +1,799 @@
+/**
+ * Streaming request bodies
+ * Decodes Content-Length and chunked bodies straight out of the
+ * client's receive buffer and passes each piece to a body handler,
+ * so an upload never needs more memory than one receive buffer
+ *
+ * @author: Braden Hitchcock
+ * @class: CS 360 (CS 324 Systems Programming)
+ * Brigham Young University
+ *
+ **/
+
+#define _GNU_SOURCE
+#include "http_server.h"
+#include <sys/signalfd.h>
+
+extern int vflag;
+extern cgi_opts_t cgi_opts;
+
+// CGI pipes and the SIGCHLD signalfd are watched by their own epoll
+// instance, which the server's event loop watches in turn
+static int backend_epoll = -1;
+static int child_fd = -1;
+// clients whose CGI process hasn't been reaped yet
+static client_t* running[UPLOAD_MAX_RUNNING];
+
+static int discard_respond(client_t* client);
+static int cgi_start(client_t* client);
+static int cgi_data(client_t* client, unsigned char* data, int length);
+static int cgi_finish(client_t* client);
+static int cgi_respond(client_t* client);
+static int cgi_spawn(client_t* client, int input, long length);
+static char* cgi_program(http_request* request);
+static int feed_chunked(client_t* client, unsigned char* data, int length);
+static void deliver(client_t* client, unsigned char* data, int length);
+static int flush_backlog(client_t* client);
+static void reap_children(client_t* woken[], int* count, int max);
+static void add_woken(client_t* woken[], int* count, int max, client_t* client);
+static int temp_file();
+
+// bodies sent to static files are read and dropped, the file is served as for a GET
+static upload_handler_t discard_handler = {"discard", NULL, NULL, NULL, discard_respond};
+// bodies sent to scripts are fed to the CGI program's stdin
+static upload_handler_t cgi_handler = {"cgi", cgi_start, cgi_data, cgi_finish, cgi_respond};
+
+
+/**********************************************************************************
+***********************************************************************************
+** Reads the "cgi" lines from the config file into the given options struct.
+** Lines look like "cgi <extension> <program>", e.g. "cgi php php-cgi"
+**/
+void load_cgi_opts(char* config_path, cgi_opts_t* opts){
+	opts->count = 0;
+
+	FILE* config = fopen(config_path,"r");
+	if(config == NULL){
+		return;
+	}
+	char line[512];
+	char key[512];
+	char ext[512];
+	char program[512];
+	while(fgets(line,sizeof(line),config)){
+		if(sscanf(line,"%s %s %s",key,ext,program) != 3 || strcmp(key,"cgi") != 0){
+			continue;
+		}
+		if(opts->count == UPLOAD_MAX_CGI){
+			fprintf(stderr,"Too many cgi lines in config, ignoring %s\n",ext);
+			continue;
+		}
+		if(snprintf(opts->ext[opts->count],sizeof(opts->ext[0]),"%s",ext) >= (int)sizeof(opts->ext[0])
+				|| snprintf(opts->program[opts->count],sizeof(opts->program[0]),"%s",program)
+				>= (int)sizeof(opts->program[0])){
+			fprintf(stderr,"cgi line for %s is too long, ignoring it\n",ext);
+			continue;
+		}
+		if(vflag) printf("CGI: *.%s -> %s\n",ext,program);
+		opts->count++;
+	}
+	fclose(config);
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Sets up the watching of CGI processes. SIGCHLD is blocked and read from a
+** signalfd so children are reaped from the event loop, never waited on.
+** Returns a descriptor for the event loop to watch for input, or -1
+**/
+int upload_init(){
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask,SIGCHLD);
+	if(sigprocmask(SIG_BLOCK,&mask,NULL) == -1){
+		perror("sigprocmask");
+		return -1;
+	}
+	if((child_fd = signalfd(-1,&mask,SFD_NONBLOCK | SFD_CLOEXEC)) == -1){
+		perror("signalfd");
+		return -1;
+	}
+	if((backend_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1){
+		perror("epoll_create1: cgi");
+		return -1;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(backend_epoll,EPOLL_CTL_ADD,child_fd,&ev) == -1){
+		perror("epoll_ctl: signalfd");
+		return -1;
+	}
+	return backend_epoll;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Handles whatever happened on the CGI side: pipes with room for more of the
+** body and children that exited. Fills woken with the clients that can go on,
+** either reading the rest of their body or sending their response, and
+** returns how many there are
+**/
+int upload_events(client_t* woken[], int max){
+	struct epoll_event events[MAX_EVENTS];
+	int count = 0;
+	int nfds = epoll_wait(backend_epoll,events,MAX_EVENTS,0);
+	int n;
+	for(n = 0; n < nfds; n++){
+		if(events[n].data.ptr == NULL){
+			reap_children(woken,&count,max);
+			continue;
+		}
+		client_t* client = (client_t*)events[n].data.ptr;
+		upload_t* upload = &client->upload;
+		if(upload->to_backend == -1){
+			continue;
+		}
+		int paused = upload_paused(client);
+		if(flush_backlog(client) != 0){
+			upload->status = STATUS_INTERNAL_ERROR;
+			close(upload->to_backend);
+			upload->to_backend = -1;
+			upload->backlog_length = 0;
+		}
+		if((paused && !upload_paused(client))
+				|| (client->state == RUNNING_CGI && !upload_waiting(client))){
+			add_woken(woken,&count,max,client);
+		}
+	}
+	return count;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Returns TRUE when so much of the body is waiting for the CGI that no more
+** should be read from the client until the pipe catches up
+**/
+int upload_paused(client_t* client){
+	return client->upload.backlog_length > UPLOAD_BACKLOG_MAX;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Returns TRUE while the CGI for a complete body is still taking its input or
+** hasn't exited, so its output isn't ready to send
+**/
+int upload_waiting(client_t* client){
+	upload_t* upload = &client->upload;
+	return upload->handler == &cgi_handler && (upload->pid > 0 || upload->to_backend != -1);
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Looks at the framing headers of the newest request and gets ready for its
+** body. Returns 1 if a body (or a CGI request) follows, 0 if the request has
+** no body, or -1 if the framing headers cannot be understood
+**/
+int upload_begin(client_t* client){
+	upload_t* upload = &client->upload;
+	http_request* request = &client->requests[client->num_requests - 1];
+	char* encoding = request_header(request,"Transfer-Encoding");
+	char* length = request_header(request,"Content-Length");
+
+	memset(upload,0,sizeof(upload_t));
+	upload->request = client->num_requests - 1;
+	upload->status = STATUS_OK;
+	upload->to_backend = -1;
+	upload->output = -1;
+
+	if(encoding != NULL){
+		// chunked is the only transfer coding we can take apart
+		if(strcasecmp(encoding,"chunked") != 0){
+			return -1;
+		}
+		upload->framing = FRAMING_CHUNKED;
+		upload->chunk_state = CHUNK_SIZE;
+	}
+	else if(length != NULL){
+		char* end;
+		errno = 0;
+		long n = strtol(length,&end,10);
+		while(*end == ' ' || *end == '\t') end++;
+		if(end == length || *end != '\0' || n < 0 || errno == ERANGE){
+			return -1;
+		}
+		upload->framing = FRAMING_LENGTH;
+		upload->remaining = n;
+	}
+
+	upload->program = cgi_program(request);
+	if(strcmp(request->method,"POST") == 0 && upload->program != NULL){
+		upload->handler = &cgi_handler;
+	}
+	else if(upload->framing != FRAMING_NONE){
+		upload->handler = &discard_handler;
+	}
+	else{
+		return 0;
+	}
+	if(vflag) printf("Streaming request body to the %s handler\n",upload->handler->name);
+
+	if(upload->handler->start != NULL && upload->handler->start(client) != 0){
+		// keep reading the body so the connection stays in step,
+		// the request is answered with a 500
+		upload->status = STATUS_INTERNAL_ERROR;
+	}
+	return 1;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Decodes whatever body bytes are waiting in the receive buffer and moves the
+** buffer position past them. Returns 1 once the whole body is in, 0 if more is
+** needed, or -1 if the chunked framing is broken
+**/
+int upload_feed(client_t* client){
+	upload_t* upload = &client->upload;
+	unsigned char* data = (unsigned char*)&client->recv_buf.data[client->recv_buf.position];
+	int length = client->recv_buf.length - client->recv_buf.position;
+
+	if(upload->framing == FRAMING_CHUNKED){
+		int used = feed_chunked(client,data,length);
+		if(used < 0){
+			return -1;
+		}
+		client->recv_buf.position += used;
+		return upload->chunk_state == CHUNK_DONE;
+	}
+
+	// anything past Content-Length belongs to the next request
+	int used = length < upload->remaining ? length : (int)upload->remaining;
+	deliver(client,data,used);
+	upload->remaining -= used;
+	client->recv_buf.position += used;
+	return upload->remaining == 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Tells the handler the body is complete
+**/
+int upload_finish(client_t* client){
+	upload_t* upload = &client->upload;
+	if(vflag) printf("Request body complete: %ld bytes\n",upload->received);
+	if(upload->status == STATUS_OK && upload->handler->finish != NULL
+			&& upload->handler->finish(client) != 0){
+		upload->status = STATUS_INTERNAL_ERROR;
+	}
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Builds the response for the request that carried the body
+**/
+int upload_response(client_t* client){
+	if(client->upload.status != STATUS_OK){
+		client->status = client->upload.status;
+		return build_error_header(client);
+	}
+	return client->upload.handler->respond(client);
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Throws away whatever is left of an upload (files, pipes and processes)
+**/
+void upload_reset(client_t* client){
+	upload_t* upload = &client->upload;
+	if(upload->handler == NULL){
+		return;
+	}
+	if(upload->to_backend != -1){
+		close(upload->to_backend);
+	}
+	if(upload->output != -1){
+		close(upload->output);
+	}
+	if(upload->pid > 0){
+		// reap_children() collects it, nobody is waiting for it now
+		kill(upload->pid,SIGKILL);
+		int i;
+		for(i = 0; i < UPLOAD_MAX_RUNNING; i++){
+			if(running[i] == client){
+				running[i] = NULL;
+			}
+		}
+	}
+	free(upload->backlog);
+	memset(upload,0,sizeof(upload_t));
+	upload->to_backend = -1;
+	upload->output = -1;
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Chunked decoder. Walks the size lines, chunk data and trailers in data and
+** hands the chunk data on. Stops right after the final CRLF so a pipelined
+** request behind the body is left alone. Returns the number of bytes used or
+** -1 on a malformed body
+**/
+static int feed_chunked(client_t* client, unsigned char* data, int length){
+	upload_t* upload = &client->upload;
+	int pos = 0;
+	while(pos < length && upload->chunk_state != CHUNK_DONE){
+		unsigned char c;
+		switch(upload->chunk_state){
+			case CHUNK_SIZE:
+			case CHUNK_TRAILER:
+				c = data[pos++];
+				if(c != '\n'){
+					if(upload->line_len == UPLOAD_LINE_MAX - 1){
+						return -1;
+					}
+					upload->line[upload->line_len++] = c;
+					break;
+				}
+				// a whole line is in, drop the CR
+				if(upload->line_len > 0 && upload->line[upload->line_len - 1] == '\r'){
+					upload->line_len--;
+				}
+				upload->line[upload->line_len] = '\0';
+				if(upload->chunk_state == CHUNK_TRAILER){
+					// trailers are ignored, an empty line ends the body
+					if(upload->line_len == 0){
+						upload->chunk_state = CHUNK_DONE;
+					}
+				}
+				else{
+					// chunk extensions follow a ';' and are ignored
+					char* end;
+					errno = 0;
+					long size = strtol(upload->line,&end,16);
+					while(*end == ' ' || *end == '\t') end++;
+					if(end == upload->line || (*end != '\0' && *end != ';')
+							|| size < 0 || errno == ERANGE){
+						return -1;
+					}
+					upload->chunk_left = size;
+					upload->chunk_state = (size == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+				}
+				upload->line_len = 0;
+				break;
+			case CHUNK_DATA:{
+				int n = length - pos;
+				if(n > upload->chunk_left){
+					n = (int)upload->chunk_left;
+				}
+				deliver(client,&data[pos],n);
+				pos += n;
+				upload->chunk_left -= n;
+				if(upload->chunk_left == 0){
+					upload->chunk_state = CHUNK_DATA_END;
+				}
+				break;
+			}
+			case CHUNK_DATA_END:
+				c = data[pos++];
+				if(c == '\n'){
+					upload->chunk_state = CHUNK_SIZE;
+				}
+				else if(c != '\r'){
+					return -1;
+				}
+				break;
+			case CHUNK_DONE:
+				break;
+		}
+	}
+	return pos;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Passes one decoded piece of the body to the handler. Once the handler fails
+** the rest of the body is only counted
+**/
+static void deliver(client_t* client, unsigned char* data, int length){
+	upload_t* upload = &client->upload;
+	if(length <= 0){
+		return;
+	}
+	upload->received += length;
+	if(upload->status == STATUS_OK && upload->handler->data != NULL
+			&& upload->handler->data(client,data,length) != 0){
+		upload->status = STATUS_INTERNAL_ERROR;
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Discard handler - answers with the static file like a GET would
+**/
+static int discard_respond(client_t* client){
+	return build_ok_header(client);
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** CGI handler - a Content-Length body goes through a pipe to the script as it
+** arrives. A chunked body has no length up front and CGI needs CONTENT_LENGTH,
+** so it is spooled to a temp file and the script starts once it is complete.
+** The script's output goes to another temp file
+**/
+static int cgi_start(client_t* client){
+	upload_t* upload = &client->upload;
+	if((upload->output = temp_file()) == -1){
+		return -1;
+	}
+	if(upload->framing == FRAMING_CHUNKED){
+		upload->to_backend = temp_file();
+		return upload->to_backend == -1 ? -1 : 0;
+	}
+	int fds[2];
+	if(pipe2(fds,O_CLOEXEC) == -1){
+		perror("pipe2");
+		return -1;
+	}
+	if(cgi_spawn(client,fds[0],upload->remaining) != 0){
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	close(fds[0]);
+	upload->to_backend = fds[1];
+	// only our end is non-blocking, the script reads its stdin as usual.
+	// The pipe reports when it has room again through upload_events()
+	set_blocking(upload->to_backend,0);
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLET;
+	ev.data.ptr = (void*)client;
+	if(epoll_ctl(backend_epoll,EPOLL_CTL_ADD,upload->to_backend,&ev) == -1){
+		perror("epoll_ctl: cgi pipe");
+		return -1;
+	}
+	return 0;
+}
+
+static int cgi_data(client_t* client, unsigned char* data, int length){
+	upload_t* upload = &client->upload;
+	if(upload->to_backend == -1){
+		return 0;
+	}
+	if(upload->framing == FRAMING_CHUNKED){
+		// the spool file is a regular file, it never makes us wait
+		if(write(upload->to_backend,data,length) != length){
+			perror("write: cgi spool");
+			return -1;
+		}
+		return 0;
+	}
+	// queue the piece behind whatever the pipe hasn't taken yet
+	if(upload->backlog_length + length > upload->backlog_max){
+		int max = upload->backlog_max ? upload->backlog_max : BUFFER_MAX;
+		while(max < upload->backlog_length + length){
+			max *= 2;
+		}
+		unsigned char* backlog = realloc(upload->backlog,max);
+		if(backlog == NULL){
+			perror("realloc: cgi backlog");
+			return -1;
+		}
+		upload->backlog = backlog;
+		upload->backlog_max = max;
+	}
+	memcpy(upload->backlog + upload->backlog_length,data,length);
+	upload->backlog_length += length;
+	return flush_backlog(client);
+}
+
+static int cgi_finish(client_t* client){
+	upload_t* upload = &client->upload;
+	if(upload->framing == FRAMING_CHUNKED){
+		lseek(upload->to_backend,0,SEEK_SET);
+		int spawned = cgi_spawn(client,upload->to_backend,upload->received);
+		close(upload->to_backend);
+		upload->to_backend = -1;
+		return spawned;
+	}
+	// the pipe is closed once the backlog drains, and the answer is
+	// ready when reap_children() sees the script exit
+	upload->input_done = TRUE;
+	return flush_backlog(client);
+}
+
+/**********************************************************************************
+***********************************************************************************
+** Turns the script output (CGI headers, blank line, body) into an HTTP
+** response in the send buffer. A "Status:" header sets the status line
+**/
+static int cgi_respond(client_t* client){
+	upload_t* upload = &client->upload;
+	http_request request = client->requests[client->cur_request];
+
+	struct stat attrib;
+	char head[BUFFER_MAX];
+	int n = pread(upload->output,head,BUFFER_MAX - 1,0);
+	if(n < 0 || fstat(upload->output,&attrib) == -1){
+		client->status = STATUS_INTERNAL_ERROR;
+		return build_error_header(client);
+	}
+	head[n] = '\0';
+	char* end = strstr(head,"\r\n\r\n");
+	int skip = 4;
+	char* lf_end = strstr(head,"\n\n");
+	if(lf_end != NULL && (end == NULL || lf_end < end)){
+		end = lf_end;
+		skip = 2;
+	}
+	if(end == NULL){
+		fprintf(stderr,"CGI program %s sent no headers\n",upload->program);
+		client->status = STATUS_INTERNAL_ERROR;
+		return build_error_header(client);
+	}
+	*end = '\0';
+	long body_offset = (end - head) + skip;
+	long body_length = attrib.st_size - body_offset;
+
+	// make room for the headers and the whole script output
+	int needed = BUFFER_MAX + (int)attrib.st_size;
+	if(client->send_buf.max_length < needed){
+		client->send_buf.data = realloc(client->send_buf.data,needed);
+		client->send_buf.max_length = needed;
+	}
+	char* response = (char*)client->send_buf.data;
+
+	char* status = "200 OK";
+	char* lines[HEADER_MAX * 2];
+	int num_lines = 0;
+	char* line = strtok(head,"\r\n");
+	while(line != NULL && num_lines < HEADER_MAX * 2){
+		if(strncasecmp(line,"Status:",7) == 0){
+			status = line + 7;
+			while(*status == ' ') status++;
+		}
+		else{
+			lines[num_lines++] = line;
+		}
+		line = strtok(NULL,"\r\n");
+	}
+
+	int length = 0;
+	length += sprintf(response,"%s %s\r\n",request.version,status);
+	set_date_header(response,&length);
+	set_servername_header(response,&length,SERVER_NAME);
+	int i;
+	for(i = 0; i < num_lines; i++){
+		length += sprintf(response+length,"%s\r\n",lines[i]);
+	}
+	set_content_length_header(response,&length,(int)body_length);
+	length += sprintf(response+length,"\r\n");
+	if(vflag) printf("RESPONSE HEAD (cgi):\n%s\n",response);
+
+	long done = 0;
+	while(done < body_length){
+		int got = pread(upload->output,response + length + done,body_length - done,body_offset + done);
+		if(got <= 0){
+			break;
+		}
+		done += got;
+	}
+	client->send_buf.length = length + done;
+	client->response_built = TRUE;
+	time(&client->last_active);
+	return client->send_buf.length;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Starts the CGI program for the current upload with input as its stdin and
+** the output file as its stdout
+**/
+static int cgi_spawn(client_t* client, int input, long length){
+	upload_t* upload = &client->upload;
+	http_request* request = &client->requests[upload->request];
+
+	// split the query string off the URI
+	char path[BUFFER_MAX];
+	char* query = strchr(request->uri,'?');
+	int path_len = query ? (int)(query - request->uri) : (int)strlen(request->uri);
+	snprintf(path,sizeof(path),"%.*s",path_len,request->uri);
+	char script[BUFFER_MAX + 8];
+	snprintf(script,sizeof(script),"%s%s",SERVER_ROOT_DIR,path);
+	char content_length[32];
+	snprintf(content_length,sizeof(content_length),"%ld",length);
+	char* content_type = request_header(request,"Content-Type");
+
+	pid_t pid = fork();
+	if(pid == -1){
+		perror("fork");
+		return -1;
+	}
+	if(pid == 0){
+		// the server blocks SIGCHLD for its signalfd, the script shouldn't inherit that
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK,&mask,NULL);
+		dup2(input,STDIN_FILENO);
+		dup2(upload->output,STDOUT_FILENO);
+		setenv("GATEWAY_INTERFACE","CGI/1.1",1);
+		setenv("SERVER_SOFTWARE",SERVER_NAME,1);
+		setenv("SERVER_PROTOCOL",request->version,1);
+		setenv("REQUEST_METHOD",request->method,1);
+		setenv("SCRIPT_NAME",path,1);
+		setenv("SCRIPT_FILENAME",script,1);
+		setenv("QUERY_STRING",query ? query + 1 : "",1);
+		setenv("CONTENT_LENGTH",content_length,1);
+		if(content_type != NULL) setenv("CONTENT_TYPE",content_type,1);
+		// php-cgi refuses to run without this
+		setenv("REDIRECT_STATUS","200",1);
+		execlp(upload->program,upload->program,script,(char*)NULL);
+		perror("execlp");
+		_exit(127);
+	}
+	upload->pid = pid;
+	int i;
+	for(i = 0; i < UPLOAD_MAX_RUNNING; i++){
+		if(running[i] == NULL){
+			running[i] = client;
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Returns the CGI program configured for the request's file extension or NULL
+**/
+static char* cgi_program(http_request* request){
+	char path[BUFFER_MAX];
+	snprintf(path,sizeof(path),"%s",request->uri);
+	char* query = strchr(path,'?');
+	if(query != NULL){
+		*query = '\0';
+	}
+	char* ext = get_filename_ext(path);
+	int i;
+	for(i = 0; i < cgi_opts.count; i++){
+		if(strcmp(cgi_opts.ext[i],ext) == 0){
+			return cgi_opts.program[i];
+		}
+	}
+	return NULL;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Writes as much of the backlog to the CGI's pipe as it takes without waiting,
+** and closes the pipe once the whole body has gone through. Returns 0 or -1
+** if the write failed
+**/
+static int flush_backlog(client_t* client){
+	upload_t* upload = &client->upload;
+	int done = 0;
+	while(done < upload->backlog_length){
+		ssize_t n = write(upload->to_backend,upload->backlog + done,upload->backlog_length - done);
+		if(n == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			if(errno != EPIPE){
+				perror("write: cgi");
+				return -1;
+			}
+			// the script stopped reading its input, that is its business
+			done = upload->backlog_length;
+			close(upload->to_backend);
+			upload->to_backend = -1;
+			break;
+		}
+		done += n;
+	}
+	if(done > 0){
+		memmove(upload->backlog,upload->backlog + done,upload->backlog_length - done);
+		upload->backlog_length -= done;
+		time(&client->last_active);
+	}
+	if(upload->input_done && upload->backlog_length == 0 && upload->to_backend != -1){
+		// end of file for the script
+		close(upload->to_backend);
+		upload->to_backend = -1;
+	}
+	return 0;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Collects every child that has exited. A CGI that failed turns its request
+** into a 500, and a client that was only waiting for its script is woken
+**/
+static void reap_children(client_t* woken[], int* count, int max){
+	struct signalfd_siginfo info;
+	while(read(child_fd,&info,sizeof(info)) == sizeof(info)){
+		// several exits can share one signal, waitpid() finds them all
+	}
+	int status;
+	pid_t pid;
+	while((pid = waitpid(-1,&status,WNOHANG)) > 0){
+		int i;
+		for(i = 0; i < UPLOAD_MAX_RUNNING; i++){
+			if(running[i] != NULL && running[i]->upload.pid == pid){
+				break;
+			}
+		}
+		if(i == UPLOAD_MAX_RUNNING){
+			// killed along with its client, or an upgraded server
+			continue;
+		}
+		client_t* client = running[i];
+		upload_t* upload = &client->upload;
+		running[i] = NULL;
+		upload->pid = 0;
+		if(!WIFEXITED(status) || WEXITSTATUS(status) == 127){
+			fprintf(stderr,"CGI program %s failed\n",upload->program);
+			upload->status = STATUS_INTERNAL_ERROR;
+		}
+		if(client->state == RUNNING_CGI && !upload_waiting(client)){
+			add_woken(woken,count,max,client);
+		}
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Adds a client to the woken list unless it is there already
+**/
+static void add_woken(client_t* woken[], int* count, int max, client_t* client){
+	int i;
+	for(i = 0; i < *count; i++){
+		if(woken[i] == client){
+			return;
+		}
+	}
+	if(*count < max){
+		woken[(*count)++] = client;
+	}
+	return;
+}
+
+
+/**********************************************************************************
+***********************************************************************************
+** Creates an anonymous temp file (unlinked right away) for spooling
+**/
+static int temp_file(){
+	char path[] = UPLOAD_TEMPLATE;
+	int fd = mkostemp(path,O_CLOEXEC);
+	if(fd == -1){
+		perror("mkostemp");
+		return -1;
+	}
+	unlink(path);
+	return fd;
+}
@@ -0,0 +1,100 @@
+/*
+ * Header file for upload.c
+ * Streaming request bodies (Content-Length and chunked) that are
+ * handed to a handler a piece at a time as they come off the socket
+ *
+ * @author: Braden Hitchcock
+ * @class: CS 360 (CS 324 Systems Programming)
+*/
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define UPLOAD_LINE_MAX     64              // longest chunk size or trailer line kept
+#define UPLOAD_MAX_CGI      8               // "cgi" lines read from the config
+#define UPLOAD_TEMPLATE     "/tmp/http_server.XXXXXX"
+#define UPLOAD_BACKLOG_MAX  65536           // body bytes held for a slow CGI before its client is paused
+#define UPLOAD_MAX_RUNNING  100             // CGI processes at once (one per client)
+
+// How the body is framed on the wire
+//
+enum framing {
+    FRAMING_NONE,
+    FRAMING_LENGTH,
+    FRAMING_CHUNKED
+};
+
+// Where the chunked decoder is
+//
+enum chunk_state {
+    CHUNK_SIZE,                     // reading the hex size line
+    CHUNK_DATA,                     // inside a chunk
+    CHUNK_DATA_END,                 // the CRLF after a chunk
+    CHUNK_TRAILER,                  // trailer lines after the last chunk
+    CHUNK_DONE
+};
+
+struct client;
+
+// A body handler sees the body one piece at a time. start() runs when the
+// headers are in, data() for every decoded piece, finish() once the last
+// byte has arrived and respond() when it is the request's turn to answer
+typedef struct upload_handler {
+    char* name;
+    int (*start)(struct client* client);
+    int (*data)(struct client* client, unsigned char* data, int length);
+    int (*finish)(struct client* client);
+    int (*respond)(struct client* client);
+} upload_handler_t;
+
+// Extension -> program map for CGI scripts ("cgi <ext> <program>")
+//
+typedef struct cgi_opts {
+    int count;
+    char ext[UPLOAD_MAX_CGI][16];
+    char program[UPLOAD_MAX_CGI][256];
+} cgi_opts_t;
+
+typedef struct upload {
+    upload_handler_t* handler;      // NULL when no body is in flight
+    int request;                    // index of the request that owns the body
+    int status;                     // STATUS_OK unless the body went wrong
+    enum framing framing;
+    long remaining;                 // Content-Length bytes still to come
+    long received;                  // decoded body bytes so far
+    enum chunk_state chunk_state;
+    long chunk_left;                // bytes left in the current chunk
+    char line[UPLOAD_LINE_MAX];     // partial size / trailer line
+    int line_len;
+    char* program;                  // CGI program for the request
+    pid_t pid;                      // running CGI process (0 = none)
+    int to_backend;                 // pipe to the CGI's stdin (non-blocking), or the spool file
+    int output;                     // file the CGI writes its output to
+    unsigned char* backlog;         // body bytes the pipe hasn't taken yet
+    int backlog_length;
+    int backlog_max;
+    int input_done;                 // whole body is in, close the pipe once the backlog drains
+} upload_t;
+
+void load_cgi_opts(char* config_path, cgi_opts_t* opts);
+int upload_init();
+int upload_events(struct client* woken[], int max);
+int upload_paused(struct client* client);
+int upload_waiting(struct client* client);
+int upload_begin(struct client* client);
+int upload_feed(struct client* client);
+int upload_finish(struct client* client);
+int upload_response(struct client* client);
+void upload_reset(struct client* client);
+
+#endif /* UPLOAD_H */
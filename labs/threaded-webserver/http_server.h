@@ -27,6 +27,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <netinet/tcp.h>
 
 #define SERVER_NAME     "Prestige/CS360 (Ubuntu 64-bit)"
 
@@ -44,6 +45,13 @@
 #define FALSE       0
 #define TRUE        1
 
+// TCP tuning defaults (overridden by "tcp" lines in the config file)
+//
+#define DEFAULT_TCP_NODELAY         FALSE
+#define DEFAULT_TCP_CORK            FALSE
+#define DEFAULT_TCP_DEFER_ACCEPT    0       // seconds, 0 = off
+#define DEFAULT_TCP_FASTOPEN        0       // pending TFO queue length, 0 = off
+
 // HTTP Request Types
 //
 #define GET         1
@@ -93,6 +101,15 @@ typedef struct{
     http_header* headers;
 } http_request;
 
+// TCP socket tuning options
+//
+typedef struct tcp_opts {
+    int nodelay;                    // disable Nagle on client sockets
+    int cork;                       // cork header + body into full segments
+    int defer_accept;               // wake accept() only once data arrives
+    int fastopen;                   // allow data in the SYN (TFO queue length)
+} tcp_opts_t;
+
 // Structs for threading
 //
 typedef unsigned int bool;
@@ -121,6 +138,10 @@ typedef struct param{
 // Setup functions
 void usage(char* name);
 int create_server_socket(char* port, int protocol);
+void load_tcp_opts(char* config_path, tcp_opts_t* opts);
+int set_listener_opts(int sock, tcp_opts_t* opts);
+int set_client_opts(int sock, tcp_opts_t* opts);
+int set_cork(int sock, int corked);
 void http_server_run(char* config_path, char* port, world_t* world);
 void* worker(void* args);
 void handle_client(int sock, struct sockaddr_storage client_addr, socklen_t addr_len);
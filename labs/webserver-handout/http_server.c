@@ -14,6 +14,7 @@
 #define SERVER_ROOT_DIR		"www"
 
 int vflag;
+tcp_opts_t tcp_opts;
 
 int main(int argc, char* argv[]) {
 
@@ -84,7 +85,9 @@ void reap(int signum){
 void http_server_run(char* config_path, char* port, int verbose_flag){
 	
 	vflag = verbose_flag;
+	load_tcp_opts(config_path,&tcp_opts);
 	int sock = create_server_socket(port, SOCK_STREAM);
+	set_listener_opts(sock,&tcp_opts);
 	// setup handling SIGCHLD
 	struct sigaction sa;
 	memset(&sa,0,sizeof(sa));
@@ -135,6 +138,7 @@ void handle_client(int sock, struct sockaddr_storage client_addr, socklen_t addr
 		return;
 	}
 	printf("Got a connection from %s:%s\n", client_hostname, client_port);
+	set_client_opts(sock,&tcp_opts);
 	// Here is where we read responses from the client
 	int bytes_read = recv(sock, request, BUFFER_MAX-1, 0);
 	if (bytes_read == 0) {
@@ -407,6 +411,9 @@ int send_response(int sock,http_request request, int* status){
 
 	if(vflag) printf("RESPONSE HEAD:\n%s\n",response);
 
+	// hold the header back so it shares segments with the file contents
+	set_cork(sock,TRUE);
+
 	// send the header
 	if(send(sock,response,length,0) < 0){
 		perror("send:");	
@@ -429,6 +436,8 @@ int send_response(int sock,http_request request, int* status){
 
 		close(file_descriptor);
 	}
+	// flush the tail of the response
+	set_cork(sock,FALSE);
 
 	if(vflag) printf("File contents sent!\n\n");
 
@@ -532,6 +541,107 @@ int create_server_socket(char* port, int protocol) {
 	return sock;
 }
 
+/** Reads the "tcp" lines from the config file into the given options struct.
+ ** Lines look like "tcp <option> <value>" where value is on/off or a number.
+ ** Anything missing (including the whole file) keeps its default value.
+**/
+void load_tcp_opts(char* config_path, tcp_opts_t* opts){
+	opts->nodelay = DEFAULT_TCP_NODELAY;
+	opts->cork = DEFAULT_TCP_CORK;
+	opts->defer_accept = DEFAULT_TCP_DEFER_ACCEPT;
+	opts->fastopen = DEFAULT_TCP_FASTOPEN;
+
+	FILE* config = fopen(config_path,"r");
+	if(config == NULL){
+		if(vflag) printf("No config file found, using default TCP options\n");
+		return;
+	}
+	char line[BUFFER_MAX];
+	char key[BUFFER_MAX];
+	char name[BUFFER_MAX];
+	char value[BUFFER_MAX];
+	while(fgets(line,sizeof(line),config)){
+		if(sscanf(line,"%s %s %s",key,name,value) != 3 || strcmp(key,"tcp") != 0){
+			continue;
+		}
+		int num;
+		if(strcmp(value,"on") == 0){
+			num = TRUE;
+		}else if(strcmp(value,"off") == 0){
+			num = FALSE;
+		}else{
+			num = atoi(value);
+		}
+		if(strcmp(name,"nodelay") == 0){
+			opts->nodelay = num;
+		}else if(strcmp(name,"cork") == 0){
+			opts->cork = num;
+		}else if(strcmp(name,"defer_accept") == 0){
+			opts->defer_accept = num;
+		}else if(strcmp(name,"fastopen") == 0){
+			opts->fastopen = num;
+		}else{
+			fprintf(stderr,"Unknown tcp option in config: %s\n",name);
+		}
+	}
+	fclose(config);
+	if(vflag){
+		printf("TCP options: nodelay=%d cork=%d defer_accept=%d fastopen=%d\n",
+			opts->nodelay,opts->cork,opts->defer_accept,opts->fastopen);
+	}
+	return;
+}
+
+/** Applies the listener options to the server socket. These are only hints to
+ ** the kernel, so a failure is reported but the server keeps running
+**/
+int set_listener_opts(int sock, tcp_opts_t* opts){
+	int ret = 0;
+	if(opts->defer_accept > 0){
+		if(setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept,
+				sizeof(opts->defer_accept)) == -1){
+			perror("setsockopt: TCP_DEFER_ACCEPT");
+			ret = -1;
+		}
+	}
+	if(opts->fastopen > 0){
+		if(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen,
+				sizeof(opts->fastopen)) == -1){
+			perror("setsockopt: TCP_FASTOPEN");
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/** Applies the per-connection options to a newly accepted client socket
+**/
+int set_client_opts(int sock, tcp_opts_t* opts){
+	if(opts->nodelay){
+		int optval = 1;
+		if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)) == -1){
+			perror("setsockopt: TCP_NODELAY");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Corks or uncorks a client socket so a response header and body go out
+ ** together in full segments. Uncorking flushes anything still queued.
+ ** Does nothing unless corking is turned on in the config
+**/
+int set_cork(int sock, int corked){
+	if(!tcp_opts.cork){
+		return 0;
+	}
+	if(setsockopt(sock, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked)) == -1){
+		perror("setsockopt: TCP_CORK");
+		return -1;
+	}
+	return 0;
+}
+
 /** Frees the pointers inside of a http_request struct
 **/
 void freeRequestStruct(http_request request){